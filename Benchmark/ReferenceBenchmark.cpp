@@ -0,0 +1,423 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+  Reference benchmark
+
+  Measures the referencing engine on synthetic data, without the GUI:
+  for every combination of channel count, block size and reference
+  preset, a ReferencePlan is compiled and blocks are referenced in place
+  exactly as VirtualRef does on the audio thread (snapshot, then engine),
+  until the time budget of the configuration is used up.
+
+  Results are written as JSON, one entry per configuration, with the
+  throughput and the median, 99th percentile and maximum time per block.
+
+  Usage: VirtualRefBenchmark [--threads N] [--isa scalar|sse2|avx2|avx512]
+                             [--seconds S] [--sample-rate HZ] [--output FILE]
+
+*/
+
+#include "ReferenceEngine.h"
+#include "ReferenceKernels.h"
+#include "ReferenceMatrix.h"
+#include "ReferencePlan.h"
+#include "ReferencePreset.h"
+#include "ReferenceSnapshot.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+/** Settings given on the command line */
+struct Settings
+{
+    int numThreads = 1;
+    double secondsPerConfig = 0.1;
+    double sampleRate = 30000.0;
+    std::string output;
+};
+
+/** A reference layout to measure */
+struct Preset
+{
+    const char* name;
+    ReferencePreset::Scope scope;
+    bool includeSelf;
+    float density; /**< fraction of random references per row, random presets only */
+    ReferencePlan::Statistic statistic;
+};
+
+/** Timing of one configuration */
+struct Result
+{
+    int numChannels;
+    int blockSize;
+    std::string preset;
+    float density;
+    const char* mode;
+    int numGroups; /**< unique reference signals of the plan */
+    int numNonZeros; /**< reference weights of the plan, after deduplication */
+    int numBlocks;
+    double samplesPerSecond;
+    double nsPerChannelSample;
+    double p50Microseconds;
+    double p99Microseconds;
+    double maxMicroseconds;
+    double realtimeFactor;
+};
+
+const int channelCounts[] = { 32, 64, 128, 256, 384, 512, 768, 1024, 1536 };
+const int blockSizes[] = { 64, 256, 1024, 4096 };
+
+// random matrices above ReferencePlan::denseDensityThreshold are run in
+// the dense mode, so together these cover every kernel path
+const Preset presets[] = {
+    { "none", ReferencePreset::Scope::None, false, 0.0f, ReferencePlan::Statistic::Mean },
+    { "car", ReferencePreset::Scope::AllChannels, true, 0.0f, ReferencePlan::Statistic::Mean },
+    { "cmr", ReferencePreset::Scope::AllChannels, true, 0.0f, ReferencePlan::Statistic::Median },
+    { "tetrode", ReferencePreset::Scope::OwnGroup, false, 0.0f, ReferencePlan::Statistic::Mean },
+    { "random", ReferencePreset::Scope::None, false, 0.05f, ReferencePlan::Statistic::Mean },
+    { "random", ReferencePreset::Scope::None, false, 0.25f, ReferencePlan::Statistic::Mean },
+    { "random", ReferencePreset::Scope::None, false, 0.6f, ReferencePlan::Statistic::Mean }
+};
+
+/** Minimum number of timed blocks per configuration */
+const int minBlocks = 10;
+
+/** Fills the matrix with the preset; random presets select each
+    reference with probability density, with a fixed seed */
+void fillMatrix (ReferenceMatrix& matrix, const Preset& preset, int numChannels)
+{
+    if (preset.density <= 0.0f)
+    {
+        ReferencePreset generator (preset.scope, preset.includeSelf);
+        generator.apply (&matrix, numChannels);
+        return;
+    }
+
+    std::mt19937 random (numChannels);
+    std::uniform_real_distribution<float> uniform (0.0f, 1.0f);
+
+    for (int row = 0; row < numChannels; row++)
+    {
+        std::vector<ReferenceMatrix::Reference> references;
+
+        for (int column = 0; column < numChannels; column++)
+        {
+            if (uniform (random) < preset.density)
+                references.push_back ({ column, 1.0f });
+        }
+
+        matrix.setReferences (row, std::move (references));
+    }
+}
+
+const char* getModeName (const ReferencePlan& plan)
+{
+    if (plan.isEmpty())
+        return "empty";
+
+    if (plan.getStatistic() == ReferencePlan::Statistic::Median)
+        return "median";
+
+    switch (plan.getMode())
+    {
+        case ReferencePlan::Mode::Dense:
+            return "dense";
+        case ReferencePlan::Mode::Window:
+            return "window";
+        default:
+            return "sparse";
+    }
+}
+
+double percentile (const std::vector<double>& sorted, double fraction)
+{
+    size_t index = std::min (sorted.size() - 1, (size_t) (fraction * (double) sorted.size()));
+    return sorted[index];
+}
+
+Result run (const Settings& settings, const Preset& preset, int numChannels, int blockSize)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    ReferenceMatrix matrix (numChannels);
+    fillMatrix (matrix, preset, numChannels);
+
+    size_t numReferences = 0;
+
+    for (int c = 0; c < numChannels; c++)
+        numReferences += matrix.getNumReferences (c);
+
+    std::vector<int> globalIndices (numChannels);
+
+    for (int c = 0; c < numChannels; c++)
+        globalIndices[c] = c;
+
+    ReferencePlan::Options options;
+    options.statistic = preset.statistic;
+
+    ReferencePlan plan;
+    plan.build (&matrix, globalIndices, options);
+
+    ReferenceEngine engine;
+    engine.prepare (settings.numThreads, 1, numChannels);
+
+    ReferenceSnapshot snapshot;
+    snapshot.prepare (numChannels, blockSize, numChannels);
+
+    // white noise, restored before every block so that the signal does not
+    // decay as it is referenced over and over
+    std::vector<float> input ((size_t) numChannels * blockSize);
+    std::vector<float> buffer (input.size());
+    std::vector<float*> channels (numChannels);
+
+    std::mt19937 random (1);
+    std::normal_distribution<float> normal (0.0f, 50.0f);
+
+    for (auto& sample : input)
+        sample = normal (random);
+
+    for (int c = 0; c < numChannels; c++)
+        channels[c] = buffer.data() + (size_t) c * blockSize;
+
+    std::vector<double> blockSeconds;
+    double totalSeconds = 0.0;
+
+    // the budget is wall time, so that cheap blocks are not outweighed by
+    // restoring the input
+    Clock::time_point end = Clock::now() + std::chrono::duration_cast<Clock::duration> (std::chrono::duration<double> (settings.secondsPerConfig));
+
+    while (Clock::now() < end || (int) blockSeconds.size() < minBlocks)
+    {
+        std::memcpy (buffer.data(), input.data(), input.size() * sizeof (float));
+
+        Clock::time_point start = Clock::now();
+
+        if (! plan.isEmpty())
+        {
+            const float* const* sources = snapshot.capture (&plan, channels.data(), blockSize);
+
+            engine.beginBlock();
+            engine.addStream (&plan, sources, channels.data(), blockSize, 1.0f);
+            engine.processBlock();
+        }
+
+        double seconds = std::chrono::duration<double> (Clock::now() - start).count();
+
+        blockSeconds.push_back (seconds);
+        totalSeconds += seconds;
+    }
+
+    std::sort (blockSeconds.begin(), blockSeconds.end());
+
+    double numBlocks = (double) blockSeconds.size();
+    double channelSamples = numBlocks * blockSize * numChannels;
+    double meanSeconds = std::max (totalSeconds / numBlocks, 1.0e-12);
+
+    Result result;
+    result.numChannels = numChannels;
+    result.blockSize = blockSize;
+    result.preset = preset.name;
+    result.density = (float) numReferences / ((float) numChannels * numChannels);
+    result.mode = getModeName (plan);
+    result.numGroups = plan.getNumGroups();
+    result.numNonZeros = plan.getNumNonZeros();
+    result.numBlocks = (int) blockSeconds.size();
+    result.samplesPerSecond = numBlocks * blockSize / std::max (totalSeconds, 1.0e-12);
+    result.nsPerChannelSample = totalSeconds * 1.0e9 / channelSamples;
+    result.p50Microseconds = percentile (blockSeconds, 0.5) * 1.0e6;
+    result.p99Microseconds = percentile (blockSeconds, 0.99) * 1.0e6;
+    result.maxMicroseconds = blockSeconds.back() * 1.0e6;
+    result.realtimeFactor = blockSize / settings.sampleRate / meanSeconds;
+
+    return result;
+}
+
+void writeJson (FILE* file, const Settings& settings, const std::vector<Result>& results)
+{
+    std::fprintf (file, "{\n");
+    std::fprintf (file, "  \"instruction_set\": \"%s\",\n",
+                  ReferenceKernels::getInstructionSetName (ReferenceKernels::getInstructionSet()));
+    std::fprintf (file, "  \"threads\": %d,\n", settings.numThreads);
+    std::fprintf (file, "  \"sample_rate\": %g,\n", settings.sampleRate);
+    std::fprintf (file, "  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result& r = results[i];
+
+        std::fprintf (file,
+                      "    { \"channels\": %d, \"block_size\": %d, \"preset\": \"%s\", \"density\": %.4f, "
+                      "\"mode\": \"%s\", \"groups\": %d, \"nonzeros\": %d, \"blocks\": %d, "
+                      "\"samples_per_second\": %.1f, \"ns_per_channel_sample\": %.4f, "
+                      "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, \"realtime_factor\": %.1f }%s\n",
+                      r.numChannels,
+                      r.blockSize,
+                      r.preset.c_str(),
+                      r.density,
+                      r.mode,
+                      r.numGroups,
+                      r.numNonZeros,
+                      r.numBlocks,
+                      r.samplesPerSecond,
+                      r.nsPerChannelSample,
+                      r.p50Microseconds,
+                      r.p99Microseconds,
+                      r.maxMicroseconds,
+                      r.realtimeFactor,
+                      i + 1 < results.size() ? "," : "");
+    }
+
+    std::fprintf (file, "  ]\n}\n");
+}
+
+bool parseInstructionSet (const std::string& name, ReferenceKernels::InstructionSet& set)
+{
+    const ReferenceKernels::InstructionSet sets[] = { ReferenceKernels::InstructionSet::Scalar,
+                                                      ReferenceKernels::InstructionSet::SSE2,
+                                                      ReferenceKernels::InstructionSet::AVX2,
+                                                      ReferenceKernels::InstructionSet::AVX512 };
+
+    for (auto candidate : sets)
+    {
+        std::string candidateName = ReferenceKernels::getInstructionSetName (candidate);
+        candidateName.erase (std::remove (candidateName.begin(), candidateName.end(), '-'), candidateName.end());
+        std::transform (candidateName.begin(), candidateName.end(), candidateName.begin(), ::tolower);
+
+        if (candidateName.compare (0, name.size(), name) == 0)
+        {
+            set = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void printUsage()
+{
+    std::fprintf (stderr,
+                  "Usage: VirtualRefBenchmark [--threads N] [--isa scalar|sse2|avx2|avx512]\n"
+                  "                           [--seconds S] [--sample-rate HZ] [--output FILE]\n");
+}
+} // namespace
+
+int main (int argc, char* argv[])
+{
+    Settings settings;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if (argument == "--help" || argument == "-h" || i + 1 >= argc)
+        {
+            printUsage();
+            return argument == "--help" || argument == "-h" ? 0 : 1;
+        }
+
+        std::string value = argv[++i];
+
+        if (argument == "--threads")
+        {
+            settings.numThreads = std::max (1, std::min (64, std::atoi (value.c_str())));
+        }
+        else if (argument == "--seconds")
+        {
+            settings.secondsPerConfig = std::max (0.0, std::atof (value.c_str()));
+        }
+        else if (argument == "--sample-rate")
+        {
+            settings.sampleRate = std::max (1.0, std::atof (value.c_str()));
+        }
+        else if (argument == "--output")
+        {
+            settings.output = value;
+        }
+        else if (argument == "--isa")
+        {
+            ReferenceKernels::InstructionSet set;
+
+            if (! parseInstructionSet (value, set) || ! ReferenceKernels::setInstructionSet (set))
+            {
+                std::fprintf (stderr, "Instruction set %s is not supported\n", value.c_str());
+                return 1;
+            }
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+
+    for (int numChannels : channelCounts)
+    {
+        for (int blockSize : blockSizes)
+        {
+            for (const Preset& preset : presets)
+            {
+                results.push_back (run (settings, preset, numChannels, blockSize));
+
+                const Result& r = results.back();
+                std::fprintf (stderr,
+                              "%5d ch %5d samples %-8s %-7s p50 %9.1f us  p99 %9.1f us  %7.3f ns/ch-sample\n",
+                              r.numChannels,
+                              r.blockSize,
+                              r.preset.c_str(),
+                              r.mode,
+                              r.p50Microseconds,
+                              r.p99Microseconds,
+                              r.nsPerChannelSample);
+            }
+        }
+    }
+
+    FILE* file = settings.output.empty() ? stdout : std::fopen (settings.output.c_str(), "w");
+
+    if (file == nullptr)
+    {
+        std::fprintf (stderr, "Could not open %s\n", settings.output.c_str());
+        return 1;
+    }
+
+    writeJson (file, settings, results);
+
+    if (file != stdout)
+        std::fclose (file);
+
+    return 0;
+}
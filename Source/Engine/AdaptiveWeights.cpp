@@ -0,0 +1,86 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "AdaptiveWeights.h"
+#include "ReferenceMatrix.h"
+
+#include <algorithm>
+
+AdaptiveWeights::AdaptiveWeights()
+    : stepSize (defaultStepSize),
+      frozen (false),
+      blocksSincePublish (0)
+{
+}
+
+void AdaptiveWeights::setStepSize (float value)
+{
+    stepSize.store (std::max (0.0f, value), std::memory_order_relaxed);
+}
+
+void AdaptiveWeights::setFrozen (bool value)
+{
+    frozen.store (value, std::memory_order_relaxed);
+}
+
+void AdaptiveWeights::prepare()
+{
+    blocksSincePublish = 0;
+    published.reset (weights);
+}
+
+void AdaptiveWeights::endBlock()
+{
+    if (++blocksSincePublish < publishInterval)
+        return;
+
+    blocksSincePublish = 0;
+
+    // the slots were sized in prepare(), so this copy does not allocate
+    std::vector<float>& copy = published.getWriteSlot();
+    std::copy (weights.begin(), weights.end(), copy.begin());
+
+    published.publish();
+}
+
+bool AdaptiveWeights::getLatest (std::vector<float>& latest)
+{
+    if (! published.acquire())
+        return false;
+
+    latest = published.getReadSlot();
+
+    return true;
+}
+
+void AdaptiveWeights::exportWeights (const std::vector<float>& values, ReferenceMatrix* learned) const
+{
+    for (int row : rowChannel)
+        learned->clearChannel (row);
+
+    for (size_t e = 0; e < values.size() && e < weightColumn.size(); e++)
+    {
+        if (weightColumn[e] >= 0)
+            learned->setValue (weightRow[e], weightColumn[e], values[e]);
+    }
+}
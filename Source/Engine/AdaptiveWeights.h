@@ -0,0 +1,127 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __ADAPTIVEWEIGHTS_H__
+#define __ADAPTIVEWEIGHTS_H__
+
+#include "TripleBuffer.h"
+
+#include <atomic>
+#include <vector>
+
+class ReferenceMatrix;
+
+/**
+
+  Adaptive weights
+
+  Reference weights of an adaptive ReferencePlan, learned online with a
+  block normalized LMS rule. Each referenced channel x has its own
+  weights w over its reference sources s_k, its reference is
+  sum_k w_k * s_k, and once per block the weights move along the
+  gradient of the residual power:
+
+    w_k += stepSize * sum_i e[i] * s_k[i] / sum_k sum_i s_k[i]^2
+
+  with e = x - sum_k w_k * s_k over the first tile of the block. The
+  normalization by the power of the sources makes the step independent
+  of the signal level; steps between 0 and 1 converge.
+
+  The weights are laid out like the plan's weights (sourceWeight in the
+  sparse mode, denseWeights in the dense mode), and are the only part of
+  a plan that the audio thread modifies; each row is only ever touched by
+  the job that references it. Every publishInterval blocks, a copy is
+  handed to the message thread through a triple buffer, e.g. to be saved
+  or to seed the weights of a recompiled plan.
+
+  @see ReferencePlan, ReferenceEngine
+
+*/
+
+class AdaptiveWeights
+{
+public:
+    /** Step size of new plans */
+    static constexpr float defaultStepSize = 0.05f;
+
+    /** Number of blocks between two copies handed to the message thread */
+    static constexpr int publishInterval = 32;
+
+    /** Source power below which a row is not updated */
+    static constexpr float minPower = 1.0e-20f;
+
+    /** Constructor */
+    AdaptiveWeights();
+
+    /** Sets the size of every update (normally between 0 and 1) */
+    void setStepSize (float stepSize);
+
+    /** Returns the size of every update */
+    float getStepSize() const { return stepSize.load (std::memory_order_relaxed); }
+
+    /** Stops or resumes learning; frozen weights are still applied */
+    void setFrozen (bool frozen);
+
+    /** Returns true if the weights are not being updated */
+    bool isFrozen() const { return frozen.load (std::memory_order_relaxed); }
+
+    /** Must be called once the layout below is complete and before the
+        audio thread uses the weights. Allocates the published copies. */
+    void prepare();
+
+    /** Called by the audio thread between blocks, when no job is running.
+        Publishes a copy of the weights every publishInterval blocks, without
+        locking or allocating. */
+    void endBlock();
+
+    /** Copies the latest published weights. Returns false, and leaves
+        latest unchanged, if nothing was published since the last call. */
+    bool getLatest (std::vector<float>& latest);
+
+    /** Writes weights (in the layout below) into a matrix, as the value of
+        each row's reference channels, for saving and seeding */
+    void exportWeights (const std::vector<float>& weights, ReferenceMatrix* learned) const;
+
+    /** Current weights, written by the audio thread */
+    std::vector<float> weights;
+
+    /** 1 for weights that are learned, 0 for structural zeros (e.g. the
+        channels a row does not reference in the dense mode) */
+    std::vector<float> learnable;
+
+    /** Local channel of each row */
+    std::vector<int> rowChannel;
+
+    /** Local row and reference channel of each weight, or -1 for structural zeros */
+    std::vector<int> weightRow;
+    std::vector<int> weightColumn;
+
+private:
+    std::atomic<float> stepSize;
+    std::atomic<bool> frozen;
+
+    int blocksSincePublish;
+    TripleBuffer<std::vector<float>> published;
+};
+
+#endif //__ADAPTIVEWEIGHTS_H__
@@ -0,0 +1,258 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ChannelGeometry.h"
+
+#include <algorithm>
+#include <cmath>
+
+ChannelGeometry::ChannelGeometry()
+{
+}
+
+void ChannelGeometry::setPositions (const std::vector<Position>& positions_)
+{
+    positions = positions_;
+}
+
+void ChannelGeometry::setLinearLayout (int numChannels, float pitch)
+{
+    positions.assign (std::max (0, numChannels), Position());
+
+    for (int c = 0; c < numChannels; c++)
+        positions[c].y = c * pitch;
+}
+
+bool ChannelGeometry::isPlaced (int channel) const
+{
+    return std::isfinite (positions[channel].x) && std::isfinite (positions[channel].y);
+}
+
+ChannelGeometry::SpatialIndex ChannelGeometry::buildIndex (float radius) const
+{
+    SpatialIndex index;
+
+    int numPlaced = 0;
+    float maxX = 0.0f;
+    float maxY = 0.0f;
+
+    for (int c = 0; c < getNumChannels(); c++)
+    {
+        if (! isPlaced (c))
+            continue;
+
+        const Position& p = positions[c];
+
+        index.minX = numPlaced == 0 ? p.x : std::min (index.minX, p.x);
+        index.minY = numPlaced == 0 ? p.y : std::min (index.minY, p.y);
+        maxX = numPlaced == 0 ? p.x : std::max (maxX, p.x);
+        maxY = numPlaced == 0 ? p.y : std::max (maxY, p.y);
+
+        numPlaced++;
+    }
+
+    if (numPlaced == 0)
+        return index;
+
+    // with tiny radii the grid would have more cells than channels
+    float extent = std::max (maxX - index.minX, maxY - index.minY);
+    index.cellSize = std::max ({ radius, extent / (float) numPlaced, 1.0e-3f });
+
+    index.numColumns = (int) ((maxX - index.minX) / index.cellSize) + 1;
+    index.numRows = (int) ((maxY - index.minY) / index.cellSize) + 1;
+
+    // counting sort of the channels by cell
+    std::vector<int> cellOf (positions.size(), -1);
+    index.cellStart.assign ((size_t) index.numColumns * index.numRows + 1, 0);
+
+    for (int c = 0; c < getNumChannels(); c++)
+    {
+        if (! isPlaced (c))
+            continue;
+
+        int column = (int) ((positions[c].x - index.minX) / index.cellSize);
+        int row = (int) ((positions[c].y - index.minY) / index.cellSize);
+
+        cellOf[c] = row * index.numColumns + column;
+        index.cellStart[cellOf[c] + 1]++;
+    }
+
+    for (size_t cell = 1; cell < index.cellStart.size(); cell++)
+        index.cellStart[cell] += index.cellStart[cell - 1];
+
+    std::vector<int> next (index.cellStart.begin(), index.cellStart.end() - 1);
+    index.cellChannel.resize (numPlaced);
+
+    for (int c = 0; c < getNumChannels(); c++)
+    {
+        if (cellOf[c] >= 0)
+            index.cellChannel[next[cellOf[c]]++] = c;
+    }
+
+    return index;
+}
+
+void ChannelGeometry::findNeighbours (const SpatialIndex& index, int channel, float radius, std::vector<int>& neighbours) const
+{
+    neighbours.clear();
+
+    if (! isPlaced (channel) || index.cellStart.empty())
+        return;
+
+    const Position& centre = positions[channel];
+
+    int column = (int) ((centre.x - index.minX) / index.cellSize);
+    int row = (int) ((centre.y - index.minY) / index.cellSize);
+
+    // the cells are at least radius wide, so the neighbours are all in the
+    // surrounding cells
+    std::vector<std::pair<float, int>> found;
+
+    for (int r = std::max (0, row - 1); r <= std::min (index.numRows - 1, row + 1); r++)
+    {
+        for (int c = std::max (0, column - 1); c <= std::min (index.numColumns - 1, column + 1); c++)
+        {
+            int cell = r * index.numColumns + c;
+
+            for (int k = index.cellStart[cell]; k < index.cellStart[cell + 1]; k++)
+            {
+                int other = index.cellChannel[k];
+
+                float dx = positions[other].x - centre.x;
+                float dy = positions[other].y - centre.y;
+                float distanceSquared = dx * dx + dy * dy;
+
+                if (other != channel && distanceSquared <= radius * radius)
+                    found.emplace_back (distanceSquared, other);
+            }
+        }
+    }
+
+    // ties are broken by channel index, so the result does not depend on
+    // the layout of the grid
+    std::sort (found.begin(), found.end());
+
+    for (auto& f : found)
+        neighbours.push_back (f.second);
+}
+
+std::vector<int> ChannelGeometry::getNeighbours (int channel, float radius) const
+{
+    std::vector<int> neighbours;
+
+    if (channel < 0 || channel >= getNumChannels() || radius < 0.0f)
+        return neighbours;
+
+    findNeighbours (buildIndex (radius), channel, radius, neighbours);
+
+    return neighbours;
+}
+
+std::vector<std::vector<int>> ChannelGeometry::getLocalReferences (float radius, int excludeNearest) const
+{
+    std::vector<std::vector<int>> references (positions.size());
+
+    if (radius < 0.0f)
+        return references;
+
+    SpatialIndex index = buildIndex (radius);
+    std::vector<int> neighbours;
+
+    for (int c = 0; c < getNumChannels(); c++)
+    {
+        findNeighbours (index, c, radius, neighbours);
+
+        int skip = std::min ((int) neighbours.size(), std::max (0, excludeNearest));
+
+        references[c].assign (neighbours.begin() + skip, neighbours.end());
+        std::sort (references[c].begin(), references[c].end());
+    }
+
+    return references;
+}
+
+std::vector<int> ChannelGeometry::getShanks() const
+{
+    std::vector<int> shank (positions.size(), -1);
+    std::vector<int> order;
+
+    for (int c = 0; c < getNumChannels(); c++)
+    {
+        if (isPlaced (c))
+            order.push_back (c);
+    }
+
+    auto acrossShanks = [this] (int a, int b)
+    {
+        if (positions[a].x != positions[b].x)
+            return positions[a].x < positions[b].x;
+
+        return a < b;
+    };
+
+    std::sort (order.begin(), order.end(), acrossShanks);
+
+    // a gap across the shanks starts a new shank
+    for (size_t k = 0; k < order.size(); k++)
+    {
+        bool gap = k > 0 && positions[order[k]].x - positions[order[k - 1]].x > shankSeparation;
+        shank[order[k]] = k == 0 ? 0 : shank[order[k - 1]] + (gap ? 1 : 0);
+    }
+
+    return shank;
+}
+
+std::vector<int> ChannelGeometry::getShankOrder() const
+{
+    std::vector<int> shank = getShanks();
+    std::vector<int> order;
+    std::vector<int> unplaced;
+
+    for (int c = 0; c < getNumChannels(); c++)
+    {
+        if (shank[c] >= 0)
+            order.push_back (c);
+        else
+            unplaced.push_back (c);
+    }
+
+    auto alongShanks = [this, &shank] (int a, int b)
+    {
+        if (shank[a] != shank[b])
+            return shank[a] < shank[b];
+
+        if (positions[a].y != positions[b].y)
+            return positions[a].y < positions[b].y;
+
+        if (positions[a].x != positions[b].x)
+            return positions[a].x < positions[b].x;
+
+        return a < b;
+    };
+
+    std::sort (order.begin(), order.end(), alongShanks);
+
+    order.insert (order.end(), unplaced.begin(), unplaced.end());
+
+    return order;
+}
@@ -0,0 +1,127 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __CHANNELGEOMETRY_H__
+#define __CHANNELGEOMETRY_H__
+
+#include <vector>
+
+/**
+
+  Channel geometry
+
+  Positions of the recording sites of one stream, in micrometres (x
+  across the shank, y along it), either from the stream's channel
+  metadata or from a probe map (see VirtualRef::loadProbeMap). Sites
+  without a finite position (e.g. channels a probe map does not wire) are
+  nobody's neighbour.
+
+  Neighbours are found with a uniform grid whose cells are as wide as the
+  search radius, so each query only looks at the sites of nine cells and
+  finding the neighbours of every site grows linearly with the number of
+  sites.
+
+  getShankOrder() sorts the sites along the shank(s), so that the sites
+  within a radius are mostly consecutive; a ReferencePlan given this
+  order can then compute local references as sliding windows.
+
+  @see ReferencePlan, VirtualRef
+
+*/
+
+class ChannelGeometry
+{
+public:
+    /** Position of a site, in micrometres */
+    struct Position
+    {
+        float x = 0.0f;
+        float y = 0.0f;
+    };
+
+    /** Sites whose x positions are further apart than this are on different shanks */
+    static constexpr float shankSeparation = 100.0f;
+
+    /** Distance between neighbouring sites when no positions are known */
+    static constexpr float defaultPitch = 20.0f;
+
+    /** Constructor */
+    ChannelGeometry();
+
+    /** Sets the position of every local channel */
+    void setPositions (const std::vector<Position>& positions);
+
+    /** Places the channels in a single column, in index order */
+    void setLinearLayout (int numChannels, float pitch = defaultPitch);
+
+    /** Returns the number of channels */
+    int getNumChannels() const { return (int) positions.size(); }
+
+    /** Returns the position of a local channel */
+    const Position& getPosition (int channel) const { return positions[channel]; }
+
+    /** Returns true if the channel has a finite position */
+    bool isPlaced (int channel) const;
+
+    /** Returns the channels within radius of a channel, excluding the
+        channel itself, nearest first */
+    std::vector<int> getNeighbours (int channel, float radius) const;
+
+    /** Returns the local reference of every channel: the channels within
+        radius, except the channel itself and its excludeNearest nearest
+        neighbours (e.g. sites that pick up the same units) */
+    std::vector<std::vector<int>> getLocalReferences (float radius, int excludeNearest) const;
+
+    /** Returns the shank of each channel, numbered from the lowest x, or
+        -1 for channels that are not placed */
+    std::vector<int> getShanks() const;
+
+    /** Returns the channels shank by shank, each shank sorted along its
+        length (by y, then by x), followed by the channels that are not
+        placed */
+    std::vector<int> getShankOrder() const;
+
+private:
+    /** Grid of cells that are radius wide, with the channels of each cell */
+    struct SpatialIndex
+    {
+        float cellSize = 1.0f;
+        float minX = 0.0f;
+        float minY = 0.0f;
+        int numColumns = 0;
+        int numRows = 0;
+
+        std::vector<int> cellStart;
+        std::vector<int> cellChannel;
+    };
+
+    /** Sorts the channels into cells of the given size */
+    SpatialIndex buildIndex (float radius) const;
+
+    /** Collects the channels within radius of a channel, nearest first */
+    void findNeighbours (const SpatialIndex& index, int channel, float radius, std::vector<int>& neighbours) const;
+
+    std::vector<Position> positions;
+};
+
+#endif //__CHANNELGEOMETRY_H__
@@ -0,0 +1,184 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ChannelStatistics.h"
+#include "ReferenceKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+float median (std::vector<float> values)
+{
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element (values.begin(), middle, values.end());
+
+    return *middle;
+}
+} // namespace
+
+ChannelStatistics::ChannelStatistics()
+    : windowSamples (1),
+      numAccumulated (0)
+{
+}
+
+void ChannelStatistics::prepare (const std::vector<int>& globalIndices, int windowSamples_)
+{
+    channelIndex = globalIndices;
+    windowSamples = std::max (1, windowSamples_);
+
+    size_t numChannels = channelIndex.size();
+
+    sumSquares.resize (numChannels);
+    sumDifferences.resize (numChannels);
+    minimum.resize (numChannels);
+    maximum.resize (numChannels);
+    lastSample.resize (numChannels);
+
+    reset();
+}
+
+void ChannelStatistics::reset()
+{
+    std::fill (sumSquares.begin(), sumSquares.end(), 0.0);
+    std::fill (sumDifferences.begin(), sumDifferences.end(), 0.0);
+    std::fill (minimum.begin(), minimum.end(), INFINITY);
+    std::fill (maximum.begin(), maximum.end(), -INFINITY);
+
+    numAccumulated = 0;
+    summaries.reset (std::vector<Summary> (channelIndex.size()));
+}
+
+void ChannelStatistics::accumulate (const float* const* channels, int numSamples)
+{
+    int offset = 0;
+
+    while (offset < numSamples)
+    {
+        int count = std::min (numSamples - offset, windowSamples - numAccumulated);
+
+        for (size_t c = 0; c < channelIndex.size(); c++)
+        {
+            const float* x = channels[channelIndex[c]] + offset;
+
+            // the first sample of a window has no predecessor
+            float previous = numAccumulated == 0 ? x[0] : lastSample[c];
+            float stats[4] = { 0.0f, 0.0f, minimum[c], maximum[c] };
+
+            ReferenceKernels::channelStatistics (stats, x, previous, count);
+
+            sumSquares[c] += stats[0];
+            sumDifferences[c] += stats[1];
+            minimum[c] = stats[2];
+            maximum[c] = stats[3];
+            lastSample[c] = x[count - 1];
+        }
+
+        numAccumulated += count;
+        offset += count;
+
+        if (numAccumulated == windowSamples)
+            completeWindow();
+    }
+}
+
+void ChannelStatistics::completeWindow()
+{
+    std::vector<Summary>& window = summaries.getWriteSlot();
+
+    for (size_t c = 0; c < channelIndex.size(); c++)
+    {
+        window[c].rms = (float) std::sqrt (sumSquares[c] / numAccumulated);
+        window[c].differenceRms = (float) std::sqrt (sumDifferences[c] / numAccumulated);
+        window[c].range = maximum[c] - minimum[c];
+
+        sumSquares[c] = 0.0;
+        sumDifferences[c] = 0.0;
+        minimum[c] = INFINITY;
+        maximum[c] = -INFINITY;
+    }
+
+    numAccumulated = 0;
+
+    summaries.publish();
+}
+
+bool ChannelStatistics::getLatest (std::vector<Summary>& latest)
+{
+    if (! summaries.acquire())
+        return false;
+
+    latest = summaries.getReadSlot();
+
+    return true;
+}
+
+void ChannelStatistics::evaluate (const std::vector<Summary>& summaries,
+                                  std::vector<Quality>& quality,
+                                  std::vector<float>& noiseWeight)
+{
+    int numChannels = (int) summaries.size();
+
+    quality.assign (numChannels, Quality::Good);
+    noiseWeight.assign (numChannels, 1.0f);
+
+    if (numChannels < minChannels)
+        return;
+
+    std::vector<float> rms;
+    std::vector<float> differenceRms;
+
+    for (auto& summary : summaries)
+    {
+        rms.push_back (summary.rms);
+        differenceRms.push_back (summary.differenceRms);
+    }
+
+    float typicalRms = median (rms);
+    float typicalDifference = median (differenceRms);
+
+    for (int c = 0; c < numChannels; c++)
+    {
+        const Summary& summary = summaries[c];
+
+        // non-finite samples would spread into every reference
+        if (! std::isfinite (summary.rms) || ! std::isfinite (summary.differenceRms))
+            quality[c] = Quality::Noisy;
+        else if (summary.range <= 0.0f || summary.differenceRms < flatRatio * typicalDifference)
+            quality[c] = Quality::Flat;
+        else if (summary.differenceRms > noisyRatio * typicalDifference || summary.rms > noisyRatio * typicalRms)
+            quality[c] = Quality::Noisy;
+
+        if (quality[c] != Quality::Good)
+        {
+            noiseWeight[c] = 0.0f;
+        }
+        else if (summary.differenceRms > typicalDifference)
+        {
+            float ratio = typicalDifference / summary.differenceRms;
+            noiseWeight[c] = ratio * ratio;
+        }
+    }
+}
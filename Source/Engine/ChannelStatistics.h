@@ -0,0 +1,123 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __CHANNELSTATISTICS_H__
+#define __CHANNELSTATISTICS_H__
+
+#include "TripleBuffer.h"
+
+#include <vector>
+
+/**
+
+  Channel statistics
+
+  Running per-channel statistics of one stream, used to find channels
+  that should not take part in a reference: the RMS, the RMS of the first
+  difference (a crude estimate of the high-frequency noise power) and the
+  range, which is 0 for a flat line.
+
+  accumulate() is called by the audio thread on the raw input and
+  neither locks nor allocates. Every windowSamples samples, the window
+  is summarized into a triple buffer, from which the message thread
+  picks up the latest complete window with getLatest(). evaluate() then
+  classifies the channels against the median of the stream.
+
+  @see VirtualRef
+
+*/
+
+class ChannelStatistics
+{
+public:
+    /** How a channel compares to the rest of its stream */
+    enum class Quality
+    {
+        Good = 0,
+        Flat, /**< no signal, e.g. a disconnected or shorted channel */
+        Noisy /**< far more (high-frequency) power than the median channel */
+    };
+
+    /** Statistics of one channel over a window */
+    struct Summary
+    {
+        float rms = 0.0f;
+        float differenceRms = 0.0f;
+        float range = 0.0f;
+    };
+
+    /** Channels whose difference RMS is below this fraction of the median are flat */
+    static constexpr float flatRatio = 0.1f;
+
+    /** Channels whose RMS or difference RMS exceed the median by this factor are noisy */
+    static constexpr float noisyRatio = 5.0f;
+
+    /** Streams with fewer channels are not evaluated */
+    static constexpr int minChannels = 4;
+
+    /** Constructor */
+    ChannelStatistics();
+
+    /** Allocates the accumulators for the given channels (global indices)
+        and sets the window length. Must not be called while the audio
+        thread is accumulating. */
+    void prepare (const std::vector<int>& globalIndices, int windowSamples);
+
+    /** Discards the current window and any unread summary. Must not be
+        called while the audio thread is accumulating. */
+    void reset();
+
+    /** Adds numSamples samples of every channel, with channels indexed by
+        global channel index. Does not lock or allocate. */
+    void accumulate (const float* const* channels, int numSamples);
+
+    /** Copies the summaries of the latest complete window. Returns false,
+        and leaves summaries unchanged, if no window has completed since
+        the last call. */
+    bool getLatest (std::vector<Summary>& summaries);
+
+    /** Classifies every channel and computes its inverse noise variance
+        weight relative to the median channel, capped at 1 (0 for channels
+        that are not good). */
+    static void evaluate (const std::vector<Summary>& summaries,
+                          std::vector<Quality>& quality,
+                          std::vector<float>& noiseWeight);
+
+private:
+    /** Summarizes the current window and hands it to the reader */
+    void completeWindow();
+
+    std::vector<int> channelIndex;
+    int windowSamples;
+    int numAccumulated;
+
+    std::vector<double> sumSquares;
+    std::vector<double> sumDifferences;
+    std::vector<float> minimum;
+    std::vector<float> maximum;
+    std::vector<float> lastSample;
+
+    TripleBuffer<std::vector<Summary>> summaries;
+};
+
+#endif //__CHANNELSTATISTICS_H__
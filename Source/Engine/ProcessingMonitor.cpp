@@ -0,0 +1,182 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ProcessingMonitor.h"
+
+#include <algorithm>
+#include <cmath>
+
+void ProcessingMonitor::Window::reset (int numStreams)
+{
+    histogram.assign (numBuckets, 0);
+    numBlocks = 0;
+    totalSeconds = 0.0;
+    maxSeconds = 0.0;
+    budgetSeconds = 0.0;
+    channelSamples = 0.0;
+    streamSeconds.assign (std::max (0, numStreams), 0.0);
+}
+
+void ProcessingMonitor::Window::add (const Window& other)
+{
+    histogram.resize (numBuckets, 0);
+    streamSeconds.resize (std::max (streamSeconds.size(), other.streamSeconds.size()), 0.0);
+
+    for (size_t b = 0; b < other.histogram.size() && b < histogram.size(); b++)
+        histogram[b] += other.histogram[b];
+
+    for (size_t s = 0; s < other.streamSeconds.size(); s++)
+        streamSeconds[s] += other.streamSeconds[s];
+
+    numBlocks += other.numBlocks;
+    totalSeconds += other.totalSeconds;
+    maxSeconds = std::max (maxSeconds, other.maxSeconds);
+    budgetSeconds += other.budgetSeconds;
+    channelSamples += other.channelSamples;
+}
+
+ProcessingMonitor::ProcessingMonitor()
+    : enabled (false)
+{
+    prepare (0);
+}
+
+void ProcessingMonitor::setEnabled (bool value)
+{
+    enabled.store (value, std::memory_order_relaxed);
+}
+
+void ProcessingMonitor::prepare (int numStreams)
+{
+    current.reset (numStreams);
+
+    Window empty;
+    empty.reset (numStreams);
+    published.reset (empty);
+}
+
+void ProcessingMonitor::addStreamTimes (const double* seconds, int numStreams)
+{
+    int n = std::min (numStreams, (int) current.streamSeconds.size());
+
+    for (int s = 0; s < n; s++)
+        current.streamSeconds[s] += seconds[s];
+}
+
+void ProcessingMonitor::addBlock (double seconds, double budgetSeconds, double channelSamples)
+{
+    current.histogram[bucketOf (seconds)]++;
+    current.numBlocks++;
+    current.totalSeconds += seconds;
+    current.maxSeconds = std::max (current.maxSeconds, seconds);
+    current.budgetSeconds += budgetSeconds;
+    current.channelSamples += channelSamples;
+
+    if (current.numBlocks < publishInterval)
+        return;
+
+    // the slots were sized in prepare(), so these copies do not allocate
+    Window& window = published.getWriteSlot();
+
+    std::copy (current.histogram.begin(), current.histogram.end(), window.histogram.begin());
+    std::copy (current.streamSeconds.begin(), current.streamSeconds.end(), window.streamSeconds.begin());
+    window.numBlocks = current.numBlocks;
+    window.totalSeconds = current.totalSeconds;
+    window.maxSeconds = current.maxSeconds;
+    window.budgetSeconds = current.budgetSeconds;
+    window.channelSamples = current.channelSamples;
+
+    published.publish();
+
+    std::fill (current.histogram.begin(), current.histogram.end(), 0);
+    std::fill (current.streamSeconds.begin(), current.streamSeconds.end(), 0.0);
+    current.numBlocks = 0;
+    current.totalSeconds = 0.0;
+    current.maxSeconds = 0.0;
+    current.budgetSeconds = 0.0;
+    current.channelSamples = 0.0;
+}
+
+bool ProcessingMonitor::getLatest (Window& window)
+{
+    if (! published.acquire())
+        return false;
+
+    window = published.getReadSlot();
+
+    return true;
+}
+
+int ProcessingMonitor::bucketOf (double seconds)
+{
+    double nanoseconds = seconds * 1.0e9;
+
+    if (! (nanoseconds > 1.0))
+        return 0;
+
+    return std::min (numBuckets - 1, (int) (std::log2 (nanoseconds) * bucketsPerOctave));
+}
+
+double ProcessingMonitor::bucketLimit (int bucket)
+{
+    return std::exp2 ((double) (bucket + 1) / bucketsPerOctave) * 1.0e-9;
+}
+
+ProcessingMonitor::Summary ProcessingMonitor::summarize (const Window& window)
+{
+    Summary summary;
+    summary.numBlocks = window.numBlocks;
+    summary.maxSeconds = window.maxSeconds;
+
+    if (window.numBlocks == 0)
+        return summary;
+
+    // percentiles are reported as the upper end of their bucket (within
+    // 9 % for 8 buckets per octave), but never beyond the longest block
+    auto percentile = [&] (double fraction)
+    {
+        double rank = fraction * window.numBlocks;
+        double count = 0.0;
+
+        for (size_t b = 0; b < window.histogram.size(); b++)
+        {
+            count += window.histogram[b];
+
+            if (count >= rank)
+                return std::min (bucketLimit ((int) b), window.maxSeconds);
+        }
+
+        return window.maxSeconds;
+    };
+
+    summary.medianSeconds = percentile (0.5);
+    summary.p99Seconds = percentile (0.99);
+
+    if (window.channelSamples > 0.0)
+        summary.nsPerChannelSample = window.totalSeconds * 1.0e9 / window.channelSamples;
+
+    if (window.budgetSeconds > 0.0)
+        summary.budgetFraction = window.totalSeconds / window.budgetSeconds;
+
+    return summary;
+}
@@ -0,0 +1,150 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __PROCESSINGMONITOR_H__
+#define __PROCESSINGMONITOR_H__
+
+#include "TripleBuffer.h"
+
+#include <atomic>
+#include <vector>
+
+/**
+
+  Processing monitor
+
+  Records how long the audio thread takes per block, and how much CPU
+  time the jobs of each stream take (summed over all threads), so the
+  cost of referencing can be watched during acquisition.
+
+  The audio thread adds each block to a histogram with bucketsPerOctave
+  logarithmic buckets per doubling of the block time. Every
+  publishInterval blocks, the window is handed to the message thread
+  through a triple buffer, so recording neither locks nor allocates.
+  When the monitor is disabled, the audio thread does not read the clock
+  at all.
+
+  @see VirtualRef, ReferenceEngine
+
+*/
+
+class ProcessingMonitor
+{
+public:
+    /** Histogram buckets per doubling of the block time */
+    static constexpr int bucketsPerOctave = 8;
+
+    /** Number of histogram buckets, covering 1 ns to about 4 s */
+    static constexpr int numBuckets = 32 * bucketsPerOctave;
+
+    /** Number of blocks per window handed to the message thread */
+    static constexpr int publishInterval = 64;
+
+    /** Blocks recorded over some time */
+    struct Window
+    {
+        /** Number of blocks per bucket of the block time */
+        std::vector<unsigned int> histogram;
+
+        int numBlocks = 0;
+
+        /** Total and longest block time */
+        double totalSeconds = 0.0;
+        double maxSeconds = 0.0;
+
+        /** Total duration of the blocks' samples, i.e. the real-time budget */
+        double budgetSeconds = 0.0;
+
+        /** Total number of samples times channels referenced */
+        double channelSamples = 0.0;
+
+        /** CPU time of each stream's jobs, over all threads */
+        std::vector<double> streamSeconds;
+
+        /** Forgets all blocks and sizes the window for numStreams streams */
+        void reset (int numStreams);
+
+        /** Adds the blocks of another window */
+        void add (const Window& other);
+    };
+
+    /** Statistics of a window */
+    struct Summary
+    {
+        int numBlocks = 0;
+
+        /** Median, 99th percentile and longest block time, in seconds */
+        double medianSeconds = 0.0;
+        double p99Seconds = 0.0;
+        double maxSeconds = 0.0;
+
+        /** Block time per sample and channel, in nanoseconds */
+        double nsPerChannelSample = 0.0;
+
+        /** Fraction of the real-time budget spent on the audio thread */
+        double budgetFraction = 0.0;
+    };
+
+    /** Constructor */
+    ProcessingMonitor();
+
+    /** Enables or disables recording; takes effect at the next block */
+    void setEnabled (bool enabled);
+
+    /** Returns true if blocks are recorded */
+    bool isEnabled() const { return enabled.load (std::memory_order_relaxed); }
+
+    /** Discards all recorded blocks and sizes the windows for numStreams
+        streams. Must not be called while the audio thread is recording. */
+    void prepare (int numStreams);
+
+    /** Adds the CPU time of each stream's jobs (numStreams values) to the
+        current window. Called by the audio thread. */
+    void addStreamTimes (const double* seconds, int numStreams);
+
+    /** Adds a block that took the given time and held budgetSeconds of
+        samples, and hands the window to the reader every publishInterval
+        blocks. Called by the audio thread; does not lock or allocate. */
+    void addBlock (double seconds, double budgetSeconds, double channelSamples);
+
+    /** Copies the latest complete window. Returns false, and leaves window
+        unchanged, if no window has completed since the last call. */
+    bool getLatest (Window& window);
+
+    /** Computes the statistics of a window */
+    static Summary summarize (const Window& window);
+
+private:
+    /** Returns the histogram bucket of a block time */
+    static int bucketOf (double seconds);
+
+    /** Returns the upper bound of a histogram bucket, in seconds */
+    static double bucketLimit (int bucket);
+
+    std::atomic<bool> enabled;
+
+    Window current;
+    TripleBuffer<Window> published;
+};
+
+#endif //__PROCESSINGMONITOR_H__
@@ -0,0 +1,110 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceDelayLine.h"
+
+#include <algorithm>
+#include <cstring>
+
+ReferenceDelayLine::ReferenceDelayLine()
+    : delay (0),
+      writePos (0),
+      blockSamples (0)
+{
+}
+
+void ReferenceDelayLine::prepare (const std::vector<int>& globalIndices, int numGlobalChannels, int delaySamples)
+{
+    channelIndex = globalIndices;
+    delay = std::max (1, delaySamples);
+
+    size_t size = (size_t) delay * channelIndex.size();
+
+    outputRing.assign (size, 0.0f);
+    sourceBlock.assign (size, 0.0f);
+    outputBlock.assign (size, 0.0f);
+
+    sourcePointers.assign (numGlobalChannels, nullptr);
+    outputPointers.assign (numGlobalChannels, nullptr);
+
+    for (size_t i = 0; i < channelIndex.size(); i++)
+    {
+        sourcePointers[channelIndex[i]] = sourceBlock.data() + i * delay;
+        outputPointers[channelIndex[i]] = outputBlock.data() + i * delay;
+    }
+
+    reset();
+}
+
+void ReferenceDelayLine::reset()
+{
+    std::fill (outputRing.begin(), outputRing.end(), 0.0f);
+
+    writePos = 0;
+    blockSamples = 0;
+}
+
+void ReferenceDelayLine::commitBlock()
+{
+    int firstSamples = std::min (blockSamples, delay - writePos);
+
+    for (size_t i = 0; i < channelIndex.size(); i++)
+    {
+        const float* block = outputBlock.data() + i * delay;
+        float* ring = outputRing.data() + i * delay;
+
+        memcpy (ring + writePos, block, (size_t) firstSamples * sizeof (float));
+        memcpy (ring, block + firstSamples, (size_t) (blockSamples - firstSamples) * sizeof (float));
+    }
+
+    writePos = (writePos + blockSamples) % delay;
+    blockSamples = 0;
+}
+
+void ReferenceDelayLine::push (float* const* channels, int numSamples)
+{
+    commitBlock();
+
+    numSamples = std::min (numSamples, delay);
+
+    // the ring holds exactly delay samples, so the oldest ones, which are
+    // emitted now, start at the write position
+    int firstSamples = std::min (numSamples, delay - writePos);
+    size_t bytes = (size_t) numSamples * sizeof (float);
+
+    for (size_t i = 0; i < channelIndex.size(); i++)
+    {
+        float* data = channels[channelIndex[i]];
+        const float* ring = outputRing.data() + i * delay;
+
+        // store the new block
+        memcpy (sourceBlock.data() + i * delay, data, bytes);
+        memcpy (outputBlock.data() + i * delay, data, bytes);
+
+        // and emit the one that was referenced delay samples ago
+        memcpy (data, ring + writePos, (size_t) firstSamples * sizeof (float));
+        memcpy (data + firstSamples, ring, (size_t) (numSamples - firstSamples) * sizeof (float));
+    }
+
+    blockSamples = numSamples;
+}
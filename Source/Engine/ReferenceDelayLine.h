@@ -0,0 +1,104 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEDELAYLINE_H__
+#define __REFERENCEDELAYLINE_H__
+
+#include <vector>
+
+/**
+
+  Reference delay line
+
+  Preallocated buffers that let a stream be referenced asynchronously,
+  with a fixed latency of delaySamples.
+
+  Every block that is pushed is copied to a contiguous work area twice:
+  once as the unmodified source copy and once as the copy that is
+  referenced in place by the workers. The block is then replaced by the
+  referenced samples that were pushed delaySamples earlier, from a ring
+  that the work area is moved into at the next push. The caller must make
+  sure the work on the previous block has completed before pushing the
+  next one.
+
+  As the work area never wraps, each block is handed to the
+  ReferenceEngine as a single range, so a plan is never split across
+  concurrent jobs and adaptive plans learn once per block, as in the
+  synchronous mode. The pointer arrays are indexed by global channel
+  index, like the processor's AudioBuffer.
+
+  @see ReferenceEngine
+
+*/
+
+class ReferenceDelayLine
+{
+public:
+    /** Constructor */
+    ReferenceDelayLine();
+
+    /** Allocates the buffers for the given global channel indices.
+        numGlobalChannels is the size of the processor's AudioBuffer. */
+    void prepare (const std::vector<int>& globalIndices, int numGlobalChannels, int delaySamples);
+
+    /** Clears the buffers, so that the first delaySamples output samples are zero */
+    void reset();
+
+    /** Returns the latency added by the delay line */
+    int getDelaySamples() const { return delay; }
+
+    /** Stores a block of the stream's channels and replaces it with the
+        delayed output. numSamples must not exceed the delay. */
+    void push (float* const* channels, int numSamples);
+
+    /** Unmodified samples of the last pushed block */
+    const float* const* getSources() const { return sourcePointers.data(); }
+
+    /** Samples of the last pushed block that are referenced in place */
+    float* const* getOutputs() const { return outputPointers.data(); }
+
+    /** Number of samples of the last pushed block */
+    int getBlockSamples() const { return blockSamples; }
+
+private:
+    /** Moves the referenced samples of the last pushed block into the ring */
+    void commitBlock();
+
+    std::vector<int> channelIndex;
+
+    int delay;
+    int writePos;
+    int blockSamples;
+
+    /** Referenced samples, delay per channel */
+    std::vector<float> outputRing;
+
+    /** The last pushed block, delay per channel */
+    std::vector<float> sourceBlock;
+    std::vector<float> outputBlock;
+
+    std::vector<const float*> sourcePointers;
+    std::vector<float*> outputPointers;
+};
+
+#endif //__REFERENCEDELAYLINE_H__
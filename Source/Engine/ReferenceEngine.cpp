@@ -0,0 +1,787 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceEngine.h"
+#include "ReferenceKernels.h"
+#include "ReferencePlan.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+/* Jobs are claimed from a single word that packs the number of the block
+   with its job count and the next unclaimed job. A worker that is preempted
+   in the middle of a claim can then never take a job of a later block: its
+   compare-exchange fails once a new block has been started, and it simply
+   continues with the new block's word. */
+static const int jobBits = 16;
+static const int maxJobs = (1 << jobBits) - 1;
+
+static unsigned long long packClaim (unsigned long long block, int count, int next)
+{
+    return (block << (2 * jobBits)) | ((unsigned long long) count << jobBits) | (unsigned long long) next;
+}
+
+ReferenceEngine::ReferenceEngine()
+    : numThreads (1),
+      asynchronous (false),
+      timed (false),
+      numJobs (0),
+      nextClaim (0),
+      jobsDone (0),
+      pendingJobs (0),
+      blockNumber (0),
+      generation (0),
+      shouldExit (false)
+{
+}
+
+ReferenceEngine::~ReferenceEngine()
+{
+    stopWorkers();
+}
+
+void ReferenceEngine::prepare (int numThreads_, int maxStreams, int maxGroups, bool asynchronous_)
+{
+    waitForBlock();
+
+    numThreads_ = std::max (1, numThreads_);
+
+    // in the asynchronous mode the caller does not take part, so every
+    // thread is a worker
+    int numWorkers = asynchronous_ ? numThreads_ : numThreads_ - 1;
+
+    if (numThreads_ != numThreads || (int) workers.size() != numWorkers)
+    {
+        stopWorkers();
+
+        numThreads = numThreads_;
+        shouldExit = false;
+
+        for (int i = 1; i <= numWorkers; i++)
+            workers.emplace_back (&ReferenceEngine::workerLoop, this, i);
+    }
+
+    asynchronous = asynchronous_;
+
+    jobs.resize (std::min ((size_t) std::max (1, maxStreams) * numThreads, (size_t) maxJobs));
+    numJobs = 0;
+    tagSeconds.assign (std::max (1, maxStreams), 0.0);
+
+    // the sparse mode needs one tile (two when masking), the dense mode one
+    // tile per group and the median four tiles plus a transposed block of
+    // up to maxGroups sources, so the scratch memory does not depend on
+    // the block size. Adaptive plans add a tile for the residual and the
+    // correlation with up to maxGroups sources. The window mode needs
+    // prefix sums over up to one source per channel, plus one tile.
+    size_t scratchSize = (size_t) std::max ({ 2 * ReferencePlan::sparseTileSamples,
+                                              (maxGroups + 4) * ReferencePlan::denseTileSamples,
+                                              (maxGroups + 2) * ReferencePlan::windowTileSamples })
+                         + maxGroups;
+    scratch.resize (numWorkers + 1);
+
+    for (auto& s : scratch)
+        s.assign (scratchSize, 0.0f);
+}
+
+void ReferenceEngine::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock (wakeMutex);
+        shouldExit = true;
+    }
+
+    wakeCondition.notify_all();
+
+    for (auto& worker : workers)
+        worker.join();
+
+    workers.clear();
+}
+
+void ReferenceEngine::beginBlock()
+{
+    waitForBlock();
+
+    numJobs = 0;
+}
+
+void ReferenceEngine::addStream (const ReferencePlan* plan,
+                                 const float* const* sources,
+                                 float* const* channels,
+                                 int numSamples,
+                                 float gain,
+                                 int tag)
+{
+    int numGroups = plan->getNumGroups();
+
+    if (numGroups == 0)
+        return;
+
+    int count = numJobs;
+    int available = (int) jobs.size() - count;
+
+    if (available <= 0)
+        return;
+
+    // split the groups into ranges of roughly equal cost
+    const std::vector<int>& costEnd = plan->groupCostEnd;
+    int totalCost = costEnd[numGroups];
+    int numParts = std::min ({ numThreads, available, std::max (1, totalCost / minJobCost), numGroups });
+
+    int firstGroup = 0;
+
+    for (int part = 1; part <= numParts && firstGroup < numGroups; part++)
+    {
+        int lastGroup = numGroups;
+
+        if (part < numParts)
+        {
+            long long target = (long long) totalCost * part / numParts;
+            lastGroup = int (std::lower_bound (costEnd.begin() + 1, costEnd.end(), target) - costEnd.begin());
+            lastGroup = std::max (firstGroup + 1, std::min (lastGroup, numGroups));
+        }
+
+        jobs[count++] = { plan, sources, channels, numSamples, gain, firstGroup, lastGroup, tag, timed, 0.0 };
+        firstGroup = lastGroup;
+    }
+
+    numJobs = count;
+}
+
+void ReferenceEngine::setTimed (bool value)
+{
+    timed = value;
+}
+
+void ReferenceEngine::takeJobTimes (double* seconds, int numTags)
+{
+    for (int t = 0; t < numTags && t < (int) tagSeconds.size(); t++)
+    {
+        seconds[t] += tagSeconds[t];
+        tagSeconds[t] = 0.0;
+    }
+}
+
+void ReferenceEngine::processBlock()
+{
+    int count = numJobs;
+
+    if (count == 0)
+        return;
+
+    publishJobs (count);
+
+    if (count > 1 || asynchronous)
+        wakeWorkers();
+
+    runJobs (0);
+    waitForBlock();
+}
+
+void ReferenceEngine::startBlock()
+{
+    int count = numJobs;
+
+    if (! asynchronous || count == 0)
+        return;
+
+    publishJobs (count);
+    wakeWorkers();
+}
+
+void ReferenceEngine::publishJobs (int count)
+{
+    pendingJobs = count;
+    jobsDone.store (0, std::memory_order_relaxed);
+
+    // releases the jobs to the workers; claims of earlier blocks fail from
+    // here on, since the block number changes
+    blockNumber = (blockNumber + 1) & 0xffffffffull;
+    nextClaim.store (packClaim (blockNumber, count, 0), std::memory_order_release);
+}
+
+void ReferenceEngine::waitForBlock()
+{
+    if (pendingJobs == 0)
+        return;
+
+    while (jobsDone.load (std::memory_order_acquire) < pendingJobs)
+        std::this_thread::yield();
+
+    for (int j = 0; j < pendingJobs; j++)
+    {
+        const Job& job = jobs[j];
+
+        if (job.timed && job.tag >= 0 && job.tag < (int) tagSeconds.size())
+            tagSeconds[job.tag] += job.seconds;
+    }
+
+    // every job of the block has been claimed, so workers that wake up
+    // late find nothing left to do until the next block is published
+    pendingJobs = 0;
+}
+
+void ReferenceEngine::wakeWorkers()
+{
+    if (workers.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock (wakeMutex);
+        generation++;
+    }
+
+    wakeCondition.notify_all();
+}
+
+void ReferenceEngine::runJobs (int worker)
+{
+    unsigned long long claim = nextClaim.load (std::memory_order_acquire);
+
+    for (;;)
+    {
+        int count = int ((claim >> jobBits) & maxJobs);
+        int index = int (claim & maxJobs);
+
+        if (index >= count)
+            break;
+
+        // the claim only succeeds if no other block has been published since
+        // the word was read, and it synchronizes with the release in
+        // publishJobs(), so the job is that of the current block and the
+        // block cannot complete before the job does. On failure, claim holds
+        // the current word and the loop retries with it.
+        if (! nextClaim.compare_exchange_weak (claim, claim + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+            continue;
+
+        Job& job = jobs[index];
+
+        if (job.timed)
+        {
+            auto start = std::chrono::steady_clock::now();
+            runJob (job, scratch[worker].data());
+            job.seconds = std::chrono::duration<double> (std::chrono::steady_clock::now() - start).count();
+        }
+        else
+        {
+            runJob (job, scratch[worker].data());
+        }
+
+        jobsDone.fetch_add (1, std::memory_order_release);
+
+        claim = nextClaim.load (std::memory_order_acquire);
+    }
+}
+
+void ReferenceEngine::workerLoop (int worker)
+{
+    unsigned long long seen = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock (wakeMutex);
+            wakeCondition.wait (lock, [&] { return shouldExit || generation != seen; });
+
+            if (shouldExit)
+                return;
+
+            seen = generation;
+        }
+
+        runJobs (worker);
+    }
+}
+
+void ReferenceEngine::runJob (const Job& job, float* scratchData)
+{
+    if (job.plan->getStatistic() == ReferencePlan::Statistic::Median)
+        processMedian (job, scratchData);
+    else if (job.plan->getStatistic() == ReferencePlan::Statistic::Adaptive)
+        processAdaptive (job, scratchData);
+    else if (job.plan->isMasked())
+        processMasked (job, scratchData);
+    else if (job.plan->getMode() == ReferencePlan::Mode::Dense)
+        processDense (job, scratchData);
+    else if (job.plan->getMode() == ReferencePlan::Mode::Window)
+        processWindow (job, scratchData);
+    else
+        processSparse (job, scratchData);
+}
+
+void ReferenceEngine::processSparse (const Job& job, float* ref)
+{
+    const int tileSize = ReferencePlan::sparseTileSamples;
+    const ReferencePlan* plan = job.plan;
+
+    // all groups of the job are completed tile by tile, so sources shared
+    // by several groups are still cached when the next group reads them
+    for (int start = 0; start < job.numSamples; start += tileSize)
+    {
+        int tileSamples = std::min (tileSize, job.numSamples - start);
+
+        // each unique reference signal is computed once and then
+        // subtracted from all the channels that share it
+        for (int g = job.firstGroup; g < job.lastGroup; g++)
+        {
+            int sourceStart = plan->sourceStart[g];
+
+            ReferenceKernels::weightedSum (ref,
+                                           job.sources,
+                                           plan->sourceIndex.data() + sourceStart,
+                                           plan->sourceWeight.data() + sourceStart,
+                                           plan->sourceStart[g + 1] - sourceStart,
+                                           start,
+                                           tileSamples);
+
+            publishReference (job, g, ref, plan->groupOutputScale[g], start, tileSamples);
+            subtractGroupReference (job, g, ref, start, tileSamples);
+        }
+    }
+}
+
+void ReferenceEngine::processMasked (const Job& job, float* scratchData)
+{
+    const int tileSize = ReferencePlan::sparseTileSamples;
+    const ReferencePlan* plan = job.plan;
+    float threshold = plan->getSaturationThreshold();
+
+    float* sum = scratchData;
+    float* count = scratchData + tileSize;
+
+    for (int start = 0; start < job.numSamples; start += tileSize)
+    {
+        int tileSamples = std::min (tileSize, job.numSamples - start);
+
+        for (int g = job.firstGroup; g < job.lastGroup; g++)
+        {
+            int sourceStart = plan->sourceStart[g];
+            int memberStart = plan->memberStart[g];
+            int numMembers = plan->memberStart[g + 1] - memberStart;
+
+            // unless each member removes its own sample, all members share
+            // the reference, so it is divided out once
+            bool leaveOneOut = plan->groupLeaveOneOut[g];
+
+            ReferenceKernels::maskedWeightedSum (sum,
+                                                 count,
+                                                 job.sources,
+                                                 plan->sourceIndex.data() + sourceStart,
+                                                 plan->sourceWeight.data() + sourceStart,
+                                                 plan->sourceDivisor.data() + sourceStart,
+                                                 plan->sourceStart[g + 1] - sourceStart,
+                                                 threshold,
+                                                 start,
+                                                 tileSamples,
+                                                 ! leaveOneOut);
+
+            if (leaveOneOut)
+            {
+                // the whole set's masked mean, 0 where every source is masked
+                if (g < plan->getNumPublished())
+                {
+                    float* output = job.channels[plan->groupOutput[g]] + start;
+
+                    for (int i = 0; i < tileSamples; i++)
+                        output[i] = count[i] > 0.0f ? sum[i] / count[i] : 0.0f;
+                }
+
+                // each member removes its own sample, if it was not masked;
+                // the divisor already accounts for the member's own weight
+                for (int m = memberStart; m < memberStart + numMembers; m++)
+                {
+                    ReferenceKernels::subtractMaskedReference (job.channels,
+                                                               plan->memberIndex.data() + m,
+                                                               1,
+                                                               sum,
+                                                               count,
+                                                               plan->memberSelfWeight[m],
+                                                               plan->memberSelfDivisor[m],
+                                                               threshold,
+                                                               job.gain,
+                                                               start,
+                                                               tileSamples);
+                }
+
+                continue;
+            }
+
+            publishReference (job, g, sum, 1.0f, start, tileSamples);
+
+            ReferenceKernels::subtractReference (job.channels,
+                                                 plan->memberIndex.data() + memberStart,
+                                                 numMembers,
+                                                 sum,
+                                                 job.gain,
+                                                 start,
+                                                 tileSamples);
+        }
+    }
+}
+
+void ReferenceEngine::processDense (const Job& job, float* refs)
+{
+    const int tileSize = ReferencePlan::denseTileSamples;
+
+    int numRows = job.lastGroup - job.firstGroup;
+
+    for (int start = 0; start < job.numSamples; start += tileSize)
+    {
+        int tileSamples = std::min (tileSize, job.numSamples - start);
+
+        computeDenseReferences (job, job.plan->denseWeights.data(), refs, start, tileSamples);
+
+        for (int r = 0; r < numRows; r++)
+        {
+            int g = job.firstGroup + r;
+
+            publishReference (job, g, refs + r * tileSize, job.plan->groupOutputScale[g], start, tileSamples);
+            subtractGroupReference (job, g, refs + r * tileSize, start, tileSamples);
+        }
+    }
+}
+
+void ReferenceEngine::computeDenseReferences (const Job& job, const float* weights, float* refs, int startSample, int numSamples)
+{
+    const int tileSize = ReferencePlan::denseTileSamples;
+    const int sourceBlock = ReferencePlan::denseSourceBlock;
+
+    const ReferencePlan* plan = job.plan;
+    int numRows = job.lastGroup - job.firstGroup;
+    int numSources = (int) plan->denseSources.size();
+    const float* rowWeights = weights + (size_t) job.firstGroup * numSources;
+
+    // refs = W * X for this tile, with the sources split into blocks
+    // so the source tile stays in cache while all groups are computed
+    for (int k = 0; k < numSources; k += sourceBlock)
+    {
+        ReferenceKernels::denseWeightedSum (refs,
+                                            tileSize,
+                                            rowWeights + k,
+                                            numSources,
+                                            job.sources,
+                                            plan->denseSources.data() + k,
+                                            numRows,
+                                            std::min (sourceBlock, numSources - k),
+                                            startSample,
+                                            numSamples,
+                                            k > 0);
+    }
+}
+
+void ReferenceEngine::processWindow (const Job& job, float* scratchData)
+{
+    const int tileSize = ReferencePlan::windowTileSamples;
+    const ReferencePlan* plan = job.plan;
+
+    int runStart = plan->windowStart[job.firstGroup];
+    int runEnd = plan->windowStart[job.lastGroup];
+
+    if (runStart == runEnd)
+        return;
+
+    // the prefix sums always start at the first channel, whichever job
+    // computes them, so every group sees the same rounding
+    int numPrefix = *std::max_element (plan->windowLast.begin() + runStart, plan->windowLast.begin() + runEnd);
+
+    float* prefix = scratchData;
+    float* ref = scratchData + (size_t) (numPrefix + 1) * tileSize;
+
+    for (int start = 0; start < job.numSamples; start += tileSize)
+    {
+        int tileSamples = std::min (tileSize, job.numSamples - start);
+
+        ReferenceKernels::prefixSums (prefix,
+                                      tileSize,
+                                      job.sources,
+                                      plan->windowChannels.data(),
+                                      numPrefix,
+                                      start,
+                                      tileSamples);
+
+        for (int g = job.firstGroup; g < job.lastGroup; g++)
+        {
+            int first = plan->windowStart[g];
+
+            ReferenceKernels::windowSum (ref,
+                                         prefix,
+                                         tileSize,
+                                         plan->windowFirst.data() + first,
+                                         plan->windowLast.data() + first,
+                                         plan->windowStart[g + 1] - first,
+                                         plan->windowWeight[g],
+                                         tileSamples);
+
+            publishReference (job, g, ref, plan->groupOutputScale[g], start, tileSamples);
+            subtractGroupReference (job, g, ref, start, tileSamples);
+        }
+    }
+}
+
+void ReferenceEngine::processMedian (const Job& job, float* scratchData)
+{
+    const int tileSize = ReferencePlan::denseTileSamples;
+    const ReferencePlan* plan = job.plan;
+
+    float* ranks = scratchData;
+    float* ref = scratchData + 3 * tileSize;
+    float* selectScratch = scratchData + 4 * tileSize;
+
+    for (int g = job.firstGroup; g < job.lastGroup; g++)
+    {
+        int sourceStart = plan->sourceStart[g];
+        int numSources = plan->sourceStart[g + 1] - sourceStart;
+        int memberStart = plan->memberStart[g];
+        int numMembers = plan->memberStart[g + 1] - memberStart;
+        bool leaveOneOut = plan->groupLeaveOneOut[g];
+
+        // the lower median, plus its neighbours where they are needed
+        int lowerMedian = (numSources - 1) / 2;
+        int firstRank = lowerMedian;
+        int numRanks = numSources % 2 == 1 ? 1 : 2;
+
+        if (leaveOneOut && numSources % 2 == 1)
+        {
+            firstRank = lowerMedian - 1;
+            numRanks = 3;
+        }
+
+        for (int start = 0; start < job.numSamples; start += tileSize)
+        {
+            int tileSamples = std::min (tileSize, job.numSamples - start);
+
+            ReferenceKernels::orderStatistics (ranks,
+                                               tileSize,
+                                               job.sources,
+                                               plan->sourceIndex.data() + sourceStart,
+                                               numSources,
+                                               firstRank,
+                                               numRanks,
+                                               start,
+                                               tileSamples,
+                                               selectScratch);
+
+            bool published = g < plan->getNumPublished();
+
+            // the median of the whole set, which leave-one-out members
+            // only need if it is published
+            const float* median = leaveOneOut && numSources % 2 == 1 ? ranks + tileSize : ranks;
+
+            if (numSources % 2 == 0 && (! leaveOneOut || published))
+            {
+                for (int i = 0; i < tileSamples; i++)
+                    ref[i] = 0.5f * (ranks[i] + ranks[tileSize + i]);
+
+                median = ref;
+            }
+
+            if (published)
+                publishReference (job, g, median, 1.0f, start, tileSamples);
+
+            if (leaveOneOut)
+            {
+                ReferenceKernels::subtractLeaveOneOutMedian (job.channels,
+                                                             plan->memberIndex.data() + memberStart,
+                                                             numMembers,
+                                                             ranks,
+                                                             tileSize,
+                                                             numSources,
+                                                             job.gain,
+                                                             start,
+                                                             tileSamples);
+                continue;
+            }
+
+            ReferenceKernels::subtractReference (job.channels,
+                                                 plan->memberIndex.data() + memberStart,
+                                                 numMembers,
+                                                 median,
+                                                 job.gain,
+                                                 start,
+                                                 tileSamples);
+        }
+    }
+}
+
+void ReferenceEngine::processAdaptive (const Job& job, float* scratchData)
+{
+    const ReferencePlan* plan = job.plan;
+    const AdaptiveWeights* adaptive = plan->adaptive.get();
+
+    bool dense = plan->getMode() == ReferencePlan::Mode::Dense;
+    const int tileSize = dense ? ReferencePlan::denseTileSamples : ReferencePlan::sparseTileSamples;
+    int numRows = job.lastGroup - job.firstGroup;
+
+    // one reference tile per row in the dense mode, otherwise one
+    float* refs = scratchData;
+    float* rowScratch = scratchData + (dense ? numRows : 1) * tileSize;
+
+    float stepSize = adaptive->isFrozen() ? 0.0f : adaptive->getStepSize();
+
+    for (int start = 0; start < job.numSamples; start += tileSize)
+    {
+        int tileSamples = std::min (tileSize, job.numSamples - start);
+
+        // the weights only learn from the first tile of each block, which
+        // bounds the cost of an update independently of the block size
+        bool update = stepSize > 0.0f && start == 0;
+
+        if (dense)
+            computeDenseReferences (job, adaptive->weights.data(), refs, start, tileSamples);
+
+        for (int r = 0; r < numRows; r++)
+        {
+            int g = job.firstGroup + r;
+            float* ref = dense ? refs + r * tileSize : refs;
+
+            if (! dense)
+            {
+                int sourceStart = plan->sourceStart[g];
+
+                ReferenceKernels::weightedSum (ref,
+                                               job.sources,
+                                               plan->sourceIndex.data() + sourceStart,
+                                               adaptive->weights.data() + sourceStart,
+                                               plan->sourceStart[g + 1] - sourceStart,
+                                               start,
+                                               tileSamples);
+            }
+
+            publishReference (job, g, ref, 1.0f, start, tileSamples);
+
+            // the residual is taken before the row's own subtraction
+            if (update)
+                adaptRow (job, g, ref, stepSize, rowScratch, start, tileSamples);
+
+            ReferenceKernels::subtractReference (job.channels,
+                                                 plan->memberIndex.data() + plan->memberStart[g],
+                                                 1,
+                                                 ref,
+                                                 job.gain,
+                                                 start,
+                                                 tileSamples);
+        }
+    }
+}
+
+void ReferenceEngine::adaptRow (const Job& job, int group, const float* ref, float stepSize, float* scratchData, int startSample, int numSamples)
+{
+    const ReferencePlan* plan = job.plan;
+    AdaptiveWeights* adaptive = plan->adaptive.get();
+
+    const int tileSize = std::max (ReferencePlan::sparseTileSamples, ReferencePlan::denseTileSamples);
+    float* error = scratchData;
+    float* correlation = scratchData + tileSize;
+
+    const float* x = job.channels[plan->memberIndex[plan->memberStart[group]]] + startSample;
+
+    for (int i = 0; i < numSamples; i++)
+        error[i] = x[i] - ref[i];
+
+    // the row's weights and sources, in the plan's layout
+    size_t first;
+    const int* sources;
+    int numSources;
+
+    if (plan->getMode() == ReferencePlan::Mode::Dense)
+    {
+        numSources = (int) plan->denseSources.size();
+        first = (size_t) group * numSources;
+        sources = plan->denseSources.data();
+    }
+    else
+    {
+        numSources = plan->sourceStart[group + 1] - plan->sourceStart[group];
+        first = (size_t) plan->sourceStart[group];
+        sources = plan->sourceIndex.data() + first;
+    }
+
+    float power = ReferenceKernels::correlate (correlation, job.sources, sources, numSources, error, startSample, numSamples);
+
+    if (! (power > AdaptiveWeights::minPower) || ! std::isfinite (power))
+        return;
+
+    // a non-finite residual would make the weights unusable for good
+    float total = 0.0f;
+
+    for (int k = 0; k < numSources; k++)
+        total += correlation[k];
+
+    if (! std::isfinite (total))
+        return;
+
+    float step = stepSize / power;
+    float* weights = adaptive->weights.data() + first;
+    const float* learnable = adaptive->learnable.data() + first;
+
+    for (int k = 0; k < numSources; k++)
+        weights[k] += step * learnable[k] * correlation[k];
+}
+
+void ReferenceEngine::publishReference (const Job& job, int group, const float* ref, float scale, int startSample, int numSamples)
+{
+    const ReferencePlan* plan = job.plan;
+
+    if (group >= plan->getNumPublished())
+        return;
+
+    float* output = job.channels[plan->groupOutput[group]] + startSample;
+
+    for (int i = 0; i < numSamples; i++)
+        output[i] = scale * ref[i];
+}
+
+void ReferenceEngine::subtractGroupReference (const Job& job, int group, const float* ref, int startSample, int numSamples)
+{
+    const ReferencePlan* plan = job.plan;
+
+    int memberStart = plan->memberStart[group];
+    int numMembers = plan->memberStart[group + 1] - memberStart;
+
+    if (plan->groupLeaveOneOut[group])
+    {
+        // members can differ in their own weight and normalization
+        for (int m = memberStart; m < memberStart + numMembers; m++)
+        {
+            ReferenceKernels::subtractLeaveOneOut (job.channels,
+                                                   plan->memberIndex.data() + m,
+                                                   1,
+                                                   ref,
+                                                   plan->memberSelfWeight[m],
+                                                   job.gain * plan->memberGain[m],
+                                                   startSample,
+                                                   numSamples);
+        }
+    }
+    else
+    {
+        ReferenceKernels::subtractReference (job.channels,
+                                             plan->memberIndex.data() + memberStart,
+                                             numMembers,
+                                             ref,
+                                             job.gain,
+                                             startSample,
+                                             numSamples);
+    }
+}
@@ -0,0 +1,199 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEENGINE_H__
+#define __REFERENCEENGINE_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ReferencePlan;
+
+/**
+
+  Reference engine
+
+  Executes the ReferencePlans of all streams for one block of data.
+
+  Each stream's groups are split into ranges of roughly equal cost
+  (sources + members), and the resulting jobs are claimed lock-free by a
+  persistent pool of worker threads. The calling thread takes part in the
+  work and then waits until every job has completed.
+
+  Jobs walk the block in sample tiles (see ReferencePlan), completing
+  the reference sums and subtractions of a tile while its samples are
+  still in cache, so the scratch memory does not grow with the block.
+
+  Every group is always computed by the same sequence of operations, no
+  matter which job it ends up in, so the output is bit-identical for any
+  number of threads.
+
+  Adaptive plans update their weights while they run (see
+  AdaptiveWeights). Each row is updated by the job that references it,
+  from its own residual, so this also holds for them.
+
+  Groups whose reference signal is published (see ReferencePlan) write
+  it to their output channel from the tile in which it was computed, so
+  publishing costs one store per sample and group.
+
+  In the asynchronous mode, all jobs are run by the workers: startBlock()
+  returns immediately and waitForBlock() collects the result later, e.g.
+  at the start of the next block (see ReferenceDelayLine).
+
+  @see ReferencePlan, ReferenceKernels
+
+*/
+
+class ReferenceEngine
+{
+public:
+    /** Constructor */
+    ReferenceEngine();
+
+    /** Destructor */
+    ~ReferenceEngine();
+
+    /** Starts or stops worker threads and sizes the scratch memory, which
+        only depends on the tile sizes, not on the block size. Waits
+        for a started block, and must not be called while one is being added
+        or processed. maxStreams is the maximum number of addStream() calls
+        per block, and maxGroups the maximum number of channels of a
+        stream, which bounds its groups and the sources of each group. */
+    void prepare (int numThreads, int maxStreams, int maxGroups, bool asynchronous = false);
+
+    /** Returns the number of threads used per block, including the caller
+        in the synchronous mode */
+    int getNumThreads() const { return numThreads; }
+
+    /** Returns true if blocks are processed by the workers only */
+    bool isAsynchronous() const { return asynchronous; }
+
+    /** Waits for any started block and then starts collecting the streams
+        of a new block */
+    void beginBlock();
+
+    /** Adds a stream to the current block. sources must hold an unmodified
+        copy of the channels that are being referenced in place. tag
+        identifies the stream in takeJobTimes(). */
+    void addStream (const ReferencePlan* plan,
+                    const float* const* sources,
+                    float* const* channels,
+                    int numSamples,
+                    float gain,
+                    int tag = 0);
+
+    /** Measures the time of every job added from now on */
+    void setTimed (bool timed);
+
+    /** Adds the time that the measured jobs of the blocks completed since
+        the last call took, by tag, to seconds[0 .. numTags) and restarts
+        the count */
+    void takeJobTimes (double* seconds, int numTags);
+
+    /** Processes all streams added since beginBlock() and returns once
+        every stream has been referenced */
+    void processBlock();
+
+    /** Hands all streams added since beginBlock() to the workers and
+        returns immediately. Only has an effect in the asynchronous mode. */
+    void startBlock();
+
+    /** Returns once the last started block has been referenced */
+    void waitForBlock();
+
+private:
+    /** A contiguous range of groups of one stream */
+    struct Job
+    {
+        const ReferencePlan* plan;
+        const float* const* sources;
+        float* const* channels;
+        int numSamples;
+        float gain;
+        int firstGroup;
+        int lastGroup;
+        int tag;
+        bool timed;
+
+        /** Time the job took, if it is timed */
+        double seconds;
+    };
+
+    /** Minimum cost (sources + members) that is worth a separate job */
+    static constexpr int minJobCost = 64;
+
+    void runJobs (int worker);
+    void runJob (const Job& job, float* scratch);
+
+    void processSparse (const Job& job, float* scratch);
+    void processMasked (const Job& job, float* scratch);
+    void processDense (const Job& job, float* scratch);
+    void processWindow (const Job& job, float* scratch);
+    void processMedian (const Job& job, float* scratch);
+    void processAdaptive (const Job& job, float* scratch);
+
+    void computeDenseReferences (const Job& job, const float* weights, float* refs, int startSample, int numSamples);
+
+    void adaptRow (const Job& job, int group, const float* ref, float stepSize, float* scratch, int startSample, int numSamples);
+
+    void subtractGroupReference (const Job& job, int group, const float* ref, int startSample, int numSamples);
+
+    void publishReference (const Job& job, int group, const float* ref, float scale, int startSample, int numSamples);
+
+    /** Hands count jobs to the workers as a new block */
+    void publishJobs (int count);
+
+    void workerLoop (int worker);
+    void stopWorkers();
+
+    void wakeWorkers();
+
+    int numThreads;
+    bool asynchronous;
+    bool timed;
+
+    /** Time of the completed jobs, by tag (audio thread only) */
+    std::vector<double> tagSeconds;
+
+    std::vector<Job> jobs;
+    int numJobs;
+
+    /** Block number, job count and next unclaimed job (see runJobs()) */
+    std::atomic<unsigned long long> nextClaim;
+    std::atomic<int> jobsDone;
+    int pendingJobs;
+    unsigned long long blockNumber;
+
+    std::vector<std::vector<float>> scratch;
+
+    std::vector<std::thread> workers;
+    std::mutex wakeMutex;
+    std::condition_variable wakeCondition;
+    unsigned long long generation;
+    bool shouldExit;
+};
+
+#endif //__REFERENCEENGINE_H__
@@ -0,0 +1,2828 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define REFKERNELS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define REFKERNELS_X86 0
+#endif
+
+/* GCC and Clang need to be told which functions may use wider instruction
+   sets, MSVC allows all intrinsics everywhere. */
+#if defined(_MSC_VER) && ! defined(__clang__)
+#define REFKERNELS_TARGET(isa)
+#else
+#define REFKERNELS_TARGET(isa) __attribute__ ((target (isa)))
+#endif
+
+using namespace ReferenceKernels;
+
+namespace
+{
+typedef void (*WeightedSumFn) (float*, const float* const*, const int*, const float*, int, int, int);
+typedef void (*SubtractReferenceFn) (float* const*, const int*, int, const float*, float, int, int);
+typedef void (*SubtractLeaveOneOutFn) (float* const*, const int*, int, const float*, float, float, int, int);
+typedef void (*DenseWeightedSumFn) (float*, int, const float*, int, const float* const*, const int*, int, int, int, int, bool);
+typedef void (*NetworkOrderStatisticsFn) (float*, int, const float* const*, const int*, int, int, int, int, int);
+typedef void (*SelectOrderStatisticsFn) (float*, int, const float* const*, const int*, int, int, int, int, int, float*);
+typedef void (*SubtractLeaveOneOutMedianFn) (float* const*, const int*, int, const float*, int, int, float, int, int);
+typedef void (*MaskedWeightedSumFn) (float*, float*, const float* const*, const int*, const float*, const float*, int, float, int, int, bool);
+typedef void (*SubtractMaskedReferenceFn) (float* const*, const int*, int, const float*, const float*, float, float, float, float, int, int);
+typedef void (*ChannelStatisticsFn) (float*, const float*, float, int);
+typedef float (*CorrelateFn) (float*, const float* const*, const int*, int, const float*, int, int);
+typedef void (*PrefixSumsFn) (float*, int, const float* const*, const int*, int, int, int);
+typedef void (*WindowSumFn) (float*, const float*, int, const int*, const int*, int, float, int);
+
+struct KernelTable
+{
+    InstructionSet set;
+    WeightedSumFn weightedSum;
+    SubtractReferenceFn subtractReference;
+    SubtractLeaveOneOutFn subtractLeaveOneOut;
+    DenseWeightedSumFn denseWeightedSum;
+    NetworkOrderStatisticsFn networkOrderStatistics;
+    SelectOrderStatisticsFn selectOrderStatistics;
+    SubtractLeaveOneOutMedianFn subtractLeaveOneOutMedian;
+    MaskedWeightedSumFn maskedWeightedSum;
+    SubtractMaskedReferenceFn subtractMaskedReference;
+    ChannelStatisticsFn channelStatistics;
+    CorrelateFn correlate;
+    PrefixSumsFn prefixSums;
+    WindowSumFn windowSum;
+};
+
+/* Compare-exchange networks for 0 .. maxNetworkSources wires, derived from
+   Batcher's odd-even merge sort over maxNetworkSources wires. Wires beyond
+   the group size would only hold +inf and never move, so comparators that
+   touch them are dropped. */
+struct Comparator
+{
+    unsigned char lo;
+    unsigned char hi;
+};
+
+std::vector<std::vector<Comparator>> buildSortingNetworks()
+{
+    const int n = maxNetworkSources;
+    std::vector<std::vector<Comparator>> networks (n + 1);
+
+    for (int p = 1; p < n; p <<= 1)
+    {
+        for (int k = p; k >= 1; k >>= 1)
+        {
+            for (int j = k % p; j + k < n; j += 2 * k)
+            {
+                for (int i = 0; i < std::min (k, n - j - k); i++)
+                {
+                    int a = i + j;
+                    int b = i + j + k;
+
+                    if (a / (2 * p) != b / (2 * p))
+                        continue;
+
+                    for (int size = b + 1; size <= n; size++)
+                        networks[size].push_back ({ (unsigned char) a, (unsigned char) b });
+                }
+            }
+        }
+    }
+
+    return networks;
+}
+
+const std::vector<std::vector<Comparator>> sortingNetworks = buildSortingNetworks();
+
+/* -----------------------------------------------------------------
+Scalar
+----------------------------------------------------------------- */
+
+void weightedSumScalar (float* dst,
+                        const float* const* channels,
+                        const int* sourceIndex,
+                        const float* weights,
+                        int numSources,
+                        int startSample,
+                        int numSamples)
+{
+    bool accumulate = false;
+    int k = 0;
+
+    for (; k + 4 <= numSources; k += 4)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+        const float* s1 = channels[sourceIndex[k + 1]] + startSample;
+        const float* s2 = channels[sourceIndex[k + 2]] + startSample;
+        const float* s3 = channels[sourceIndex[k + 3]] + startSample;
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            float acc = accumulate ? dst[i] : 0.0f;
+            acc += weights[k] * s0[i];
+            acc += weights[k + 1] * s1[i];
+            acc += weights[k + 2] * s2[i];
+            acc += weights[k + 3] * s3[i];
+            dst[i] = acc;
+        }
+
+        accumulate = true;
+    }
+
+    for (; k < numSources; k++)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            float acc = accumulate ? dst[i] : 0.0f;
+            acc += weights[k] * s0[i];
+            dst[i] = acc;
+        }
+
+        accumulate = true;
+    }
+
+    if (! accumulate)
+        std::memset (dst, 0, sizeof (float) * numSamples);
+}
+
+void subtractReferenceScalar (float* const* channels,
+                              const int* memberIndex,
+                              int numMembers,
+                              const float* ref,
+                              float gain,
+                              int startSample,
+                              int numSamples)
+{
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < numSamples; i++)
+            x[i] -= gain * ref[i];
+    }
+}
+
+void subtractLeaveOneOutScalar (float* const* channels,
+                                const int* memberIndex,
+                                int numMembers,
+                                const float* sum,
+                                float selfWeight,
+                                float gain,
+                                int startSample,
+                                int numSamples)
+{
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < numSamples; i++)
+            x[i] -= gain * (sum[i] - selfWeight * x[i]);
+    }
+}
+
+void denseWeightedSumScalar (float* refs,
+                             int refStride,
+                             const float* weights,
+                             int weightStride,
+                             const float* const* channels,
+                             const int* sourceIndex,
+                             int numRows,
+                             int numSources,
+                             int startSample,
+                             int numSamples,
+                             bool accumulate)
+{
+    for (int r = 0; r < numRows; r++)
+    {
+        float* out = refs + r * refStride;
+        const float* w = weights + r * weightStride;
+
+        if (! accumulate)
+            std::memset (out, 0, sizeof (float) * numSamples);
+
+        for (int k = 0; k < numSources; k++)
+        {
+            const float* x = channels[sourceIndex[k]] + startSample;
+
+            for (int i = 0; i < numSamples; i++)
+                out[i] += w[k] * x[i];
+        }
+    }
+}
+
+/* min and max with the same operand order as minps / maxps, so that
+   SIMD bodies and scalar tails agree */
+void maskedWeightedSumScalar (float* sum,
+                              float* count,
+                              const float* const* channels,
+                              const int* sourceIndex,
+                              const float* weights,
+                              const float* divisors,
+                              int numSources,
+                              float threshold,
+                              int startSample,
+                              int numSamples,
+                              bool divide)
+{
+    std::memset (sum, 0, sizeof (float) * numSamples);
+    std::memset (count, 0, sizeof (float) * numSamples);
+
+    for (int k = 0; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample;
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            // NaNs fail the comparison and are masked as well
+            bool valid = std::fabs (x[i]) < threshold;
+            sum[i] += valid ? weights[k] * x[i] : 0.0f;
+            count[i] += valid ? divisors[k] : 0.0f;
+        }
+    }
+
+    if (divide)
+    {
+        for (int i = 0; i < numSamples; i++)
+            sum[i] = count[i] > 0.0f ? sum[i] / count[i] : 0.0f;
+    }
+}
+
+void subtractMaskedReferenceScalar (float* const* channels,
+                                    const int* memberIndex,
+                                    int numMembers,
+                                    const float* sum,
+                                    const float* count,
+                                    float selfWeight,
+                                    float selfDivisor,
+                                    float threshold,
+                                    float gain,
+                                    int startSample,
+                                    int numSamples)
+{
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            bool valid = std::fabs (x[i]) < threshold;
+            float numerator = sum[i] - (valid ? selfWeight * x[i] : 0.0f);
+            float denominator = count[i] - (valid ? selfDivisor : 0.0f);
+
+            if (denominator > 0.0f)
+                x[i] -= gain * (numerator / denominator);
+        }
+    }
+}
+
+void channelStatisticsScalar (float* stats, const float* x, float previous, int numSamples)
+{
+    float squares = 0.0f;
+    float differences = 0.0f;
+    float low = stats[2];
+    float high = stats[3];
+
+    for (int i = 0; i < numSamples; i++)
+    {
+        float difference = x[i] - previous;
+        previous = x[i];
+
+        squares += x[i] * x[i];
+        differences += difference * difference;
+        low = std::min (low, x[i]);
+        high = std::max (high, x[i]);
+    }
+
+    stats[0] += squares;
+    stats[1] += differences;
+    stats[2] = low;
+    stats[3] = high;
+}
+
+float correlateScalar (float* correlation,
+                       const float* const* channels,
+                       const int* sourceIndex,
+                       int numSources,
+                       const float* error,
+                       int startSample,
+                       int numSamples)
+{
+    float power = 0.0f;
+
+    for (int k = 0; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample;
+        float dot = 0.0f;
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            dot += error[i] * x[i];
+            power += x[i] * x[i];
+        }
+
+        correlation[k] = dot;
+    }
+
+    return power;
+}
+
+void prefixSumsScalar (float* prefix,
+                       int prefixStride,
+                       const float* const* channels,
+                       const int* channelIndex,
+                       int numChannels,
+                       int startSample,
+                       int numSamples)
+{
+    std::fill (prefix, prefix + numSamples, 0.0f);
+
+    for (int p = 0; p < numChannels; p++)
+    {
+        const float* x = channels[channelIndex[p]] + startSample;
+        const float* previous = prefix + (size_t) p * prefixStride;
+        float* next = prefix + (size_t) (p + 1) * prefixStride;
+
+        for (int i = 0; i < numSamples; i++)
+            next[i] = previous[i] + x[i];
+    }
+}
+
+void windowSumScalar (float* dst,
+                      const float* prefix,
+                      int prefixStride,
+                      const int* runFirst,
+                      const int* runLast,
+                      int numRuns,
+                      float weight,
+                      int numSamples)
+{
+    for (int i = 0; i < numSamples; i++)
+    {
+        float sum = 0.0f;
+
+        for (int r = 0; r < numRuns; r++)
+            sum += prefix[(size_t) runLast[r] * prefixStride + i] - prefix[(size_t) runFirst[r] * prefixStride + i];
+
+        dst[i] = weight * sum;
+    }
+}
+
+inline float minScalar (float a, float b) { return a < b ? a : b; }
+inline float maxScalar (float a, float b) { return a > b ? a : b; }
+
+void networkOrderStatisticsScalar (float* ranks,
+                                   int rankStride,
+                                   const float* const* channels,
+                                   const int* sourceIndex,
+                                   int numSources,
+                                   int firstRank,
+                                   int numRanks,
+                                   int startSample,
+                                   int numSamples)
+{
+    const std::vector<Comparator>& network = sortingNetworks[numSources];
+    float v[maxNetworkSources];
+
+    for (int i = 0; i < numSamples; i++)
+    {
+        for (int k = 0; k < numSources; k++)
+            v[k] = channels[sourceIndex[k]][startSample + i];
+
+        for (const Comparator& c : network)
+        {
+            float lo = minScalar (v[c.lo], v[c.hi]);
+            v[c.hi] = maxScalar (v[c.lo], v[c.hi]);
+            v[c.lo] = lo;
+        }
+
+        for (int r = 0; r < numRanks; r++)
+            ranks[r * rankStride + i] = v[firstRank + r];
+    }
+}
+
+/* Groups that are too large for a network are transposed into blocks of
+   sample-major columns, and each column is partially sorted around the
+   requested ranks. */
+void selectOrderStatisticsScalar (float* ranks,
+                            int rankStride,
+                                  const float* const* channels,
+                                  const int* sourceIndex,
+                                  int numSources,
+                                  int firstRank,
+                                  int numRanks,
+                                  int startSample,
+                                  int numSamples,
+                                  float* scratch)
+{
+    const int blockSamples = orderStatisticsBlockSamples;
+
+    // with three ranks the middle one is selected and its neighbours are
+    // the largest value below and the smallest value above it
+    int middle = firstRank + (numRanks == 3 ? 1 : 0);
+
+    for (int start = 0; start < numSamples; start += blockSamples)
+    {
+        int count = std::min (blockSamples, numSamples - start);
+
+        for (int k = 0; k < numSources; k++)
+        {
+            const float* x = channels[sourceIndex[k]] + startSample + start;
+
+            for (int i = 0; i < count; i++)
+                scratch[i * numSources + k] = x[i];
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            float* column = scratch + i * numSources;
+            std::nth_element (column, column + middle, column + numSources);
+
+            for (int r = 0; r < numRanks; r++)
+            {
+                int rank = firstRank + r;
+                float value = column[middle];
+
+                if (rank < middle)
+                    value = *std::max_element (column, column + middle);
+                else if (rank > middle)
+                    value = *std::min_element (column + middle + 1, column + numSources);
+
+                ranks[r * rankStride + start + i] = value;
+            }
+        }
+    }
+}
+
+void subtractLeaveOneOutMedianScalar (float* const* channels,
+                                      const int* memberIndex,
+                                      int numMembers,
+                                      const float* ranks,
+                                      int rankStride,
+                                      int numSources,
+                                      float gain,
+                                      int startSample,
+                                      int numSamples)
+{
+    const float* r0 = ranks;
+    const float* r1 = ranks + rankStride;
+    const float* r2 = ranks + 2 * rankStride;
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        if (numSources % 2 == 1)
+        {
+            // r0, r1, r2 are the ranks below, at and above the median of the
+            // whole set; removing x leaves an even count
+            for (int i = 0; i < numSamples; i++)
+            {
+                float lo = x[i] < r1[i] ? r1[i] : r0[i];
+                float hi = x[i] > r1[i] ? r1[i] : r2[i];
+                x[i] -= gain * (0.5f * (lo + hi));
+            }
+        }
+        else
+        {
+            // r0, r1 are the two middle ranks; removing x leaves an odd count
+            for (int i = 0; i < numSamples; i++)
+                x[i] -= gain * (x[i] <= r0[i] ? r1[i] : r0[i]);
+        }
+    }
+}
+
+#if REFKERNELS_X86
+
+/* -----------------------------------------------------------------
+SSE2
+----------------------------------------------------------------- */
+
+REFKERNELS_TARGET ("sse2")
+void weightedSumSSE2 (float* dst,
+                      const float* const* channels,
+                      const int* sourceIndex,
+                      const float* weights,
+                      int numSources,
+                      int startSample,
+                      int numSamples)
+{
+    bool accumulate = false;
+    int k = 0;
+
+    for (; k + 4 <= numSources; k += 4)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+        const float* s1 = channels[sourceIndex[k + 1]] + startSample;
+        const float* s2 = channels[sourceIndex[k + 2]] + startSample;
+        const float* s3 = channels[sourceIndex[k + 3]] + startSample;
+
+        __m128 w0 = _mm_set1_ps (weights[k]);
+        __m128 w1 = _mm_set1_ps (weights[k + 1]);
+        __m128 w2 = _mm_set1_ps (weights[k + 2]);
+        __m128 w3 = _mm_set1_ps (weights[k + 3]);
+
+        int i = 0;
+
+        for (; i + 4 <= numSamples; i += 4)
+        {
+            __m128 acc = accumulate ? _mm_loadu_ps (dst + i) : _mm_setzero_ps();
+            acc = _mm_add_ps (acc, _mm_mul_ps (w0, _mm_loadu_ps (s0 + i)));
+            acc = _mm_add_ps (acc, _mm_mul_ps (w1, _mm_loadu_ps (s1 + i)));
+            acc = _mm_add_ps (acc, _mm_mul_ps (w2, _mm_loadu_ps (s2 + i)));
+            acc = _mm_add_ps (acc, _mm_mul_ps (w3, _mm_loadu_ps (s3 + i)));
+            _mm_storeu_ps (dst + i, acc);
+        }
+
+        for (; i < numSamples; i++)
+        {
+            float acc = accumulate ? dst[i] : 0.0f;
+            acc += weights[k] * s0[i];
+            acc += weights[k + 1] * s1[i];
+            acc += weights[k + 2] * s2[i];
+            acc += weights[k + 3] * s3[i];
+            dst[i] = acc;
+        }
+
+        accumulate = true;
+    }
+
+    for (; k < numSources; k++)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+        __m128 w0 = _mm_set1_ps (weights[k]);
+
+        int i = 0;
+
+        for (; i + 4 <= numSamples; i += 4)
+        {
+            __m128 acc = accumulate ? _mm_loadu_ps (dst + i) : _mm_setzero_ps();
+            acc = _mm_add_ps (acc, _mm_mul_ps (w0, _mm_loadu_ps (s0 + i)));
+            _mm_storeu_ps (dst + i, acc);
+        }
+
+        for (; i < numSamples; i++)
+        {
+            float acc = accumulate ? dst[i] : 0.0f;
+            acc += weights[k] * s0[i];
+            dst[i] = acc;
+        }
+
+        accumulate = true;
+    }
+
+    if (! accumulate)
+        std::memset (dst, 0, sizeof (float) * numSamples);
+}
+
+REFKERNELS_TARGET ("sse2")
+void subtractReferenceSSE2 (float* const* channels,
+                            const int* memberIndex,
+                            int numMembers,
+                            const float* ref,
+                            float gain,
+                            int startSample,
+                            int numSamples)
+{
+    __m128 g = _mm_set1_ps (gain);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        int i = 0;
+
+        for (; i + 4 <= numSamples; i += 4)
+            _mm_storeu_ps (x + i, _mm_sub_ps (_mm_loadu_ps (x + i), _mm_mul_ps (g, _mm_loadu_ps (ref + i))));
+
+        for (; i < numSamples; i++)
+            x[i] -= gain * ref[i];
+    }
+}
+
+REFKERNELS_TARGET ("sse2")
+void subtractLeaveOneOutSSE2 (float* const* channels,
+                              const int* memberIndex,
+                              int numMembers,
+                              const float* sum,
+                              float selfWeight,
+                              float gain,
+                              int startSample,
+                              int numSamples)
+{
+    __m128 g = _mm_set1_ps (gain);
+    __m128 w = _mm_set1_ps (selfWeight);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        int i = 0;
+
+        for (; i + 4 <= numSamples; i += 4)
+        {
+            __m128 v = _mm_loadu_ps (x + i);
+            __m128 ref = _mm_sub_ps (_mm_loadu_ps (sum + i), _mm_mul_ps (w, v));
+            _mm_storeu_ps (x + i, _mm_sub_ps (v, _mm_mul_ps (g, ref)));
+        }
+
+        for (; i < numSamples; i++)
+            x[i] -= gain * (sum[i] - selfWeight * x[i]);
+    }
+}
+
+REFKERNELS_TARGET ("sse2")
+void maskedWeightedSumSSE2 (float* sum,
+                            float* count,
+                            const float* const* channels,
+                            const int* sourceIndex,
+                            const float* weights,
+                            const float* divisors,
+                            int numSources,
+                            float threshold,
+                            int startSample,
+                            int numSamples,
+                            bool divide)
+{
+    __m128 t = _mm_set1_ps (threshold);
+    __m128 absMask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+
+    int body = numSamples & ~3;
+
+    for (int i = 0; i < body; i += 4)
+    {
+        __m128 acc = _mm_setzero_ps();
+        __m128 cnt = _mm_setzero_ps();
+
+        for (int k = 0; k < numSources; k++)
+        {
+            __m128 x = _mm_loadu_ps (channels[sourceIndex[k]] + startSample + i);
+            __m128 valid = _mm_cmplt_ps (_mm_and_ps (x, absMask), t);
+            acc = _mm_add_ps (acc, _mm_mul_ps (_mm_set1_ps (weights[k]), _mm_and_ps (x, valid)));
+            cnt = _mm_add_ps (cnt, _mm_and_ps (_mm_set1_ps (divisors[k]), valid));
+        }
+
+        if (divide)
+            acc = _mm_and_ps (_mm_div_ps (acc, cnt), _mm_cmpgt_ps (cnt, _mm_setzero_ps()));
+
+        _mm_storeu_ps (sum + i, acc);
+        _mm_storeu_ps (count + i, cnt);
+    }
+
+    if (body < numSamples)
+        maskedWeightedSumScalar (sum + body, count + body, channels, sourceIndex, weights, divisors, numSources, threshold, startSample + body, numSamples - body, divide);
+}
+
+REFKERNELS_TARGET ("sse2")
+void subtractMaskedReferenceSSE2 (float* const* channels,
+                                  const int* memberIndex,
+                                  int numMembers,
+                                  const float* sum,
+                                  const float* count,
+                                  float selfWeight,
+                                  float selfDivisor,
+                                  float threshold,
+                                  float gain,
+                                  int startSample,
+                                  int numSamples)
+{
+    __m128 t = _mm_set1_ps (threshold);
+    __m128 absMask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+    __m128 g = _mm_set1_ps (gain);
+    __m128 sw = _mm_set1_ps (selfWeight);
+    __m128 sd = _mm_set1_ps (selfDivisor);
+
+    int body = numSamples & ~3;
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < body; i += 4)
+        {
+            __m128 v = _mm_loadu_ps (x + i);
+            __m128 valid = _mm_cmplt_ps (_mm_and_ps (v, absMask), t);
+            __m128 numerator = _mm_sub_ps (_mm_loadu_ps (sum + i), _mm_mul_ps (sw, _mm_and_ps (v, valid)));
+            __m128 denominator = _mm_sub_ps (_mm_loadu_ps (count + i), _mm_and_ps (sd, valid));
+
+            // no reference where every source is masked
+            __m128 ref = _mm_and_ps (_mm_div_ps (numerator, denominator), _mm_cmpgt_ps (denominator, _mm_setzero_ps()));
+            _mm_storeu_ps (x + i, _mm_sub_ps (v, _mm_mul_ps (g, ref)));
+        }
+    }
+
+    if (body < numSamples)
+        subtractMaskedReferenceScalar (channels, memberIndex, numMembers, sum + body, count + body, selfWeight, selfDivisor, threshold, gain, startSample + body, numSamples - body);
+}
+
+REFKERNELS_TARGET ("sse2")
+void channelStatisticsSSE2 (float* stats, const float* x, float previous, int numSamples)
+{
+    if (numSamples <= 4)
+        return channelStatisticsScalar (stats, x, previous, numSamples);
+
+    // the first sample's predecessor is not in x
+    channelStatisticsScalar (stats, x, previous, 1);
+
+    __m128 squares = _mm_setzero_ps();
+    __m128 differences = _mm_setzero_ps();
+    __m128 low = _mm_set1_ps (stats[2]);
+    __m128 high = _mm_set1_ps (stats[3]);
+
+    int i = 1;
+
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        __m128 v = _mm_loadu_ps (x + i);
+        __m128 d = _mm_sub_ps (v, _mm_loadu_ps (x + i - 1));
+
+        squares = _mm_add_ps (squares, _mm_mul_ps (v, v));
+        differences = _mm_add_ps (differences, _mm_mul_ps (d, d));
+        low = _mm_min_ps (low, v);
+        high = _mm_max_ps (high, v);
+    }
+
+    float lanes[4][4];
+    _mm_storeu_ps (lanes[0], squares);
+    _mm_storeu_ps (lanes[1], differences);
+    _mm_storeu_ps (lanes[2], low);
+    _mm_storeu_ps (lanes[3], high);
+
+    for (int l = 0; l < 4; l++)
+    {
+        stats[0] += lanes[0][l];
+        stats[1] += lanes[1][l];
+        stats[2] = std::min (stats[2], lanes[2][l]);
+        stats[3] = std::max (stats[3], lanes[3][l]);
+    }
+
+    channelStatisticsScalar (stats, x + i, x[i - 1], numSamples - i);
+}
+
+REFKERNELS_TARGET ("sse2")
+float correlateSSE2 (float* correlation,
+                     const float* const* channels,
+                     const int* sourceIndex,
+                     int numSources,
+                     const float* error,
+                     int startSample,
+                     int numSamples)
+{
+    int body = numSamples & ~3;
+    __m128 power = _mm_setzero_ps();
+    float tailPower = 0.0f;
+
+    for (int k = 0; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample;
+        __m128 dot = _mm_setzero_ps();
+
+        for (int i = 0; i < body; i += 4)
+        {
+            __m128 v = _mm_loadu_ps (x + i);
+            dot = _mm_add_ps (dot, _mm_mul_ps (_mm_loadu_ps (error + i), v));
+            power = _mm_add_ps (power, _mm_mul_ps (v, v));
+        }
+
+        float lanes[4];
+        _mm_storeu_ps (lanes, dot);
+        correlation[k] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+        for (int i = body; i < numSamples; i++)
+        {
+            correlation[k] += error[i] * x[i];
+            tailPower += x[i] * x[i];
+        }
+    }
+
+    float lanes[4];
+    _mm_storeu_ps (lanes, power);
+
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + tailPower;
+}
+
+REFKERNELS_TARGET ("sse2")
+void prefixSumsSSE2 (float* prefix,
+                     int prefixStride,
+                     const float* const* channels,
+                     const int* channelIndex,
+                     int numChannels,
+                     int startSample,
+                     int numSamples)
+{
+    int body = numSamples & ~3;
+
+    std::fill (prefix, prefix + numSamples, 0.0f);
+
+    for (int p = 0; p < numChannels; p++)
+    {
+        const float* x = channels[channelIndex[p]] + startSample;
+        const float* previous = prefix + (size_t) p * prefixStride;
+        float* next = prefix + (size_t) (p + 1) * prefixStride;
+
+        for (int i = 0; i < body; i += 4)
+            _mm_storeu_ps (next + i, _mm_add_ps (_mm_loadu_ps (previous + i), _mm_loadu_ps (x + i)));
+
+        for (int i = body; i < numSamples; i++)
+            next[i] = previous[i] + x[i];
+    }
+}
+
+REFKERNELS_TARGET ("sse2")
+void windowSumSSE2 (float* dst,
+                    const float* prefix,
+                    int prefixStride,
+                    const int* runFirst,
+                    const int* runLast,
+                    int numRuns,
+                    float weight,
+                    int numSamples)
+{
+    int body = numSamples & ~3;
+    __m128 w = _mm_set1_ps (weight);
+
+    for (int i = 0; i < body; i += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+
+        for (int r = 0; r < numRuns; r++)
+        {
+            __m128 last = _mm_loadu_ps (prefix + (size_t) runLast[r] * prefixStride + i);
+            __m128 first = _mm_loadu_ps (prefix + (size_t) runFirst[r] * prefixStride + i);
+            sum = _mm_add_ps (sum, _mm_sub_ps (last, first));
+        }
+
+        _mm_storeu_ps (dst + i, _mm_mul_ps (w, sum));
+    }
+
+    if (body < numSamples)
+        windowSumScalar (dst + body, prefix + body, prefixStride, runFirst, runLast, numRuns, weight, numSamples - body);
+}
+
+REFKERNELS_TARGET ("sse2")
+void networkOrderStatisticsSSE2 (float* ranks,
+                                 int rankStride,
+                                 const float* const* channels,
+                                 const int* sourceIndex,
+                                 int numSources,
+                                 int firstRank,
+                                 int numRanks,
+                                 int startSample,
+                                 int numSamples)
+{
+    const std::vector<Comparator>& network = sortingNetworks[numSources];
+    __m128 v[maxNetworkSources];
+
+    int i = 0;
+
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        for (int k = 0; k < numSources; k++)
+            v[k] = _mm_loadu_ps (channels[sourceIndex[k]] + startSample + i);
+
+        for (const Comparator& c : network)
+        {
+            __m128 lo = _mm_min_ps (v[c.lo], v[c.hi]);
+            v[c.hi] = _mm_max_ps (v[c.lo], v[c.hi]);
+            v[c.lo] = lo;
+        }
+
+        for (int r = 0; r < numRanks; r++)
+            _mm_storeu_ps (ranks + r * rankStride + i, v[firstRank + r]);
+    }
+
+    if (i < numSamples)
+        networkOrderStatisticsScalar (ranks + i, rankStride, channels, sourceIndex, numSources, firstRank, numRanks, startSample + i, numSamples - i);
+}
+
+REFKERNELS_TARGET ("sse2")
+inline __m128 selectSSE2 (__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps (_mm_and_ps (mask, a), _mm_andnot_ps (mask, b));
+}
+
+REFKERNELS_TARGET ("sse2")
+void subtractLeaveOneOutMedianSSE2 (float* const* channels,
+                                    const int* memberIndex,
+                                    int numMembers,
+                                    const float* ranks,
+                                    int rankStride,
+                                    int numSources,
+                                    float gain,
+                                    int startSample,
+                                    int numSamples)
+{
+    const float* r0 = ranks;
+    const float* r1 = ranks + rankStride;
+    const float* r2 = ranks + 2 * rankStride;
+
+    __m128 g = _mm_set1_ps (gain);
+    __m128 half = _mm_set1_ps (0.5f);
+    bool odd = numSources % 2 == 1;
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        int i = 0;
+
+        for (; i + 4 <= numSamples; i += 4)
+        {
+            __m128 v = _mm_loadu_ps (x + i);
+            __m128 a = _mm_loadu_ps (r0 + i);
+            __m128 b = _mm_loadu_ps (r1 + i);
+            __m128 ref;
+
+            if (odd)
+            {
+                __m128 c = _mm_loadu_ps (r2 + i);
+                __m128 lo = selectSSE2 (_mm_cmplt_ps (v, b), b, a);
+                __m128 hi = selectSSE2 (_mm_cmpgt_ps (v, b), b, c);
+                ref = _mm_mul_ps (half, _mm_add_ps (lo, hi));
+            }
+            else
+            {
+                ref = selectSSE2 (_mm_cmple_ps (v, a), b, a);
+            }
+
+            _mm_storeu_ps (x + i, _mm_sub_ps (v, _mm_mul_ps (g, ref)));
+        }
+
+        if (i < numSamples)
+            subtractLeaveOneOutMedianScalar (channels, memberIndex + m, 1, ranks + i, rankStride, numSources, gain, startSample + i, numSamples - i);
+    }
+}
+
+/* -----------------------------------------------------------------
+AVX2 + FMA
+
+Tails use masked loads and stores, so every sample goes through the
+same fused operations regardless of where a block starts or ends.
+----------------------------------------------------------------- */
+
+REFKERNELS_TARGET ("avx2,fma")
+inline __m256i tailMaskAVX2 (int remaining)
+{
+    return _mm256_cmpgt_epi32 (_mm256_set1_epi32 (remaining), _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void weightedSumAVX2 (float* dst,
+                      const float* const* channels,
+                      const int* sourceIndex,
+                      const float* weights,
+                      int numSources,
+                      int startSample,
+                      int numSamples)
+{
+    bool accumulate = false;
+    int k = 0;
+
+    int tail = numSamples & 7;
+    int body = numSamples - tail;
+    __m256i mask = tailMaskAVX2 (tail);
+
+    for (; k + 4 <= numSources; k += 4)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+        const float* s1 = channels[sourceIndex[k + 1]] + startSample;
+        const float* s2 = channels[sourceIndex[k + 2]] + startSample;
+        const float* s3 = channels[sourceIndex[k + 3]] + startSample;
+
+        __m256 w0 = _mm256_set1_ps (weights[k]);
+        __m256 w1 = _mm256_set1_ps (weights[k + 1]);
+        __m256 w2 = _mm256_set1_ps (weights[k + 2]);
+        __m256 w3 = _mm256_set1_ps (weights[k + 3]);
+
+        for (int i = 0; i < body; i += 8)
+        {
+            __m256 acc = accumulate ? _mm256_loadu_ps (dst + i) : _mm256_setzero_ps();
+            acc = _mm256_fmadd_ps (w0, _mm256_loadu_ps (s0 + i), acc);
+            acc = _mm256_fmadd_ps (w1, _mm256_loadu_ps (s1 + i), acc);
+            acc = _mm256_fmadd_ps (w2, _mm256_loadu_ps (s2 + i), acc);
+            acc = _mm256_fmadd_ps (w3, _mm256_loadu_ps (s3 + i), acc);
+            _mm256_storeu_ps (dst + i, acc);
+        }
+
+        if (tail > 0)
+        {
+            __m256 acc = accumulate ? _mm256_maskload_ps (dst + body, mask) : _mm256_setzero_ps();
+            acc = _mm256_fmadd_ps (w0, _mm256_maskload_ps (s0 + body, mask), acc);
+            acc = _mm256_fmadd_ps (w1, _mm256_maskload_ps (s1 + body, mask), acc);
+            acc = _mm256_fmadd_ps (w2, _mm256_maskload_ps (s2 + body, mask), acc);
+            acc = _mm256_fmadd_ps (w3, _mm256_maskload_ps (s3 + body, mask), acc);
+            _mm256_maskstore_ps (dst + body, mask, acc);
+        }
+
+        accumulate = true;
+    }
+
+    for (; k < numSources; k++)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+        __m256 w0 = _mm256_set1_ps (weights[k]);
+
+        for (int i = 0; i < body; i += 8)
+        {
+            __m256 acc = accumulate ? _mm256_loadu_ps (dst + i) : _mm256_setzero_ps();
+            acc = _mm256_fmadd_ps (w0, _mm256_loadu_ps (s0 + i), acc);
+            _mm256_storeu_ps (dst + i, acc);
+        }
+
+        if (tail > 0)
+        {
+            __m256 acc = accumulate ? _mm256_maskload_ps (dst + body, mask) : _mm256_setzero_ps();
+            acc = _mm256_fmadd_ps (w0, _mm256_maskload_ps (s0 + body, mask), acc);
+            _mm256_maskstore_ps (dst + body, mask, acc);
+        }
+
+        accumulate = true;
+    }
+
+    if (! accumulate)
+        std::memset (dst, 0, sizeof (float) * numSamples);
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void subtractReferenceAVX2 (float* const* channels,
+                            const int* memberIndex,
+                            int numMembers,
+                            const float* ref,
+                            float gain,
+                            int startSample,
+                            int numSamples)
+{
+    __m256 g = _mm256_set1_ps (gain);
+
+    int tail = numSamples & 7;
+    int body = numSamples - tail;
+    __m256i mask = tailMaskAVX2 (tail);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < body; i += 8)
+            _mm256_storeu_ps (x + i, _mm256_fnmadd_ps (g, _mm256_loadu_ps (ref + i), _mm256_loadu_ps (x + i)));
+
+        if (tail > 0)
+        {
+            __m256 v = _mm256_fnmadd_ps (g, _mm256_maskload_ps (ref + body, mask), _mm256_maskload_ps (x + body, mask));
+            _mm256_maskstore_ps (x + body, mask, v);
+        }
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void subtractLeaveOneOutAVX2 (float* const* channels,
+                              const int* memberIndex,
+                              int numMembers,
+                              const float* sum,
+                              float selfWeight,
+                              float gain,
+                              int startSample,
+                              int numSamples)
+{
+    __m256 g = _mm256_set1_ps (gain);
+    __m256 w = _mm256_set1_ps (selfWeight);
+
+    int tail = numSamples & 7;
+    int body = numSamples - tail;
+    __m256i mask = tailMaskAVX2 (tail);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < body; i += 8)
+        {
+            __m256 v = _mm256_loadu_ps (x + i);
+            __m256 ref = _mm256_fnmadd_ps (w, v, _mm256_loadu_ps (sum + i));
+            _mm256_storeu_ps (x + i, _mm256_fnmadd_ps (g, ref, v));
+        }
+
+        if (tail > 0)
+        {
+            __m256 v = _mm256_maskload_ps (x + body, mask);
+            __m256 ref = _mm256_fnmadd_ps (w, v, _mm256_maskload_ps (sum + body, mask));
+            _mm256_maskstore_ps (x + body, mask, _mm256_fnmadd_ps (g, ref, v));
+        }
+    }
+}
+
+/* Register tile of 4 rows x 16 samples (8 accumulators). The tail of the
+   tile is handled with masked loads/stores. */
+REFKERNELS_TARGET ("avx2,fma")
+void denseRowsAVX2 (float* refs,
+                    int refStride,
+                    const float* weights,
+                    int weightStride,
+                    const float* const* channels,
+                    const int* sourceIndex,
+                    int numSources,
+                    int startSample,
+                    int i,
+                    __m256i m0,
+                    __m256i m1,
+                    bool accumulate)
+{
+    float* o0 = refs + i;
+    float* o1 = o0 + refStride;
+    float* o2 = o1 + refStride;
+    float* o3 = o2 + refStride;
+
+    __m256 a00, a01, a10, a11, a20, a21, a30, a31;
+
+    if (accumulate)
+    {
+        a00 = _mm256_maskload_ps (o0, m0);
+        a01 = _mm256_maskload_ps (o0 + 8, m1);
+        a10 = _mm256_maskload_ps (o1, m0);
+        a11 = _mm256_maskload_ps (o1 + 8, m1);
+        a20 = _mm256_maskload_ps (o2, m0);
+        a21 = _mm256_maskload_ps (o2 + 8, m1);
+        a30 = _mm256_maskload_ps (o3, m0);
+        a31 = _mm256_maskload_ps (o3 + 8, m1);
+    }
+    else
+    {
+        a00 = a01 = a10 = a11 = a20 = a21 = a30 = a31 = _mm256_setzero_ps();
+    }
+
+    const float* w0 = weights;
+    const float* w1 = w0 + weightStride;
+    const float* w2 = w1 + weightStride;
+    const float* w3 = w2 + weightStride;
+
+    for (int k = 0; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample + i;
+        __m256 x0 = _mm256_maskload_ps (x, m0);
+        __m256 x1 = _mm256_maskload_ps (x + 8, m1);
+
+        __m256 w = _mm256_broadcast_ss (w0 + k);
+        a00 = _mm256_fmadd_ps (w, x0, a00);
+        a01 = _mm256_fmadd_ps (w, x1, a01);
+
+        w = _mm256_broadcast_ss (w1 + k);
+        a10 = _mm256_fmadd_ps (w, x0, a10);
+        a11 = _mm256_fmadd_ps (w, x1, a11);
+
+        w = _mm256_broadcast_ss (w2 + k);
+        a20 = _mm256_fmadd_ps (w, x0, a20);
+        a21 = _mm256_fmadd_ps (w, x1, a21);
+
+        w = _mm256_broadcast_ss (w3 + k);
+        a30 = _mm256_fmadd_ps (w, x0, a30);
+        a31 = _mm256_fmadd_ps (w, x1, a31);
+    }
+
+    _mm256_maskstore_ps (o0, m0, a00);
+    _mm256_maskstore_ps (o0 + 8, m1, a01);
+    _mm256_maskstore_ps (o1, m0, a10);
+    _mm256_maskstore_ps (o1 + 8, m1, a11);
+    _mm256_maskstore_ps (o2, m0, a20);
+    _mm256_maskstore_ps (o2 + 8, m1, a21);
+    _mm256_maskstore_ps (o3, m0, a30);
+    _mm256_maskstore_ps (o3 + 8, m1, a31);
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void denseRowAVX2 (float* refs,
+                   const float* weights,
+                   const float* const* channels,
+                   const int* sourceIndex,
+                   int numSources,
+                   int startSample,
+                   int i,
+                   __m256i m0,
+                   __m256i m1,
+                   bool accumulate)
+{
+    float* o = refs + i;
+
+    __m256 a0 = accumulate ? _mm256_maskload_ps (o, m0) : _mm256_setzero_ps();
+    __m256 a1 = accumulate ? _mm256_maskload_ps (o + 8, m1) : _mm256_setzero_ps();
+
+    for (int k = 0; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample + i;
+        __m256 w = _mm256_broadcast_ss (weights + k);
+        a0 = _mm256_fmadd_ps (w, _mm256_maskload_ps (x, m0), a0);
+        a1 = _mm256_fmadd_ps (w, _mm256_maskload_ps (x + 8, m1), a1);
+    }
+
+    _mm256_maskstore_ps (o, m0, a0);
+    _mm256_maskstore_ps (o + 8, m1, a1);
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void denseWeightedSumAVX2 (float* refs,
+                           int refStride,
+                           const float* weights,
+                           int weightStride,
+                           const float* const* channels,
+                           const int* sourceIndex,
+                           int numRows,
+                           int numSources,
+                           int startSample,
+                           int numSamples,
+                           bool accumulate)
+{
+    for (int i = 0; i < numSamples; i += 16)
+    {
+        __m256i m0 = tailMaskAVX2 (numSamples - i);
+        __m256i m1 = tailMaskAVX2 (numSamples - i - 8);
+
+        int r = 0;
+
+        for (; r + 4 <= numRows; r += 4)
+        {
+            denseRowsAVX2 (refs + r * refStride,
+                           refStride,
+                           weights + r * weightStride,
+                           weightStride,
+                           channels,
+                           sourceIndex,
+                           numSources,
+                           startSample,
+                           i,
+                           m0,
+                           m1,
+                           accumulate);
+        }
+
+        for (; r < numRows; r++)
+        {
+            denseRowAVX2 (refs + r * refStride,
+                          weights + r * weightStride,
+                          channels,
+                          sourceIndex,
+                          numSources,
+                          startSample,
+                          i,
+                          m0,
+                          m1,
+                          accumulate);
+        }
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void maskedWeightedSumAVX2 (float* sum,
+                            float* count,
+                            const float* const* channels,
+                            const int* sourceIndex,
+                            const float* weights,
+                            const float* divisors,
+                            int numSources,
+                            float threshold,
+                            int startSample,
+                            int numSamples,
+                            bool divide)
+{
+    __m256 t = _mm256_set1_ps (threshold);
+    __m256 absMask = _mm256_castsi256_ps (_mm256_set1_epi32 (0x7fffffff));
+
+    // the accumulators stay in registers for a whole tile of samples, so
+    // the masking only adds a compare and two ANDs per source vector
+    for (int i = 0; i < numSamples; i += 16)
+    {
+        __m256i m0 = tailMaskAVX2 (numSamples - i);
+        __m256i m1 = tailMaskAVX2 (numSamples - i - 8);
+
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 cnt0 = _mm256_setzero_ps();
+        __m256 cnt1 = _mm256_setzero_ps();
+
+        for (int k = 0; k < numSources; k++)
+        {
+            const float* x = channels[sourceIndex[k]] + startSample + i;
+            __m256 w = _mm256_set1_ps (weights[k]);
+            __m256 d = _mm256_set1_ps (divisors[k]);
+
+            __m256 x0 = _mm256_maskload_ps (x, m0);
+            __m256 x1 = _mm256_maskload_ps (x + 8, m1);
+            __m256 valid0 = _mm256_cmp_ps (_mm256_and_ps (x0, absMask), t, _CMP_LT_OQ);
+            __m256 valid1 = _mm256_cmp_ps (_mm256_and_ps (x1, absMask), t, _CMP_LT_OQ);
+
+            acc0 = _mm256_fmadd_ps (w, _mm256_and_ps (x0, valid0), acc0);
+            acc1 = _mm256_fmadd_ps (w, _mm256_and_ps (x1, valid1), acc1);
+            cnt0 = _mm256_add_ps (cnt0, _mm256_and_ps (d, valid0));
+            cnt1 = _mm256_add_ps (cnt1, _mm256_and_ps (d, valid1));
+        }
+
+        if (divide)
+        {
+            __m256 zero = _mm256_setzero_ps();
+            acc0 = _mm256_and_ps (_mm256_div_ps (acc0, cnt0), _mm256_cmp_ps (cnt0, zero, _CMP_GT_OQ));
+            acc1 = _mm256_and_ps (_mm256_div_ps (acc1, cnt1), _mm256_cmp_ps (cnt1, zero, _CMP_GT_OQ));
+        }
+
+        _mm256_maskstore_ps (sum + i, m0, acc0);
+        _mm256_maskstore_ps (sum + i + 8, m1, acc1);
+        _mm256_maskstore_ps (count + i, m0, cnt0);
+        _mm256_maskstore_ps (count + i + 8, m1, cnt1);
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void subtractMaskedReferenceAVX2 (float* const* channels,
+                                  const int* memberIndex,
+                                  int numMembers,
+                                  const float* sum,
+                                  const float* count,
+                                  float selfWeight,
+                                  float selfDivisor,
+                                  float threshold,
+                                  float gain,
+                                  int startSample,
+                                  int numSamples)
+{
+    __m256 t = _mm256_set1_ps (threshold);
+    __m256 absMask = _mm256_castsi256_ps (_mm256_set1_epi32 (0x7fffffff));
+    __m256 g = _mm256_set1_ps (gain);
+    __m256 sw = _mm256_set1_ps (selfWeight);
+    __m256 sd = _mm256_set1_ps (selfDivisor);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < numSamples; i += 8)
+        {
+            __m256i mask = tailMaskAVX2 (numSamples - i);
+
+            __m256 v = _mm256_maskload_ps (x + i, mask);
+            __m256 valid = _mm256_cmp_ps (_mm256_and_ps (v, absMask), t, _CMP_LT_OQ);
+            __m256 numerator = _mm256_fnmadd_ps (sw, _mm256_and_ps (v, valid), _mm256_maskload_ps (sum + i, mask));
+            __m256 denominator = _mm256_sub_ps (_mm256_maskload_ps (count + i, mask), _mm256_and_ps (sd, valid));
+
+            // no reference where every source is masked
+            __m256 ref = _mm256_and_ps (_mm256_div_ps (numerator, denominator),
+                                        _mm256_cmp_ps (denominator, _mm256_setzero_ps(), _CMP_GT_OQ));
+
+            _mm256_maskstore_ps (x + i, mask, _mm256_fnmadd_ps (g, ref, v));
+        }
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void channelStatisticsAVX2 (float* stats, const float* x, float previous, int numSamples)
+{
+    if (numSamples <= 8)
+        return channelStatisticsScalar (stats, x, previous, numSamples);
+
+    // the first sample's predecessor is not in x
+    channelStatisticsScalar (stats, x, previous, 1);
+
+    __m256 squares = _mm256_setzero_ps();
+    __m256 differences = _mm256_setzero_ps();
+    __m256 low = _mm256_set1_ps (stats[2]);
+    __m256 high = _mm256_set1_ps (stats[3]);
+
+    int i = 1;
+
+    for (; i + 8 <= numSamples; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps (x + i);
+        __m256 d = _mm256_sub_ps (v, _mm256_loadu_ps (x + i - 1));
+
+        squares = _mm256_fmadd_ps (v, v, squares);
+        differences = _mm256_fmadd_ps (d, d, differences);
+        low = _mm256_min_ps (low, v);
+        high = _mm256_max_ps (high, v);
+    }
+
+    if (i < numSamples)
+    {
+        // masked lanes load 0, which adds nothing to the sums
+        __m256i mask = tailMaskAVX2 (numSamples - i);
+        __m256 valid = _mm256_castsi256_ps (mask);
+        __m256 v = _mm256_maskload_ps (x + i, mask);
+        __m256 d = _mm256_sub_ps (v, _mm256_maskload_ps (x + i - 1, mask));
+
+        squares = _mm256_fmadd_ps (v, v, squares);
+        differences = _mm256_fmadd_ps (d, d, differences);
+        low = _mm256_blendv_ps (low, _mm256_min_ps (low, v), valid);
+        high = _mm256_blendv_ps (high, _mm256_max_ps (high, v), valid);
+    }
+
+    float lanes[4][8];
+    _mm256_storeu_ps (lanes[0], squares);
+    _mm256_storeu_ps (lanes[1], differences);
+    _mm256_storeu_ps (lanes[2], low);
+    _mm256_storeu_ps (lanes[3], high);
+
+    for (int l = 0; l < 8; l++)
+    {
+        stats[0] += lanes[0][l];
+        stats[1] += lanes[1][l];
+        stats[2] = std::min (stats[2], lanes[2][l]);
+        stats[3] = std::max (stats[3], lanes[3][l]);
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void prefixSumsAVX2 (float* prefix,
+                     int prefixStride,
+                     const float* const* channels,
+                     const int* channelIndex,
+                     int numChannels,
+                     int startSample,
+                     int numSamples)
+{
+    int body = numSamples & ~7;
+    __m256i mask = tailMaskAVX2 (numSamples - body);
+
+    std::fill (prefix, prefix + numSamples, 0.0f);
+
+    for (int p = 0; p < numChannels; p++)
+    {
+        const float* x = channels[channelIndex[p]] + startSample;
+        const float* previous = prefix + (size_t) p * prefixStride;
+        float* next = prefix + (size_t) (p + 1) * prefixStride;
+
+        for (int i = 0; i < body; i += 8)
+            _mm256_storeu_ps (next + i, _mm256_add_ps (_mm256_loadu_ps (previous + i), _mm256_loadu_ps (x + i)));
+
+        if (body < numSamples)
+            _mm256_maskstore_ps (next + body, mask, _mm256_add_ps (_mm256_maskload_ps (previous + body, mask), _mm256_maskload_ps (x + body, mask)));
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void windowSumAVX2 (float* dst,
+                    const float* prefix,
+                    int prefixStride,
+                    const int* runFirst,
+                    const int* runLast,
+                    int numRuns,
+                    float weight,
+                    int numSamples)
+{
+    int body = numSamples & ~7;
+    __m256i mask = tailMaskAVX2 (numSamples - body);
+    __m256 w = _mm256_set1_ps (weight);
+
+    for (int i = 0; i < body; i += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+
+        for (int r = 0; r < numRuns; r++)
+        {
+            __m256 last = _mm256_loadu_ps (prefix + (size_t) runLast[r] * prefixStride + i);
+            __m256 first = _mm256_loadu_ps (prefix + (size_t) runFirst[r] * prefixStride + i);
+            sum = _mm256_add_ps (sum, _mm256_sub_ps (last, first));
+        }
+
+        _mm256_storeu_ps (dst + i, _mm256_mul_ps (w, sum));
+    }
+
+    if (body < numSamples)
+    {
+        __m256 sum = _mm256_setzero_ps();
+
+        for (int r = 0; r < numRuns; r++)
+        {
+            __m256 last = _mm256_maskload_ps (prefix + (size_t) runLast[r] * prefixStride + body, mask);
+            __m256 first = _mm256_maskload_ps (prefix + (size_t) runFirst[r] * prefixStride + body, mask);
+            sum = _mm256_add_ps (sum, _mm256_sub_ps (last, first));
+        }
+
+        _mm256_maskstore_ps (dst + body, mask, _mm256_mul_ps (w, sum));
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+inline float horizontalSumAVX2 (__m256 v)
+{
+    __m128 half = _mm_add_ps (_mm256_castps256_ps128 (v), _mm256_extractf128_ps (v, 1));
+    half = _mm_add_ps (half, _mm_movehl_ps (half, half));
+
+    return _mm_cvtss_f32 (_mm_add_ss (half, _mm_shuffle_ps (half, half, 1)));
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+float correlateAVX2 (float* correlation,
+                     const float* const* channels,
+                     const int* sourceIndex,
+                     int numSources,
+                     const float* error,
+                     int startSample,
+                     int numSamples)
+{
+    int body = numSamples & ~7;
+    __m256i mask = tailMaskAVX2 (numSamples - body);
+    __m256 power = _mm256_setzero_ps();
+    int k = 0;
+
+    // four sources per pass, so the error is loaded once for four
+    // independent accumulators; masked lanes load 0, which adds nothing
+    for (; k + 4 <= numSources; k += 4)
+    {
+        const float* x0 = channels[sourceIndex[k]] + startSample;
+        const float* x1 = channels[sourceIndex[k + 1]] + startSample;
+        const float* x2 = channels[sourceIndex[k + 2]] + startSample;
+        const float* x3 = channels[sourceIndex[k + 3]] + startSample;
+
+        __m256 dot0 = _mm256_setzero_ps();
+        __m256 dot1 = _mm256_setzero_ps();
+        __m256 dot2 = _mm256_setzero_ps();
+        __m256 dot3 = _mm256_setzero_ps();
+        __m256 power01 = _mm256_setzero_ps();
+        __m256 power23 = _mm256_setzero_ps();
+
+        int i = 0;
+
+        for (; i < body; i += 8)
+        {
+            __m256 e = _mm256_loadu_ps (error + i);
+            __m256 v0 = _mm256_loadu_ps (x0 + i);
+            __m256 v1 = _mm256_loadu_ps (x1 + i);
+            __m256 v2 = _mm256_loadu_ps (x2 + i);
+            __m256 v3 = _mm256_loadu_ps (x3 + i);
+
+            dot0 = _mm256_fmadd_ps (e, v0, dot0);
+            dot1 = _mm256_fmadd_ps (e, v1, dot1);
+            dot2 = _mm256_fmadd_ps (e, v2, dot2);
+            dot3 = _mm256_fmadd_ps (e, v3, dot3);
+            power01 = _mm256_fmadd_ps (v1, v1, _mm256_fmadd_ps (v0, v0, power01));
+            power23 = _mm256_fmadd_ps (v3, v3, _mm256_fmadd_ps (v2, v2, power23));
+        }
+
+        if (i < numSamples)
+        {
+            __m256 e = _mm256_maskload_ps (error + i, mask);
+            __m256 v0 = _mm256_maskload_ps (x0 + i, mask);
+            __m256 v1 = _mm256_maskload_ps (x1 + i, mask);
+            __m256 v2 = _mm256_maskload_ps (x2 + i, mask);
+            __m256 v3 = _mm256_maskload_ps (x3 + i, mask);
+
+            dot0 = _mm256_fmadd_ps (e, v0, dot0);
+            dot1 = _mm256_fmadd_ps (e, v1, dot1);
+            dot2 = _mm256_fmadd_ps (e, v2, dot2);
+            dot3 = _mm256_fmadd_ps (e, v3, dot3);
+            power01 = _mm256_fmadd_ps (v1, v1, _mm256_fmadd_ps (v0, v0, power01));
+            power23 = _mm256_fmadd_ps (v3, v3, _mm256_fmadd_ps (v2, v2, power23));
+        }
+
+        correlation[k] = horizontalSumAVX2 (dot0);
+        correlation[k + 1] = horizontalSumAVX2 (dot1);
+        correlation[k + 2] = horizontalSumAVX2 (dot2);
+        correlation[k + 3] = horizontalSumAVX2 (dot3);
+        power = _mm256_add_ps (power, _mm256_add_ps (power01, power23));
+    }
+
+    for (; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample;
+        __m256 dot = _mm256_setzero_ps();
+
+        for (int i = 0; i < body; i += 8)
+        {
+            __m256 v = _mm256_loadu_ps (x + i);
+            dot = _mm256_fmadd_ps (_mm256_loadu_ps (error + i), v, dot);
+            power = _mm256_fmadd_ps (v, v, power);
+        }
+
+        if (body < numSamples)
+        {
+            __m256 v = _mm256_maskload_ps (x + body, mask);
+            dot = _mm256_fmadd_ps (_mm256_maskload_ps (error + body, mask), v, dot);
+            power = _mm256_fmadd_ps (v, v, power);
+        }
+
+        correlation[k] = horizontalSumAVX2 (dot);
+    }
+
+    return horizontalSumAVX2 (power);
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void networkOrderStatisticsAVX2 (float* ranks,
+                                 int rankStride,
+                                 const float* const* channels,
+                                 const int* sourceIndex,
+                                 int numSources,
+                                 int firstRank,
+                                 int numRanks,
+                                 int startSample,
+                                 int numSamples)
+{
+    const std::vector<Comparator>& network = sortingNetworks[numSources];
+    __m256 v[maxNetworkSources];
+
+    for (int i = 0; i < numSamples; i += 8)
+    {
+        __m256i mask = tailMaskAVX2 (numSamples - i);
+
+        for (int k = 0; k < numSources; k++)
+            v[k] = _mm256_maskload_ps (channels[sourceIndex[k]] + startSample + i, mask);
+
+        for (const Comparator& c : network)
+        {
+            __m256 lo = _mm256_min_ps (v[c.lo], v[c.hi]);
+            v[c.hi] = _mm256_max_ps (v[c.lo], v[c.hi]);
+            v[c.lo] = lo;
+        }
+
+        for (int r = 0; r < numRanks; r++)
+            _mm256_maskstore_ps (ranks + r * rankStride + i, mask, v[firstRank + r]);
+    }
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void subtractLeaveOneOutMedianAVX2 (float* const* channels,
+                                    const int* memberIndex,
+                                    int numMembers,
+                                    const float* ranks,
+                                    int rankStride,
+                                    int numSources,
+                                    float gain,
+                                    int startSample,
+                                    int numSamples)
+{
+    const float* r0 = ranks;
+    const float* r1 = ranks + rankStride;
+    const float* r2 = ranks + 2 * rankStride;
+
+    __m256 g = _mm256_set1_ps (gain);
+    __m256 half = _mm256_set1_ps (0.5f);
+    bool odd = numSources % 2 == 1;
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < numSamples; i += 8)
+        {
+            __m256i mask = tailMaskAVX2 (numSamples - i);
+
+            __m256 v = _mm256_maskload_ps (x + i, mask);
+            __m256 a = _mm256_maskload_ps (r0 + i, mask);
+            __m256 b = _mm256_maskload_ps (r1 + i, mask);
+            __m256 ref;
+
+            if (odd)
+            {
+                __m256 c = _mm256_maskload_ps (r2 + i, mask);
+                __m256 lo = _mm256_blendv_ps (a, b, _mm256_cmp_ps (v, b, _CMP_LT_OQ));
+                __m256 hi = _mm256_blendv_ps (c, b, _mm256_cmp_ps (v, b, _CMP_GT_OQ));
+                ref = _mm256_mul_ps (half, _mm256_add_ps (lo, hi));
+            }
+            else
+            {
+                ref = _mm256_blendv_ps (a, b, _mm256_cmp_ps (v, a, _CMP_LE_OQ));
+            }
+
+            _mm256_maskstore_ps (x + i, mask, _mm256_sub_ps (v, _mm256_mul_ps (g, ref)));
+        }
+    }
+}
+
+/* Radix selection for groups that are too large for a network. Each
+   sample is a lane; the sources are converted once into integer keys that
+   sort like the floats, and the key of the requested rank is then found
+   bit by bit from the top, with one counting pass over the group per bit.
+   This is exact and branch-free, unlike nth_element on every sample. */
+REFKERNELS_TARGET ("avx2,fma")
+inline __m256i floatKeyAVX2 (__m256i bits)
+{
+    // negative floats get their magnitude bits flipped; the same mapping
+    // also converts a key back into float bits
+    return _mm256_xor_si256 (bits, _mm256_and_si256 (_mm256_srai_epi32 (bits, 31), _mm256_set1_epi32 (0x7fffffff)));
+}
+
+REFKERNELS_TARGET ("avx2,fma")
+void selectOrderStatisticsAVX2 (float* ranks,
+                                int rankStride,
+                                const float* const* channels,
+                                const int* sourceIndex,
+                                int numSources,
+                                int firstRank,
+                                int numRanks,
+                                int startSample,
+                                int numSamples,
+                                float* scratch)
+{
+    int* keys = reinterpret_cast<int*> (scratch);
+    int middle = firstRank + (numRanks == 3 ? 1 : 0);
+
+    const __m256i signBit = _mm256_set1_epi32 (int (0x80000000u));
+    const __m256i middleRank = _mm256_set1_epi32 (middle);
+
+    for (int i = 0; i < numSamples; i += 8)
+    {
+        __m256i mask = tailMaskAVX2 (numSamples - i);
+
+        for (int k = 0; k < numSources; k++)
+        {
+            __m256 x = _mm256_maskload_ps (channels[sourceIndex[k]] + startSample + i, mask);
+            _mm256_storeu_si256 ((__m256i*) (keys + k * 8), floatKeyAVX2 (_mm256_castps_si256 (x)));
+        }
+
+        // prefix holds the selected key with its sign bit flipped, so the
+        // bits can be decided from the top like an unsigned number
+        __m256i prefix = _mm256_setzero_si256();
+
+        for (int b = 31; b >= 0; b--)
+        {
+            __m256i candidate = _mm256_or_si256 (prefix, _mm256_set1_epi32 (int (1u << b)));
+            __m256i threshold = _mm256_xor_si256 (candidate, signBit);
+            __m256i count = _mm256_setzero_si256();
+
+            for (int k = 0; k < numSources; k++)
+            {
+                __m256i key = _mm256_loadu_si256 ((const __m256i*) (keys + k * 8));
+                count = _mm256_sub_epi32 (count, _mm256_cmpgt_epi32 (threshold, key));
+            }
+
+            // fewer than middle + 1 keys below the candidate: the bit is set
+            __m256i take = _mm256_cmpgt_epi32 (_mm256_add_epi32 (middleRank, _mm256_set1_epi32 (1)), count);
+            prefix = _mm256_blendv_epi8 (prefix, candidate, take);
+        }
+
+        __m256i selected = _mm256_xor_si256 (prefix, signBit);
+        __m256i below = selected;
+        __m256i above = selected;
+
+        if (numRanks > 1)
+        {
+            // the neighbouring ranks are either ties of the selected key or
+            // the closest keys below and above it
+            __m256i lessCount = _mm256_setzero_si256();
+            __m256i lessEqualCount = _mm256_setzero_si256();
+            __m256i maxBelow = _mm256_set1_epi32 (int (0x80000000u));
+            __m256i minAbove = _mm256_set1_epi32 (0x7fffffff);
+
+            for (int k = 0; k < numSources; k++)
+            {
+                __m256i key = _mm256_loadu_si256 ((const __m256i*) (keys + k * 8));
+                __m256i less = _mm256_cmpgt_epi32 (selected, key);
+                __m256i greater = _mm256_cmpgt_epi32 (key, selected);
+
+                lessCount = _mm256_sub_epi32 (lessCount, less);
+                lessEqualCount = _mm256_add_epi32 (lessEqualCount, _mm256_add_epi32 (greater, _mm256_set1_epi32 (1)));
+                maxBelow = _mm256_blendv_epi8 (maxBelow, _mm256_max_epi32 (maxBelow, key), less);
+                minAbove = _mm256_blendv_epi8 (minAbove, _mm256_min_epi32 (minAbove, key), greater);
+            }
+
+            __m256i tiedBelow = _mm256_cmpgt_epi32 (middleRank, lessCount);
+            __m256i tiedAbove = _mm256_cmpgt_epi32 (lessEqualCount, _mm256_add_epi32 (middleRank, _mm256_set1_epi32 (1)));
+
+            below = _mm256_blendv_epi8 (maxBelow, selected, tiedBelow);
+            above = _mm256_blendv_epi8 (minAbove, selected, tiedAbove);
+        }
+
+        for (int r = 0; r < numRanks; r++)
+        {
+            int rank = firstRank + r;
+            __m256i key = rank < middle ? below : (rank > middle ? above : selected);
+            _mm256_maskstore_ps (ranks + r * rankStride + i, mask, _mm256_castsi256_ps (floatKeyAVX2 (key)));
+        }
+    }
+}
+
+/* -----------------------------------------------------------------
+AVX-512
+----------------------------------------------------------------- */
+
+REFKERNELS_TARGET ("avx512f")
+void weightedSumAVX512 (float* dst,
+                        const float* const* channels,
+                        const int* sourceIndex,
+                        const float* weights,
+                        int numSources,
+                        int startSample,
+                        int numSamples)
+{
+    bool accumulate = false;
+    int k = 0;
+
+    int tail = numSamples & 15;
+    int body = numSamples - tail;
+    __mmask16 mask = (__mmask16) ((1u << tail) - 1);
+
+    for (; k + 4 <= numSources; k += 4)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+        const float* s1 = channels[sourceIndex[k + 1]] + startSample;
+        const float* s2 = channels[sourceIndex[k + 2]] + startSample;
+        const float* s3 = channels[sourceIndex[k + 3]] + startSample;
+
+        __m512 w0 = _mm512_set1_ps (weights[k]);
+        __m512 w1 = _mm512_set1_ps (weights[k + 1]);
+        __m512 w2 = _mm512_set1_ps (weights[k + 2]);
+        __m512 w3 = _mm512_set1_ps (weights[k + 3]);
+
+        for (int i = 0; i < body; i += 16)
+        {
+            __m512 acc = accumulate ? _mm512_loadu_ps (dst + i) : _mm512_setzero_ps();
+            acc = _mm512_fmadd_ps (w0, _mm512_loadu_ps (s0 + i), acc);
+            acc = _mm512_fmadd_ps (w1, _mm512_loadu_ps (s1 + i), acc);
+            acc = _mm512_fmadd_ps (w2, _mm512_loadu_ps (s2 + i), acc);
+            acc = _mm512_fmadd_ps (w3, _mm512_loadu_ps (s3 + i), acc);
+            _mm512_storeu_ps (dst + i, acc);
+        }
+
+        if (tail > 0)
+        {
+            __m512 acc = accumulate ? _mm512_maskz_loadu_ps (mask, dst + body) : _mm512_setzero_ps();
+            acc = _mm512_fmadd_ps (w0, _mm512_maskz_loadu_ps (mask, s0 + body), acc);
+            acc = _mm512_fmadd_ps (w1, _mm512_maskz_loadu_ps (mask, s1 + body), acc);
+            acc = _mm512_fmadd_ps (w2, _mm512_maskz_loadu_ps (mask, s2 + body), acc);
+            acc = _mm512_fmadd_ps (w3, _mm512_maskz_loadu_ps (mask, s3 + body), acc);
+            _mm512_mask_storeu_ps (dst + body, mask, acc);
+        }
+
+        accumulate = true;
+    }
+
+    for (; k < numSources; k++)
+    {
+        const float* s0 = channels[sourceIndex[k]] + startSample;
+        __m512 w0 = _mm512_set1_ps (weights[k]);
+
+        for (int i = 0; i < body; i += 16)
+        {
+            __m512 acc = accumulate ? _mm512_loadu_ps (dst + i) : _mm512_setzero_ps();
+            acc = _mm512_fmadd_ps (w0, _mm512_loadu_ps (s0 + i), acc);
+            _mm512_storeu_ps (dst + i, acc);
+        }
+
+        if (tail > 0)
+        {
+            __m512 acc = accumulate ? _mm512_maskz_loadu_ps (mask, dst + body) : _mm512_setzero_ps();
+            acc = _mm512_fmadd_ps (w0, _mm512_maskz_loadu_ps (mask, s0 + body), acc);
+            _mm512_mask_storeu_ps (dst + body, mask, acc);
+        }
+
+        accumulate = true;
+    }
+
+    if (! accumulate)
+        std::memset (dst, 0, sizeof (float) * numSamples);
+}
+
+REFKERNELS_TARGET ("avx512f")
+void subtractReferenceAVX512 (float* const* channels,
+                              const int* memberIndex,
+                              int numMembers,
+                              const float* ref,
+                              float gain,
+                              int startSample,
+                              int numSamples)
+{
+    __m512 g = _mm512_set1_ps (gain);
+
+    int tail = numSamples & 15;
+    int body = numSamples - tail;
+    __mmask16 mask = (__mmask16) ((1u << tail) - 1);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < body; i += 16)
+            _mm512_storeu_ps (x + i, _mm512_fnmadd_ps (g, _mm512_loadu_ps (ref + i), _mm512_loadu_ps (x + i)));
+
+        if (tail > 0)
+        {
+            __m512 v = _mm512_fnmadd_ps (g, _mm512_maskz_loadu_ps (mask, ref + body), _mm512_maskz_loadu_ps (mask, x + body));
+            _mm512_mask_storeu_ps (x + body, mask, v);
+        }
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+void subtractLeaveOneOutAVX512 (float* const* channels,
+                                const int* memberIndex,
+                                int numMembers,
+                                const float* sum,
+                                float selfWeight,
+                                float gain,
+                                int startSample,
+                                int numSamples)
+{
+    __m512 g = _mm512_set1_ps (gain);
+    __m512 w = _mm512_set1_ps (selfWeight);
+
+    int tail = numSamples & 15;
+    int body = numSamples - tail;
+    __mmask16 mask = (__mmask16) ((1u << tail) - 1);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < body; i += 16)
+        {
+            __m512 v = _mm512_loadu_ps (x + i);
+            __m512 ref = _mm512_fnmadd_ps (w, v, _mm512_loadu_ps (sum + i));
+            _mm512_storeu_ps (x + i, _mm512_fnmadd_ps (g, ref, v));
+        }
+
+        if (tail > 0)
+        {
+            __m512 v = _mm512_maskz_loadu_ps (mask, x + body);
+            __m512 ref = _mm512_fnmadd_ps (w, v, _mm512_maskz_loadu_ps (mask, sum + body));
+            _mm512_mask_storeu_ps (x + body, mask, _mm512_fnmadd_ps (g, ref, v));
+        }
+    }
+}
+
+inline __mmask16 tailMask16 (int remaining)
+{
+    if (remaining >= 16)
+        return (__mmask16) 0xffff;
+
+    return remaining <= 0 ? (__mmask16) 0 : (__mmask16) ((1u << remaining) - 1);
+}
+
+/* Register tile of 4 rows x 32 samples (8 accumulators) */
+REFKERNELS_TARGET ("avx512f")
+void denseRowsAVX512 (float* refs,
+                      int refStride,
+                      const float* weights,
+                      int weightStride,
+                      const float* const* channels,
+                      const int* sourceIndex,
+                      int numSources,
+                      int startSample,
+                      int i,
+                      __mmask16 m0,
+                      __mmask16 m1,
+                      bool accumulate)
+{
+    float* o0 = refs + i;
+    float* o1 = o0 + refStride;
+    float* o2 = o1 + refStride;
+    float* o3 = o2 + refStride;
+
+    __m512 a00, a01, a10, a11, a20, a21, a30, a31;
+
+    if (accumulate)
+    {
+        a00 = _mm512_maskz_loadu_ps (m0, o0);
+        a01 = _mm512_maskz_loadu_ps (m1, o0 + 16);
+        a10 = _mm512_maskz_loadu_ps (m0, o1);
+        a11 = _mm512_maskz_loadu_ps (m1, o1 + 16);
+        a20 = _mm512_maskz_loadu_ps (m0, o2);
+        a21 = _mm512_maskz_loadu_ps (m1, o2 + 16);
+        a30 = _mm512_maskz_loadu_ps (m0, o3);
+        a31 = _mm512_maskz_loadu_ps (m1, o3 + 16);
+    }
+    else
+    {
+        a00 = a01 = a10 = a11 = a20 = a21 = a30 = a31 = _mm512_setzero_ps();
+    }
+
+    const float* w0 = weights;
+    const float* w1 = w0 + weightStride;
+    const float* w2 = w1 + weightStride;
+    const float* w3 = w2 + weightStride;
+
+    for (int k = 0; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample + i;
+        __m512 x0 = _mm512_maskz_loadu_ps (m0, x);
+        __m512 x1 = _mm512_maskz_loadu_ps (m1, x + 16);
+
+        __m512 w = _mm512_set1_ps (w0[k]);
+        a00 = _mm512_fmadd_ps (w, x0, a00);
+        a01 = _mm512_fmadd_ps (w, x1, a01);
+
+        w = _mm512_set1_ps (w1[k]);
+        a10 = _mm512_fmadd_ps (w, x0, a10);
+        a11 = _mm512_fmadd_ps (w, x1, a11);
+
+        w = _mm512_set1_ps (w2[k]);
+        a20 = _mm512_fmadd_ps (w, x0, a20);
+        a21 = _mm512_fmadd_ps (w, x1, a21);
+
+        w = _mm512_set1_ps (w3[k]);
+        a30 = _mm512_fmadd_ps (w, x0, a30);
+        a31 = _mm512_fmadd_ps (w, x1, a31);
+    }
+
+    _mm512_mask_storeu_ps (o0, m0, a00);
+    _mm512_mask_storeu_ps (o0 + 16, m1, a01);
+    _mm512_mask_storeu_ps (o1, m0, a10);
+    _mm512_mask_storeu_ps (o1 + 16, m1, a11);
+    _mm512_mask_storeu_ps (o2, m0, a20);
+    _mm512_mask_storeu_ps (o2 + 16, m1, a21);
+    _mm512_mask_storeu_ps (o3, m0, a30);
+    _mm512_mask_storeu_ps (o3 + 16, m1, a31);
+}
+
+REFKERNELS_TARGET ("avx512f")
+void denseRowAVX512 (float* refs,
+                     const float* weights,
+                     const float* const* channels,
+                     const int* sourceIndex,
+                     int numSources,
+                     int startSample,
+                     int i,
+                     __mmask16 m0,
+                     __mmask16 m1,
+                     bool accumulate)
+{
+    float* o = refs + i;
+
+    __m512 a0 = accumulate ? _mm512_maskz_loadu_ps (m0, o) : _mm512_setzero_ps();
+    __m512 a1 = accumulate ? _mm512_maskz_loadu_ps (m1, o + 16) : _mm512_setzero_ps();
+
+    for (int k = 0; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample + i;
+        __m512 w = _mm512_set1_ps (weights[k]);
+        a0 = _mm512_fmadd_ps (w, _mm512_maskz_loadu_ps (m0, x), a0);
+        a1 = _mm512_fmadd_ps (w, _mm512_maskz_loadu_ps (m1, x + 16), a1);
+    }
+
+    _mm512_mask_storeu_ps (o, m0, a0);
+    _mm512_mask_storeu_ps (o + 16, m1, a1);
+}
+
+REFKERNELS_TARGET ("avx512f")
+void denseWeightedSumAVX512 (float* refs,
+                             int refStride,
+                             const float* weights,
+                             int weightStride,
+                             const float* const* channels,
+                             const int* sourceIndex,
+                             int numRows,
+                             int numSources,
+                             int startSample,
+                             int numSamples,
+                             bool accumulate)
+{
+    for (int i = 0; i < numSamples; i += 32)
+    {
+        __mmask16 m0 = tailMask16 (numSamples - i);
+        __mmask16 m1 = tailMask16 (numSamples - i - 16);
+
+        int r = 0;
+
+        for (; r + 4 <= numRows; r += 4)
+        {
+            denseRowsAVX512 (refs + r * refStride,
+                             refStride,
+                             weights + r * weightStride,
+                             weightStride,
+                             channels,
+                             sourceIndex,
+                             numSources,
+                             startSample,
+                             i,
+                             m0,
+                             m1,
+                             accumulate);
+        }
+
+        for (; r < numRows; r++)
+        {
+            denseRowAVX512 (refs + r * refStride,
+                            weights + r * weightStride,
+                            channels,
+                            sourceIndex,
+                            numSources,
+                            startSample,
+                            i,
+                            m0,
+                            m1,
+                            accumulate);
+        }
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+void maskedWeightedSumAVX512 (float* sum,
+                              float* count,
+                              const float* const* channels,
+                              const int* sourceIndex,
+                              const float* weights,
+                              const float* divisors,
+                              int numSources,
+                              float threshold,
+                              int startSample,
+                              int numSamples,
+                              bool divide)
+{
+    __m512 t = _mm512_set1_ps (threshold);
+
+    for (int i = 0; i < numSamples; i += 32)
+    {
+        __mmask16 m0 = tailMask16 (numSamples - i);
+        __mmask16 m1 = tailMask16 (numSamples - i - 16);
+
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        __m512 cnt0 = _mm512_setzero_ps();
+        __m512 cnt1 = _mm512_setzero_ps();
+
+        for (int k = 0; k < numSources; k++)
+        {
+            const float* x = channels[sourceIndex[k]] + startSample + i;
+            __m512 w = _mm512_set1_ps (weights[k]);
+            __m512 d = _mm512_set1_ps (divisors[k]);
+
+            __m512 x0 = _mm512_maskz_loadu_ps (m0, x);
+            __m512 x1 = _mm512_maskz_loadu_ps (m1, x + 16);
+            __mmask16 valid0 = _mm512_cmp_ps_mask (_mm512_abs_ps (x0), t, _CMP_LT_OQ);
+            __mmask16 valid1 = _mm512_cmp_ps_mask (_mm512_abs_ps (x1), t, _CMP_LT_OQ);
+
+            acc0 = _mm512_mask3_fmadd_ps (w, x0, acc0, valid0);
+            acc1 = _mm512_mask3_fmadd_ps (w, x1, acc1, valid1);
+            cnt0 = _mm512_mask_add_ps (cnt0, valid0, cnt0, d);
+            cnt1 = _mm512_mask_add_ps (cnt1, valid1, cnt1, d);
+        }
+
+        if (divide)
+        {
+            __m512 zero = _mm512_setzero_ps();
+            acc0 = _mm512_maskz_div_ps (_mm512_cmp_ps_mask (cnt0, zero, _CMP_GT_OQ), acc0, cnt0);
+            acc1 = _mm512_maskz_div_ps (_mm512_cmp_ps_mask (cnt1, zero, _CMP_GT_OQ), acc1, cnt1);
+        }
+
+        _mm512_mask_storeu_ps (sum + i, m0, acc0);
+        _mm512_mask_storeu_ps (sum + i + 16, m1, acc1);
+        _mm512_mask_storeu_ps (count + i, m0, cnt0);
+        _mm512_mask_storeu_ps (count + i + 16, m1, cnt1);
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+void subtractMaskedReferenceAVX512 (float* const* channels,
+                                    const int* memberIndex,
+                                    int numMembers,
+                                    const float* sum,
+                                    const float* count,
+                                    float selfWeight,
+                                    float selfDivisor,
+                                    float threshold,
+                                    float gain,
+                                    int startSample,
+                                    int numSamples)
+{
+    __m512 t = _mm512_set1_ps (threshold);
+    __m512 g = _mm512_set1_ps (gain);
+    __m512 sw = _mm512_set1_ps (selfWeight);
+    __m512 sd = _mm512_set1_ps (selfDivisor);
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < numSamples; i += 16)
+        {
+            __mmask16 mask = tailMask16 (numSamples - i);
+
+            __m512 v = _mm512_maskz_loadu_ps (mask, x + i);
+            __mmask16 valid = _mm512_cmp_ps_mask (_mm512_abs_ps (v), t, _CMP_LT_OQ);
+            __m512 numerator = _mm512_mask3_fnmadd_ps (sw, v, _mm512_maskz_loadu_ps (mask, sum + i), valid);
+            __m512 denominator = _mm512_mask_sub_ps (_mm512_maskz_loadu_ps (mask, count + i), valid, _mm512_maskz_loadu_ps (mask, count + i), sd);
+
+            // no reference where every source is masked
+            __mmask16 referenced = _mm512_cmp_ps_mask (denominator, _mm512_setzero_ps(), _CMP_GT_OQ);
+            __m512 ref = _mm512_maskz_div_ps (referenced, numerator, denominator);
+
+            _mm512_mask_storeu_ps (x + i, mask, _mm512_fnmadd_ps (g, ref, v));
+        }
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+void channelStatisticsAVX512 (float* stats, const float* x, float previous, int numSamples)
+{
+    if (numSamples <= 16)
+        return channelStatisticsScalar (stats, x, previous, numSamples);
+
+    // the first sample's predecessor is not in x
+    channelStatisticsScalar (stats, x, previous, 1);
+
+    __m512 squares = _mm512_setzero_ps();
+    __m512 differences = _mm512_setzero_ps();
+    __m512 low = _mm512_set1_ps (stats[2]);
+    __m512 high = _mm512_set1_ps (stats[3]);
+
+    for (int i = 1; i < numSamples; i += 16)
+    {
+        __mmask16 mask = tailMask16 (numSamples - i);
+        __m512 v = _mm512_maskz_loadu_ps (mask, x + i);
+        __m512 d = _mm512_maskz_sub_ps (mask, v, _mm512_maskz_loadu_ps (mask, x + i - 1));
+
+        squares = _mm512_fmadd_ps (v, v, squares);
+        differences = _mm512_fmadd_ps (d, d, differences);
+        low = _mm512_mask_min_ps (low, mask, low, v);
+        high = _mm512_mask_max_ps (high, mask, high, v);
+    }
+
+    stats[0] += _mm512_reduce_add_ps (squares);
+    stats[1] += _mm512_reduce_add_ps (differences);
+    stats[2] = _mm512_reduce_min_ps (low);
+    stats[3] = _mm512_reduce_max_ps (high);
+}
+
+REFKERNELS_TARGET ("avx512f")
+void prefixSumsAVX512 (float* prefix,
+                       int prefixStride,
+                       const float* const* channels,
+                       const int* channelIndex,
+                       int numChannels,
+                       int startSample,
+                       int numSamples)
+{
+    int body = numSamples & ~15;
+    __mmask16 mask = tailMask16 (numSamples - body);
+
+    std::fill (prefix, prefix + numSamples, 0.0f);
+
+    for (int p = 0; p < numChannels; p++)
+    {
+        const float* x = channels[channelIndex[p]] + startSample;
+        const float* previous = prefix + (size_t) p * prefixStride;
+        float* next = prefix + (size_t) (p + 1) * prefixStride;
+
+        for (int i = 0; i < body; i += 16)
+            _mm512_storeu_ps (next + i, _mm512_add_ps (_mm512_loadu_ps (previous + i), _mm512_loadu_ps (x + i)));
+
+        if (body < numSamples)
+            _mm512_mask_storeu_ps (next + body, mask, _mm512_add_ps (_mm512_maskz_loadu_ps (mask, previous + body), _mm512_maskz_loadu_ps (mask, x + body)));
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+void windowSumAVX512 (float* dst,
+                      const float* prefix,
+                      int prefixStride,
+                      const int* runFirst,
+                      const int* runLast,
+                      int numRuns,
+                      float weight,
+                      int numSamples)
+{
+    __m512 w = _mm512_set1_ps (weight);
+
+    for (int i = 0; i < numSamples; i += 16)
+    {
+        __mmask16 mask = tailMask16 (numSamples - i);
+        __m512 sum = _mm512_setzero_ps();
+
+        for (int r = 0; r < numRuns; r++)
+        {
+            __m512 last = _mm512_maskz_loadu_ps (mask, prefix + (size_t) runLast[r] * prefixStride + i);
+            __m512 first = _mm512_maskz_loadu_ps (mask, prefix + (size_t) runFirst[r] * prefixStride + i);
+            sum = _mm512_add_ps (sum, _mm512_sub_ps (last, first));
+        }
+
+        _mm512_mask_storeu_ps (dst + i, mask, _mm512_mul_ps (w, sum));
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+float correlateAVX512 (float* correlation,
+                       const float* const* channels,
+                       const int* sourceIndex,
+                       int numSources,
+                       const float* error,
+                       int startSample,
+                       int numSamples)
+{
+    int body = numSamples & ~15;
+    __mmask16 mask = tailMask16 (numSamples - body);
+    __m512 power = _mm512_setzero_ps();
+    int k = 0;
+
+    // four sources per pass, so the error is loaded once for four
+    // independent accumulators
+    for (; k + 4 <= numSources; k += 4)
+    {
+        const float* x0 = channels[sourceIndex[k]] + startSample;
+        const float* x1 = channels[sourceIndex[k + 1]] + startSample;
+        const float* x2 = channels[sourceIndex[k + 2]] + startSample;
+        const float* x3 = channels[sourceIndex[k + 3]] + startSample;
+
+        __m512 dot0 = _mm512_setzero_ps();
+        __m512 dot1 = _mm512_setzero_ps();
+        __m512 dot2 = _mm512_setzero_ps();
+        __m512 dot3 = _mm512_setzero_ps();
+        __m512 power01 = _mm512_setzero_ps();
+        __m512 power23 = _mm512_setzero_ps();
+
+        for (int i = 0; i < numSamples; i += 16)
+        {
+            __mmask16 lanes = i < body ? (__mmask16) 0xffff : mask;
+            __m512 e = _mm512_maskz_loadu_ps (lanes, error + i);
+            __m512 v0 = _mm512_maskz_loadu_ps (lanes, x0 + i);
+            __m512 v1 = _mm512_maskz_loadu_ps (lanes, x1 + i);
+            __m512 v2 = _mm512_maskz_loadu_ps (lanes, x2 + i);
+            __m512 v3 = _mm512_maskz_loadu_ps (lanes, x3 + i);
+
+            dot0 = _mm512_fmadd_ps (e, v0, dot0);
+            dot1 = _mm512_fmadd_ps (e, v1, dot1);
+            dot2 = _mm512_fmadd_ps (e, v2, dot2);
+            dot3 = _mm512_fmadd_ps (e, v3, dot3);
+            power01 = _mm512_fmadd_ps (v1, v1, _mm512_fmadd_ps (v0, v0, power01));
+            power23 = _mm512_fmadd_ps (v3, v3, _mm512_fmadd_ps (v2, v2, power23));
+        }
+
+        correlation[k] = _mm512_reduce_add_ps (dot0);
+        correlation[k + 1] = _mm512_reduce_add_ps (dot1);
+        correlation[k + 2] = _mm512_reduce_add_ps (dot2);
+        correlation[k + 3] = _mm512_reduce_add_ps (dot3);
+        power = _mm512_add_ps (power, _mm512_add_ps (power01, power23));
+    }
+
+    for (; k < numSources; k++)
+    {
+        const float* x = channels[sourceIndex[k]] + startSample;
+        __m512 dot = _mm512_setzero_ps();
+
+        for (int i = 0; i < numSamples; i += 16)
+        {
+            __mmask16 lanes = i < body ? (__mmask16) 0xffff : mask;
+            __m512 v = _mm512_maskz_loadu_ps (lanes, x + i);
+            dot = _mm512_fmadd_ps (_mm512_maskz_loadu_ps (lanes, error + i), v, dot);
+            power = _mm512_fmadd_ps (v, v, power);
+        }
+
+        correlation[k] = _mm512_reduce_add_ps (dot);
+    }
+
+    return _mm512_reduce_add_ps (power);
+}
+
+REFKERNELS_TARGET ("avx512f")
+void networkOrderStatisticsAVX512 (float* ranks,
+                                   int rankStride,
+                                   const float* const* channels,
+                                   const int* sourceIndex,
+                                   int numSources,
+                                   int firstRank,
+                                   int numRanks,
+                                   int startSample,
+                                   int numSamples)
+{
+    const std::vector<Comparator>& network = sortingNetworks[numSources];
+    __m512 v[maxNetworkSources];
+
+    for (int i = 0; i < numSamples; i += 16)
+    {
+        __mmask16 mask = tailMask16 (numSamples - i);
+
+        for (int k = 0; k < numSources; k++)
+            v[k] = _mm512_maskz_loadu_ps (mask, channels[sourceIndex[k]] + startSample + i);
+
+        for (const Comparator& c : network)
+        {
+            __m512 lo = _mm512_min_ps (v[c.lo], v[c.hi]);
+            v[c.hi] = _mm512_max_ps (v[c.lo], v[c.hi]);
+            v[c.lo] = lo;
+        }
+
+        for (int r = 0; r < numRanks; r++)
+            _mm512_mask_storeu_ps (ranks + r * rankStride + i, mask, v[firstRank + r]);
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+void subtractLeaveOneOutMedianAVX512 (float* const* channels,
+                                      const int* memberIndex,
+                                      int numMembers,
+                                      const float* ranks,
+                                      int rankStride,
+                                      int numSources,
+                                      float gain,
+                                      int startSample,
+                                      int numSamples)
+{
+    const float* r0 = ranks;
+    const float* r1 = ranks + rankStride;
+    const float* r2 = ranks + 2 * rankStride;
+
+    __m512 g = _mm512_set1_ps (gain);
+    __m512 half = _mm512_set1_ps (0.5f);
+    bool odd = numSources % 2 == 1;
+
+    for (int m = 0; m < numMembers; m++)
+    {
+        float* x = channels[memberIndex[m]] + startSample;
+
+        for (int i = 0; i < numSamples; i += 16)
+        {
+            __mmask16 mask = tailMask16 (numSamples - i);
+
+            __m512 v = _mm512_maskz_loadu_ps (mask, x + i);
+            __m512 a = _mm512_maskz_loadu_ps (mask, r0 + i);
+            __m512 b = _mm512_maskz_loadu_ps (mask, r1 + i);
+            __m512 ref;
+
+            if (odd)
+            {
+                __m512 c = _mm512_maskz_loadu_ps (mask, r2 + i);
+                __m512 lo = _mm512_mask_mov_ps (a, _mm512_cmp_ps_mask (v, b, _CMP_LT_OQ), b);
+                __m512 hi = _mm512_mask_mov_ps (c, _mm512_cmp_ps_mask (v, b, _CMP_GT_OQ), b);
+                ref = _mm512_mul_ps (half, _mm512_add_ps (lo, hi));
+            }
+            else
+            {
+                ref = _mm512_mask_mov_ps (a, _mm512_cmp_ps_mask (v, a, _CMP_LE_OQ), b);
+            }
+
+            _mm512_mask_storeu_ps (x + i, mask, _mm512_sub_ps (v, _mm512_mul_ps (g, ref)));
+        }
+    }
+}
+
+REFKERNELS_TARGET ("avx512f")
+inline __m512i floatKeyAVX512 (__m512i bits)
+{
+    return _mm512_xor_si512 (bits, _mm512_and_si512 (_mm512_srai_epi32 (bits, 31), _mm512_set1_epi32 (0x7fffffff)));
+}
+
+/* Radix selection, see selectOrderStatisticsAVX2 */
+REFKERNELS_TARGET ("avx512f")
+void selectOrderStatisticsAVX512 (float* ranks,
+                                  int rankStride,
+                                  const float* const* channels,
+                                  const int* sourceIndex,
+                                  int numSources,
+                                  int firstRank,
+                                  int numRanks,
+                                  int startSample,
+                                  int numSamples,
+                                  float* scratch)
+{
+    int* keys = reinterpret_cast<int*> (scratch);
+    int middle = firstRank + (numRanks == 3 ? 1 : 0);
+
+    const __m512i signBit = _mm512_set1_epi32 (int (0x80000000u));
+    const __m512i middleRank = _mm512_set1_epi32 (middle);
+    const __m512i one = _mm512_set1_epi32 (1);
+
+    for (int i = 0; i < numSamples; i += 16)
+    {
+        __mmask16 mask = tailMask16 (numSamples - i);
+
+        for (int k = 0; k < numSources; k++)
+        {
+            __m512 x = _mm512_maskz_loadu_ps (mask, channels[sourceIndex[k]] + startSample + i);
+            _mm512_storeu_si512 (keys + k * 16, floatKeyAVX512 (_mm512_castps_si512 (x)));
+        }
+
+        __m512i prefix = _mm512_setzero_si512();
+
+        for (int b = 31; b >= 0; b--)
+        {
+            __m512i candidate = _mm512_or_si512 (prefix, _mm512_set1_epi32 (int (1u << b)));
+            __m512i threshold = _mm512_xor_si512 (candidate, signBit);
+            __m512i count = _mm512_setzero_si512();
+
+            for (int k = 0; k < numSources; k++)
+            {
+                __m512i key = _mm512_loadu_si512 (keys + k * 16);
+                count = _mm512_mask_add_epi32 (count, _mm512_cmplt_epi32_mask (key, threshold), count, one);
+            }
+
+            prefix = _mm512_mask_mov_epi32 (prefix, _mm512_cmple_epi32_mask (count, middleRank), candidate);
+        }
+
+        __m512i selected = _mm512_xor_si512 (prefix, signBit);
+        __m512i below = selected;
+        __m512i above = selected;
+
+        if (numRanks > 1)
+        {
+            __m512i lessCount = _mm512_setzero_si512();
+            __m512i lessEqualCount = _mm512_setzero_si512();
+            __m512i maxBelow = _mm512_set1_epi32 (int (0x80000000u));
+            __m512i minAbove = _mm512_set1_epi32 (0x7fffffff);
+
+            for (int k = 0; k < numSources; k++)
+            {
+                __m512i key = _mm512_loadu_si512 (keys + k * 16);
+                __mmask16 less = _mm512_cmplt_epi32_mask (key, selected);
+                __mmask16 greater = _mm512_cmpgt_epi32_mask (key, selected);
+
+                lessCount = _mm512_mask_add_epi32 (lessCount, less, lessCount, one);
+                lessEqualCount = _mm512_mask_add_epi32 (lessEqualCount, (__mmask16) ~greater, lessEqualCount, one);
+                maxBelow = _mm512_mask_max_epi32 (maxBelow, less, maxBelow, key);
+                minAbove = _mm512_mask_min_epi32 (minAbove, greater, minAbove, key);
+            }
+
+            __mmask16 tiedBelow = _mm512_cmplt_epi32_mask (lessCount, middleRank);
+            __mmask16 tiedAbove = _mm512_cmpgt_epi32_mask (lessEqualCount, _mm512_add_epi32 (middleRank, one));
+
+            below = _mm512_mask_mov_epi32 (maxBelow, tiedBelow, selected);
+            above = _mm512_mask_mov_epi32 (minAbove, tiedAbove, selected);
+        }
+
+        for (int r = 0; r < numRanks; r++)
+        {
+            int rank = firstRank + r;
+            __m512i key = rank < middle ? below : (rank > middle ? above : selected);
+            _mm512_mask_storeu_ps (ranks + r * rankStride + i, mask, _mm512_castsi512_ps (floatKeyAVX512 (key)));
+        }
+    }
+}
+
+#endif // REFKERNELS_X86
+
+/* -----------------------------------------------------------------
+Dispatch
+----------------------------------------------------------------- */
+
+const KernelTable scalarKernels = { InstructionSet::Scalar, weightedSumScalar, subtractReferenceScalar, subtractLeaveOneOutScalar, denseWeightedSumScalar, networkOrderStatisticsScalar, selectOrderStatisticsScalar, subtractLeaveOneOutMedianScalar, maskedWeightedSumScalar, subtractMaskedReferenceScalar, channelStatisticsScalar, correlateScalar, prefixSumsScalar, windowSumScalar };
+
+#if REFKERNELS_X86
+const KernelTable sse2Kernels = { InstructionSet::SSE2, weightedSumSSE2, subtractReferenceSSE2, subtractLeaveOneOutSSE2, denseWeightedSumScalar, networkOrderStatisticsSSE2, selectOrderStatisticsScalar, subtractLeaveOneOutMedianSSE2, maskedWeightedSumSSE2, subtractMaskedReferenceSSE2, channelStatisticsSSE2, correlateSSE2, prefixSumsSSE2, windowSumSSE2 };
+const KernelTable avx2Kernels = { InstructionSet::AVX2, weightedSumAVX2, subtractReferenceAVX2, subtractLeaveOneOutAVX2, denseWeightedSumAVX2, networkOrderStatisticsAVX2, selectOrderStatisticsAVX2, subtractLeaveOneOutMedianAVX2, maskedWeightedSumAVX2, subtractMaskedReferenceAVX2, channelStatisticsAVX2, correlateAVX2, prefixSumsAVX2, windowSumAVX2 };
+const KernelTable avx512Kernels = { InstructionSet::AVX512, weightedSumAVX512, subtractReferenceAVX512, subtractLeaveOneOutAVX512, denseWeightedSumAVX512, networkOrderStatisticsAVX512, selectOrderStatisticsAVX512, subtractLeaveOneOutMedianAVX512, maskedWeightedSumAVX512, subtractMaskedReferenceAVX512, channelStatisticsAVX512, correlateAVX512, prefixSumsAVX512, windowSumAVX512 };
+#endif
+
+InstructionSet detectInstructionSet()
+{
+#if REFKERNELS_X86
+#if defined(_MSC_VER) && ! defined(__clang__)
+    int info[4];
+
+    __cpuid (info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid (info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+
+    bool avx2 = false;
+    bool avx512f = false;
+
+    if (maxLeaf >= 7)
+    {
+        __cpuidex (info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+        avx512f = (info[1] & (1 << 16)) != 0;
+    }
+
+    // the OS has to save the wider registers on context switches
+    unsigned long long xcr0 = osxsave ? _xgetbv (0) : 0;
+    bool ymmEnabled = (xcr0 & 0x6) == 0x6;
+    bool zmmEnabled = (xcr0 & 0xe6) == 0xe6;
+
+    if (avx512f && zmmEnabled)
+        return InstructionSet::AVX512;
+    if (avx2 && fma && ymmEnabled)
+        return InstructionSet::AVX2;
+    if (sse2)
+        return InstructionSet::SSE2;
+#else
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports ("avx512f"))
+        return InstructionSet::AVX512;
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+        return InstructionSet::AVX2;
+    if (__builtin_cpu_supports ("sse2"))
+        return InstructionSet::SSE2;
+#endif
+#endif
+
+    return InstructionSet::Scalar;
+}
+
+const KernelTable* getKernelTable (InstructionSet set)
+{
+    switch (set)
+    {
+#if REFKERNELS_X86
+        case InstructionSet::AVX512:
+            return &avx512Kernels;
+        case InstructionSet::AVX2:
+            return &avx2Kernels;
+        case InstructionSet::SSE2:
+            return &sse2Kernels;
+#endif
+        default:
+            return &scalarKernels;
+    }
+}
+
+const InstructionSet bestInstructionSet = detectInstructionSet();
+const KernelTable* activeKernels = getKernelTable (bestInstructionSet);
+
+} // namespace
+
+void ReferenceKernels::weightedSum (float* dst,
+                                    const float* const* channels,
+                                    const int* sourceIndex,
+                                    const float* weights,
+                                    int numSources,
+                                    int startSample,
+                                    int numSamples)
+{
+    activeKernels->weightedSum (dst, channels, sourceIndex, weights, numSources, startSample, numSamples);
+}
+
+void ReferenceKernels::subtractReference (float* const* channels,
+                                          const int* memberIndex,
+                                          int numMembers,
+                                          const float* ref,
+                                          float gain,
+                                          int startSample,
+                                          int numSamples)
+{
+    activeKernels->subtractReference (channels, memberIndex, numMembers, ref, gain, startSample, numSamples);
+}
+
+void ReferenceKernels::subtractLeaveOneOut (float* const* channels,
+                                            const int* memberIndex,
+                                            int numMembers,
+                                            const float* sum,
+                                            float selfWeight,
+                                            float gain,
+                                            int startSample,
+                                            int numSamples)
+{
+    activeKernels->subtractLeaveOneOut (channels, memberIndex, numMembers, sum, selfWeight, gain, startSample, numSamples);
+}
+
+void ReferenceKernels::denseWeightedSum (float* refs,
+                                         int refStride,
+                                         const float* weights,
+                                         int weightStride,
+                                         const float* const* channels,
+                                         const int* sourceIndex,
+                                         int numRows,
+                                         int numSources,
+                                         int startSample,
+                                         int numSamples,
+                                         bool accumulate)
+{
+    activeKernels->denseWeightedSum (refs, refStride, weights, weightStride, channels, sourceIndex, numRows, numSources, startSample, numSamples, accumulate);
+}
+
+void ReferenceKernels::orderStatistics (float* ranks,
+                                        int rankStride,
+                                        const float* const* channels,
+                                        const int* sourceIndex,
+                                        int numSources,
+                                        int firstRank,
+                                        int numRanks,
+                                        int startSample,
+                                        int numSamples,
+                                        float* scratch)
+{
+    if (numSources <= maxNetworkSources)
+        activeKernels->networkOrderStatistics (ranks, rankStride, channels, sourceIndex, numSources, firstRank, numRanks, startSample, numSamples);
+    else
+        activeKernels->selectOrderStatistics (ranks, rankStride, channels, sourceIndex, numSources, firstRank, numRanks, startSample, numSamples, scratch);
+}
+
+void ReferenceKernels::subtractLeaveOneOutMedian (float* const* channels,
+                                                  const int* memberIndex,
+                                                  int numMembers,
+                                                  const float* ranks,
+                                                  int rankStride,
+                                                  int numSources,
+                                                  float gain,
+                                                  int startSample,
+                                                  int numSamples)
+{
+    activeKernels->subtractLeaveOneOutMedian (channels, memberIndex, numMembers, ranks, rankStride, numSources, gain, startSample, numSamples);
+}
+
+void ReferenceKernels::maskedWeightedSum (float* sum,
+                                          float* count,
+                                          const float* const* channels,
+                                          const int* sourceIndex,
+                                          const float* weights,
+                                          const float* divisors,
+                                          int numSources,
+                                          float threshold,
+                                          int startSample,
+                                          int numSamples,
+                                          bool divide)
+{
+    activeKernels->maskedWeightedSum (sum, count, channels, sourceIndex, weights, divisors, numSources, threshold, startSample, numSamples, divide);
+}
+
+void ReferenceKernels::subtractMaskedReference (float* const* channels,
+                                                const int* memberIndex,
+                                                int numMembers,
+                                                const float* sum,
+                                                const float* count,
+                                                float selfWeight,
+                                                float selfDivisor,
+                                                float threshold,
+                                                float gain,
+                                                int startSample,
+                                                int numSamples)
+{
+    activeKernels->subtractMaskedReference (channels, memberIndex, numMembers, sum, count, selfWeight, selfDivisor, threshold, gain, startSample, numSamples);
+}
+
+void ReferenceKernels::channelStatistics (float* stats, const float* x, float previous, int numSamples)
+{
+    activeKernels->channelStatistics (stats, x, previous, numSamples);
+}
+
+float ReferenceKernels::correlate (float* correlation,
+                                   const float* const* channels,
+                                   const int* sourceIndex,
+                                   int numSources,
+                                   const float* error,
+                                   int startSample,
+                                   int numSamples)
+{
+    return activeKernels->correlate (correlation, channels, sourceIndex, numSources, error, startSample, numSamples);
+}
+
+void ReferenceKernels::prefixSums (float* prefix,
+                                   int prefixStride,
+                                   const float* const* channels,
+                                   const int* channelIndex,
+                                   int numChannels,
+                                   int startSample,
+                                   int numSamples)
+{
+    activeKernels->prefixSums (prefix, prefixStride, channels, channelIndex, numChannels, startSample, numSamples);
+}
+
+void ReferenceKernels::windowSum (float* dst,
+                                  const float* prefix,
+                                  int prefixStride,
+                                  const int* runFirst,
+                                  const int* runLast,
+                                  int numRuns,
+                                  float weight,
+                                  int numSamples)
+{
+    activeKernels->windowSum (dst, prefix, prefixStride, runFirst, runLast, numRuns, weight, numSamples);
+}
+
+InstructionSet ReferenceKernels::getInstructionSet()
+{
+    return activeKernels->set;
+}
+
+InstructionSet ReferenceKernels::getBestSupportedInstructionSet()
+{
+    return bestInstructionSet;
+}
+
+bool ReferenceKernels::setInstructionSet (InstructionSet set)
+{
+    if (int (set) > int (bestInstructionSet))
+        return false;
+
+    activeKernels = getKernelTable (set);
+    return true;
+}
+
+const char* ReferenceKernels::getInstructionSetName (InstructionSet set)
+{
+    switch (set)
+    {
+        case InstructionSet::AVX512:
+            return "AVX-512";
+        case InstructionSet::AVX2:
+            return "AVX2";
+        case InstructionSet::SSE2:
+            return "SSE2";
+        default:
+            return "Scalar";
+    }
+}
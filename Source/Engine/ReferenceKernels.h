@@ -0,0 +1,266 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEKERNELS_H__
+#define __REFERENCEKERNELS_H__
+
+/**
+
+  Reference kernels
+
+  Vectorized inner loops used to compute and subtract reference signals.
+  The fastest implementation supported by the CPU (AVX-512, AVX2 + FMA,
+  SSE2 or plain C++) is selected once, when the plugin is loaded.
+
+  Channels are addressed through an array of channel pointers plus a
+  list of indices, so that the CSR lists of a ReferencePlan can be
+  passed in directly.
+
+  @see ReferencePlan
+
+*/
+
+namespace ReferenceKernels
+{
+/** Instruction sets that a kernel implementation can be built for */
+enum class InstructionSet
+{
+    Scalar = 0,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+/** Computes dst[i] = sum_k weights[k] * channels[sourceIndex[k]][startSample + i].
+    Up to four sources are accumulated per pass, so that every output
+    sample is loaded and stored once per four sources. */
+void weightedSum (float* dst,
+                  const float* const* channels,
+                  const int* sourceIndex,
+                  const float* weights,
+                  int numSources,
+                  int startSample,
+                  int numSamples);
+
+/** Computes x[startSample + i] -= gain * ref[i] for every channel x in memberIndex */
+void subtractReference (float* const* channels,
+                        const int* memberIndex,
+                        int numMembers,
+                        const float* ref,
+                        float gain,
+                        int startSample,
+                        int numSamples);
+
+/** Leave-one-out subtraction. sum holds the weighted sum of a whole group,
+    including the member itself, so each member's reference is obtained by
+    removing its own contribution:
+
+      x[startSample + i] -= gain * (sum[i] - selfWeight * x[startSample + i])
+
+    This turns "all channels except self" into a single shared sum instead
+    of one reference set per channel. */
+void subtractLeaveOneOut (float* const* channels,
+                          const int* memberIndex,
+                          int numMembers,
+                          const float* sum,
+                          float selfWeight,
+                          float gain,
+                          int startSample,
+                          int numSamples);
+
+/** Dense tile product used for dense, non-uniform reference matrices:
+
+      refs[r * refStride + i] (+)= sum_k weights[r * weightStride + k] * channels[sourceIndex[k]][startSample + i]
+
+    for r < numRows, k < numSources and i < numSamples. Rows are computed
+    four at a time with the accumulators held in registers. If accumulate
+    is false, refs is overwritten, otherwise the products are added, so
+    that long source lists can be split into cache-sized blocks. */
+void denseWeightedSum (float* refs,
+                       int refStride,
+                       const float* weights,
+                       int weightStride,
+                       const float* const* channels,
+                       const int* sourceIndex,
+                       int numRows,
+                       int numSources,
+                       int startSample,
+                       int numSamples,
+                       bool accumulate);
+
+/** Largest group whose order statistics are computed with a sorting network */
+const int maxNetworkSources = 32;
+
+/** Number of samples per transposed block of larger groups */
+const int orderStatisticsBlockSamples = 16;
+
+/** Per-sample order statistics of a group of channels, used for median
+    references:
+
+      ranks[r * rankStride + i] = value of rank firstRank + r among the
+                                  channels[sourceIndex[k]][startSample + i]
+
+    for r < numRanks (at most 3, and consecutive around the median) and
+    i < numSamples. Groups of up to maxNetworkSources channels go through a
+    compare-exchange network whose wires are SIMD vectors of consecutive
+    samples. Larger groups use a vectorized radix selection (AVX2 and
+    AVX-512) or nth_element on transposed sample-major blocks; both work
+    in scratch, which must hold numSources * orderStatisticsBlockSamples
+    floats. */
+void orderStatistics (float* ranks,
+                      int rankStride,
+                      const float* const* channels,
+                      const int* sourceIndex,
+                      int numSources,
+                      int firstRank,
+                      int numRanks,
+                      int startSample,
+                      int numSamples,
+                      float* scratch);
+
+/** Leave-one-out median subtraction. ranks holds the middle order
+    statistics of the whole group of numSources channels (ranks k - 1, k
+    and k + 1 for an odd count, k and k + 1 for an even count, with k the
+    lower median), from which the median of each member's set without
+    itself follows by comparing the member's own value. */
+void subtractLeaveOneOutMedian (float* const* channels,
+                                const int* memberIndex,
+                                int numMembers,
+                                const float* ranks,
+                                int rankStride,
+                                int numSources,
+                                float gain,
+                                int startSample,
+                                int numSamples);
+
+/** Saturation-masked weighted sum, used to keep railed channels out of
+    the reference. Samples whose magnitude is at or beyond threshold (and
+    NaNs) are left out per sample:
+
+      sum[i]   = sum_k weights[k]  * x_k[i] * valid_k[i]
+      count[i] = sum_k divisors[k] * valid_k[i]
+
+    with x_k = channels[sourceIndex[k]] + startSample. The reference is
+    sum / count, so count must be in the same units as the normalization
+    the weights were divided by. If divide is true, sum is overwritten
+    with that reference (0 where every source is masked). */
+void maskedWeightedSum (float* sum,
+                        float* count,
+                        const float* const* channels,
+                        const int* sourceIndex,
+                        const float* weights,
+                        const float* divisors,
+                        int numSources,
+                        float threshold,
+                        int startSample,
+                        int numSamples,
+                        bool divide);
+
+/** Subtracts the masked reference sum / count from every member. In
+    leave-one-out groups the member's own contribution is removed first
+    if its sample was not masked:
+
+      x[startSample + i] -= gain * (sum[i] - selfWeight * x) / (count[i] - selfDivisor)
+
+    Samples for which every source was masked are left unchanged. */
+void subtractMaskedReference (float* const* channels,
+                              const int* memberIndex,
+                              int numMembers,
+                              const float* sum,
+                              const float* count,
+                              float selfWeight,
+                              float selfDivisor,
+                              float threshold,
+                              float gain,
+                              int startSample,
+                              int numSamples);
+
+/** Running statistics of one channel, used to find bad channels:
+
+      stats[0] += sum_i x[i]^2
+      stats[1] += sum_i (x[i] - x[i - 1])^2, with x[-1] = previous
+      stats[2] = min (stats[2], x[i])
+      stats[3] = max (stats[3], x[i])
+
+    for i < numSamples. The sums are accumulated in single precision, so
+    a call should cover at most a few thousand samples. */
+void channelStatistics (float* stats, const float* x, float previous, int numSamples);
+
+/** Block gradient of the normalized LMS rule used by adaptive references:
+
+      correlation[k] = sum_i error[i] * x_k[i]
+
+    for k < numSources and i < numSamples, with
+    x_k = channels[sourceIndex[k]] + startSample. Returns the total power
+    of the sources, sum_k sum_i x_k[i]^2, which normalizes the step. */
+float correlate (float* correlation,
+                 const float* const* channels,
+                 const int* sourceIndex,
+                 int numSources,
+                 const float* error,
+                 int startSample,
+                 int numSamples);
+
+/** Running sums over an ordered list of channels, used for references
+    that average a window of neighbouring channels:
+
+      prefix[p * prefixStride + i] = sum_{q < p} channels[channelIndex[q]][startSample + i]
+
+    for p <= numChannels and i < numSamples. */
+void prefixSums (float* prefix,
+                 int prefixStride,
+                 const float* const* channels,
+                 const int* channelIndex,
+                 int numChannels,
+                 int startSample,
+                 int numSamples);
+
+/** Weighted sum of runs of consecutive channels, read from prefixSums():
+
+      dst[i] = weight * sum_r (prefix[runLast[r] * prefixStride + i] - prefix[runFirst[r] * prefixStride + i])
+
+    so each run costs two loads, however many channels it covers. */
+void windowSum (float* dst,
+                const float* prefix,
+                int prefixStride,
+                const int* runFirst,
+                const int* runLast,
+                int numRuns,
+                float weight,
+                int numSamples);
+
+/** Returns the instruction set of the kernels currently in use */
+InstructionSet getInstructionSet();
+
+/** Returns the most capable instruction set supported by this CPU */
+InstructionSet getBestSupportedInstructionSet();
+
+/** Forces a specific implementation (e.g. for testing). Returns false and
+    leaves the selection unchanged if the CPU does not support it. */
+bool setInstructionSet (InstructionSet set);
+
+/** Returns a readable name for an instruction set */
+const char* getInstructionSetName (InstructionSet set);
+} // namespace ReferenceKernels
+
+#endif //__REFERENCEKERNELS_H__
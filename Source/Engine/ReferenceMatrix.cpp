@@ -0,0 +1,305 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceMatrix.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+const int bitsPerWord = 64;
+
+int countBits (uint64_t word)
+{
+    return (int) std::bitset<bitsPerWord> (word).count();
+}
+
+/** Index of the lowest set bit of a nonzero word */
+int lowestBit (uint64_t word)
+{
+    return countBits ((word & (~word + 1)) - 1);
+}
+
+bool compareReferenceChannel (const ReferenceMatrix::Reference& ref, int channel)
+{
+    return ref.channel < channel;
+}
+} // namespace
+
+ReferenceMatrix::ReferenceMatrix (int nChan)
+{
+    nChannels = nChan;
+    nChannelsBefore = -1;
+    wordsPerRow = 0;
+    update();
+}
+
+ReferenceMatrix::~ReferenceMatrix()
+{
+}
+
+void ReferenceMatrix::setNumberOfChannels (int n)
+{
+    nChannels = n;
+    update();
+}
+
+int ReferenceMatrix::getNumberOfChannels()
+{
+    return nChannels;
+}
+
+void ReferenceMatrix::update()
+{
+    if (nChannels != nChannelsBefore)
+    {
+        wordsPerRow = (nChannels + bitsPerWord - 1) / bitsPerWord;
+
+        bits.assign ((size_t) nChannels * wordsPerRow, 0);
+        weights.clear();
+        weights.resize (nChannels);
+
+        nChannelsBefore = nChannels;
+    }
+}
+
+void ReferenceMatrix::setValue (int rowIndex, int colIndex, float value)
+{
+    if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+    {
+        uint64_t& word = getRowBits (rowIndex)[colIndex / bitsPerWord];
+        uint64_t mask = (uint64_t) 1 << (colIndex % bitsPerWord);
+
+        if (value == 0)
+            word &= ~mask;
+        else
+            word |= mask;
+
+        std::vector<Reference>& row = weights[rowIndex];
+        auto it = std::lower_bound (row.begin(), row.end(), colIndex, compareReferenceChannel);
+        bool found = it != row.end() && it->channel == colIndex;
+
+        if (value == 0 || value == 1)
+        {
+            if (found)
+                row.erase (it);
+        }
+        else if (found)
+        {
+            it->value = value;
+        }
+        else
+        {
+            row.insert (it, { colIndex, value });
+        }
+    }
+    else
+    {
+        std::cout << "RefMatrix::setValue INDEX OUT OF BOUNDS! (rowIndex=" << rowIndex << ", colIndex=" << colIndex << ")" << std::endl;
+    }
+}
+
+float ReferenceMatrix::getValue (int rowIndex, int colIndex)
+{
+    float value = -1;
+    if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+    {
+        uint64_t word = getRowBits (rowIndex)[colIndex / bitsPerWord];
+
+        if ((word >> (colIndex % bitsPerWord) & 1) == 0)
+            return 0.0f;
+
+        const std::vector<Reference>& row = weights[rowIndex];
+        auto it = std::lower_bound (row.begin(), row.end(), colIndex, compareReferenceChannel);
+
+        value = (it != row.end() && it->channel == colIndex) ? it->value : 1.0f;
+    }
+
+    return value;
+}
+
+std::vector<ReferenceMatrix::Reference> ReferenceMatrix::getReferences (int index)
+{
+    std::vector<Reference> references;
+
+    if (index < 0 || index >= nChannels)
+        return references;
+
+    const uint64_t* row = getRowBits (index);
+    auto weight = weights[index].begin();
+
+    references.reserve (getNumReferences (index));
+
+    for (int w = 0; w < wordsPerRow; w++)
+    {
+        for (uint64_t word = row[w]; word != 0; word &= word - 1)
+        {
+            int channel = w * bitsPerWord + lowestBit (word);
+
+            // the side table holds a subset of the selected channels, in the same order
+            bool weighted = weight != weights[index].end() && weight->channel == channel;
+
+            references.push_back ({ channel, weighted ? (weight++)->value : 1.0f });
+        }
+    }
+
+    return references;
+}
+
+int ReferenceMatrix::getNumReferences (int index)
+{
+    if (index < 0 || index >= nChannels)
+        return 0;
+
+    const uint64_t* row = getRowBits (index);
+    int count = 0;
+
+    for (int w = 0; w < wordsPerRow; w++)
+        count += countBits (row[w]);
+
+    return count;
+}
+
+bool ReferenceMatrix::isSameRow (int first, int second)
+{
+    if (first < 0 || first >= nChannels || second < 0 || second >= nChannels)
+        return false;
+
+    if (std::memcmp (getRowBits (first), getRowBits (second), wordsPerRow * sizeof (uint64_t)) != 0)
+        return false;
+
+    const std::vector<Reference>& a = weights[first];
+    const std::vector<Reference>& b = weights[second];
+
+    return std::equal (a.begin(), a.end(), b.begin(), b.end(), [] (const Reference& x, const Reference& y)
+                       { return x.channel == y.channel && x.value == y.value; });
+}
+
+void ReferenceMatrix::setReferences (int index, std::vector<Reference> references)
+{
+    if (index < 0 || index >= nChannels)
+        return;
+
+    clearChannel (index);
+
+    uint64_t* row = getRowBits (index);
+
+    for (auto& ref : references)
+    {
+        if (ref.value == 0)
+            continue;
+
+        row[ref.channel / bitsPerWord] |= (uint64_t) 1 << (ref.channel % bitsPerWord);
+
+        if (ref.value != 1)
+            weights[index].push_back (ref);
+    }
+}
+
+void ReferenceMatrix::clearChannel (int index)
+{
+    if (index >= 0 && index < nChannels)
+    {
+        std::fill_n (getRowBits (index), wordsPerRow, 0);
+        weights[index].clear();
+    }
+}
+
+bool ReferenceMatrix::allChannelReferencesActive (int index)
+{
+    if (getNumReferences (index) != nChannels)
+        return false;
+
+    // only positive values count as active
+    for (auto& ref : weights[index])
+    {
+        if (ref.value <= 0)
+            return false;
+    }
+
+    return true;
+}
+
+void ReferenceMatrix::setAll (float value)
+{
+    setAll (value, nChannels);
+}
+
+void ReferenceMatrix::setAll (float value, int maxChan)
+{
+    maxChan = std::min (nChannels, maxChan);
+
+    // the words that hold channels [0, maxChan), the last one partially
+    int fullWords = maxChan / bitsPerWord;
+    uint64_t lastMask = ((uint64_t) 1 << (maxChan % bitsPerWord)) - 1;
+
+    for (int i = 0; i < maxChan; i++)
+    {
+        // keep the references beyond maxChan
+        uint64_t* rowBits = getRowBits (i);
+
+        std::fill_n (rowBits, fullWords, value != 0 ? ~(uint64_t) 0 : 0);
+
+        if (lastMask != 0)
+            rowBits[fullWords] = value != 0 ? rowBits[fullWords] | lastMask : rowBits[fullWords] & ~lastMask;
+
+        std::vector<Reference>& row = weights[i];
+        auto tail = std::lower_bound (row.begin(), row.end(), maxChan, compareReferenceChannel);
+        std::vector<Reference> newRow;
+
+        if (value != 0 && value != 1)
+        {
+            newRow.reserve (maxChan + (row.end() - tail));
+
+            for (int j = 0; j < maxChan; j++)
+                newRow.push_back ({ j, value });
+        }
+
+        newRow.insert (newRow.end(), tail, row.end());
+        row.swap (newRow);
+    }
+}
+
+void ReferenceMatrix::clear()
+{
+    std::fill (bits.begin(), bits.end(), 0);
+
+    for (auto& row : weights)
+        row.clear();
+}
+
+void ReferenceMatrix::print()
+{
+    for (int i = 0; i < nChannels; i++)
+    {
+        for (int j = 0; j < nChannels; j++)
+        {
+            std::cout << getValue (i, j) << " ";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+}
@@ -0,0 +1,131 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEMATRIX_H__
+#define __REFERENCEMATRIX_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+
+  Reference matrix
+
+  Each row indicates the selected reference channels for each channel.
+
+  > 0: selected, with the value acting as the gain of that reference
+    0: not selected
+
+  The reference of a row is the weighted sum of its selected channels,
+  divided by the number of references or by the sum of the weights (see
+  VirtualRef::setNormalizeBySum).
+
+  Almost every configuration is binary, so each row is stored as a packed
+  bitset of its selected channels (1536 x 1536 channels take 288 KB), and
+  only values other than 1 are kept in a sparse side table of (channel,
+  value) entries sorted by channel. Counting a row's references is a
+  popcount and comparing two rows a memcmp of their bits.
+
+  @see VirtualRef
+
+*/
+
+class ReferenceMatrix
+{
+public:
+    /** A selected reference channel of a row */
+    struct Reference
+    {
+        int channel;
+        float value;
+    };
+
+    /** Constructor */
+    ReferenceMatrix (int nChan);
+
+    /** Destructor */
+    ~ReferenceMatrix();
+
+    /** Set the number of channels for the matrix*/
+    void setNumberOfChannels (int n);
+
+    /** Get the number of channels for the matrix*/
+    int getNumberOfChannels();
+
+    /** Called when the input channels have changed*/
+    void update();
+
+    /** Sets the value for the specified row and column */
+    void setValue (int rowIndex, int colIndex, float value);
+
+    /** Gets the value for the specified row and column */
+    float getValue (int rowIndex, int colIndex);
+
+    /** Gets the nonzero references of the specified row, sorted by channel */
+    std::vector<Reference> getReferences (int index);
+
+    /** Returns the number of nonzero references of the specified row */
+    int getNumReferences (int index);
+
+    /** Returns true if two rows select the same references with the same values */
+    bool isSameRow (int first, int second);
+
+    /** Replaces all references of the specified row at once. The
+        references must be sorted by channel and within range. */
+    void setReferences (int index, std::vector<Reference> references);
+
+    /** Clears all references of the specified row */
+    void clearChannel (int index);
+
+    /** Checks if all the reference channels are active for the given input channel index */
+    bool allChannelReferencesActive (int index);
+
+    /** Sets the value for all reference channels */
+    void setAll (float value);
+
+    /** Sets the value for all reference channels up to the max channel number*/
+    void setAll (float value, int maxChan);
+
+    /** Clears the reference channel matrix */
+    void clear();
+
+    /** Prints the matrix values*/
+    void print();
+
+private:
+    /** Returns the first word of a row's bitset */
+    uint64_t* getRowBits (int index) { return bits.data() + (size_t) index * wordsPerRow; }
+
+    int nChannels;
+    int nChannelsBefore;
+    int wordsPerRow;
+
+    /** Selected channels, wordsPerRow words per row */
+    std::vector<uint64_t> bits;
+
+    /** Values other than 1 of each row's selected channels, sorted by channel */
+    std::vector<std::vector<Reference>> weights;
+};
+
+#endif //__REFERENCEMATRIX_H__
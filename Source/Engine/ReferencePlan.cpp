@@ -0,0 +1,563 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferencePlan.h"
+#include "ReferenceMatrix.h"
+
+#include <algorithm>
+#include <map>
+
+ReferencePlan::ReferencePlan()
+    : numGroups (0),
+      numPublished (0),
+      mode (Mode::Sparse),
+      statistic (Statistic::Mean),
+      saturationThreshold (0.0f)
+{
+    sourceStart.push_back (0);
+    memberStart.push_back (0);
+    windowStart.push_back (0);
+    groupCostEnd.push_back (0);
+}
+
+void ReferencePlan::build (ReferenceMatrix* matrix, const std::vector<int>& globalIndices)
+{
+    build (matrix, globalIndices, Options());
+}
+
+void ReferencePlan::build (ReferenceMatrix* matrix,
+                           const std::vector<int>& globalIndices,
+                           const Options& options)
+{
+    int numChan = matrix->getNumberOfChannels();
+    Normalization normalization = options.normalization;
+    const std::vector<float>& sourceScale = options.sourceScale;
+    statistic = options.statistic;
+    saturationThreshold = statistic == Statistic::Mean ? std::max (0.0f, options.saturationThreshold) : 0.0f;
+
+    typedef std::vector<std::pair<int, float>> ReferenceSet;
+
+    struct Group
+    {
+        ReferenceSet sources;
+        std::vector<int> members;
+        bool leaveOneOut = false;
+    };
+
+    // rows are keyed by their active references and weights, which
+    // together identify the reference signal
+    std::map<ReferenceSet, int> groupIndex;
+    std::vector<Group> groups;
+    ReferenceSet refs;
+    int previousGroup = -1;
+
+    for (int i = 0; i < numChan; i++)
+    {
+        // a row equal to the previous one (e.g. in a common average) joins
+        // its group without being compared element by element. Adaptive
+        // rows leave out their own channel, so they always differ.
+        if (i > 0 && statistic != Statistic::Adaptive && matrix->isSameRow (i, i - 1))
+        {
+            if (previousGroup >= 0)
+                groups[previousGroup].members.push_back (i);
+
+            continue;
+        }
+
+        previousGroup = -1;
+        refs.clear();
+
+        for (auto& ref : matrix->getReferences (i))
+        {
+            float value = ref.value;
+
+            if (ref.channel < (int) sourceScale.size())
+                value *= sourceScale[ref.channel];
+
+            // an adaptive reference that includes the channel itself
+            // would learn to cancel the signal
+            if (statistic == Statistic::Adaptive && ref.channel == i)
+                continue;
+
+            // the median is unweighted
+            if (value > 0)
+                refs.emplace_back (ref.channel, statistic == Statistic::Median ? 1.0f : value);
+        }
+
+        if (refs.empty())
+            continue;
+
+        // adaptive rows learn their own weights, so they are never shared
+        if (statistic == Statistic::Adaptive)
+        {
+            groups.emplace_back();
+            groups.back().sources = refs;
+            groups.back().members.push_back (i);
+            continue;
+        }
+
+        auto it = groupIndex.find (refs);
+
+        if (it == groupIndex.end())
+        {
+            it = groupIndex.emplace (refs, (int) groups.size()).first;
+            groups.emplace_back();
+            groups.back().sources = refs;
+        }
+
+        groups[it->second].members.push_back (i);
+        previousGroup = it->second;
+    }
+
+    // "all channels of a set except myself" gives every member its own
+    // reference set. If every channel of the set has the same weight in
+    // all rows that reference it, such rows are merged into a single
+    // leave-one-out group that sums the whole set once and removes each
+    // member's own contribution when subtracting.
+    std::map<std::vector<int>, std::vector<int>> leaveOneOutSets;
+
+    for (int g = 0; g < (int) groups.size() && statistic != Statistic::Adaptive; g++)
+    {
+        if (groups[g].members.size() != 1)
+            continue;
+
+        std::vector<int> set;
+
+        for (auto& source : groups[g].sources)
+            set.push_back (source.first);
+
+        int self = groups[g].members[0];
+        auto pos = std::lower_bound (set.begin(), set.end(), self);
+
+        if (pos != set.end() && *pos == self)
+            continue;
+
+        set.insert (pos, self);
+        leaveOneOutSets[set].push_back (g);
+    }
+
+    std::vector<bool> merged (groups.size(), false);
+
+    for (auto& entry : leaveOneOutSets)
+    {
+        if (entry.second.size() < 2)
+            continue;
+
+        std::map<int, float> setWeights;
+        bool consistent = true;
+
+        for (int g : entry.second)
+        {
+            for (auto& source : groups[g].sources)
+            {
+                auto weight = setWeights.emplace (source.first, source.second);
+                consistent = consistent && weight.first->second == source.second;
+            }
+        }
+
+        if (! consistent || setWeights.size() != entry.first.size())
+            continue;
+
+        Group group;
+        group.leaveOneOut = true;
+        group.sources.assign (setWeights.begin(), setWeights.end());
+
+        for (int g : entry.second)
+        {
+            group.members.push_back (groups[g].members[0]);
+            merged[g] = true;
+        }
+
+        std::sort (group.members.begin(), group.members.end());
+
+        groups.push_back (std::move (group));
+        merged.push_back (false);
+    }
+
+    // flatten into CSR
+    numGroups = 0;
+    sourceStart.assign (1, 0);
+    memberStart.assign (1, 0);
+    sourceIndex.clear();
+    sourceWeight.clear();
+    sourceDivisor.clear();
+    memberIndex.clear();
+    groupLeaveOneOut.clear();
+    memberSelfWeight.clear();
+    memberSelfDivisor.clear();
+    memberGain.clear();
+    groupOutputScale.clear();
+    channelGroup.assign (numChan, -1);
+
+    std::vector<int> sourceChannel;
+
+    for (int g = 0; g < (int) groups.size(); g++)
+    {
+        if (merged[g])
+            continue;
+
+        const Group& group = groups[g];
+
+        float totalWeight = 0.0f;
+
+        for (auto& source : group.sources)
+            totalWeight += source.second;
+
+        auto selfWeightOf = [&group] (int member)
+        {
+            if (! group.leaveOneOut)
+                return 0.0f;
+
+            auto self = std::lower_bound (group.sources.begin(),
+                                          group.sources.end(),
+                                          std::make_pair (member, 0.0f),
+                                          [] (const std::pair<int, float>& a, const std::pair<int, float>& b)
+                                          { return a.first < b.first; });
+
+            return self->second;
+        };
+
+        // a leave-one-out member does not count its own entry
+        auto normalizationOf = [&] (float selfWeight)
+        {
+            if (statistic == Statistic::Median)
+                return 1.0f;
+
+            if (normalization == Normalization::Sum)
+                return totalWeight - selfWeight;
+
+            return float (group.sources.size() - (group.leaveOneOut ? 1 : 0));
+        };
+
+        // the weights are normalized here, once, so the kernels only
+        // have to multiply and accumulate. The group is normalized as for
+        // its first member, and the other members correct for the
+        // difference through their gain.
+        float norm = normalizationOf (selfWeightOf (group.members[0]));
+
+        for (auto& source : group.sources)
+        {
+            sourceIndex.push_back (globalIndices[source.first]);
+            sourceChannel.push_back (source.first);
+            sourceWeight.push_back (source.second / norm);
+            sourceDivisor.push_back ((normalization == Normalization::Sum ? source.second : 1.0f) / norm);
+        }
+
+        for (int member : group.members)
+        {
+            float selfWeight = selfWeightOf (member);
+
+            memberIndex.push_back (globalIndices[member]);
+            memberSelfWeight.push_back (selfWeight / norm);
+            memberSelfDivisor.push_back (group.leaveOneOut ? (normalization == Normalization::Sum ? selfWeight : 1.0f) / norm : 0.0f);
+            memberGain.push_back (norm / normalizationOf (selfWeight));
+            channelGroup[member] = numGroups;
+        }
+
+        // the published signal of a leave-one-out group is the mean of
+        // its whole set
+        float wholeSet = normalization == Normalization::Sum ? totalWeight : float (group.sources.size());
+        bool rescaled = group.leaveOneOut && statistic != Statistic::Median;
+
+        sourceStart.push_back ((int) sourceIndex.size());
+        memberStart.push_back ((int) memberIndex.size());
+        groupLeaveOneOut.push_back (group.leaveOneOut);
+        groupOutputScale.push_back (rescaled ? norm / wholeSet : 1.0f);
+
+        numGroups++;
+    }
+
+    numPublished = std::min (numGroups, (int) options.outputIndices.size());
+    groupOutput.clear();
+
+    if (numPublished > 0)
+    {
+        groupOutput.assign (numGroups, -1);
+        std::copy (options.outputIndices.begin(), options.outputIndices.begin() + numPublished, groupOutput.begin());
+    }
+
+    buildWindows (options.channelOrder, sourceChannel);
+
+    if (mode == Mode::Sparse)
+        buildDense();
+
+    buildCosts();
+    buildSources();
+    buildAdaptive (sourceChannel, options.learnedWeights);
+}
+
+void ReferencePlan::buildWindows (const std::vector<int>& channelOrder, const std::vector<int>& sourceChannel)
+{
+    mode = Mode::Sparse;
+    windowChannels.clear();
+    windowStart.assign (1, 0);
+    windowFirst.clear();
+    windowLast.clear();
+    windowWeight.clear();
+
+    // the median, the masked mean and learned weights need every source
+    if (numGroups < minWindowGroups || statistic != Statistic::Mean || isMasked())
+        return;
+
+    int numChan = (int) channelGroup.size();
+
+    // only sources take part in the prefix sums, so channels that are
+    // used as references do not split a run
+    std::vector<int> sourceGlobal (numChan, -1);
+
+    for (size_t k = 0; k < sourceChannel.size(); k++)
+        sourceGlobal[sourceChannel[k]] = sourceIndex[k];
+
+    std::vector<int> order;
+    std::vector<int> position (numChan, -1);
+
+    auto addToOrder = [&] (int channel)
+    {
+        if (channel >= 0 && channel < numChan && sourceGlobal[channel] >= 0 && position[channel] < 0)
+        {
+            position[channel] = (int) order.size();
+            order.push_back (channel);
+        }
+    };
+
+    for (int channel : channelOrder)
+        addToOrder (channel);
+
+    for (int channel = 0; channel < numChan; channel++)
+        addToOrder (channel);
+
+    std::vector<int> first;
+    std::vector<int> last;
+    std::vector<int> start (1, 0);
+    std::vector<float> weight;
+    std::vector<int> positions;
+
+    for (int g = 0; g < numGroups; g++)
+    {
+        float groupWeight = sourceWeight[sourceStart[g]];
+        positions.clear();
+
+        for (int k = sourceStart[g]; k < sourceStart[g + 1]; k++)
+        {
+            if (sourceWeight[k] != groupWeight)
+                return;
+
+            positions.push_back (position[sourceChannel[k]]);
+        }
+
+        std::sort (positions.begin(), positions.end());
+
+        for (size_t p = 0; p < positions.size(); p++)
+        {
+            if (p == 0 || positions[p] != positions[p - 1] + 1)
+            {
+                first.push_back (positions[p]);
+                last.push_back (positions[p] + 1);
+            }
+            else
+            {
+                last.back() = positions[p] + 1;
+            }
+        }
+
+        start.push_back ((int) first.size());
+        weight.push_back (groupWeight);
+    }
+
+    // every tile adds each channel once into the prefix sums, then reads
+    // two of them per run
+    long long windowLoads = (long long) order.size() + 2 * (long long) first.size();
+
+    if (windowLoads * minWindowSpeedup > getNumNonZeros())
+        return;
+
+    for (int channel : order)
+        windowChannels.push_back (sourceGlobal[channel]);
+
+    windowStart = start;
+    windowFirst = first;
+    windowLast = last;
+    windowWeight = weight;
+
+    mode = Mode::Window;
+}
+
+void ReferencePlan::buildDense()
+{
+    mode = Mode::Sparse;
+    denseSources.clear();
+    denseWeights.clear();
+
+    // the median and the masked mean need the sources group by group
+    if (numGroups < minDenseGroups || statistic == Statistic::Median || isMasked())
+        return;
+
+    denseSources = sourceIndex;
+    std::sort (denseSources.begin(), denseSources.end());
+    denseSources.erase (std::unique (denseSources.begin(), denseSources.end()), denseSources.end());
+
+    int numSources = (int) denseSources.size();
+
+    if (getNumNonZeros() < denseDensityThreshold * float (numGroups) * float (numSources))
+    {
+        denseSources.clear();
+        return;
+    }
+
+    denseWeights.assign ((size_t) numGroups * numSources, 0.0f);
+
+    for (int g = 0; g < numGroups; g++)
+    {
+        for (int k = sourceStart[g]; k < sourceStart[g + 1]; k++)
+        {
+            int column = int (std::lower_bound (denseSources.begin(), denseSources.end(), sourceIndex[k]) - denseSources.begin());
+            denseWeights[(size_t) g * numSources + column] = sourceWeight[k];
+        }
+    }
+
+    mode = Mode::Dense;
+}
+
+void ReferencePlan::buildCosts()
+{
+    groupCostEnd.assign (numGroups + 1, 0);
+
+    for (int g = 0; g < numGroups; g++)
+    {
+        int numSources = sourceStart[g + 1] - sourceStart[g];
+
+        if (mode == Mode::Dense)
+            numSources = (int) denseSources.size();
+        else if (mode == Mode::Window)
+            numSources = 2 * (windowStart[g + 1] - windowStart[g]);
+
+        // a published reference costs about as much as one more member
+        int numMembers = memberStart[g + 1] - memberStart[g] + (g < numPublished ? 1 : 0);
+
+        groupCostEnd[g + 1] = groupCostEnd[g] + numSources + numMembers;
+    }
+}
+
+void ReferencePlan::buildSources()
+{
+    std::vector<int> sources = sourceIndex;
+    std::sort (sources.begin(), sources.end());
+    sources.erase (std::unique (sources.begin(), sources.end()), sources.end());
+
+    std::vector<int> members = memberIndex;
+    std::sort (members.begin(), members.end());
+
+    snapshotSources.clear();
+    directSources.clear();
+
+    for (int source : sources)
+    {
+        // a single group computes its whole reference before it modifies
+        // any member, so it can always read the buffer in place
+        if (numGroups > 1 && std::binary_search (members.begin(), members.end(), source))
+            snapshotSources.push_back (source);
+        else
+            directSources.push_back (source);
+    }
+}
+
+void ReferencePlan::buildAdaptive (const std::vector<int>& sourceChannel, ReferenceMatrix* learnedWeights)
+{
+    adaptive.reset();
+
+    if (statistic != Statistic::Adaptive || numGroups == 0)
+        return;
+
+    adaptive = std::make_unique<AdaptiveWeights>();
+
+    AdaptiveWeights& state = *adaptive;
+    state.rowChannel.assign (numGroups, -1);
+
+    for (int c = 0; c < (int) channelGroup.size(); c++)
+    {
+        if (channelGroup[c] >= 0)
+            state.rowChannel[channelGroup[c]] = c;
+    }
+
+    if (mode == Mode::Dense)
+    {
+        int numSources = (int) denseSources.size();
+
+        // local channel of each dense column
+        std::vector<int> columnChannel (numSources, -1);
+
+        for (size_t k = 0; k < sourceIndex.size(); k++)
+        {
+            int column = int (std::lower_bound (denseSources.begin(), denseSources.end(), sourceIndex[k]) - denseSources.begin());
+            columnChannel[column] = sourceChannel[k];
+        }
+
+        state.weights = denseWeights;
+        state.learnable.assign (denseWeights.size(), 0.0f);
+        state.weightRow.assign (denseWeights.size(), -1);
+        state.weightColumn.assign (denseWeights.size(), -1);
+
+        for (size_t e = 0; e < denseWeights.size(); e++)
+        {
+            if (denseWeights[e] == 0.0f)
+                continue;
+
+            state.learnable[e] = 1.0f;
+            state.weightRow[e] = state.rowChannel[e / numSources];
+            state.weightColumn[e] = columnChannel[e % numSources];
+        }
+    }
+    else
+    {
+        state.weights = sourceWeight;
+        state.learnable.assign (sourceWeight.size(), 1.0f);
+        state.weightRow.resize (sourceWeight.size());
+        state.weightColumn = sourceChannel;
+
+        for (int g = 0; g < numGroups; g++)
+        {
+            for (int k = sourceStart[g]; k < sourceStart[g + 1]; k++)
+                state.weightRow[k] = state.rowChannel[g];
+        }
+    }
+
+    if (learnedWeights != nullptr)
+    {
+        for (size_t e = 0; e < state.weights.size(); e++)
+        {
+            int row = state.weightRow[e];
+
+            int column = state.weightColumn[e];
+
+            if (column < 0 || row >= learnedWeights->getNumberOfChannels() || column >= learnedWeights->getNumberOfChannels())
+                continue;
+
+            float learned = learnedWeights->getValue (row, column);
+
+            if (learned != 0.0f)
+                state.weights[e] = learned;
+        }
+    }
+
+    state.prepare();
+}
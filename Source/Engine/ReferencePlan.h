@@ -0,0 +1,327 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEPLAN_H__
+#define __REFERENCEPLAN_H__
+
+#include "AdaptiveWeights.h"
+
+#include <memory>
+#include <vector>
+
+class ReferenceMatrix;
+
+/**
+
+  Reference plan
+
+  Compiled, read-only form of a stream's ReferenceMatrix that is walked
+  by the audio thread. It is built on the message thread whenever the
+  matrix or the stream's channels change.
+
+  Rows that select the same references are collapsed into one group, so
+  each unique reference signal is computed once per block. Groups are
+  stored in CSR layout:
+
+    sources of group g:  sourceIndex[sourceStart[g] .. sourceStart[g + 1])
+    members of group g:  memberIndex[memberStart[g] .. memberStart[g + 1])
+
+  Source and member indices are global channel indices, i.e. they address
+  the processor's AudioBuffer directly. Source weights are the matrix
+  values, already divided by the number of references or, optionally, by
+  the sum of the reference weights.
+
+  Rows of the form "all channels of a set except myself" (e.g. a common
+  average that excludes the channel itself) are merged into a single
+  leave-one-out group: the whole set is summed once and each member
+  removes its own contribution, x_m -= g * a_m * (sum - w_m * x_m), where
+  w_m = memberSelfWeight[m] and a_m = memberGain[m] corrects the
+  normalization when the members' weights differ (e.g. noise-weighted
+  references). Members of ordinary groups have a self weight of 0 and a
+  gain of 1.
+
+  Each local channel can be given a source scale, which multiplies its
+  matrix values wherever it is used as a reference; a scale of 0 leaves
+  it out entirely (see VirtualRef, which derives the scales from running
+  channel statistics).
+
+  With the median statistic, each group's reference is the per-sample
+  median of its sources (weights are ignored), and leave-one-out groups
+  remove each member from the median; see
+  ReferenceKernels::subtractLeaveOneOutMedian.
+
+  With the adaptive statistic, every referenced channel gets a group of
+  its own, without itself as a source, and its weights are learned while
+  the plan runs (see AdaptiveWeights). They start out as the normalized
+  matrix values, or as previously learned weights where those are given.
+
+  With a saturation threshold, samples at or beyond the threshold are
+  left out of the reference per sample, and the divisor shrinks with
+  them: sourceDivisor holds each source's share of the normalization
+  (1 / count, or its normalized weight), so the reference becomes
+  sum(weight * x) / sum(divisor) over the unmasked sources (see
+  ReferenceKernels::maskedWeightedSum). The threshold only applies to the
+  mean.
+
+  Local references (e.g. "all sites within a radius") give every row its
+  own set of neighbours, so neither deduplication nor the dense mode
+  help. If the sources of every group are equally weighted and form a few
+  runs of consecutive channels along the shank (channelOrder, see
+  ChannelGeometry), the plan switches to the window mode instead: each
+  tile's channels are summed once into prefix sums, and each group's
+  reference costs two loads per run, so the cost per sample grows with
+  the number of channels rather than with channels x neighbours.
+
+  If most groups reference most of the same channels, deduplication
+  cannot reduce the work and the plan switches to the dense mode: the
+  group weights are also laid out as a numGroups x denseSources matrix,
+  so the reference signals of a sample tile can be computed as one
+  cache- and register-blocked matrix product.
+
+  Each group's reference signal can also be written to an output channel
+  (outputIndices), from the same pass that computes it. A leave-one-out
+  group publishes the mean of its whole set, including every member,
+  which is the signal the members' own references are derived from.
+
+  Sources that are also members of a group are rewritten while other
+  groups may still read them, so they are listed in snapshotSources and
+  read from an unmodified copy (see ReferenceSnapshot). All other sources
+  are read directly from the buffer.
+
+  @see ReferenceMatrix, VirtualRef
+
+*/
+
+class ReferencePlan
+{
+public:
+    /** How the reference signals are computed */
+    enum class Mode
+    {
+        Sparse = 0,
+        Dense,
+        Window
+    };
+
+    /** How the matrix values of a row are normalized */
+    enum class Normalization
+    {
+        Count = 0, /**< divided by the number of references */
+        Sum /**< divided by the sum of the weights (weighted mean) */
+    };
+
+    /** How the reference signal of a group is computed from its sources */
+    enum class Statistic
+    {
+        Mean = 0, /**< weighted average */
+        Median, /**< common median reference */
+        Adaptive /**< weights learned per channel (normalized LMS) */
+    };
+
+    /** Minimum fraction of nonzero group weights for the dense mode */
+    static constexpr float denseDensityThreshold = 0.5f;
+
+    /** Minimum number of groups for the dense mode */
+    static constexpr int minDenseGroups = 8;
+
+    /** Number of samples per tile in the sparse mode */
+    static constexpr int sparseTileSamples = 512;
+
+    /** Number of samples per tile in the dense mode */
+    static constexpr int denseTileSamples = 128;
+
+    /** Number of sources accumulated per pass in the dense mode */
+    static constexpr int denseSourceBlock = 256;
+
+    /** Minimum number of groups for the window mode */
+    static constexpr int minWindowGroups = 8;
+
+    /** Factor by which the window mode must reduce the loads per sample
+        compared to the sparse mode */
+    static constexpr int minWindowSpeedup = 2;
+
+    /** Number of samples per tile in the window mode */
+    static constexpr int windowTileSamples = 128;
+
+    /** Settings that control how a matrix is compiled */
+    struct Options
+    {
+        Normalization normalization = Normalization::Count;
+        Statistic statistic = Statistic::Mean;
+
+        /** Amplitude at or beyond which samples are masked, 0 = off */
+        float saturationThreshold = 0.0f;
+
+        /** Factor applied to the matrix values of each local channel
+            wherever it is used as a reference (0 leaves it out). Empty
+            means a factor of 1 for every channel. */
+        std::vector<float> sourceScale;
+
+        /** Weights to start from with the adaptive statistic, by row and
+            reference channel (e.g. learned by a previous plan). Missing
+            entries start from the normalized matrix values. */
+        ReferenceMatrix* learnedWeights = nullptr;
+
+        /** Local channels in their order along the shank(s), for the
+            window mode. Channels that are not listed follow in index
+            order; empty means index order. */
+        std::vector<int> channelOrder;
+
+        /** Global index of the channel that receives the reference signal
+            of each group, in group order. Groups beyond the list are not
+            published; empty publishes nothing. */
+        std::vector<int> outputIndices;
+    };
+
+    /** Constructor */
+    ReferencePlan();
+
+    /** Compiles the plan from a reference matrix. globalIndices maps each
+        local channel index of the stream to its global channel index. */
+    void build (ReferenceMatrix* matrix,
+                const std::vector<int>& globalIndices,
+                const Options& options);
+
+    /** Compiles the plan with the default options */
+    void build (ReferenceMatrix* matrix, const std::vector<int>& globalIndices);
+
+    /** Returns the number of unique reference groups */
+    int getNumGroups() const { return numGroups; }
+
+    /** Returns the total number of nonzero reference weights across all groups */
+    int getNumNonZeros() const { return (int) sourceIndex.size(); }
+
+    /** Returns true if no channel of the stream is referenced */
+    bool isEmpty() const { return numGroups == 0; }
+
+    /** Returns the execution mode chosen for this plan */
+    Mode getMode() const { return mode; }
+
+    /** Returns the statistic used for the reference signals */
+    Statistic getStatistic() const { return statistic; }
+
+    /** Returns the amplitude at or beyond which samples are left out of
+        the reference, or 0 if nothing is masked */
+    float getSaturationThreshold() const { return saturationThreshold; }
+
+    /** Returns true if saturated samples are masked out of the reference */
+    bool isMasked() const { return saturationThreshold > 0.0f; }
+
+    /** Returns the number of groups whose reference signal is published */
+    int getNumPublished() const { return numPublished; }
+
+    std::vector<int> sourceStart;
+    std::vector<int> sourceIndex;
+    std::vector<float> sourceWeight;
+
+    /** Share of each source in the normalization, used when masking */
+    std::vector<float> sourceDivisor;
+
+    std::vector<int> memberStart;
+    std::vector<int> memberIndex;
+
+    /** True for leave-one-out groups */
+    std::vector<bool> groupLeaveOneOut;
+
+    /** Weight of each member's own channel in its leave-one-out group, 0 otherwise */
+    std::vector<float> memberSelfWeight;
+
+    /** Share of each member's own channel in the normalization of its
+        leave-one-out group, 0 otherwise */
+    std::vector<float> memberSelfDivisor;
+
+    /** Factor that turns the group's normalization into the member's own,
+        1 unless the members of a leave-one-out group have different weights */
+    std::vector<float> memberGain;
+
+    /** Group of each local channel, or -1 if the channel is not referenced */
+    std::vector<int> channelGroup;
+
+    /** Running sum of the per-group cost (sources + members), with
+        groupCostEnd[0] = 0. Used to split the groups into balanced jobs. */
+    std::vector<int> groupCostEnd;
+
+    /** Distinct source channels (global indices), used in the dense mode */
+    std::vector<int> denseSources;
+
+    /** Row-major numGroups x denseSources.size() weights, used in the dense mode */
+    std::vector<float> denseWeights;
+
+    /** Source channels (global indices) in shank order, used in the window mode */
+    std::vector<int> windowChannels;
+
+    /** Runs of each group, as half-open ranges of positions in
+        windowChannels, used in the window mode:
+        runs of group g:  [windowFirst[r], windowLast[r]) for r in
+                          windowStart[g] .. windowStart[g + 1] */
+    std::vector<int> windowStart;
+    std::vector<int> windowFirst;
+    std::vector<int> windowLast;
+
+    /** The common weight of each group's sources, used in the window mode */
+    std::vector<float> windowWeight;
+
+    /** Distinct sources (global indices) that must be read from a copy of the input */
+    std::vector<int> snapshotSources;
+
+    /** Distinct sources (global indices) that can be read from the buffer in place */
+    std::vector<int> directSources;
+
+    /** Output channel (global index) of each group, or -1 if its reference
+        signal is not published. Empty if nothing is published. */
+    std::vector<int> groupOutput;
+
+    /** Factor that turns a group's normalized sum into the published
+        signal, 1 except for leave-one-out groups, whose sum is
+        normalized as for one of their members */
+    std::vector<float> groupOutputScale;
+
+    /** Learned weights, only with the adaptive statistic */
+    std::unique_ptr<AdaptiveWeights> adaptive;
+
+private:
+    /** Switches to the window mode if the groups are runs of consecutive
+        channels. sourceChannel holds the local channel of each source. */
+    void buildWindows (const std::vector<int>& channelOrder, const std::vector<int>& sourceChannel);
+
+    /** Switches to the dense mode if the groups are dense enough */
+    void buildDense();
+
+    /** Fills groupCostEnd for the selected mode */
+    void buildCosts();
+
+    /** Splits the sources into snapshotSources and directSources */
+    void buildSources();
+
+    /** Lays out the adaptive weights for the selected mode. sourceChannel
+        holds the local channel of each source. */
+    void buildAdaptive (const std::vector<int>& sourceChannel, ReferenceMatrix* learnedWeights);
+
+    int numGroups;
+    int numPublished;
+    Mode mode;
+    Statistic statistic;
+    float saturationThreshold;
+};
+
+#endif //__REFERENCEPLAN_H__
@@ -0,0 +1,132 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferencePreset.h"
+#include "ReferenceMatrix.h"
+
+#include <algorithm>
+
+ReferencePreset::ReferencePreset (Scope scope_, bool includeSelf_)
+    : scope (scope_),
+      includeSelf (includeSelf_),
+      groupSize (4),
+      weight (1.0f)
+{
+}
+
+std::vector<int> ReferencePreset::consecutiveBanks (int numChannels, int bankSize)
+{
+    std::vector<int> bank (std::max (0, numChannels));
+
+    for (int c = 0; c < numChannels; c++)
+        bank[c] = bankSize > 0 ? c / bankSize : 0;
+
+    return bank;
+}
+
+void ReferencePreset::apply (ReferenceMatrix* matrix, int numChannels) const
+{
+    int nChannels = matrix->getNumberOfChannels();
+    numChannels = std::min (std::max (0, numChannels), nChannels);
+
+    int size = std::max (1, groupSize);
+
+    auto bankOf = [this] (int channel)
+    {
+        return channel < (int) channelBank.size() ? std::max (-1, channelBank[channel]) : -1;
+    };
+
+    // members of each bank, in channel order; bank -1 is stored last
+    int numBanks = 0;
+
+    for (int c = 0; c < numChannels; c++)
+        numBanks = std::max (numBanks, bankOf (c) + 1);
+
+    std::vector<std::vector<int>> bankMembers (numBanks + 1);
+
+    for (int c = 0; c < numChannels; c++)
+    {
+        int bank = bankOf (c);
+        bankMembers[bank >= 0 ? bank : numBanks].push_back (c);
+    }
+
+    std::vector<ReferenceMatrix::Reference> row;
+
+    for (int c = 0; c < numChannels; c++)
+    {
+        int bank = bankOf (c);
+        const std::vector<int>& members = bankMembers[bank >= 0 ? bank : numBanks];
+
+        int group = c / size;
+        int target = group;
+
+        if (scope == Scope::NextGroup)
+        {
+            // the nearest later group with channels in the same bank, or
+            // else the nearest earlier one
+            auto later = std::upper_bound (members.begin(), members.end(), (group + 1) * size - 1);
+
+            if (later != members.end())
+                target = *later / size;
+            else
+            {
+                auto earlier = std::lower_bound (members.begin(), members.end(), group * size);
+                target = earlier != members.begin() ? *(earlier - 1) / size : group;
+            }
+        }
+
+        row.clear();
+
+        if (scope != Scope::None && ! (scope == Scope::NextGroup && target == group))
+        {
+            // group and bank members are both sorted, so the group is one
+            // range of the bank
+            auto first = members.begin();
+            auto last = members.end();
+
+            if (scope == Scope::OwnGroup || scope == Scope::NextGroup)
+            {
+                first = std::lower_bound (members.begin(), members.end(), target * size);
+                last = std::lower_bound (first, members.end(), (target + 1) * size);
+            }
+
+            for (auto it = first; it != last; it++)
+            {
+                int channel = *it;
+
+                if (scope == Scope::OtherGroups && channel / size == group)
+                    continue;
+
+                if (channel == c && ! includeSelf)
+                    continue;
+
+                row.push_back ({ channel, weight });
+            }
+        }
+
+        matrix->setReferences (c, row);
+    }
+
+    for (int c = numChannels; c < nChannels; c++)
+        matrix->clearChannel (c);
+}
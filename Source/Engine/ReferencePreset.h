@@ -0,0 +1,90 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEPRESET_H__
+#define __REFERENCEPRESET_H__
+
+#include <vector>
+
+class ReferenceMatrix;
+
+/**
+
+  Reference preset
+
+  Generates the rows of a ReferenceMatrix from a few parameters instead of
+  channel by channel. Channels are wired in groups of groupSize
+  consecutive channels (1 = single channels, 2 = stereotrodes,
+  4 = tetrodes, ...), and references never cross a bank (e.g. a shank or
+  a headstage), given as one bank index per channel.
+
+  Each row is built in order and assigned in one go, so applying a preset
+  costs one write per selected reference, and never searches or shifts
+  a row.
+
+  @see ReferenceMatrix, VirtualRefDisplay
+
+*/
+
+class ReferencePreset
+{
+public:
+    /** Which channels of its bank a channel is referenced to */
+    enum class Scope
+    {
+        None = 0, /**< no references */
+        AllChannels, /**< all channels of the bank */
+        OwnGroup, /**< the channels of its own group */
+        OtherGroups, /**< all channels of the bank outside its own group */
+        NextGroup /**< the channels of the next group (the previous one for the last group) */
+    };
+
+    /** Constructor */
+    ReferencePreset (Scope scope = Scope::None, bool includeSelf = false);
+
+    Scope scope;
+
+    /** True if a channel references itself where its scope covers it */
+    bool includeSelf;
+
+    /** Number of consecutive channels per group */
+    int groupSize;
+
+    /** Bank of each channel; channels beyond the list, or with a negative
+        bank, are one bank together. Empty means a single bank. */
+    std::vector<int> channelBank;
+
+    /** Weight of every reference */
+    float weight;
+
+    /** Replaces the references of the first numChannels rows of the matrix.
+        Channels beyond numChannels are neither referenced nor used as
+        references. */
+    void apply (ReferenceMatrix* matrix, int numChannels) const;
+
+    /** Returns the bank of each channel for banks of bankSize consecutive
+        channels */
+    static std::vector<int> consecutiveBanks (int numChannels, int bankSize);
+};
+
+#endif //__REFERENCEPRESET_H__
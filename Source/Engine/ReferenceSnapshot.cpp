@@ -0,0 +1,75 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceSnapshot.h"
+#include "ReferencePlan.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+ReferenceSnapshot::ReferenceSnapshot()
+    : rows (nullptr),
+      rowStride (0),
+      numRows (0)
+{
+}
+
+void ReferenceSnapshot::prepare (int maxChannels, int maxBlockSamples, int numGlobalChannels)
+{
+    const int floatsPerLine = alignment / (int) sizeof (float);
+
+    // every row starts on a cache line
+    rowStride = (std::max (1, maxBlockSamples) + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+    numRows = std::max (0, maxChannels);
+
+    memory.assign ((size_t) rowStride * numRows + floatsPerLine, 0.0f);
+
+    uintptr_t address = reinterpret_cast<uintptr_t> (memory.data());
+    uintptr_t aligned = (address + alignment - 1) & ~uintptr_t (alignment - 1);
+    rows = memory.data() + (aligned - address) / sizeof (float);
+
+    sourcePointers.assign (numGlobalChannels, nullptr);
+}
+
+const float* const* ReferenceSnapshot::capture (const ReferencePlan* plan, const float* const* channels, int numSamples)
+{
+    numSamples = std::min (numSamples, rowStride);
+
+    int row = 0;
+
+    for (int source : plan->snapshotSources)
+    {
+        if (row == numRows)
+            break;
+
+        float* copy = rows + (size_t) row++ * rowStride;
+        memcpy (copy, channels[source], (size_t) numSamples * sizeof (float));
+        sourcePointers[source] = copy;
+    }
+
+    for (int source : plan->directSources)
+        sourcePointers[source] = channels[source];
+
+    return sourcePointers.data();
+}
@@ -0,0 +1,72 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCESNAPSHOT_H__
+#define __REFERENCESNAPSHOT_H__
+
+#include <vector>
+
+class ReferencePlan;
+
+/**
+
+  Reference snapshot
+
+  Unmodified copy of the source channels of one stream, taken before
+  the stream is referenced in place.
+
+  Only the plan's snapshotSources are copied, each into its own 64-byte
+  aligned row of preallocated memory; every other source is read directly
+  from the buffer. capture() returns source pointers indexed by global
+  channel index that can be passed to the ReferenceEngine.
+
+  @see ReferencePlan, ReferenceEngine
+
+*/
+
+class ReferenceSnapshot
+{
+public:
+    /** Constructor */
+    ReferenceSnapshot();
+
+    /** Allocates room for maxChannels rows of maxBlockSamples samples.
+        numGlobalChannels is the size of the processor's AudioBuffer. */
+    void prepare (int maxChannels, int maxBlockSamples, int numGlobalChannels);
+
+    /** Copies the plan's snapshot sources and returns the source pointers.
+        Does not allocate. */
+    const float* const* capture (const ReferencePlan* plan, const float* const* channels, int numSamples);
+
+private:
+    static constexpr int alignment = 64;
+
+    std::vector<float> memory;
+    float* rows;
+    int rowStride;
+    int numRows;
+
+    std::vector<const float*> sourcePointers;
+};
+
+#endif //__REFERENCESNAPSHOT_H__
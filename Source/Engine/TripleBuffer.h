@@ -0,0 +1,102 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __TRIPLEBUFFER_H__
+#define __TRIPLEBUFFER_H__
+
+#include <atomic>
+
+/**
+
+  Triple buffer
+
+  Hands values from one writer thread (typically the audio thread) to
+  one reader thread without locks. The writer owns one slot and the
+  reader another; the third is exchanged atomically, together with a flag
+  that marks it as new. Neither side ever waits, and the reader always
+  gets the most recently published value.
+
+  Values should be sized before use (e.g. with reset()), so that filling
+  the write slot does not allocate.
+
+  @see ChannelStatistics, AdaptiveWeights
+
+*/
+
+template <typename T>
+class TripleBuffer
+{
+public:
+    /** Constructor */
+    TripleBuffer()
+        : writeIndex (0),
+          readIndex (2),
+          sharedIndex (1)
+    {
+    }
+
+    /** Sets every slot to value and forgets any unread one. Must not be
+        called while either side is in use. */
+    void reset (const T& value)
+    {
+        for (auto& slot : slots)
+            slot = value;
+
+        writeIndex = 0;
+        readIndex = 2;
+        sharedIndex.store (1);
+    }
+
+    /** Returns the slot that the writer fills next */
+    T& getWriteSlot() { return slots[writeIndex]; }
+
+    /** Hands the write slot to the reader */
+    void publish()
+    {
+        writeIndex = sharedIndex.exchange (writeIndex | freshFlag, std::memory_order_acq_rel) & ~freshFlag;
+    }
+
+    /** Takes the most recently published slot, if there is one that the
+        reader has not seen yet. Returns false otherwise. */
+    bool acquire()
+    {
+        if ((sharedIndex.load (std::memory_order_relaxed) & freshFlag) == 0)
+            return false;
+
+        readIndex = sharedIndex.exchange (readIndex, std::memory_order_acq_rel) & ~freshFlag;
+        return true;
+    }
+
+    /** Returns the slot last taken by acquire() */
+    const T& getReadSlot() const { return slots[readIndex]; }
+
+private:
+    static constexpr int freshFlag = 4;
+
+    T slots[3];
+    int writeIndex;
+    int readIndex;
+    std::atomic<int> sharedIndex;
+};
+
+#endif //__TRIPLEBUFFER_H__
@@ -22,21 +22,30 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "VirtualRef.h"
+#include "Engine/ReferenceKernels.h"
 #include "VirtualRefEditor.h"
 #include <stdio.h>
 
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
-
 VirtualRef::VirtualRef()
     : GenericProcessor ("Virtual Ref"),
-      channelBuffer (1, BUFFER_SIZE),
-      avgBuffer (1, BUFFER_SIZE),
-      globalGain (1.0f)
+      acquisitionActive (false),
+      timingLogEnabled (false),
+      globalGain (1.0f),
+      numThreads (1),
+      maxBlockSamples (BUFFER_SIZE),
+      asynchronous (false),
+      normalizeBySum (false),
+      loadingSettings (false)
 {
+    LOGD ("Virtual Ref kernels: ", ReferenceKernels::getInstructionSetName (ReferenceKernels::getInstructionSet()));
 }
 
 VirtualRef::~VirtualRef()
 {
+    if (settingsLoader.joinable())
+        settingsLoader.join();
+
+    delete loadedSettings.exchange (nullptr);
 }
 
 AudioProcessorEditor* VirtualRef::createEditor()
@@ -47,312 +56,1579 @@ AudioProcessorEditor* VirtualRef::createEditor()
 
 void VirtualRef::updateSettings()
 {
+    collectLearnedWeights();
+
+    streamContexts.clear();
+
     for (auto stream : getDataStreams())
     {
-        int numChannels = (stream->getChannelCount() > 128) ? 128 : stream->getChannelCount();
+        int numChannels = stream->getChannelCount();
+
+        auto refMat = refMatMap.find (stream->getKey());
+
+        if (refMat == refMatMap.end())
+            refMatMap.emplace (stream->getKey(), std::make_unique<ReferenceMatrix> (numChannels));
+        else if (refMat->second->getNumberOfChannels() != numChannels)
+            refMat->second->setNumberOfChannels (numChannels);
+
+        auto context = std::make_unique<StreamContext>();
+        context->streamId = stream->getStreamId();
+        context->sampleRate = stream->getSampleRate();
+        context->enabled = (bool) (*stream)["enable_stream"];
+        context->monitored = badChannelMap[stream->getKey()] != BadChannelMode::Off;
+
+        // an assessment only applies to the channels it was made for
+        auto assessment = assessmentMap.find (stream->getKey());
 
-        refMatMap.emplace (stream->getKey(), std::make_unique<ReferenceMatrix> (numChannels));
+        if (assessment != assessmentMap.end() && (int) assessment->second.quality.size() != numChannels)
+            assessmentMap.erase (assessment);
+
+        // and so do learned weights
+        auto learned = learnedMap.find (stream->getKey());
+
+        if (learned != learnedMap.end() && learned->second->getNumberOfChannels() != numChannels)
+            learnedMap.erase (learned);
+
+        // a probe map is kept while the stream's channel count matches
+        auto probeMap = probeMaps.find (stream->getKey());
+
+        if (probeMap != probeMaps.end() && (int) probeMap->second.size() != numChannels)
+            probeMaps.erase (probeMap);
+
+        for (auto channel : stream->getContinuousChannels())
+            context->globalIndices.push_back (channel->getGlobalIndex());
+
+        streamContexts.push_back (std::move (context));
 
         if (editor != nullptr)
         {
             editor->updateVisualizer();
         }
     }
+
+    rebuildReferencePlans();
+
+    // the reference channels follow the groups of the plans just built,
+    // which then have to be told where to write
+    if (addReferenceChannels())
+        rebuildReferencePlans();
+
+    prepareEngine();
 }
 
-void VirtualRef::process (AudioBuffer<float>& buffer)
+bool VirtualRef::addReferenceChannels()
 {
-    // loop through the streams
-    for (auto stream : getDataStreams())
+    bool added = false;
+
+    for (int i = 0; i < (int) streamContexts.size(); i++)
     {
-        if ((*stream)["enable_stream"])
-        {
-            float* ref;
-            float refGain;
-            int numRefs;
-            int numChan = refMatMap[stream->getKey()]->getNumberOfChannels();
+        StreamContext* context = streamContexts[i].get();
+        DataStream* stream = getDataStream (context->streamId);
+        const ReferencePlan* plan = currentSettings->plans[i].get();
 
-            channelBuffer = buffer;
+        if (! publishMap[stream->getKey()] || plan->isEmpty())
+            continue;
 
-            for (int i = 0; i < numChan; i++)
-            {
-                avgBuffer.clear();
+        Array<ContinuousChannel*> inputs = stream->getContinuousChannels();
 
-                ref = refMatMap[stream->getKey()]->getChannel (i);
-                numRefs = 0;
-                for (int j = 0; j < numChan; j++)
-                {
-                    if (ref[j] > 0)
-                    {
-                        numRefs++;
-                    }
-                }
+        for (int group = 0; group < plan->getNumGroups(); group++)
+        {
+            // the members of a group are listed by their local channel
+            String members;
+            int numMembers = 0;
 
-                for (int j = 0; j < numChan; j++)
-                {
-                    if (ref[j] > 0)
-                    {
-                        refGain = 1.0f / float (numRefs);
-                        int globalChanIndex = stream->getContinuousChannels()[j]->getGlobalIndex();
-
-                        avgBuffer.addFrom (0,
-                                           0,
-                                           channelBuffer,
-                                           globalChanIndex,
-                                           0,
-                                           channelBuffer.getNumSamples(),
-                                           refGain);
-                    }
-                }
+            for (int channel = 0; channel < (int) plan->channelGroup.size(); channel++)
+            {
+                if (plan->channelGroup[channel] != group)
+                    continue;
 
-                if (numRefs > 0)
-                {
-                    int globalChanIndex = stream->getContinuousChannels()[i]->getGlobalIndex();
-
-                    buffer.addFrom (globalChanIndex, // destChannel
-                                    0, // destStartSample
-                                    avgBuffer, // source
-                                    0, // sourceChannel
-                                    0, // sourceStartSample
-                                    buffer.getNumSamples(), // numSamples
-                                    -1.0f * globalGain); // global gain to apply
-                }
+                if (numMembers < 4)
+                    members += (numMembers > 0 ? ", " : "") + inputs[channel]->getName();
+
+                numMembers++;
             }
+
+            if (numMembers > 4)
+                members += " and " + String (numMembers - 4) + " more";
+
+            ContinuousChannel::Settings channelSettings {
+                ContinuousChannel::Type::AUX,
+                "REF" + String (group + 1),
+                "Reference signal of " + members,
+                "virtualref.reference",
+                inputs[0]->getBitVolts(),
+                stream
+            };
+
+            // global indices follow the order in which channels are added
+            context->referenceIndices.push_back (continuousChannels.size());
+
+            continuousChannels.add (new ContinuousChannel (channelSettings));
+            continuousChannels.getLast()->addProcessor (processorInfo.get());
+            stream->addChannel (continuousChannels.getLast());
         }
+
+        added = true;
     }
+
+    return added;
 }
 
-ReferenceMatrix* VirtualRef::getReferenceMatrix()
+void VirtualRef::updateReferenceChannels()
 {
-    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    if (acquisitionActive)
+        return;
+
+    for (int i = 0; i < (int) streamContexts.size(); i++)
     {
-        return refMatMap[stream->getKey()].get();
+        StreamContext* context = streamContexts[i].get();
+        const ReferencePlan* plan = currentSettings->plans[i].get();
+
+        int numGroups = publishMap[currentSettings->streamKeys[i]] ? plan->getNumGroups() : 0;
+
+        if (numGroups != (int) context->referenceIndices.size())
+        {
+            CoreServices::updateSignalChain (getEditor());
+            return;
+        }
     }
-    return nullptr;
 }
 
-void VirtualRef::setGlobalGain (float value)
+void VirtualRef::prepareEngine()
 {
-    globalGain = value;
-}
+    // a stream can have at most one group per channel
+    int maxGroups = 0;
 
-float VirtualRef::getGlobalGain()
-{
-    return globalGain;
-}
+    for (auto& refMat : refMatMap)
+        maxGroups = jmax (maxGroups, refMat.second->getNumberOfChannels());
 
-void VirtualRef::saveCustomParametersToXml (XmlElement* xml)
-{
-    xml->setAttribute ("Type", "VirtualRef");
-    xml->setAttribute ("GlobalGain", getGlobalGain());
+    engine.prepare (numThreads, (int) streamContexts.size(), maxGroups, asynchronous);
 
-    for (auto stream : getDataStreams())
+    // the host's block size is only known once playback has been prepared;
+    // longer blocks are still handled, in chunks of maxBlockSamples
+    maxBlockSamples = getBlockSize() > 0 ? getBlockSize() : BUFFER_SIZE;
+
+    int numGlobalChannels = 0;
+
+    for (auto& context : streamContexts)
     {
-        String streamKey = stream->getKey();
-        XmlElement* streamXml = xml->createNewChildElement ("STREAM");
-        streamXml->setAttribute ("Key", streamKey);
+        for (int index : context->globalIndices)
+            numGlobalChannels = jmax (numGlobalChannels, index + 1);
 
-        int numChannels = refMatMap[streamKey]->getNumberOfChannels();
+        for (int index : context->referenceIndices)
+            numGlobalChannels = jmax (numGlobalChannels, index + 1);
+    }
 
-        for (int i = 0; i < numChannels; i++)
+    for (auto& context : streamContexts)
+    {
+        int numChannels = (int) context->globalIndices.size();
+
+        // statistics are evaluated over windows of one second
+        context->statistics.prepare (context->globalIndices,
+                                     (int) getDataStream (context->streamId)->getSampleRate());
+
+        if (asynchronous)
         {
-            float* ref = refMatMap[streamKey]->getChannel (i);
+            // the delay line already holds an unmodified copy of the input
+            context->snapshot.prepare (0, 0, 0);
+            // reference channels are delayed with the stream, so they
+            // line up with the channels they were computed from
+            std::vector<int> delayedIndices = context->globalIndices;
+            delayedIndices.insert (delayedIndices.end(), context->referenceIndices.begin(), context->referenceIndices.end());
 
-            XmlElement* channelXml = streamXml->createNewChildElement ("CHANNEL");
-            channelXml->setAttribute ("Index", i + 1);
-            for (int j = 0; j < numChannels; j++)
-            {
-                if (ref[j] > 0)
-                {
-                    XmlElement* refXml = channelXml->createNewChildElement ("REFERENCE");
-                    refXml->setAttribute ("Index", j + 1);
-                    refXml->setAttribute ("Value", ref[j]);
-                }
-            }
+            context->delayLine = std::make_unique<ReferenceDelayLine>();
+            context->delayLine->prepare (delayedIndices, numGlobalChannels, maxBlockSamples);
+        }
+        else
+        {
+            context->snapshot.prepare (numChannels, maxBlockSamples, numGlobalChannels);
+            context->delayLine.reset();
         }
     }
+
+    chunkPointers.assign (numGlobalChannels, nullptr);
+
+    jobSeconds.assign (streamContexts.size(), 0.0);
+    monitor.prepare ((int) streamContexts.size());
+
+    setLatencySamples (asynchronous ? maxBlockSamples : 0);
+
+    if (asynchronous)
+        LOGC ("Virtual Ref adds ", maxBlockSamples, " samples of latency in asynchronous mode; sample numbers and timestamps are shifted to match");
 }
 
-void VirtualRef::loadCustomParametersFromXml (XmlElement* customParamsXml)
+std::shared_ptr<const ReferencePlan> VirtualRef::buildReferencePlan (int streamIndex)
 {
-    float globGain = (float) customParamsXml->getDoubleAttribute ("GlobalGain", 1.0f);
-    setGlobalGain (globGain);
+    StreamContext* context = streamContexts[streamIndex].get();
+    String streamKey = getDataStream (context->streamId)->getKey();
+    ReferenceMatrix* refMat = refMatMap[streamKey].get();
 
-    for (auto streamXml : customParamsXml->getChildWithTagNameIterator ("STREAM"))
-    {
-        String streamKey = streamXml->getStringAttribute ("Key", String());
+    std::vector<int> globalIndices (context->globalIndices.begin(),
+                                    context->globalIndices.begin() + refMat->getNumberOfChannels());
 
-        if (streamKey.isEmpty() || refMatMap.find (streamKey) == refMatMap.end())
-            continue;
+    ReferencePlan::Options options;
+    options.normalization = normalizeBySum ? ReferencePlan::Normalization::Sum : ReferencePlan::Normalization::Count;
+    options.statistic = statisticMap[streamKey];
+    options.saturationThreshold = saturationMap[streamKey];
+    options.sourceScale = getSourceScale (streamKey);
+    options.channelOrder = getStreamGeometry (getDataStream (context->streamId)).getShankOrder();
+    options.outputIndices = context->referenceIndices;
 
-        LOGD ("Loading references for stream: " + streamKey);
+    // noise weights only make sense as a weighted mean
+    if (badChannelMap[streamKey] == BadChannelMode::Weight)
+        options.normalization = ReferencePlan::Normalization::Sum;
 
-        refMatMap[streamKey]->clear();
+    // adaptive references continue from the weights learned so far
+    auto learned = learnedMap.find (streamKey);
 
-        for (auto channelXml : streamXml->getChildWithTagNameIterator ("CHANNEL"))
-        {
-            int channelIndex = channelXml->getIntAttribute ("Index");
+    if (learned != learnedMap.end())
+        options.learnedWeights = learned->second.get();
 
-            for (auto refXml : channelXml->getChildWithTagNameIterator ("REFERENCE"))
-            {
-                int refIndex = refXml->getIntAttribute ("Index");
-                float gain = (float) refXml->getDoubleAttribute ("Value");
-                refMatMap[streamKey]->setValue (channelIndex - 1, refIndex - 1, gain);
-            }
-        }
+    auto plan = std::make_shared<ReferencePlan>();
+    plan->build (refMat, globalIndices, options);
+
+    if (plan->adaptive != nullptr)
+    {
+        auto stepSize = stepSizeMap.find (streamKey);
+
+        plan->adaptive->setStepSize (stepSize != stepSizeMap.end() ? stepSize->second : AdaptiveWeights::defaultStepSize);
+        plan->adaptive->setFrozen (frozenMap[streamKey]);
     }
 
-    getEditor()->updateVisualizer();
+    return plan;
 }
 
-/* -----------------------------------------------------------------
-ReferenceMatrix
------------------------------------------------------------------ */
+std::vector<float> VirtualRef::getSourceScale (const String& streamKey)
+{
+    std::vector<float> scale;
+
+    BadChannelMode mode = badChannelMap[streamKey];
+    auto assessment = assessmentMap.find (streamKey);
+
+    if (mode == BadChannelMode::Off || assessment == assessmentMap.end())
+        return scale;
+
+    if (mode == BadChannelMode::Weight)
+        return assessment->second.noiseWeight;
 
-ReferenceMatrix::ReferenceMatrix (int nChan)
+    for (auto quality : assessment->second.quality)
+        scale.push_back (quality == ChannelStatistics::Quality::Good ? 1.0f : 0.0f);
+
+    return scale;
+}
+
+void VirtualRef::rebuildReferencePlans()
 {
-    nChannels = nChan;
-    nChannelsBefore = -1;
-    values = nullptr;
-    update();
+    auto next = std::make_unique<ReferenceSettings>();
+    next->globalGain = globalGain;
+
+    for (int i = 0; i < (int) streamContexts.size(); i++)
+    {
+        next->plans.push_back (buildReferencePlan (i));
+        next->streamKeys.push_back (getDataStream (streamContexts[i]->streamId)->getKey());
+    }
+
+    publishSettings (std::move (next));
 }
 
-ReferenceMatrix::~ReferenceMatrix()
+void VirtualRef::updateReferencePlan()
 {
-    if (values != nullptr)
-        delete[] values;
+    if (getEditor() == nullptr)
+        return;
+
+    collectLearnedWeights();
+
+    auto next = copySettings();
+
+    for (int i = 0; i < (int) streamContexts.size(); i++)
+    {
+        if (streamContexts[i]->streamId == getEditor()->getCurrentStream())
+            next->plans[i] = buildReferencePlan (i);
+    }
+
+    publishSettings (std::move (next));
+    updateReferenceChannels();
 }
 
-void ReferenceMatrix::setNumberOfChannels (int n)
+std::unique_ptr<VirtualRef::ReferenceSettings> VirtualRef::copySettings()
 {
-    nChannels = n;
-    update();
+    if (currentSettings == nullptr)
+        return std::make_unique<ReferenceSettings>();
+
+    return std::make_unique<ReferenceSettings> (*currentSettings);
 }
 
-int ReferenceMatrix::getNumberOfChannels()
+void VirtualRef::publishSettings (std::unique_ptr<ReferenceSettings> next)
 {
-    return nChannels;
+    settings.store (next.get());
+
+    // the audio thread may have loaded the previous snapshot up to the
+    // block that is counted after this point
+    if (currentSettings != nullptr)
+        retiredSettings.push_back ({ blockCount.load(), std::move (currentSettings) });
+
+    currentSettings = std::move (next);
+
+    reclaimSettings();
+
+    if (! retiredSettings.empty() && ! isTimerRunning())
+        startTimer (100);
 }
 
-void ReferenceMatrix::update()
+void VirtualRef::reclaimSettings()
 {
-    if (nChannels != nChannelsBefore)
-    {
-        if (values != nullptr)
-            delete[] values;
+    uint64 completed = blockCount.load();
 
-        values = new float[nChannels * nChannels];
-        for (int i = 0; i < nChannels * nChannels; i++)
-            values[i] = 0;
+    // blocks only run during acquisition
+    auto canFree = [this, completed] (const RetiredSettings& retired)
+    { return ! acquisitionActive || completed > retired.blockCount; };
 
-        nChannelsBefore = nChannels;
-    }
+    retiredSettings.erase (std::remove_if (retiredSettings.begin(), retiredSettings.end(), canFree),
+                           retiredSettings.end());
 }
 
-void ReferenceMatrix::setValue (int rowIndex, int colIndex, float value)
+void VirtualRef::timerCallback()
 {
-    if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+    reclaimSettings();
+    applyLoadedFile();
+
+    if (acquisitionActive)
     {
-        values[rowIndex * nChannels + colIndex] = value;
+        assessChannels();
+        collectLearnedWeights();
+        collectTiming();
     }
-    else
+    else if (retiredSettings.empty() && ! loadingSettings)
     {
-        std::cout << "RefMatrix::setValue INDEX OUT OF BOUNDS! (rowIndex=" << rowIndex << ", colIndex=" << colIndex << ")" << std::endl;
+        stopTimer();
     }
 }
 
-float ReferenceMatrix::getValue (int rowIndex, int colIndex)
+void VirtualRef::collectLearnedWeights()
 {
-    float value = -1;
-    if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+    if (currentSettings == nullptr)
+        return;
+
+    for (size_t i = 0; i < currentSettings->plans.size(); i++)
     {
-        value = values[rowIndex * nChannels + colIndex];
-    }
+        AdaptiveWeights* adaptive = currentSettings->plans[i]->adaptive.get();
 
-    return value;
+        if (adaptive == nullptr)
+            continue;
+
+        // without acquisition, the audio thread does not touch the weights
+        if (acquisitionActive)
+        {
+            if (! adaptive->getLatest (learnedWeights))
+                continue;
+        }
+        else
+        {
+            learnedWeights = adaptive->weights;
+        }
+
+        const String& streamKey = currentSettings->streamKeys[i];
+        auto refMat = refMatMap.find (streamKey);
+
+        if (refMat == refMatMap.end())
+            continue;
+
+        int numChannels = refMat->second->getNumberOfChannels();
+        auto& learned = learnedMap[streamKey];
+
+        if (learned == nullptr || learned->getNumberOfChannels() != numChannels)
+            learned = std::make_unique<ReferenceMatrix> (numChannels);
+
+        adaptive->exportWeights (learnedWeights, learned.get());
+    }
 }
 
-float* ReferenceMatrix::getChannel (int index)
+void VirtualRef::assessChannels()
 {
-    if (index >= 0 && index < nChannels)
-        return &values[index * nChannels];
-    else
-        return nullptr;
+    std::unique_ptr<ReferenceSettings> next;
+
+    for (int i = 0; i < (int) streamContexts.size(); i++)
+    {
+        StreamContext* context = streamContexts[i].get();
+
+        if (! context->monitored || ! context->statistics.getLatest (summaries))
+            continue;
+
+        String streamKey = getDataStream (context->streamId)->getKey();
+
+        ChannelAssessment assessment;
+        ChannelStatistics::evaluate (summaries, assessment.quality, assessment.noiseWeight);
+
+        auto current = assessmentMap.find (streamKey);
+
+        if (current != assessmentMap.end() && isSameAssessment (current->second, assessment, badChannelMap[streamKey]))
+            continue;
+
+        assessmentMap[streamKey] = std::move (assessment);
+
+        if (next == nullptr)
+        {
+            collectLearnedWeights();
+            next = copySettings();
+        }
+
+        next->plans[i] = buildReferencePlan (i);
+    }
+
+    if (next == nullptr)
+        return;
+
+    publishSettings (std::move (next));
+
+    if (auto refEditor = dynamic_cast<VirtualRefEditor*> (getEditor()))
+        refEditor->updateChannelQuality();
 }
 
-bool ReferenceMatrix::allChannelReferencesActive (int index)
+bool VirtualRef::isSameAssessment (const ChannelAssessment& a, const ChannelAssessment& b, BadChannelMode mode)
 {
-    float* chan = getChannel (index);
+    if (a.quality != b.quality)
+        return false;
 
-    int nActive = 0;
+    if (mode != BadChannelMode::Weight)
+        return true;
 
-    if (chan != nullptr)
+    for (size_t c = 0; c < a.noiseWeight.size(); c++)
     {
-        for (int i = 0; i < nChannels; i++)
-        {
-            if (chan[i] > 0)
-            {
-                nActive++;
-            }
-        }
+        float larger = jmax (a.noiseWeight[c], b.noiseWeight[c]);
+
+        if (std::abs (a.noiseWeight[c] - b.noiseWeight[c]) > scaleTolerance * larger)
+            return false;
     }
 
-    return nActive == nChannels;
+    return true;
 }
 
-void ReferenceMatrix::setAll (float value)
+void VirtualRef::parameterValueChanged (Parameter* param)
 {
-    if (values != nullptr)
+    if (param->getName().equalsIgnoreCase ("enable_stream"))
     {
-        for (int i = 0; i < nChannels; i++)
+        for (auto& context : streamContexts)
         {
-            for (int j = 0; j < nChannels; j++)
-            {
-                values[i * nChannels + j] = value;
-            }
+            if (context->streamId == param->getStreamId())
+                context->enabled = (bool) param->getValue();
         }
     }
 }
 
-void ReferenceMatrix::setAll (float value, int maxChan)
+void VirtualRef::process (AudioBuffer<float>& buffer)
 {
-    if (values != nullptr)
+    // without timing, the clock is not read at all
+    bool timed = monitor.isEnabled();
+    int64 startTicks = timed ? Time::getHighResolutionTicks() : 0;
+
+    // in the asynchronous mode the previous block may still be running;
+    // once it is done, no earlier settings are read anymore. Each chunk
+    // then starts its own engine block.
+    engine.waitForBlock();
+    engine.setTimed (timed);
+
+    ++blockCount;
+    const ReferenceSettings* current = settings.load();
+
+    // no job is running, so adaptive weights can be handed over
+    for (auto& plan : current->plans)
     {
-        maxChan = MIN (nChannels, maxChan);
-        for (int i = 0; i < maxChan; i++)
-        {
-            for (int j = 0; j < maxChan; j++)
-            {
-                values[i * nChannels + j] = value;
-            }
-        }
+        if (plan->adaptive != nullptr)
+            plan->adaptive->endBlock();
+    }
+
+    // blocks that are longer than the prepared capacity are referenced in
+    // consecutive chunks
+    for (int start = 0; start < buffer.getNumSamples(); start += maxBlockSamples)
+    {
+        float* const* channels = getChunk (buffer, start);
+
+        if (asynchronous)
+            processAsynchronous (current, channels, start);
+        else
+            processSynchronous (current, channels, start);
     }
+
+    if (asynchronous)
+        shiftDelayedStreams();
+
+    if (timed)
+        recordTiming (startTicks);
 }
 
-void ReferenceMatrix::clear()
+void VirtualRef::shiftDelayedStreams()
 {
-    if (values != nullptr)
+    for (auto& context : streamContexts)
     {
-        for (int i = 0; i < nChannels; i++)
-        {
-            for (int j = 0; j < nChannels; j++)
-            {
-                values[i * nChannels + j] = 0;
-            }
-        }
+        // disabled streams are passed through without delay
+        if (! context->enabled || context->delayLine == nullptr)
+            continue;
+
+        int delay = context->delayLine->getDelaySamples();
+
+        int64 firstSample = getFirstSampleNumberForBlock (context->streamId) - delay;
+        double firstTimestamp = getFirstTimestampForBlock (context->streamId);
+
+        // a negative timestamp means the stream has none
+        if (firstTimestamp >= 0.0 && context->sampleRate > 0.0)
+            firstTimestamp -= delay / context->sampleRate;
+
+        setTimestampAndSamples (firstSample,
+                                firstTimestamp,
+                                getNumSamplesInBlock (context->streamId),
+                                context->streamId);
+    }
+}
+
+void VirtualRef::recordTiming (int64 startTicks)
+{
+    double seconds = Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks() - startTicks);
+
+    // the budget is the duration of the longest stream's block
+    double budgetSeconds = 0.0;
+    double channelSamples = 0.0;
+
+    for (auto& context : streamContexts)
+    {
+        if (! context->enabled || context->sampleRate <= 0.0)
+            continue;
+
+        int numSamples = (int) getNumSamplesInBlock (context->streamId);
+
+        budgetSeconds = jmax (budgetSeconds, numSamples / context->sampleRate);
+        channelSamples += (double) numSamples * context->globalIndices.size();
+    }
+
+    // in the asynchronous mode, these are the jobs of the previous block
+    engine.takeJobTimes (jobSeconds.data(), (int) jobSeconds.size());
+    monitor.addStreamTimes (jobSeconds.data(), (int) jobSeconds.size());
+    std::fill (jobSeconds.begin(), jobSeconds.end(), 0.0);
+
+    monitor.addBlock (seconds, budgetSeconds, channelSamples);
+}
+
+float* const* VirtualRef::getChunk (AudioBuffer<float>& buffer, int startSample)
+{
+    if (startSample == 0)
+        return buffer.getArrayOfWritePointers();
+
+    int numChannels = jmin (buffer.getNumChannels(), (int) chunkPointers.size());
+
+    for (int i = 0; i < numChannels; i++)
+        chunkPointers[i] = buffer.getWritePointer (i) + startSample;
+
+    return chunkPointers.data();
+}
+
+void VirtualRef::processSynchronous (const ReferenceSettings* current, float* const* channels, int startSample)
+{
+    engine.beginBlock();
+
+    for (size_t i = 0; i < streamContexts.size(); i++)
+    {
+        StreamContext* context = streamContexts[i].get();
+        const ReferencePlan* plan = current->plans[i].get();
+
+        int numSamples = jmin (maxBlockSamples, (int) getNumSamplesInBlock (context->streamId) - startSample);
+
+        if (numSamples <= 0)
+            continue;
+
+        clearReferenceChannels (context, context->enabled ? plan : nullptr, channels, numSamples);
+
+        if (! context->enabled || plan->isEmpty())
+            continue;
+
+        if (context->monitored)
+            context->statistics.accumulate (channels, numSamples);
+
+        // references are computed from the unmodified input
+        const float* const* sources = context->snapshot.capture (plan, channels, numSamples);
+
+        engine.addStream (plan,
+                          sources,
+                          channels,
+                          numSamples,
+                          current->globalGain,
+                          (int) i);
     }
+
+    engine.processBlock();
 }
 
-void ReferenceMatrix::print()
+void VirtualRef::clearReferenceChannels (const StreamContext* context,
+                                         const ReferencePlan* plan,
+                                         float* const* channels,
+                                         int numSamples)
 {
-    for (int i = 0; i < nChannels; i++)
+    size_t numPublished = plan != nullptr ? (size_t) plan->getNumPublished() : 0;
+
+    for (size_t r = numPublished; r < context->referenceIndices.size(); r++)
+        std::fill_n (channels[context->referenceIndices[r]], numSamples, 0.0f);
+}
+
+void VirtualRef::processAsynchronous (const ReferenceSettings* current, float* const* channels, int startSample)
+{
+    // the previous chunk has to be complete before it is emitted
+    engine.beginBlock();
+
+    for (size_t i = 0; i < streamContexts.size(); i++)
     {
-        float* chan = getChannel (i);
-        for (int j = 0; j < nChannels; j++)
+        StreamContext* context = streamContexts[i].get();
+        const ReferencePlan* plan = current->plans[i].get();
+        ReferenceDelayLine* delayLine = context->delayLine.get();
+
+        int numSamples = jmin (maxBlockSamples, (int) getNumSamplesInBlock (context->streamId) - startSample);
+
+        if (numSamples <= 0)
+            continue;
+
+        // disabled streams are passed through without delay
+        if (! context->enabled)
         {
-            std::cout << chan[j] << " ";
+            clearReferenceChannels (context, nullptr, channels, numSamples);
+            continue;
         }
-        std::cout << std::endl;
+
+        if (context->monitored)
+            context->statistics.accumulate (channels, numSamples);
+
+        // reference channels go through the delay line silenced, and the
+        // plan that emits them fills in the ones it publishes
+        clearReferenceChannels (context, nullptr, channels, numSamples);
+        delayLine->push (channels, numSamples);
+
+        if (plan->isEmpty())
+            continue;
+
+        engine.addStream (plan,
+                          delayLine->getSources(),
+                          delayLine->getOutputs(),
+                          delayLine->getBlockSamples(),
+                          current->globalGain,
+                          (int) i);
+    }
+
+    engine.startBlock();
+}
+
+bool VirtualRef::startAcquisition()
+{
+    acquisitionActive = true;
+
+    // the host may have changed its block size since updateSettings()
+    if (getBlockSize() > 0 && getBlockSize() != maxBlockSamples)
+        prepareEngine();
+
+    for (auto& context : streamContexts)
+    {
+        if (context->delayLine != nullptr)
+            context->delayLine->reset();
+
+        context->statistics.reset();
     }
-    std::cout << std::endl;
+
+    monitor.prepare ((int) streamContexts.size());
+    timingTotal.reset ((int) streamContexts.size());
+
+    // the channel statistics are evaluated for as long as acquisition runs
+    startTimer (100);
+
+    return true;
+}
+
+bool VirtualRef::stopAcquisition()
+{
+    engine.waitForBlock();
+
+    acquisitionActive = false;
+    reclaimSettings();
+
+    // keep what was learned up to the last block
+    collectLearnedWeights();
+
+    return true;
+}
+
+ReferenceMatrix* VirtualRef::getReferenceMatrix()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        return refMatMap[stream->getKey()].get();
+    }
+    return nullptr;
+}
+
+void VirtualRef::setGlobalGain (float value)
+{
+    globalGain = value;
+
+    auto next = copySettings();
+    next->globalGain = value;
+    publishSettings (std::move (next));
+}
+
+float VirtualRef::getGlobalGain()
+{
+    return globalGain;
+}
+
+void VirtualRef::setNumThreads (int value)
+{
+    numThreads = jlimit (1, 64, value);
+    prepareEngine();
+}
+
+int VirtualRef::getNumThreads()
+{
+    return numThreads;
+}
+
+void VirtualRef::setNormalizeBySum (bool value)
+{
+    normalizeBySum = value;
+
+    collectLearnedWeights();
+    rebuildReferencePlans();
+    updateReferenceChannels();
+}
+
+bool VirtualRef::getNormalizeBySum()
+{
+    return normalizeBySum;
+}
+
+void VirtualRef::setReferenceStatistic (ReferencePlan::Statistic statistic)
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        statisticMap[stream->getKey()] = statistic;
+        updateReferencePlan();
+    }
+}
+
+ReferencePlan::Statistic VirtualRef::getReferenceStatistic()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        auto statistic = statisticMap.find (stream->getKey());
+
+        if (statistic != statisticMap.end())
+            return statistic->second;
+    }
+
+    return ReferencePlan::Statistic::Mean;
+}
+
+void VirtualRef::setSaturationThreshold (float threshold)
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        saturationMap[stream->getKey()] = jmax (0.0f, threshold);
+        updateReferencePlan();
+    }
+}
+
+float VirtualRef::getSaturationThreshold()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        auto threshold = saturationMap.find (stream->getKey());
+
+        if (threshold != saturationMap.end())
+            return threshold->second;
+    }
+
+    return 0.0f;
+}
+
+void VirtualRef::setBadChannelMode (BadChannelMode mode)
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        badChannelMap[stream->getKey()] = mode;
+
+        if (mode == BadChannelMode::Off)
+            assessmentMap.erase (stream->getKey());
+
+        for (auto& context : streamContexts)
+        {
+            if (context->streamId == stream->getStreamId())
+                context->monitored = mode != BadChannelMode::Off;
+        }
+
+        updateReferencePlan();
+
+        if (auto refEditor = dynamic_cast<VirtualRefEditor*> (getEditor()))
+            refEditor->updateChannelQuality();
+    }
+}
+
+VirtualRef::BadChannelMode VirtualRef::getBadChannelMode()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        auto mode = badChannelMap.find (stream->getKey());
+
+        if (mode != badChannelMap.end())
+            return mode->second;
+    }
+
+    return BadChannelMode::Off;
+}
+
+void VirtualRef::setAdaptiveStepSize (float stepSize)
+{
+    stepSize = jmax (0.0f, stepSize);
+
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        stepSizeMap[stream->getKey()] = stepSize;
+
+        // takes effect without recompiling, so nothing is forgotten
+        if (currentSettings != nullptr)
+        {
+            for (size_t i = 0; i < currentSettings->plans.size(); i++)
+            {
+                if (currentSettings->streamKeys[i] == stream->getKey() && currentSettings->plans[i]->adaptive != nullptr)
+                    currentSettings->plans[i]->adaptive->setStepSize (stepSize);
+            }
+        }
+    }
+}
+
+float VirtualRef::getAdaptiveStepSize()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        auto stepSize = stepSizeMap.find (stream->getKey());
+
+        if (stepSize != stepSizeMap.end())
+            return stepSize->second;
+    }
+
+    return AdaptiveWeights::defaultStepSize;
+}
+
+void VirtualRef::setAdaptationFrozen (bool frozen)
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        frozenMap[stream->getKey()] = frozen;
+
+        if (currentSettings != nullptr)
+        {
+            for (size_t i = 0; i < currentSettings->plans.size(); i++)
+            {
+                if (currentSettings->streamKeys[i] == stream->getKey() && currentSettings->plans[i]->adaptive != nullptr)
+                    currentSettings->plans[i]->adaptive->setFrozen (frozen);
+            }
+        }
+    }
+}
+
+bool VirtualRef::isAdaptationFrozen()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+        return frozenMap[stream->getKey()];
+
+    return false;
+}
+
+void VirtualRef::resetAdaptiveWeights()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        learnedMap.erase (stream->getKey());
+
+        auto next = copySettings();
+
+        for (int i = 0; i < (int) streamContexts.size(); i++)
+        {
+            if (streamContexts[i]->streamId == stream->getStreamId())
+                next->plans[i] = buildReferencePlan (i);
+        }
+
+        publishSettings (std::move (next));
+    }
+}
+
+bool VirtualRef::loadProbeMap (const File& file)
+{
+    auto stream = getDataStream (getEditor()->getCurrentStream());
+
+    if (stream == nullptr)
+        return false;
+
+    var probes = JSON::parse (file)["probes"];
+
+    if (! probes.isArray())
+    {
+        LOGE ("Virtual Ref: no probes in ", file.getFullPathName());
+        return false;
+    }
+
+    // published reference channels follow the stream's own channels
+    int numChannels = refMatMap[stream->getKey()]->getNumberOfChannels();
+    std::vector<ChannelGeometry::Position> positions (numChannels, { NAN, NAN });
+    int numPlaced = 0;
+    int firstContact = 0;
+
+    for (int p = 0; p < probes.size(); p++)
+    {
+        var contacts = probes[p]["contact_positions"];
+        var wiring = probes[p]["device_channel_indices"];
+
+        if (! contacts.isArray())
+            continue;
+
+        for (int c = 0; c < contacts.size(); c++)
+        {
+            // without a wiring, the contacts of all probes are numbered in
+            // file order; unconnected contacts are wired to -1
+            int channel = wiring.isArray() ? (int) wiring[c] : firstContact + c;
+
+            if (channel < 0 || channel >= numChannels || std::isfinite (positions[channel].x))
+                continue;
+
+            positions[channel].x = (float) contacts[c][0];
+            positions[channel].y = (float) contacts[c][1];
+            numPlaced++;
+        }
+
+        firstContact += contacts.size();
+    }
+
+    if (numPlaced == 0)
+    {
+        LOGE ("Virtual Ref: ", file.getFullPathName(), " does not place any channel of ", stream->getName());
+        return false;
+    }
+
+    LOGC ("Virtual Ref: probe map places ", numPlaced, " of ", numChannels, " channels of ", stream->getName());
+
+    probeMaps[stream->getKey()] = std::move (positions);
+    updateReferencePlan();
+
+    return true;
+}
+
+void VirtualRef::clearProbeMap()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        probeMaps.erase (stream->getKey());
+        updateReferencePlan();
+    }
+}
+
+bool VirtualRef::hasProbeMap()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+        return probeMaps.find (stream->getKey()) != probeMaps.end();
+
+    return false;
+}
+
+ChannelGeometry VirtualRef::getChannelGeometry()
+{
+    return getStreamGeometry (getDataStream (getEditor()->getCurrentStream()));
+}
+
+ChannelGeometry VirtualRef::getStreamGeometry (DataStream* stream)
+{
+    ChannelGeometry geometry;
+
+    if (stream == nullptr)
+        return geometry;
+
+    int numChannels = refMatMap[stream->getKey()]->getNumberOfChannels();
+    auto probeMap = probeMaps.find (stream->getKey());
+
+    if (probeMap != probeMaps.end() && (int) probeMap->second.size() == numChannels)
+    {
+        geometry.setPositions (probeMap->second);
+        return geometry;
+    }
+
+    std::vector<ChannelGeometry::Position> positions;
+    bool hasPositions = false;
+
+    Array<ContinuousChannel*> channels = stream->getContinuousChannels();
+
+    for (int i = 0; i < numChannels; i++)
+    {
+        ContinuousChannel* channel = channels[i];
+        positions.push_back ({ channel->position.x, channel->position.y });
+        hasPositions = hasPositions || channel->position.x != 0.0f || channel->position.y != 0.0f;
+    }
+
+    // sources that do not report positions leave them all at 0
+    if (hasPositions)
+        geometry.setPositions (positions);
+    else
+        geometry.setLinearLayout (numChannels);
+
+    return geometry;
+}
+
+void VirtualRef::setTimingEnabled (bool enabled)
+{
+    monitor.setEnabled (enabled);
+}
+
+bool VirtualRef::isTimingEnabled()
+{
+    return monitor.isEnabled();
+}
+
+void VirtualRef::setTimingLogEnabled (bool enabled)
+{
+    timingLogEnabled = enabled;
+}
+
+bool VirtualRef::isTimingLogEnabled()
+{
+    return timingLogEnabled;
+}
+
+File VirtualRef::getTimingLogFile()
+{
+    return CoreServices::getRecordingParentDirectory().getChildFile ("virtual_ref_timing.csv");
+}
+
+ProcessingMonitor::Window VirtualRef::getTiming()
+{
+    return timingTotal;
+}
+
+void VirtualRef::collectTiming()
+{
+    if (! monitor.getLatest (timingWindow))
+        return;
+
+    timingTotal.add (timingWindow);
+
+    if (timingLogEnabled)
+        logTiming (timingWindow);
+
+    if (auto refEditor = dynamic_cast<VirtualRefEditor*> (getEditor()))
+        refEditor->updateTiming();
+}
+
+void VirtualRef::logTiming (const ProcessingMonitor::Window& window)
+{
+    File file = getTimingLogFile();
+    String text;
+
+    if (! file.existsAsFile() || file.getSize() == 0)
+    {
+        text += "time,blocks,median_us,p99_us,max_us,ns_per_channel_sample,budget_percent";
+
+        for (size_t s = 0; s < window.streamSeconds.size(); s++)
+            text += ",stream" + String ((int) s + 1) + "_cpu_us_per_block";
+
+        text += "\n";
+    }
+
+    ProcessingMonitor::Summary summary = ProcessingMonitor::summarize (window);
+
+    text += Time::getCurrentTime().toISO8601 (true)
+            + "," + String (summary.numBlocks)
+            + "," + String (summary.medianSeconds * 1.0e6, 1)
+            + "," + String (summary.p99Seconds * 1.0e6, 1)
+            + "," + String (summary.maxSeconds * 1.0e6, 1)
+            + "," + String (summary.nsPerChannelSample, 3)
+            + "," + String (summary.budgetFraction * 100.0, 2);
+
+    for (double seconds : window.streamSeconds)
+        text += "," + String (seconds * 1.0e6 / jmax (1, window.numBlocks), 1);
+
+    text += "\n";
+
+    if (! file.appendText (text))
+        LOGE ("Virtual Ref: could not write ", file.getFullPathName());
+}
+
+std::vector<ChannelStatistics::Quality> VirtualRef::getChannelQuality()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        auto assessment = assessmentMap.find (stream->getKey());
+
+        if (assessment != assessmentMap.end())
+            return assessment->second.quality;
+    }
+
+    return {};
+}
+
+std::vector<float> VirtualRef::getChannelScale()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+        return getSourceScale (stream->getKey());
+
+    return {};
+}
+
+void VirtualRef::setAsynchronous (bool value)
+{
+    asynchronous = value;
+    prepareEngine();
+}
+
+bool VirtualRef::isAsynchronous()
+{
+    return asynchronous;
+}
+
+bool VirtualRef::setPublishReferences (bool publish)
+{
+    if (acquisitionActive)
+    {
+        CoreServices::sendStatusMessage ("Stop acquisition before publishing references.");
+        return false;
+    }
+
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+    {
+        publishMap[stream->getKey()] = publish;
+
+        // the channels are declared when the signal chain is updated
+        CoreServices::updateSignalChain (getEditor());
+    }
+
+    return true;
+}
+
+bool VirtualRef::getPublishReferences()
+{
+    if (auto stream = getDataStream (getEditor()->getCurrentStream()))
+        return publishMap[stream->getKey()];
+
+    return false;
+}
+
+namespace
+{
+/** Writes the (1-based) channels of a row as ranges, e.g. "1-4,9,12-20" */
+String encodeChannels (const std::vector<ReferenceMatrix::Reference>& references)
+{
+    String text;
+    size_t first = 0;
+
+    while (first < references.size())
+    {
+        size_t last = first;
+
+        while (last + 1 < references.size() && references[last + 1].channel == references[last].channel + 1)
+            last++;
+
+        if (text.isNotEmpty())
+            text << ",";
+
+        text << (references[first].channel + 1);
+
+        if (last > first)
+            text << "-" << (references[last].channel + 1);
+
+        first = last + 1;
+    }
+
+    return text;
+}
+
+/** Reads the ranges written by encodeChannels, sorted and without
+    duplicates; channels beyond numChannels are left out */
+std::vector<int> decodeChannels (const String& text, int numChannels)
+{
+    std::vector<int> channels;
+
+    for (auto& range : StringArray::fromTokens (text, ",", String()))
+    {
+        int first = range.upToFirstOccurrenceOf ("-", false, false).getIntValue();
+        int last = range.containsChar ('-') ? range.fromFirstOccurrenceOf ("-", false, false).getIntValue() : first;
+
+        for (int channel = jmax (1, first); channel <= jmin (last, numChannels); channel++)
+            channels.push_back (channel - 1);
+    }
+
+    std::sort (channels.begin(), channels.end());
+    channels.erase (std::unique (channels.begin(), channels.end()), channels.end());
+
+    return channels;
+}
+
+/** Writes (1-based) channel:value pairs, e.g. "3:0.5 7:2" */
+String encodeValues (const std::vector<ReferenceMatrix::Reference>& values)
+{
+    String text;
+
+    for (auto& value : values)
+    {
+        if (text.isNotEmpty())
+            text << " ";
+
+        text << (value.channel + 1) << ":" << String (value.value);
+    }
+
+    return text;
+}
+
+/** Reads the pairs written by encodeValues into a map by channel */
+std::map<int, float> decodeValues (const String& text, int numChannels)
+{
+    std::map<int, float> values;
+
+    for (auto& pair : StringArray::fromTokens (text, " ", String()))
+    {
+        int channel = pair.upToFirstOccurrenceOf (":", false, false).getIntValue();
+
+        if (channel >= 1 && channel <= numChannels)
+            values[channel - 1] = pair.fromFirstOccurrenceOf (":", false, false).getFloatValue();
+    }
+
+    return values;
+}
+} // namespace
+
+void VirtualRef::saveCustomParametersToXml (XmlElement* xml)
+{
+    xml->setAttribute ("Type", "VirtualRef");
+    xml->setAttribute ("GlobalGain", getGlobalGain());
+    xml->setAttribute ("Threads", getNumThreads());
+    xml->setAttribute ("Asynchronous", isAsynchronous());
+    xml->setAttribute ("NormalizeBySum", getNormalizeBySum());
+    xml->setAttribute ("Timing", isTimingEnabled());
+    xml->setAttribute ("TimingLog", isTimingLogEnabled());
+
+    collectLearnedWeights();
+
+    for (auto stream : getDataStreams())
+    {
+        String streamKey = stream->getKey();
+        ReferencePlan::Statistic statistic = statisticMap[streamKey];
+        XmlElement* streamXml = xml->createNewChildElement ("STREAM");
+        streamXml->setAttribute ("Key", streamKey);
+        streamXml->setAttribute ("Statistic", statistic == ReferencePlan::Statistic::Adaptive ? "Adaptive"
+                                              : statistic == ReferencePlan::Statistic::Median ? "Median"
+                                                                                              : "Mean");
+        streamXml->setAttribute ("SaturationThreshold", saturationMap[streamKey]);
+        streamXml->setAttribute ("PublishReferences", publishMap[streamKey]);
+
+        auto stepSize = stepSizeMap.find (streamKey);
+        streamXml->setAttribute ("StepSize", stepSize != stepSizeMap.end() ? stepSize->second : AdaptiveWeights::defaultStepSize);
+        streamXml->setAttribute ("Frozen", frozenMap[streamKey]);
+
+        auto learned = learnedMap.find (streamKey);
+        ReferenceMatrix* learnedMat = learned != learnedMap.end() ? learned->second.get() : nullptr;
+
+        BadChannelMode badChannels = badChannelMap[streamKey];
+        streamXml->setAttribute ("BadChannels", badChannels == BadChannelMode::Weight    ? "Weight"
+                                                : badChannels == BadChannelMode::Exclude ? "Exclude"
+                                                                                         : "Off");
+
+        int numChannels = refMatMap[streamKey]->getNumberOfChannels();
+        auto probeMap = probeMaps.find (streamKey);
+
+        // each row is one element: its references as channel ranges, and
+        // only the values other than 1 listed separately
+        for (int i = 0; i < numChannels; i++)
+        {
+            std::vector<ReferenceMatrix::Reference> references;
+            std::vector<ReferenceMatrix::Reference> values;
+            std::vector<ReferenceMatrix::Reference> learnedValues;
+
+            for (auto& ref : refMatMap[streamKey]->getReferences (i))
+            {
+                if (ref.value <= 0)
+                    continue;
+
+                references.push_back (ref);
+
+                if (ref.value != 1.0f)
+                    values.push_back (ref);
+
+                float learnedValue = learnedMat != nullptr ? learnedMat->getValue (i, ref.channel) : 0.0f;
+
+                if (learnedValue != 0.0f)
+                    learnedValues.push_back ({ ref.channel, learnedValue });
+            }
+
+            bool hasPosition = probeMap != probeMaps.end() && i < (int) probeMap->second.size() && std::isfinite (probeMap->second[i].x);
+
+            if (references.empty() && ! hasPosition)
+                continue;
+
+            XmlElement* channelXml = streamXml->createNewChildElement ("CHANNEL");
+            channelXml->setAttribute ("Index", i + 1);
+
+            // positions from a probe map are saved with the channel
+            if (hasPosition)
+            {
+                channelXml->setAttribute ("X", probeMap->second[i].x);
+                channelXml->setAttribute ("Y", probeMap->second[i].y);
+            }
+
+            if (! references.empty())
+                channelXml->setAttribute ("References", encodeChannels (references));
+
+            if (! values.empty())
+                channelXml->setAttribute ("Values", encodeValues (values));
+
+            if (! learnedValues.empty())
+                channelXml->setAttribute ("Learned", encodeValues (learnedValues));
+        }
+    }
+}
+
+void VirtualRef::loadCustomParametersFromXml (XmlElement* customParamsXml)
+{
+    applySettings (decodeSettings (*customParamsXml, getChannelCounts()));
+}
+
+void VirtualRef::loadSettingsFile (const File& file)
+{
+    if (loadingSettings)
+    {
+        CoreServices::sendStatusMessage ("Still loading channel reference data.");
+        return;
+    }
+
+    if (settingsLoader.joinable())
+        settingsLoader.join();
+
+    loadingSettings = true;
+
+    // the decoder only sees a copy of the channel counts
+    std::map<String, int> channelCounts = getChannelCounts();
+
+    settingsLoader = std::thread ([this, file, channelCounts]
+                                  {
+                                      std::unique_ptr<LoadedSettings> loaded;
+
+                                      if (auto xml = XmlDocument::parse (file))
+                                          loaded = decodeSettings (*xml, channelCounts);
+                                      else
+                                          loaded = std::make_unique<LoadedSettings>();
+
+                                      loaded->file = file;
+                                      loadedSettings.store (loaded.release());
+                                  });
+
+    if (! isTimerRunning())
+        startTimer (100);
+}
+
+void VirtualRef::applyLoadedFile()
+{
+    std::unique_ptr<LoadedSettings> loaded (loadedSettings.exchange (nullptr));
+
+    if (loaded == nullptr)
+        return;
+
+    settingsLoader.join();
+    loadingSettings = false;
+
+    if (! loaded->isValid)
+    {
+        CoreServices::sendStatusMessage ("Could not read channel reference data from " + loaded->file.getFullPathName());
+        return;
+    }
+
+    String fileName = loaded->file.getFullPathName();
+
+    applySettings (std::move (loaded));
+    updateReferenceChannels();
+    getEditor()->updateSettings();
+
+    CoreServices::sendStatusMessage ("Loaded channel reference data from " + fileName);
+}
+
+std::map<String, int> VirtualRef::getChannelCounts()
+{
+    std::map<String, int> channelCounts;
+
+    for (auto& refMat : refMatMap)
+        channelCounts[refMat.first] = refMat.second->getNumberOfChannels();
+
+    return channelCounts;
+}
+
+std::unique_ptr<VirtualRef::LoadedSettings> VirtualRef::decodeSettings (const XmlElement& xml, const std::map<String, int>& channelCounts)
+{
+    auto loaded = std::make_unique<LoadedSettings>();
+
+    loaded->isValid = true;
+    loaded->globalGain = (float) xml.getDoubleAttribute ("GlobalGain", 1.0f);
+    loaded->numThreads = jlimit (1, 64, xml.getIntAttribute ("Threads", 1));
+    loaded->asynchronous = xml.getBoolAttribute ("Asynchronous", false);
+    loaded->normalizeBySum = xml.getBoolAttribute ("NormalizeBySum", false);
+    loaded->timing = xml.getBoolAttribute ("Timing", false);
+    loaded->timingLog = xml.getBoolAttribute ("TimingLog", false);
+
+    for (auto streamXml : xml.getChildWithTagNameIterator ("STREAM"))
+    {
+        String streamKey = streamXml->getStringAttribute ("Key", String());
+        auto channelCount = channelCounts.find (streamKey);
+
+        if (streamKey.isEmpty() || channelCount == channelCounts.end())
+            continue;
+
+        int numChannels = channelCount->second;
+
+        LoadedSettings::Stream stream;
+        stream.key = streamKey;
+
+        String statistic = streamXml->getStringAttribute ("Statistic", "Mean");
+        stream.statistic = statistic == "Adaptive" ? ReferencePlan::Statistic::Adaptive
+                           : statistic == "Median" ? ReferencePlan::Statistic::Median
+                                                   : ReferencePlan::Statistic::Mean;
+
+        stream.stepSize = jmax (0.0f, (float) streamXml->getDoubleAttribute ("StepSize", AdaptiveWeights::defaultStepSize));
+        stream.frozen = streamXml->getBoolAttribute ("Frozen", false);
+        stream.saturationThreshold = jmax (0.0f, (float) streamXml->getDoubleAttribute ("SaturationThreshold", 0.0));
+        stream.publish = streamXml->getBoolAttribute ("PublishReferences", false);
+
+        String badChannels = streamXml->getStringAttribute ("BadChannels", "Off");
+        stream.badChannels = badChannels == "Weight"    ? BadChannelMode::Weight
+                             : badChannels == "Exclude" ? BadChannelMode::Exclude
+                                                        : BadChannelMode::Off;
+
+        stream.matrix = std::make_unique<ReferenceMatrix> (numChannels);
+
+        auto learned = std::make_unique<ReferenceMatrix> (numChannels);
+        bool hasLearned = false;
+
+        std::vector<ChannelGeometry::Position> positions (numChannels, { NAN, NAN });
+        bool hasPositions = false;
+
+        for (auto channelXml : streamXml->getChildWithTagNameIterator ("CHANNEL"))
+        {
+            int channelIndex = channelXml->getIntAttribute ("Index");
+
+            if (channelIndex < 1 || channelIndex > numChannels)
+                continue;
+
+            int row = channelIndex - 1;
+
+            if (channelXml->hasAttribute ("X"))
+            {
+                positions[row].x = (float) channelXml->getDoubleAttribute ("X");
+                positions[row].y = (float) channelXml->getDoubleAttribute ("Y");
+                hasPositions = true;
+            }
+
+            if (channelXml->hasAttribute ("References"))
+            {
+                std::map<int, float> values = decodeValues (channelXml->getStringAttribute ("Values"), numChannels);
+                std::vector<ReferenceMatrix::Reference> references;
+
+                for (int channel : decodeChannels (channelXml->getStringAttribute ("References"), numChannels))
+                {
+                    auto value = values.find (channel);
+                    references.push_back ({ channel, value != values.end() ? value->second : 1.0f });
+                }
+
+                stream.matrix->setReferences (row, std::move (references));
+
+                std::vector<ReferenceMatrix::Reference> learnedValues;
+
+                for (auto& value : decodeValues (channelXml->getStringAttribute ("Learned"), numChannels))
+                    learnedValues.push_back ({ value.first, value.second });
+
+                hasLearned = hasLearned || ! learnedValues.empty();
+                learned->setReferences (row, std::move (learnedValues));
+            }
+
+            // files saved before the compact format list every reference
+            for (auto refXml : channelXml->getChildWithTagNameIterator ("REFERENCE"))
+            {
+                int refIndex = refXml->getIntAttribute ("Index");
+                float gain = (float) refXml->getDoubleAttribute ("Value");
+                stream.matrix->setValue (row, refIndex - 1, gain);
+
+                if (refXml->hasAttribute ("Learned"))
+                {
+                    learned->setValue (row, refIndex - 1, (float) refXml->getDoubleAttribute ("Learned"));
+                    hasLearned = true;
+                }
+            }
+        }
+
+        if (hasLearned)
+            stream.learned = std::move (learned);
+
+        if (hasPositions)
+            stream.positions = std::move (positions);
+
+        loaded->streams.push_back (std::move (stream));
+    }
+
+    return loaded;
+}
+
+void VirtualRef::applySettings (std::unique_ptr<LoadedSettings> loaded)
+{
+    setGlobalGain (loaded->globalGain);
+
+    // the worker threads and the latency cannot change during acquisition
+    if (! acquisitionActive)
+    {
+        numThreads = loaded->numThreads;
+        setAsynchronous (loaded->asynchronous);
+    }
+
+    normalizeBySum = loaded->normalizeBySum;
+    setTimingEnabled (loaded->timing);
+    setTimingLogEnabled (loaded->timingLog);
+
+    for (auto& stream : loaded->streams)
+    {
+        String streamKey = stream.key;
+        auto refMat = refMatMap.find (streamKey);
+
+        // the signal chain may have changed while a file was decoded
+        if (refMat == refMatMap.end() || refMat->second->getNumberOfChannels() != stream.matrix->getNumberOfChannels())
+            continue;
+
+        LOGD ("Loading references for stream: " + streamKey);
+
+        // the canvas keeps a pointer to the stream's matrix
+        *refMat->second = *stream.matrix;
+
+        statisticMap[streamKey] = stream.statistic;
+        stepSizeMap[streamKey] = stream.stepSize;
+        frozenMap[streamKey] = stream.frozen;
+        saturationMap[streamKey] = stream.saturationThreshold;
+
+        // reference channels cannot be declared during acquisition
+        if (! acquisitionActive)
+            publishMap[streamKey] = stream.publish;
+
+        badChannelMap[streamKey] = stream.badChannels;
+
+        if (stream.badChannels == BadChannelMode::Off)
+            assessmentMap.erase (streamKey);
+
+        for (auto& context : streamContexts)
+        {
+            if (getDataStream (context->streamId)->getKey() == streamKey)
+                context->monitored = stream.badChannels != BadChannelMode::Off;
+        }
+
+        if (stream.learned != nullptr)
+            learnedMap[streamKey] = std::move (stream.learned);
+        else
+            learnedMap.erase (streamKey);
+
+        if (! stream.positions.empty())
+            probeMaps[streamKey] = std::move (stream.positions);
+        else
+            probeMaps.erase (streamKey);
+    }
+
+    rebuildReferencePlans();
+
+    getEditor()->updateVisualizer();
 }
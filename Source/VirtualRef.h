@@ -26,10 +26,20 @@
 
 #include <ProcessorHeaders.h>
 
+#include "Engine/ChannelGeometry.h"
+#include "Engine/ChannelStatistics.h"
+#include "Engine/ProcessingMonitor.h"
+#include "Engine/ReferenceDelayLine.h"
+#include "Engine/ReferenceEngine.h"
+#include "Engine/ReferenceMatrix.h"
+#include "Engine/ReferencePlan.h"
+#include "Engine/ReferenceSnapshot.h"
+
+#include <thread>
+
+/** Block size assumed until the host has reported its own */
 #define BUFFER_SIZE 1024
 
-class ReferenceMatrix;
-
 /**
 
   VirtualRef
@@ -37,11 +47,45 @@ class ReferenceMatrix;
   Allows the user to select arbitrary (virtual) reference channels for each 
   recording channel.
 
+  Edits never touch what the audio thread is reading: the compiled plans
+  and the global gain form an immutable ReferenceSettings snapshot, and
+  every edit publishes a new one with a single atomic pointer swap. The
+  audio thread loads the pointer once per block, so all streams adopt a
+  change together at a block boundary, without locks. Replaced snapshots
+  are freed on the message thread (timerCallback) once the audio thread
+  has started a later block.
+
+  Streams can also watch their own channels: the audio thread keeps
+  running ChannelStatistics of the raw input, and timerCallback evaluates
+  each completed window, excluding flat and noisy channels from the
+  references or weighting every channel by its inverse noise variance.
+  Plans are only recompiled when that assessment changes noticeably.
+
+  Adaptive references learn their weights on the audio thread; the timer
+  collects a copy of them, which is saved with the settings and seeds the
+  weights whenever a plan is recompiled.
+
+  Site positions come from the channel metadata of each stream or from a
+  loaded probe map; they order the channels along the shank for the
+  plans and define the neighbourhoods of local references.
+
+  Optionally, the time of every block is recorded (see ProcessingMonitor);
+  the timer collects the summaries for the canvas and can append them to
+  a CSV file.
+
+  A stream can also publish its reference signals: updateSettings()
+  appends one continuous channel per reference group, which the engine
+  fills from the same pass that computes the references. Since the
+  channels are declared with the signal chain, a change in the number of
+  groups updates the chain, which is only possible while acquisition is
+  stopped.
+
   @see GenericProcessor
 
 */
 
-class VirtualRef : public GenericProcessor
+class VirtualRef : public GenericProcessor,
+                   public Timer
 
 {
 public:
@@ -54,6 +98,12 @@ public:
     /** Applys average reference gain from all the selected channels for each input channel*/
     void process (AudioBuffer<float>& buffer);
 
+    /** Clears the delay lines of the asynchronous mode */
+    bool startAcquisition() override;
+
+    /** Waits for the block that is still being referenced */
+    bool stopAcquisition() override;
+
     /** Create custom editor*/
     AudioProcessorEditor* createEditor();
 
@@ -63,88 +113,419 @@ public:
     /** Gets the reference matrix for current stream */
     ReferenceMatrix* getReferenceMatrix();
 
-    /** Sets the global gain value */
+    /** Recompiles the reference plan for the current stream after its matrix was edited */
+    void updateReferencePlan();
+
+    /** Sets the global gain value; takes effect at the next block */
     void setGlobalGain (float value);
 
     /** Gets the global gain value */
     float getGlobalGain();
 
+    /** Sets the number of threads used to reference each block (1 = host thread only) */
+    void setNumThreads (int numThreads);
+
+    /** Gets the number of threads used to reference each block */
+    int getNumThreads();
+
+    /** Divides the reference weights of a row by their sum (weighted mean)
+        instead of by the number of references */
+    void setNormalizeBySum (bool normalizeBySum);
+
+    /** Returns true if reference weights are divided by their sum */
+    bool getNormalizeBySum();
+
+    /** Sets how the references of the current stream are combined: a
+        (weighted) mean or the per-sample median of the selected channels */
+    void setReferenceStatistic (ReferencePlan::Statistic statistic);
+
+    /** Returns how the references of the current stream are combined */
+    ReferencePlan::Statistic getReferenceStatistic();
+
+    /** Sets the amplitude at or beyond which samples of the current stream
+        are left out of the (mean) reference, e.g. while a channel rails.
+        0 disables the masking. */
+    void setSaturationThreshold (float threshold);
+
+    /** Returns the saturation threshold of the current stream (0 = off) */
+    float getSaturationThreshold();
+
+    /** How the running channel statistics of a stream affect its references */
+    enum class BadChannelMode
+    {
+        Off = 0, /**< all selected references are used */
+        Exclude, /**< flat and noisy channels are left out */
+        Weight /**< as Exclude, and the other channels are weighted by their inverse noise variance */
+    };
+
+    /** Sets how the references of the current stream adapt to bad channels */
+    void setBadChannelMode (BadChannelMode mode);
+
+    /** Returns how the references of the current stream adapt to bad channels */
+    BadChannelMode getBadChannelMode();
+
+    /** Sets the step size with which adaptive references of the current
+        stream learn their weights (normally between 0 and 1) */
+    void setAdaptiveStepSize (float stepSize);
+
+    /** Returns the step size of the current stream's adaptive references */
+    float getAdaptiveStepSize();
+
+    /** Stops or resumes learning of the current stream's adaptive
+        references; frozen weights are still applied */
+    void setAdaptationFrozen (bool frozen);
+
+    /** Returns true if the current stream's adaptive weights are frozen */
+    bool isAdaptationFrozen();
+
+    /** Discards the weights learned for the current stream and starts
+        again from the normalized matrix values */
+    void resetAdaptiveWeights();
+
+    /** Loads the site positions of the current stream from a probe map in
+        the probeinterface JSON format (contact_positions, wired to the
+        stream's channels by device_channel_indices where present). Returns
+        false if the file holds no positions for the stream. */
+    bool loadProbeMap (const File& file);
+
+    /** Forgets the probe map of the current stream */
+    void clearProbeMap();
+
+    /** Returns true if a probe map was loaded for the current stream */
+    bool hasProbeMap();
+
+    /** Returns the site positions of the current stream's channels */
+    ChannelGeometry getChannelGeometry();
+
+    /** Returns the last assessment of each channel of the current stream,
+        or an empty list if it has not been assessed */
+    std::vector<ChannelStatistics::Quality> getChannelQuality();
+
+    /** Returns the factor applied to each channel of the current stream
+        when it is used as a reference, or an empty list if all are 1 */
+    std::vector<float> getChannelScale();
+
+    /** Enables the asynchronous mode, in which each block is referenced by
+        worker threads while the host thread continues. The output of every
+        enabled stream is then delayed by one block, which is reported
+        through setLatencySamples(). */
+    void setAsynchronous (bool asynchronous);
+
+    /** Returns true if the asynchronous mode is enabled */
+    bool isAsynchronous();
+
+    /** Appends the reference signals of the current stream to it as extra
+        continuous channels, one per reference group. Returns false, and
+        leaves the setting unchanged, during acquisition. */
+    bool setPublishReferences (bool publish);
+
+    /** Returns true if the current stream publishes its reference signals */
+    bool getPublishReferences();
+
+    /** Enables or disables recording the processing time of every block */
+    void setTimingEnabled (bool enabled);
+
+    /** Returns true if the processing time is recorded */
+    bool isTimingEnabled();
+
+    /** Enables or disables appending a summary of the processing time to
+        timingLogFile every few seconds while it is recorded */
+    void setTimingLogEnabled (bool enabled);
+
+    /** Returns true if the timing summaries are written to timingLogFile */
+    bool isTimingLogEnabled();
+
+    /** Returns the file that the timing summaries are appended to */
+    File getTimingLogFile();
+
+    /** Returns the processing time recorded since acquisition started */
+    ProcessingMonitor::Window getTiming();
+
+    /** Frees the settings snapshots that the audio thread has stopped
+        reading, and evaluates the channel statistics and collects the
+        adaptive weights during acquisition */
+    void timerCallback() override;
+
+    /** Caches the stream's enable flag for the audio thread */
+    void parameterValueChanged (Parameter* param) override;
+
     /** Saves all custom parameters */
     void saveCustomParametersToXml (XmlElement* parentElement);
 
     /** Loads all custom parameters */
     void loadCustomParametersFromXml (XmlElement* customParamsXml);
 
+    /** Reads settings saved by saveCustomParametersToXml from a file. The
+        file is parsed and decoded on a background thread, and the timer
+        applies the result on the message thread once it is ready. */
+    void loadSettingsFile (const File& file);
+
 private:
+    /** Everything the audio thread needs to reference one stream. Contexts
+        are built in updateSettings(), so process() does not have to query
+        the streams or allocate. */
+    struct StreamContext
+    {
+        uint16 streamId = 0;
+        double sampleRate = 0.0;
+        std::atomic<bool> enabled { true };
+        std::vector<int> globalIndices;
+
+        /** Global indices of the channels declared for the reference
+            signals, in group order */
+        std::vector<int> referenceIndices;
+
+        ReferenceSnapshot snapshot;
+
+        /** Only used in the asynchronous mode */
+        std::unique_ptr<ReferenceDelayLine> delayLine;
+
+        /** Only accumulated if the stream's bad channel mode is on */
+        ChannelStatistics statistics;
+        std::atomic<bool> monitored { false };
+    };
+
+    /** Latest evaluation of a stream's channel statistics (message thread only) */
+    struct ChannelAssessment
+    {
+        std::vector<ChannelStatistics::Quality> quality;
+        std::vector<float> noiseWeight;
+    };
+
+    /** Immutable settings read by the audio thread. Plans are shared with
+        later snapshots that leave them unchanged, but are only ever
+        released on the message thread. */
+    struct ReferenceSettings
+    {
+        /** Plans in the same order as streamContexts */
+        std::vector<std::shared_ptr<const ReferencePlan>> plans;
+
+        /** Stream key of each plan */
+        std::vector<String> streamKeys;
+
+        float globalGain = 1.0f;
+    };
+
+    /** Settings decoded from XML, which can be done off the message
+        thread; applySettings() then takes them over */
+    struct LoadedSettings
+    {
+        struct Stream
+        {
+            String key;
+            ReferencePlan::Statistic statistic = ReferencePlan::Statistic::Mean;
+            float stepSize = AdaptiveWeights::defaultStepSize;
+            bool frozen = false;
+            float saturationThreshold = 0.0f;
+            BadChannelMode badChannels = BadChannelMode::Off;
+            bool publish = false;
+
+            std::unique_ptr<ReferenceMatrix> matrix;
+
+            /** nullptr if no weights were learned */
+            std::unique_ptr<ReferenceMatrix> learned;
+
+            /** Empty if no positions were saved */
+            std::vector<ChannelGeometry::Position> positions;
+        };
+
+        /** False if the file could not be parsed */
+        bool isValid = false;
+        File file;
+
+        float globalGain = 1.0f;
+        int numThreads = 1;
+        bool asynchronous = false;
+        bool normalizeBySum = false;
+        bool timing = false;
+        bool timingLog = false;
+
+        std::vector<Stream> streams;
+    };
+
+    /** A replaced snapshot, with the block count at the time it was replaced */
+    struct RetiredSettings
+    {
+        uint64 blockCount;
+        std::unique_ptr<ReferenceSettings> settings;
+    };
+
+    /** Decodes saved settings for the streams in channelCounts (by stream
+        key), in both the compact and the one-element-per-reference format.
+        Only reads its arguments, so it can run on any thread. */
+    static std::unique_ptr<LoadedSettings> decodeSettings (const XmlElement& xml, const std::map<String, int>& channelCounts);
+
+    /** Takes over decoded settings and recompiles the plans */
+    void applySettings (std::unique_ptr<LoadedSettings> loaded);
+
+    /** Applies the settings of a file once the background thread has decoded them */
+    void applyLoadedFile();
+
+    /** Returns the number of channels of each stream, by stream key */
+    std::map<String, int> getChannelCounts();
+
+    /** Compiles the plan of the stream at the given index of streamContexts */
+    std::shared_ptr<const ReferencePlan> buildReferencePlan (int streamIndex);
+
+    /** Recompiles the plans of all streams and publishes them together */
+    void rebuildReferencePlans();
+
+    /** Declares a reference channel for every group of each stream that
+        publishes its references. Returns true if any were added. */
+    bool addReferenceChannels();
+
+    /** Updates the signal chain if the number of groups of a publishing
+        stream no longer matches its reference channels. Does nothing
+        during acquisition. */
+    void updateReferenceChannels();
+
+    /** Silences the reference channels of a stream whose groups are not
+        published by the plan (nullptr = none are) */
+    void clearReferenceChannels (const StreamContext* context,
+                                 const ReferencePlan* plan,
+                                 float* const* channels,
+                                 int numSamples);
+
+    /** Returns a mutable copy of the current settings */
+    std::unique_ptr<ReferenceSettings> copySettings();
+
+    /** Hands a new snapshot to the audio thread and retires the previous one */
+    void publishSettings (std::unique_ptr<ReferenceSettings> next);
+
+    /** Frees the retired snapshots that can no longer be in use */
+    void reclaimSettings();
+
+    /** Evaluates the latest statistics of every monitored stream and
+        recompiles the plans whose assessment changed */
+    void assessChannels();
+
+    /** Returns true if two assessments exclude the same channels and, in
+        the Weight mode, weight the others within scaleTolerance of each other */
+    static bool isSameAssessment (const ChannelAssessment& a, const ChannelAssessment& b, BadChannelMode mode);
+
+    /** Returns the source scale of each channel of a stream for its bad
+        channel mode, or an empty list if all are 1 */
+    std::vector<float> getSourceScale (const String& streamKey);
+
+    /** Returns the site positions of a stream's channels: the probe map if
+        one was loaded, else the channel metadata, else a single column in
+        channel order */
+    ChannelGeometry getStreamGeometry (DataStream* stream);
+
+    /** Copies the latest weights learned by the adaptive plans of all
+        streams into learnedMap */
+    void collectLearnedWeights();
+
+    /** Records the time of a block that started at startTicks (audio thread) */
+    void recordTiming (int64 startTicks);
+
+    /** Collects the latest timing window and logs it */
+    void collectTiming();
+
+    /** Appends a timing window to the log file, with a header if the file is new */
+    void logTiming (const ProcessingMonitor::Window& window);
+
+    /** Relative change of a channel's scale that is worth a new plan */
+    static constexpr float scaleTolerance = 0.2f;
+
+    /** Starts the worker threads, sizes the engine's scratch memory and
+        allocates the snapshots and delay lines */
+    void prepareEngine();
+
+    /** Returns the buffer's channel pointers, offset to startSample */
+    float* const* getChunk (AudioBuffer<float>& buffer, int startSample);
+
+    /** References a chunk of at most maxBlockSamples samples in place */
+    void processSynchronous (const ReferenceSettings* current, float* const* channels, int startSample);
+
+    /** Hands a chunk to the workers and emits the previous one */
+    void processAsynchronous (const ReferenceSettings* current, float* const* channels, int startSample);
+
+    /** Moves the sample numbers and timestamps of the streams that went
+        through a delay line back by the delay, so that their samples keep
+        lining up with the other streams and with events */
+    void shiftDelayedStreams();
+
     std::map<String, std::unique_ptr<ReferenceMatrix>> refMatMap;
-    AudioBuffer<float> channelBuffer;
-    AudioBuffer<float> avgBuffer;
-    float globalGain;
 
-    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (VirtualRef);
-};
+    /** Statistic of each stream, by stream key; streams default to the mean */
+    std::map<String, ReferencePlan::Statistic> statisticMap;
 
-/**
+    /** Saturation threshold of each stream, by stream key; 0 = off */
+    std::map<String, float> saturationMap;
 
-  Reference matrix
+    /** Bad channel mode of each stream, by stream key; streams default to Off */
+    std::map<String, BadChannelMode> badChannelMap;
 
-  Each row indicates the selected reference channels for each channel.
+    /** Channel assessment of each stream, by stream key */
+    std::map<String, ChannelAssessment> assessmentMap;
 
-  1: selected
-  0: not selected
+    /** Adaptive step size of each stream, by stream key */
+    std::map<String, float> stepSizeMap;
 
-  TODO allow values between 0 and 1 to set the gain of each reference channel
+    /** Streams whose adaptive weights are frozen, by stream key */
+    std::map<String, bool> frozenMap;
 
-  @see VirtualRef
+    /** Streams that publish their reference signals, by stream key */
+    std::map<String, bool> publishMap;
 
-*/
+    /** Weights learned by the adaptive references of each stream, by stream
+        key, as of the last collectLearnedWeights() */
+    std::map<String, std::unique_ptr<ReferenceMatrix>> learnedMap;
 
-class ReferenceMatrix
-{
-public:
-    /** Constructor */
-    ReferenceMatrix (int nChan);
+    /** Site positions loaded from a probe map, by stream key; channels
+        that the map does not place are not finite */
+    std::map<String, std::vector<ChannelGeometry::Position>> probeMaps;
 
-    /** Destructor */
-    ~ReferenceMatrix();
+    /** Latest adaptive weights of a stream, as read by collectLearnedWeights() */
+    std::vector<float> learnedWeights;
 
-    /** Set the number of channels for the matrix*/
-    void setNumberOfChannels (int n);
+    /** Latest window of a stream, as read by assessChannels() */
+    std::vector<ChannelStatistics::Summary> summaries;
 
-    /** Get the number of channels for the matrix*/
-    int getNumberOfChannels();
+    /** Contexts in the same order as getDataStreams() */
+    std::vector<std::unique_ptr<StreamContext>> streamContexts;
+    std::atomic<ReferenceSettings*> settings { nullptr };
+    std::unique_ptr<ReferenceSettings> currentSettings;
+    std::vector<RetiredSettings> retiredSettings;
 
-    /** Called when the input channels have changed*/
-    void update();
+    /** Incremented by the audio thread once the previous block no longer
+        reads any settings */
+    std::atomic<uint64> blockCount { 0 };
+    bool acquisitionActive;
 
-    /** Sets the value for the specified row and column */
-    void setValue (int rowIndex, int colIndex, float value);
+    ReferenceEngine engine;
 
-    /** Gets the value for the specified row and column */
-    float getValue (int rowIndex, int colIndex);
+    ProcessingMonitor monitor;
 
-    /** Gets the channel value for the specified index */
-    float* getChannel (int index);
+    /** Per-stream job times of the current block (audio thread only) */
+    std::vector<double> jobSeconds;
 
-    /** Checks if all the reference channels are active for the given input channel index */
-    bool allChannelReferencesActive (int index);
+    /** Timing since acquisition started, and the latest window (message thread only) */
+    ProcessingMonitor::Window timingTotal;
+    ProcessingMonitor::Window timingWindow;
+    bool timingLogEnabled;
 
-    /** Sets the value for all reference channels */
-    void setAll (float value);
+    float globalGain;
+    int numThreads;
 
-    /** Sets the value for all reference channels up to the max channel number*/
-    void setAll (float value, int maxChan);
+    /** Capacity of the snapshots and delay lines, and the latency of the
+        asynchronous mode */
+    int maxBlockSamples;
+    std::vector<float*> chunkPointers;
+    bool asynchronous;
+    bool normalizeBySum;
 
-    /** Clears the reference channel matrix */
-    void clear();
+    /** Decodes a settings file, see loadSettingsFile() */
+    std::thread settingsLoader;
 
-    /** Prints the matrix values*/
-    void print();
+    /** Handed over by settingsLoader once decoded, taken by the timer */
+    std::atomic<LoadedSettings*> loadedSettings { nullptr };
 
-private:
-    int nChannels;
-    int nChannelsBefore;
-    float* values;
+    /** True from starting settingsLoader until its result is applied */
+    bool loadingSettings;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (VirtualRef);
 };
 
 #endif //__VIRTUALREF_H__
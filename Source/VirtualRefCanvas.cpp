@@ -74,14 +74,172 @@ VirtualRefCanvas::VirtualRefCanvas (VirtualRef* n) : processor (n)
 
     Font labelFont ("Fira Sans", "SemiBold", 16.0f);
 
+    weightLabel = std::make_unique<Label> ("WeightLabel", "Weight:");
+    weightLabel->setFont (labelFont);
+    addAndMakeVisible (weightLabel.get());
+
+    weightSlider = std::make_unique<Slider> ("Weight");
+    weightSlider->setTooltip ("Weight of newly selected references. Shift-click a selected cell to apply it.");
+    weightSlider->setSliderStyle (Slider::LinearHorizontal);
+    weightSlider->setRange (0.05f, 1.0f, 0.05f);
+    weightSlider->setTextBoxStyle (Slider::TextBoxRight, false, 40, 20);
+    weightSlider->setValue (1.0f);
+    weightSlider->addListener (this);
+    addAndMakeVisible (weightSlider.get());
+
+    normalizeButton = std::make_unique<UtilityButton> ("Weighted mean");
+    normalizeButton->setTooltip ("Divide each reference by the sum of its weights instead of by the number of references");
+    normalizeButton->setRadius (3.0f);
+    normalizeButton->setClickingTogglesState (true);
+    normalizeButton->addListener (this);
+    addAndMakeVisible (normalizeButton.get());
+
+    statisticLabel = std::make_unique<Label> ("StatisticLabel", "Reference:");
+    statisticLabel->setFont (labelFont);
+    addAndMakeVisible (statisticLabel.get());
+
+    statisticBox = std::make_unique<ComboBox> ("Statistic");
+    statisticBox->setTooltip ("Combine the selected references of each channel by their mean, by their per-sample median (weights are ignored), or with weights that each channel learns during acquisition");
+    statisticBox->addItem ("Mean", 1);
+    statisticBox->addItem ("Median", 2);
+    statisticBox->addItem ("Adaptive", 3);
+    statisticBox->setSelectedId (1, dontSendNotification);
+    statisticBox->setEditableText (false);
+    statisticBox->addListener (this);
+    addAndMakeVisible (statisticBox.get());
+
+    saturationLabel = std::make_unique<Label> ("SaturationLabel", "Clip at:");
+    saturationLabel->setFont (labelFont);
+    addAndMakeVisible (saturationLabel.get());
+
+    saturationSlider = std::make_unique<Slider> ("Saturation");
+    saturationSlider->setTooltip ("Samples at or beyond this amplitude are left out of the reference of the current stream, e.g. while a channel rails (mean only)");
+    saturationSlider->setSliderStyle (Slider::LinearHorizontal);
+    saturationSlider->setRange (0.0, 10000.0, 10.0);
+    saturationSlider->setSkewFactorFromMidPoint (1000.0);
+    saturationSlider->setTextBoxStyle (Slider::TextBoxRight, false, 60, 20);
+    saturationSlider->textFromValueFunction = [] (double value)
+    { return value > 0 ? String (value, 0) + " uV" : String ("Off"); };
+    saturationSlider->valueFromTextFunction = [] (const String& text)
+    { return (double) text.getFloatValue(); };
+    saturationSlider->setValue (0.0, dontSendNotification);
+    saturationSlider->setChangeNotificationOnlyOnRelease (true);
+    saturationSlider->addListener (this);
+    addAndMakeVisible (saturationSlider.get());
+
+    badChannelLabel = std::make_unique<Label> ("BadChannelLabel", "Bad channels:");
+    badChannelLabel->setFont (labelFont);
+    addAndMakeVisible (badChannelLabel.get());
+
+    badChannelBox = std::make_unique<ComboBox> ("BadChannels");
+    badChannelBox->setTooltip ("During acquisition, leave flat and noisy channels of the current stream out of the references, or also weight the other channels by their inverse noise variance");
+    badChannelBox->addItem ("Keep", 1);
+    badChannelBox->addItem ("Exclude", 2);
+    badChannelBox->addItem ("Noise-weighted", 3);
+    badChannelBox->setSelectedId (1, dontSendNotification);
+    badChannelBox->setEditableText (false);
+    badChannelBox->addListener (this);
+    addAndMakeVisible (badChannelBox.get());
+
+    stepSizeLabel = std::make_unique<Label> ("StepSizeLabel", "Step:");
+    stepSizeLabel->setFont (labelFont);
+    addAndMakeVisible (stepSizeLabel.get());
+
+    stepSizeSlider = std::make_unique<Slider> ("StepSize");
+    stepSizeSlider->setTooltip ("How fast adaptive references learn their weights (normalized LMS step size)");
+    stepSizeSlider->setSliderStyle (Slider::LinearHorizontal);
+    stepSizeSlider->setRange (0.001, 1.0, 0.001);
+    stepSizeSlider->setSkewFactorFromMidPoint (0.05);
+    stepSizeSlider->setTextBoxStyle (Slider::TextBoxRight, false, 50, 20);
+    stepSizeSlider->setValue (AdaptiveWeights::defaultStepSize, dontSendNotification);
+    stepSizeSlider->addListener (this);
+    addAndMakeVisible (stepSizeSlider.get());
+
+    freezeButton = std::make_unique<UtilityButton> ("Freeze");
+    freezeButton->setTooltip ("Stop learning and keep applying the current adaptive weights");
+    freezeButton->setRadius (3.0f);
+    freezeButton->setClickingTogglesState (true);
+    freezeButton->addListener (this);
+    addAndMakeVisible (freezeButton.get());
+
+    relearnButton = std::make_unique<UtilityButton> ("Relearn");
+    relearnButton->setTooltip ("Discard the learned weights and start again from the selected references");
+    relearnButton->setRadius (3.0f);
+    relearnButton->addListener (this);
+    addAndMakeVisible (relearnButton.get());
+
+    probeMapButton = std::make_unique<UtilityButton> ("Probe map");
+    probeMapButton->setTooltip ("Load the site positions of the current stream from a probeinterface (.json) file, for local references");
+    probeMapButton->setRadius (3.0f);
+    probeMapButton->addListener (this);
+    addAndMakeVisible (probeMapButton.get());
+
+    radiusLabel = std::make_unique<Label> ("RadiusLabel", "Radius:");
+    radiusLabel->setFont (labelFont);
+    addAndMakeVisible (radiusLabel.get());
+
+    radiusSlider = std::make_unique<Slider> ("Radius");
+    radiusSlider->setTooltip ("Local average: sites within this distance (um) of a channel form its reference");
+    radiusSlider->setSliderStyle (Slider::LinearHorizontal);
+    radiusSlider->setRange (10.0, 1000.0, 5.0);
+    radiusSlider->setSkewFactorFromMidPoint (100.0);
+    radiusSlider->setTextBoxStyle (Slider::TextBoxRight, false, 50, 20);
+    radiusSlider->setValue (100.0, dontSendNotification);
+    radiusSlider->setChangeNotificationOnlyOnRelease (true);
+    radiusSlider->addListener (this);
+    addAndMakeVisible (radiusSlider.get());
+
+    excludeLabel = std::make_unique<Label> ("ExcludeLabel", "Skip:");
+    excludeLabel->setFont (labelFont);
+    addAndMakeVisible (excludeLabel.get());
+
+    excludeSlider = std::make_unique<Slider> ("Exclude");
+    excludeSlider->setTooltip ("Local average: number of nearest sites left out of each reference, as they share the channel's units");
+    excludeSlider->setSliderStyle (Slider::LinearHorizontal);
+    excludeSlider->setRange (0.0, 16.0, 1.0);
+    excludeSlider->setTextBoxStyle (Slider::TextBoxRight, false, 50, 20);
+    excludeSlider->setValue (2.0, dontSendNotification);
+    excludeSlider->setChangeNotificationOnlyOnRelease (true);
+    excludeSlider->addListener (this);
+    addAndMakeVisible (excludeSlider.get());
+
+    timingButton = std::make_unique<UtilityButton> ("Timing");
+    timingButton->setTooltip ("Record how long each block takes during acquisition");
+    timingButton->setRadius (3.0f);
+    timingButton->setClickingTogglesState (true);
+    timingButton->addListener (this);
+    addAndMakeVisible (timingButton.get());
+
+    timingLogButton = std::make_unique<UtilityButton> ("Log CSV");
+    timingLogButton->setTooltip ("Append a timing summary every few seconds to virtual_ref_timing.csv in the recording directory");
+    timingLogButton->setRadius (3.0f);
+    timingLogButton->setClickingTogglesState (true);
+    timingLogButton->addListener (this);
+    addAndMakeVisible (timingLogButton.get());
+
+    publishButton = std::make_unique<UtilityButton> ("Publish refs");
+    publishButton->setTooltip ("Append each distinct reference signal of this stream to it as an extra channel (REF1, REF2, ...)");
+    publishButton->setRadius (3.0f);
+    publishButton->setClickingTogglesState (true);
+    publishButton->addListener (this);
+    addAndMakeVisible (publishButton.get());
+
+    timingLabel = std::make_unique<Label> ("TimingLabel", String());
+    timingLabel->setFont (Font ("Fira Sans", "Regular", 13.0f));
+    addAndMakeVisible (timingLabel.get());
+
     presetNamesLabel = std::make_unique<Label> ("PresetLabel", "Preset:");
     presetNamesLabel->setFont (labelFont);
     addAndMakeVisible (presetNamesLabel.get());
 
     presetNames.add ("None");
     presetNames.add ("Common average reference");
-    presetNames.add ("Avg of other tetrodes");
-    presetNames.add ("Avg of next tetrode");
+    presetNames.add ("Avg of all other channels");
+    presetNames.add ("Avg of other groups");
+    presetNames.add ("Avg of next group");
+    presetNames.add ("Other electrodes of group");
+    presetNames.add ("All electrodes of group");
+    presetNames.add ("Local average");
 
     presetNamesBox = std::make_unique<ComboBox> ("Presets");
     presetNamesBox->addItemList (presetNames, 1);
@@ -99,6 +257,11 @@ VirtualRefCanvas::VirtualRefCanvas (VirtualRef* n) : processor (n)
         channelCounts.add (String (i * 16));
     }
 
+    for (int count : { 192, 256, 384, 512, 768, 1024, 1536 })
+    {
+        channelCounts.add (String (count));
+    }
+
     channelCountBox = std::make_unique<ComboBox> ("Channels");
     channelCountBox->addItemList (channelCounts, 1);
     channelCountBox->setSelectedId (1, sendNotification);
@@ -106,6 +269,43 @@ VirtualRefCanvas::VirtualRefCanvas (VirtualRef* n) : processor (n)
     channelCountBox->addListener (this);
     addAndMakeVisible (channelCountBox.get());
 
+    groupSizeLabel = std::make_unique<Label> ("GroupSizeLabel", "Group:");
+    groupSizeLabel->setFont (labelFont);
+    addAndMakeVisible (groupSizeLabel.get());
+
+    groupSizeBox = std::make_unique<ComboBox> ("GroupSize");
+    groupSizeBox->setTooltip ("Number of consecutive channels that form a group (e.g. a tetrode) in the group presets");
+    groupSizeBox->addItem ("Single", 1);
+    groupSizeBox->addItem ("Stereotrode", 2);
+    groupSizeBox->addItem ("Tetrode", 4);
+    groupSizeBox->addItem ("Octrode", 8);
+
+    for (int size : { 16, 32, 64 })
+        groupSizeBox->addItem (String (size) + " channels", size);
+
+    groupSizeBox->setSelectedId (4, dontSendNotification);
+    groupSizeBox->setEditableText (false);
+    groupSizeBox->addListener (this);
+    addAndMakeVisible (groupSizeBox.get());
+
+    bankLabel = std::make_unique<Label> ("BankLabel", "Within:");
+    bankLabel->setFont (labelFont);
+    addAndMakeVisible (bankLabel.get());
+
+    // banks of consecutive channels have their size as id
+    bankBox = std::make_unique<ComboBox> ("Bank");
+    bankBox->setTooltip ("Presets never reference channels across these boundaries");
+    bankBox->addItem ("Whole stream", 1);
+    bankBox->addItem ("Shank", 2);
+
+    for (int size : { 32, 64, 96, 128, 192, 384 })
+        bankBox->addItem ("Banks of " + String (size), size);
+
+    bankBox->setSelectedId (1, dontSendNotification);
+    bankBox->setEditableText (false);
+    bankBox->addListener (this);
+    addAndMakeVisible (bankBox.get());
+
     update();
 }
 
@@ -141,24 +341,114 @@ void VirtualRefCanvas::refreshState()
 
 void VirtualRefCanvas::resized()
 {
-    displayViewport->setBounds (20, 20, getWidth() - 40, getHeight() - 90);
-    resetButton->setBounds (10, getHeight() - 60, 100, 20);
-    selectModeButton->setBounds (110, getHeight() - 60, 100, 20);
-    loadButton->setBounds (10, getHeight() - 30, 100, 20);
-    saveButton->setBounds (110, getHeight() - 30, 100, 20);
-
-    gainSlider->setBounds (220, getHeight() - 75, 140, 80);
-
-    channelCountLabel->setBounds (380, getHeight() - 30, 120, 20);
-    channelCountBox->setBounds (500, getHeight() - 30, 200, 20);
-    presetNamesLabel->setBounds (380, getHeight() - 60, 120, 20);
-    presetNamesBox->setBounds (500, getHeight() - 60, 200, 20);
+    // the controls are arranged in sections of two rows each, which wrap
+    // onto further rows below the display when the canvas is too narrow
+    // to show them side by side
+    const int sectionWidths[] = { 200, 150, 320, 190, 320, 310, 240, 210, 420, 90 };
+    const int sectionHeight = 50;
+    const int sectionGap = 10;
+
+    FlexBox bar;
+    bar.flexWrap = FlexBox::Wrap::wrap;
+    bar.alignContent = FlexBox::AlignContent::flexStart;
+
+    for (int width : sectionWidths)
+        bar.items.add (FlexItem ((float) width, (float) sectionHeight).withMargin (FlexItem::Margin (0, (float) sectionGap, (float) sectionGap, 0)));
+
+    bar.performLayout (Rectangle<int> (10, 0, MAX (getWidth() - 10, sectionWidths[2] + sectionGap), getHeight()));
+
+    int barHeight = 0;
+
+    for (auto& item : bar.items)
+        barHeight = MAX (barHeight, (int) item.currentBounds.getBottom() + sectionGap);
+
+    int barTop = getHeight() - barHeight;
+
+    auto section = [&] (int index)
+    { return bar.items[index].currentBounds.toNearestInt().translated (0, barTop).getTopLeft(); };
+
+    displayViewport->setBounds (20, 20, getWidth() - 40, barTop - 30);
+
+    Point<int> p = section (0);
+    resetButton->setBounds (p.x, p.y, 100, 20);
+    selectModeButton->setBounds (p.x + 100, p.y, 100, 20);
+    loadButton->setBounds (p.x, p.y + 30, 100, 20);
+    saveButton->setBounds (p.x + 100, p.y + 30, 100, 20);
+
+    p = section (1);
+    gainSlider->setBounds (p.x, p.y - 15, 140, 80);
+
+    p = section (2);
+    presetNamesLabel->setBounds (p.x, p.y, 120, 20);
+    presetNamesBox->setBounds (p.x + 120, p.y, 200, 20);
+    channelCountLabel->setBounds (p.x, p.y + 30, 120, 20);
+    channelCountBox->setBounds (p.x + 120, p.y + 30, 200, 20);
+
+    p = section (3);
+    groupSizeLabel->setBounds (p.x, p.y, 60, 20);
+    groupSizeBox->setBounds (p.x + 60, p.y, 130, 20);
+    bankLabel->setBounds (p.x, p.y + 30, 60, 20);
+    bankBox->setBounds (p.x + 60, p.y + 30, 130, 20);
+
+    p = section (4);
+    probeMapButton->setBounds (p.x, p.y, 90, 20);
+    radiusLabel->setBounds (p.x + 100, p.y, 60, 20);
+    radiusSlider->setBounds (p.x + 160, p.y, 160, 20);
+    excludeLabel->setBounds (p.x + 100, p.y + 30, 60, 20);
+    excludeSlider->setBounds (p.x + 160, p.y + 30, 160, 20);
+
+    p = section (5);
+    weightLabel->setBounds (p.x, p.y, 70, 20);
+    weightSlider->setBounds (p.x + 70, p.y, 160, 20);
+    normalizeButton->setBounds (p.x, p.y + 30, 120, 20);
+    statisticLabel->setBounds (p.x + 130, p.y + 30, 80, 20);
+    statisticBox->setBounds (p.x + 210, p.y + 30, 100, 20);
+
+    p = section (6);
+    badChannelLabel->setBounds (p.x, p.y, 100, 20);
+    badChannelBox->setBounds (p.x + 100, p.y, 140, 20);
+    saturationLabel->setBounds (p.x, p.y + 30, 60, 20);
+    saturationSlider->setBounds (p.x + 60, p.y + 30, 180, 20);
+
+    p = section (7);
+    freezeButton->setBounds (p.x, p.y, 70, 20);
+    relearnButton->setBounds (p.x + 80, p.y, 80, 20);
+    stepSizeLabel->setBounds (p.x, p.y + 30, 50, 20);
+    stepSizeSlider->setBounds (p.x + 50, p.y + 30, 160, 20);
+
+    p = section (8);
+    timingButton->setBounds (p.x, p.y, 70, 20);
+    timingLogButton->setBounds (p.x + 80, p.y, 70, 20);
+    timingLabel->setBounds (p.x, p.y + 30, 420, 20);
+
+    p = section (9);
+    publishButton->setBounds (p.x, p.y, 90, 20);
 }
 
 void VirtualRefCanvas::updateSettings()
 {
     display->update();
     gainSlider->setValue (processor->getGlobalGain());
+    normalizeButton->setToggleState (processor->getNormalizeBySum(), dontSendNotification);
+    statisticBox->setSelectedId ((int) processor->getReferenceStatistic() + 1, dontSendNotification);
+    saturationSlider->setValue (processor->getSaturationThreshold(), dontSendNotification);
+    badChannelBox->setSelectedId ((int) processor->getBadChannelMode() + 1, dontSendNotification);
+    stepSizeSlider->setValue (processor->getAdaptiveStepSize(), dontSendNotification);
+    freezeButton->setToggleState (processor->isAdaptationFrozen(), dontSendNotification);
+    timingButton->setToggleState (processor->isTimingEnabled(), dontSendNotification);
+    timingLogButton->setToggleState (processor->isTimingLogEnabled(), dontSendNotification);
+    publishButton->setToggleState (processor->getPublishReferences(), dontSendNotification);
+    updateAdaptationControls();
+    display->updateChannelQuality();
+}
+
+void VirtualRefCanvas::updateAdaptationControls()
+{
+    bool adaptive = processor->getReferenceStatistic() == ReferencePlan::Statistic::Adaptive;
+
+    stepSizeSlider->setEnabled (adaptive);
+    freezeButton->setEnabled (adaptive);
+    relearnButton->setEnabled (adaptive);
 }
 
 void VirtualRefCanvas::buttonClicked (Button* b)
@@ -169,6 +459,46 @@ void VirtualRefCanvas::buttonClicked (Button* b)
     {
         display->reset();
     }
+    else if (button == normalizeButton.get())
+    {
+        processor->setNormalizeBySum (button->getToggleState());
+    }
+    else if (button == freezeButton.get())
+    {
+        processor->setAdaptationFrozen (button->getToggleState());
+    }
+    else if (button == relearnButton.get())
+    {
+        processor->resetAdaptiveWeights();
+    }
+    else if (button == timingButton.get())
+    {
+        processor->setTimingEnabled (button->getToggleState());
+    }
+    else if (button == timingLogButton.get())
+    {
+        processor->setTimingLogEnabled (button->getToggleState());
+    }
+    else if (button == publishButton.get())
+    {
+        if (! processor->setPublishReferences (button->getToggleState()))
+            button->setToggleState (processor->getPublishReferences(), dontSendNotification);
+    }
+    else if (button == probeMapButton.get())
+    {
+        FileChooser fc ("Choose a probe map...",
+                        File::getCurrentWorkingDirectory(),
+                        "*.json",
+                        true);
+
+        if (fc.browseForFileToOpen())
+        {
+            if (! processor->loadProbeMap (fc.getResult()))
+                CoreServices::sendStatusMessage ("Could not read site positions from " + fc.getResult().getFullPathName());
+            else if (presetNames[presetNamesBox->getSelectedId() - 1] == "Local average")
+                applySelectedPreset();
+        }
+    }
     else if (button == selectModeButton.get())
     {
         display->setEnableSingleSelectionMode (button->getToggleState());
@@ -190,11 +520,63 @@ void VirtualRefCanvas::comboBoxChanged (ComboBox* cb)
 {
     if (cb == presetNamesBox.get() || cb == channelCountBox.get())
     {
-        String presetName = presetNames[presetNamesBox->getSelectedId() - 1];
-        String s = channelCounts[channelCountBox->getSelectedId() - 1];
-        int numChannels = s.getIntValue();
-        display->applyPreset (presetName, numChannels);
+        applySelectedPreset();
     }
+    else if (cb == groupSizeBox.get() || cb == bankBox.get())
+    {
+        int bankId = bankBox->getSelectedId();
+        display->setPresetLayout (groupSizeBox->getSelectedId(), bankId == 1 ? 0 : bankId == 2 ? -1 : bankId);
+        applySelectedPreset();
+    }
+    else if (cb == statisticBox.get())
+    {
+        processor->setReferenceStatistic ((ReferencePlan::Statistic) (cb->getSelectedId() - 1));
+        updateAdaptationControls();
+    }
+    else if (cb == badChannelBox.get())
+    {
+        processor->setBadChannelMode ((VirtualRef::BadChannelMode) (cb->getSelectedId() - 1));
+    }
+}
+
+void VirtualRefCanvas::applySelectedPreset()
+{
+    String presetName = presetNames[presetNamesBox->getSelectedId() - 1];
+    String s = channelCounts[channelCountBox->getSelectedId() - 1];
+    int numChannels = s.getIntValue();
+    display->applyPreset (presetName, numChannels);
+}
+
+void VirtualRefCanvas::updateChannelQuality()
+{
+    display->updateChannelQuality();
+}
+
+void VirtualRefCanvas::updateTiming()
+{
+    ProcessingMonitor::Window timing = processor->getTiming();
+    ProcessingMonitor::Summary summary = ProcessingMonitor::summarize (timing);
+
+    if (summary.numBlocks == 0)
+    {
+        timingLabel->setText (String(), dontSendNotification);
+        return;
+    }
+
+    String text = "p50 " + String (summary.medianSeconds * 1.0e3, 2) + " ms"
+                  + "  p99 " + String (summary.p99Seconds * 1.0e3, 2) + " ms"
+                  + "  max " + String (summary.maxSeconds * 1.0e3, 2) + " ms"
+                  + "  " + String (summary.nsPerChannelSample, 2) + " ns/sample/ch"
+                  + "  " + String (summary.budgetFraction * 100.0, 1) + " % of budget";
+
+    // the CPU time of each stream's jobs, per block
+    String tooltip;
+
+    for (size_t s = 0; s < timing.streamSeconds.size(); s++)
+        tooltip += "Stream " + String ((int) s + 1) + ": " + String (timing.streamSeconds[s] * 1.0e3 / summary.numBlocks, 3) + " ms CPU per block\n";
+
+    timingLabel->setText (text, dontSendNotification);
+    timingLabel->setTooltip (tooltip.trim());
 }
 
 void VirtualRefCanvas::sliderValueChanged (Slider* slider)
@@ -203,12 +585,32 @@ void VirtualRefCanvas::sliderValueChanged (Slider* slider)
     {
         processor->setGlobalGain (gainSlider->getValue());
     }
+    else if (slider == weightSlider.get())
+    {
+        display->setSelectionWeight ((float) weightSlider->getValue());
+    }
+    else if (slider == saturationSlider.get())
+    {
+        processor->setSaturationThreshold ((float) saturationSlider->getValue());
+    }
+    else if (slider == stepSizeSlider.get())
+    {
+        processor->setAdaptiveStepSize ((float) stepSizeSlider->getValue());
+    }
+    else if (slider == radiusSlider.get() || slider == excludeSlider.get())
+    {
+        display->setLocalNeighbourhood ((float) radiusSlider->getValue(), (int) excludeSlider->getValue());
+
+        if (presetNames[presetNamesBox->getSelectedId() - 1] == "Local average")
+            applySelectedPreset();
+    }
 }
 
 // ----------------------------------------------------------------
 
-VirtualRefDisplay::VirtualRefDisplay (VirtualRef* n, VirtualRefCanvas* c, Viewport* v, bool selectMode) : processor (n), canvas (c), viewport (v), nChannelsBefore (-1), singleSelectMode (selectMode), refMatrix (nullptr)
+VirtualRefDisplay::VirtualRefDisplay (VirtualRef* n, VirtualRefCanvas* c, Viewport* v, bool selectMode) : nChannelsBefore (-1), zoom (1.0f), selectionWeight (1.0f), localRadius (100.0f), localExcludeNearest (2), presetGroupSize (4), presetBankSize (0), singleSelectMode (selectMode), selectedRow (-1), selectedColumn (-1), processor (n), canvas (c), viewport (v), refMatrix (nullptr)
 {
+    setOpaque (true);
     addKeyListener (this);
     update();
 }
@@ -223,136 +625,40 @@ void VirtualRefDisplay::drawTable()
 
     if (nChannels != nChannelsBefore)
     {
-        /* Move these values somewhere else? */
-        int xOffset = 50;
-        int yOffset = 1;
-        int cellWidth = 19;
-        int cellHeight = 15;
-        int vSpace = 1;
-        int headerHeight = 20;
-        int carWidth = 35;
-
-        int totalWidth = xOffset + carWidth + nChannels * cellWidth;
-        int totalHeigth = yOffset + headerHeight + nChannels * (cellHeight + vSpace);
-
-        headerLabels.clear();
-        rowLabels.clear();
-        electrodeButtons.clear();
-        carButtons.clear();
-
-        /* Create header */
-        Font font ("Fira Sans", "Bold", 14.0f);
-
-        Label* header1 = new Label ("headerCol1", "Channel");
-        header1->setJustificationType (Justification::horizontallyCentred);
-        header1->setBounds (0, yOffset, xOffset, headerHeight);
-        header1->setFont (font);
-        addAndMakeVisible (header1);
-
-        headerLabels.add (header1);
-
-        Label* header2 = new Label ("headerCol2", "");
-        header2->setJustificationType (Justification::horizontallyCentred);
-        header2->setBounds (xOffset, yOffset, carWidth, headerHeight);
-        header2->setFont (font);
-        addAndMakeVisible (header2);
-
-        headerLabels.add (header2);
-
-        Label* header3 = new Label ("headerCol3", "Reference(s)");
-        header3->setJustificationType (Justification::horizontallyCentred);
-        header3->setBounds (xOffset + carWidth, yOffset, totalWidth - xOffset - carWidth, headerHeight);
-        header3->setFont (font);
-        addAndMakeVisible (header3);
-
-        headerLabels.add (header3);
-
-        /* Add button matrix */
-        for (int i = 0; i < nChannels; i++)
-        {
-            /* Row label */
-            Label* label = new Label (String::formatted ("row_label_%d", i), String::formatted ("%d", i + 1));
-            label->setJustificationType (Justification::horizontallyCentred);
-            label->setBounds (0, yOffset + headerHeight + i * (cellHeight + vSpace), xOffset, cellHeight);
-            label->setFont (font);
-            addAndMakeVisible (label);
-
-            rowLabels.add (label);
-
-            /* Button to select all channels as reference (aka common average reference) */
-            CarButton* cb = new CarButton ("all", i);
-            cb->setToggleState (false, dontSendNotification);
-            cb->setBounds (xOffset + 5, yOffset + headerHeight + i * (cellHeight + vSpace), carWidth - 10, cellHeight);
-            cb->addListener (this);
-            cb->setRadioGroupId (0);
-            addAndMakeVisible (cb);
-
-            carButtons.add (cb);
-
-            for (int j = 0; j < nChannels; j++)
-            {
-                bool state = refMatrix->getValue (i, j) > 0;
-
-                ElectrodeTableButton* button = new ElectrodeTableButton (j + 1, i, j);
-                button->setToggleState (state, dontSendNotification);
-                button->setRadioGroupId (0);
-                button->setBounds (xOffset + carWidth + j * cellWidth, yOffset + headerHeight + i * (cellHeight + vSpace), cellWidth, cellHeight);
-                button->addListener (this);
-                addAndMakeVisible (button);
-
-                electrodeButtons.add (button);
-            }
-        }
-
-        setSize (totalWidth, totalHeigth);
-        setBounds (0, 0, totalWidth, totalHeigth);
+        selectedRow = -1;
+        selectedColumn = -1;
         nChannelsBefore = nChannels;
     }
-    else
-    {
-        /* Only update toggle states of buttons */
-        int numRefs = 0;
-        for (int i = 0; i < nChannels; i++)
-        {
-            for (int j = 0; j < nChannels; j++)
-            {
-                bool state = refMatrix->getValue (i, j) > 0;
-
-                if (state)
-                    numRefs++;
 
-                ElectrodeTableButton* button = electrodeButtons[i * nChannels + j];
-                button->setToggleState (state, dontSendNotification);
-            }
+    setSize (xOffset + carWidth + nChannels * getCellWidth(),
+             yOffset + headerHeight + nChannels * getRowHeight());
 
-            if (numRefs == nChannels)
-                carButtons[i]->setToggleState (true, dontSendNotification);
-            else
-                carButtons[i]->setToggleState (false, dontSendNotification);
+    repaint();
+    updateSnapshot();
+}
 
-            numRefs = 0;
-        }
-    }
+void VirtualRefDisplay::updateSnapshot()
+{
+    int nChannels = refMatrix->getNumberOfChannels();
 
-    // Update Editor snapshot image
+    // the preview samples the matrix at its own resolution, so it costs
+    // the same for any number of channels
+    int size = jlimit (1, 96, nChannels);
 
-    Image refImage (Image::PixelFormat::RGB, nChannels, nChannels, false);
+    Image refImage (Image::PixelFormat::RGB, size, size, false);
     refImage.clear (refImage.getBounds(), findColour (ThemeColours::widgetBackground));
 
-    for (int i = 0; i < nChannels; i++)
+    for (int y = 0; y < size && nChannels > 0; y++)
     {
-        for (int j = 0; j < nChannels; j++)
+        for (int x = 0; x < size; x++)
         {
-            bool state = refMatrix->getValue (i, j) > 0;
-
-            if (state)
+            if (refMatrix->getValue (y * nChannels / size, x * nChannels / size) > 0)
             {
-                refImage.setPixelAt (j, i, findColour (ThemeColours::highlightedFill));
+                refImage.setPixelAt (x, y, findColour (ThemeColours::highlightedFill));
             }
         }
     }
 
-    refImage.rescaled (96, 96, Graphics::ResamplingQuality::highResamplingQuality);
     VirtualRefEditor* editor = dynamic_cast<VirtualRefEditor*> (processor->getEditor());
     editor->setSnapshot (refImage);
 }
@@ -368,10 +674,8 @@ void VirtualRefDisplay::update()
     else // clear everything
     {
         refMatrix = nullptr;
-        headerLabels.clear();
-        rowLabels.clear();
-        electrodeButtons.clear();
-        carButtons.clear();
+        nChannelsBefore = -1;
+        setSize (0, 0);
 
         Image blankImage (Image::PixelFormat::RGB, 95, 95, false);
         blankImage.clear (blankImage.getBounds(), findColour (ThemeColours::widgetBackground));
@@ -385,200 +689,446 @@ void VirtualRefDisplay::reset()
     if (refMatrix)
     {
         refMatrix->clear();
-
-        for (auto button : carButtons)
-            button->setToggleState (false, dontSendNotification);
+        processor->updateReferencePlan();
 
         update();
     }
 }
 
+void VirtualRefDisplay::setPresetLayout (int groupSize, int bankSize)
+{
+    presetGroupSize = groupSize;
+    presetBankSize = bankSize;
+}
+
+void VirtualRefDisplay::setLocalNeighbourhood (float radius, int excludeNearest)
+{
+    localRadius = radius;
+    localExcludeNearest = excludeNearest;
+}
+
+void VirtualRefDisplay::setSelectionWeight (float weight)
+{
+    selectionWeight = weight;
+}
+
 void VirtualRefDisplay::setEnableSingleSelectionMode (bool mode)
 {
     singleSelectMode = mode;
 
-    if (mode)
+    // rows that select every channel cannot be kept in single mode
+    if (mode && refMatrix)
     {
-        for (auto button : carButtons)
+        bool cleared = false;
+
+        for (int i = 0; i < refMatrix->getNumberOfChannels(); i++)
         {
-            button->setToggleState (false, sendNotification);
-            button->setEnabled (false);
+            if (refMatrix->allChannelReferencesActive (i))
+            {
+                refMatrix->clearChannel (i);
+                cleared = true;
+            }
         }
+
+        if (cleared)
+            processor->updateReferencePlan();
+
+        update();
     }
-    else
-    {
-        for (auto button : carButtons)
-            button->setEnabled (true);
-    }
+
+    repaint();
 }
 
-void VirtualRefDisplay::paint (Graphics& g)
+void VirtualRefDisplay::setZoom (float newZoom, Point<int> anchor)
 {
-    g.fillAll (findColour (ThemeColours::componentBackground));
+    newZoom = jlimit (minZoom, maxZoom, newZoom);
+
+    if (newZoom == zoom || refMatrix == nullptr)
+        return;
+
+    int left = xOffset + carWidth;
+    int top = yOffset + headerHeight;
+
+    // the cell under the anchor stays where it is on screen
+    Point<int> onScreen = anchor - viewport->getViewPosition();
+    float column = (anchor.x - left) / (float) getCellWidth();
+    float row = (anchor.y - top) / (float) getRowHeight();
+
+    zoom = newZoom;
+    drawTable();
+
+    viewport->setViewPosition (left + roundToInt (column * getCellWidth()) - onScreen.x,
+                               top + roundToInt (row * getRowHeight()) - onScreen.y);
 }
 
-void VirtualRefDisplay::buttonClicked (Button* b)
+int VirtualRefDisplay::getRowAt (Point<int> position) const
 {
-    selectedRow = -1;
-    selectedColumn = -1;
+    int y = position.y - yOffset - headerHeight;
 
-    if (b->getButtonText().startsWith ("all"))
-    {
-        CarButton* button = dynamic_cast<CarButton*> (b);
-        int channelIndex = button->getChannelNum();
+    if (y < 0 || nChannelsBefore < 0)
+        return -1;
 
-        float* chan = refMatrix->getChannel (channelIndex);
+    int row = y / getRowHeight();
 
-        float value;
-        button->getToggleState() ? value = 1 : value = 0;
+    return row < nChannelsBefore ? row : -1;
+}
 
-        for (int i = 0; i < refMatrix->getNumberOfChannels(); i++)
-        {
-            chan[i] = value;
-        }
-    }
-    else
+int VirtualRefDisplay::getColumnAt (Point<int> position) const
+{
+    int x = position.x - xOffset - carWidth;
+
+    if (x < 0 || nChannelsBefore < 0)
+        return -1;
+
+    int column = x / getCellWidth();
+
+    return column < nChannelsBefore ? column : -1;
+}
+
+void VirtualRefDisplay::paint (Graphics& g)
+{
+    g.fillAll (findColour (ThemeColours::componentBackground));
+
+    if (refMatrix == nullptr)
+        return;
+
+    int nChannels = nChannelsBefore;
+    int cellW = getCellWidth();
+    int rowH = getRowHeight();
+    int left = xOffset + carWidth;
+    int top = yOffset + headerHeight;
+
+    Colour background = findColour (ThemeColours::componentBackground);
+    Colour unselected = findColour (ThemeColours::widgetBackground);
+    Colour selected = findColour (ThemeColours::highlightedFill);
+    Colour text = findColour (Label::textColourId);
+
+    Font font ("Fira Sans", "Bold", 14.0f);
+    g.setFont (font);
+
+    /* Header */
+    Rectangle<int> clip = g.getClipBounds();
+
+    if (clip.getY() < top)
     {
-        ElectrodeTableButton* button = dynamic_cast<ElectrodeTableButton*> (b);
+        g.setColour (text);
+        g.drawText ("Channel", 0, yOffset, xOffset, headerHeight, Justification::centred);
+        g.drawText ("Reference(s)", left, yOffset, jmin (getWidth() - left, viewport->getViewWidth()), headerHeight, Justification::centredLeft);
+    }
 
-        int rowIndex = button->getRowIndex();
-        int colIndex = button->getColIndex();
-        bool state = button->getToggleState();
+    /* Only the rows and columns inside the clip region */
+    int firstRow = jlimit (0, nChannels, (clip.getY() - top) / rowH);
+    int lastRow = jlimit (0, nChannels, (clip.getBottom() - top + rowH - 1) / rowH);
+    int firstColumn = jlimit (0, nChannels, (clip.getX() - left) / cellW);
+    int lastColumn = jlimit (0, nChannels, (clip.getRight() - left + cellW - 1) / cellW);
 
-        if (singleSelectMode)
+    if (firstRow >= lastRow)
+        return;
+
+    /* Row labels and "all" toggles */
+    if (clip.getX() < left)
+    {
+        float labelScale = jmin (1.0f, rowH / (float) (cellHeight + vSpace));
+        g.setFont (font.withHeight (14.0f * labelScale));
+
+        for (int i = firstRow; i < lastRow; i++)
         {
-            int nChannels = refMatrix->getNumberOfChannels();
-            for (int i = 0; i < nChannels; i++)
+            int y = top + i * rowH;
+            int h = jmax (1, rowH - vSpace);
+
+            auto quality = i < (int) channelQuality.size() ? channelQuality[i] : ChannelStatistics::Quality::Good;
+
+            if (rowH >= 8)
             {
-                refMatrix->setValue (rowIndex, i, 0);
+                g.setColour (quality == ChannelStatistics::Quality::Flat    ? Colours::grey
+                             : quality == ChannelStatistics::Quality::Noisy ? Colours::orangered
+                                                                            : text);
+                g.drawText (String (i + 1), 0, y, xOffset, h, Justification::centred);
             }
-            refMatrix->setValue (rowIndex, colIndex, 1.);
 
-            selectedRow = rowIndex;
-            selectedColumn = colIndex;
-        }
-        else
-        {
-            refMatrix->setValue (rowIndex, colIndex, (float) state);
+            bool allSelected = ! singleSelectMode && refMatrix->allChannelReferencesActive (i);
+
+            g.setColour (allSelected ? selected : unselected.withMultipliedAlpha (singleSelectMode ? 0.4f : 1.0f));
+            g.fillRoundedRectangle ((float) xOffset + 5, (float) y, (float) carWidth - 10, (float) h, jmin (3.0f, h / 2.0f));
+
+            if (rowH >= 12)
+            {
+                g.setColour (text.withMultipliedAlpha (singleSelectMode ? 0.4f : 1.0f));
+                g.drawText ("all", xOffset + 5, y, carWidth - 10, h, Justification::centred);
+            }
         }
     }
 
-    update();
-}
-
-void VirtualRefDisplay::applyPreset (String name, int numChannels)
-{
-    if (! refMatrix)
+    if (firstColumn >= lastColumn)
         return;
 
-    int nChannels = refMatrix->getNumberOfChannels();
+    /* Cells, one pixel each, scaled up without smoothing */
+    int numRows = lastRow - firstRow;
+    int numColumns = lastColumn - firstColumn;
+
+    Image cells (Image::PixelFormat::ARGB, numColumns, numRows, false);
 
-    if (name.equalsIgnoreCase ("Other tetrode electrodes"))
     {
-        nChannels = MIN (nChannels, numChannels);
-        refMatrix->clear();
+        Image::BitmapData bitmap (cells, Image::BitmapData::writeOnly);
 
-        int nTetrodes = nChannels / 4;
-        for (int i = 0; i < nTetrodes; i++)
+        for (int i = 0; i < numRows; i++)
         {
-            for (int j = 0; j < 4; j++)
+            for (int j = 0; j < numColumns; j++)
             {
-                int channelIndex = i * 4 + j;
-                for (int k = 0; k < 4; k++)
-                {
-                    if (j != k)
-                    {
-                        refMatrix->setValue (channelIndex, i * 4 + k, 1);
-                    }
-                }
+                float value = refMatrix->getValue (firstRow + i, firstColumn + j);
+
+                // selected cells with lower weights are drawn fainter
+                bitmap.setPixelColour (j, i, value > 0 ? unselected.interpolatedWith (selected, 0.3f + 0.7f * jmin (value, 1.0f)) : unselected);
             }
         }
+    }
 
-        drawTable();
+    g.setImageResamplingQuality (Graphics::lowResamplingQuality);
+    g.drawImage (cells,
+                 left + firstColumn * cellW,
+                 top + firstRow * rowH,
+                 numColumns * cellW,
+                 numRows * rowH,
+                 0,
+                 0,
+                 numColumns,
+                 numRows);
+
+    /* Gaps between the cells, once they are large enough to show them */
+    int gridTop = top + firstRow * rowH;
+    int gridBottom = top + lastRow * rowH;
+    int gridLeft = left + firstColumn * cellW;
+    int gridRight = left + lastColumn * cellW;
+
+    g.setColour (background);
+
+    if (cellW >= 4)
+    {
+        for (int j = firstColumn; j <= lastColumn; j++)
+            g.fillRect (left + j * cellW, gridTop, 1, gridBottom - gridTop);
     }
-    else if (name.equalsIgnoreCase ("All tetrode electrodes"))
+
+    if (rowH >= 4)
     {
-        nChannels = MIN (nChannels, numChannels);
-        refMatrix->clear();
+        for (int i = firstRow; i < lastRow; i++)
+            g.fillRect (gridLeft, top + (i + 1) * rowH - vSpace, gridRight - gridLeft, vSpace);
+    }
+
+    /* Channel numbers inside the cells */
+    if (cellW >= 16 && rowH >= 12)
+    {
+        g.setFont (Font ("Fira Sans", "SemiBold", 10.0f * jmin (zoom, 1.5f)));
+        g.setColour (text);
 
-        int nTetrodes = nChannels / 4;
-        for (int i = 0; i < nTetrodes; i++)
+        for (int i = firstRow; i < lastRow; i++)
         {
-            for (int j = 0; j < 4; j++)
-            {
-                int channelIndex = i * 4 + j;
-                for (int k = 0; k < 4; k++)
-                {
-                    refMatrix->setValue (channelIndex, i * 4 + k, 1);
-                }
-            }
+            for (int j = firstColumn; j < lastColumn; j++)
+                g.drawText (String (j + 1), left + j * cellW, top + i * rowH, cellW, rowH - vSpace, Justification::centred);
         }
+    }
 
-        drawTable();
+    /* Shade the reference columns of excluded and down-weighted channels */
+    for (int j = firstColumn; j < jmin (lastColumn, (int) columnScale.size()); j++)
+    {
+        if (columnScale[j] >= 1.0f)
+            continue;
+
+        g.setColour (Colours::black.withAlpha (0.6f * (1.0f - columnScale[j])));
+        g.fillRect (left + j * cellW, gridTop, cellW, gridBottom - gridTop);
     }
-    else if (name.equalsIgnoreCase ("Common average reference"))
+
+    /* Cell selected in single mode */
+    if (singleSelectMode && selectedRow >= firstRow && selectedRow < lastRow && selectedColumn >= firstColumn && selectedColumn < lastColumn)
     {
-        nChannels = MIN (nChannels, numChannels);
-        refMatrix->clear();
-        for (int i = 0; i < nChannels; i++)
-        {
-            for (int j = 0; j < nChannels; j++)
-            {
-                refMatrix->setValue (i, j, 1);
-            }
-        }
+        g.setColour (text);
+        g.drawRect (left + selectedColumn * cellW, top + selectedRow * rowH, cellW, jmax (1, rowH - vSpace), 1);
+    }
+}
 
-        drawTable();
+void VirtualRefDisplay::updateChannelQuality()
+{
+    channelQuality = processor->getChannelQuality();
+    columnScale = processor->getChannelScale();
+
+    repaint();
+}
+
+String VirtualRefDisplay::getTooltip()
+{
+    Point<int> position = getMouseXYRelative();
+    int row = getRowAt (position);
+
+    if (row < 0 || refMatrix == nullptr)
+        return String();
+
+    if (position.x < xOffset)
+    {
+        auto quality = row < (int) channelQuality.size() ? channelQuality[row] : ChannelStatistics::Quality::Good;
+
+        if (quality == ChannelStatistics::Quality::Flat)
+            return "Flat: left out of the references";
+        else if (quality == ChannelStatistics::Quality::Noisy)
+            return "Noisy: left out of the references";
+        else if (row < (int) columnScale.size() && columnScale[row] < 1.0f)
+            return "Noise weight " + String (columnScale[row], 2);
+
+        return String();
     }
-    else if (name.equalsIgnoreCase ("Avg of other tetrodes"))
+
+    if (position.x < xOffset + carWidth)
+        return "Use all channels as references for channel " + String (row + 1);
+
+    int column = getColumnAt (position);
+
+    if (column < 0)
+        return String();
+
+    float value = refMatrix->getValue (row, column);
+    String tooltip = "Channel " + String (row + 1) + ", reference " + String (column + 1);
+
+    if (value > 0 && value != 1.0f)
+        tooltip += ": weight " + String (value, 2);
+
+    return tooltip;
+}
+
+void VirtualRefDisplay::mouseWheelMove (const MouseEvent& event, const MouseWheelDetails& wheel)
+{
+    if (event.mods.isCommandDown() && wheel.deltaY != 0)
+        setZoom (zoom * (wheel.deltaY > 0 ? 1.25f : 0.8f), event.getPosition());
+    else
+        Component::mouseWheelMove (event, wheel);
+}
+
+void VirtualRefDisplay::mouseDown (const MouseEvent& event)
+{
+    if (refMatrix == nullptr)
+        return;
+
+    int rowIndex = getRowAt (event.getPosition());
+
+    if (rowIndex < 0 || event.x < xOffset)
+        return;
+
+    if (event.x < xOffset + carWidth)
     {
-        nChannels = MIN (nChannels, numChannels);
-        refMatrix->clear();
+        /* Select all channels as reference (aka common average reference) */
+        if (singleSelectMode)
+            return;
+
+        selectedRow = -1;
+        selectedColumn = -1;
 
-        /* Activate all channels and deselect channels at the same tetrode */
-        int nTetrodes = nChannels / 4;
-        refMatrix->setAll (1, nChannels);
-        for (int i = 0; i < nTetrodes; i++)
+        bool allSelected = refMatrix->allChannelReferencesActive (rowIndex);
+
+        refMatrix->clearChannel (rowIndex);
+
+        if (! allSelected)
         {
-            for (int j = 0; j < 4; j++)
+            for (int i = 0; i < refMatrix->getNumberOfChannels(); i++)
             {
-                int channelIndex = i * 4 + j;
-                for (int k = 0; k < 4; k++)
-                {
-                    refMatrix->setValue (channelIndex, i * 4 + k, 0);
-                }
+                refMatrix->setValue (rowIndex, i, selectionWeight);
             }
         }
+    }
+    else
+    {
+        int colIndex = getColumnAt (event.getPosition());
 
-        drawTable();
+        if (colIndex < 0)
+            return;
+
+        bool isSelected = refMatrix->getValue (rowIndex, colIndex) > 0;
+
+        selectedRow = -1;
+        selectedColumn = -1;
+
+        if (singleSelectMode)
+        {
+            refMatrix->clearChannel (rowIndex);
+            refMatrix->setValue (rowIndex, colIndex, selectionWeight);
+
+            selectedRow = rowIndex;
+            selectedColumn = colIndex;
+        }
+        else if (event.mods.isShiftDown() && isSelected)
+        {
+            // shift-clicking a selected cell changes its weight instead of deselecting it
+            refMatrix->setValue (rowIndex, colIndex, selectionWeight);
+        }
+        else
+        {
+            refMatrix->setValue (rowIndex, colIndex, isSelected ? 0.0f : selectionWeight);
+        }
     }
-    else if (name.equalsIgnoreCase ("Avg of next tetrode"))
+
+    processor->updateReferencePlan();
+
+    update();
+}
+
+void VirtualRefDisplay::applyPreset (String name, int numChannels)
+{
+    if (! refMatrix)
+        return;
+
+    int nChannels = MIN (refMatrix->getNumberOfChannels(), numChannels);
+
+    if (name.equalsIgnoreCase ("Local average"))
     {
-        nChannels = MIN (nChannels, numChannels);
         refMatrix->clear();
 
-        int nTetrodes = nChannels / 4;
+        /* Sites near each channel, by the positions of the current stream */
+        ChannelGeometry geometry = processor->getChannelGeometry();
+        auto references = geometry.getLocalReferences (localRadius, localExcludeNearest);
 
-        for (int i = 0; i < nTetrodes; i++)
+        for (int i = 0; i < nChannels && i < (int) references.size(); i++)
         {
-            for (int j = 0; j < 4; j++)
+            std::vector<ReferenceMatrix::Reference> row;
+
+            for (int j : references[i])
             {
-                for (int k = 0; k < 4; k++)
-                {
-                    if (i < nTetrodes - 1)
-                    {
-                        refMatrix->setValue (i * 4 + j, (i + 1) * 4 + k, 1);
-                    }
-                    else
-                    {
-                        refMatrix->setValue (i * 4 + j, (i - 1) * 4 + k, 1);
-                    }
-                }
+                if (j < nChannels)
+                    row.push_back ({ j, 1.0f });
             }
+
+            refMatrix->setReferences (i, std::move (row));
         }
 
+        processor->updateReferencePlan();
         drawTable();
+        return;
     }
+
+    ReferencePreset preset;
+
+    if (name.equalsIgnoreCase ("Common average reference"))
+        preset = ReferencePreset (ReferencePreset::Scope::AllChannels, true);
+    else if (name.equalsIgnoreCase ("Avg of all other channels"))
+        preset = ReferencePreset (ReferencePreset::Scope::AllChannels, false);
+    else if (name.equalsIgnoreCase ("Avg of other groups"))
+        preset = ReferencePreset (ReferencePreset::Scope::OtherGroups, false);
+    else if (name.equalsIgnoreCase ("Avg of next group"))
+        preset = ReferencePreset (ReferencePreset::Scope::NextGroup, false);
+    else if (name.equalsIgnoreCase ("Other electrodes of group"))
+        preset = ReferencePreset (ReferencePreset::Scope::OwnGroup, false);
+    else if (name.equalsIgnoreCase ("All electrodes of group"))
+        preset = ReferencePreset (ReferencePreset::Scope::OwnGroup, true);
+    else
+        return;
+
+    preset.groupSize = presetGroupSize;
+
+    /* Banks of consecutive channels, or the shanks of the probe */
+    if (presetBankSize < 0)
+        preset.channelBank = processor->getChannelGeometry().getShanks();
+    else
+        preset.channelBank = ReferencePreset::consecutiveBanks (nChannels, presetBankSize);
+
+    preset.apply (refMatrix, nChannels);
+
+    processor->updateReferencePlan();
+    drawTable();
 }
 
 /*
@@ -28,9 +28,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <VisualizerEditorHeaders.h>
 #include <VisualizerWindowHeaders.h>
 
+#include "Engine/ReferencePreset.h"
 #include "VirtualRef.h"
 
-class ElectrodeTableButton;
 class VirtualRefDisplay;
 
 class VirtualRefCanvas : public Visualizer,
@@ -75,6 +75,12 @@ public:
     /** Respond to slider changes*/
     void sliderValueChanged (Slider* slider) override;
 
+    /** Shows the processor's latest channel assessment in the table */
+    void updateChannelQuality();
+
+    /** Shows the processing time recorded since acquisition started */
+    void updateTiming();
+
 private:
     std::unique_ptr<VirtualRefDisplay> display;
     VirtualRef* processor;
@@ -84,6 +90,10 @@ private:
     std::unique_ptr<Label> presetNamesLabel;
     std::unique_ptr<ComboBox> channelCountBox;
     std::unique_ptr<Label> channelCountLabel;
+    std::unique_ptr<Label> groupSizeLabel;
+    std::unique_ptr<ComboBox> groupSizeBox;
+    std::unique_ptr<Label> bankLabel;
+    std::unique_ptr<ComboBox> bankBox;
     StringArray presetNames;
     StringArray channelCounts;
 
@@ -93,7 +103,41 @@ private:
     std::unique_ptr<UtilityButton> loadButton;
     std::unique_ptr<Slider> gainSlider;
 
-    OwnedArray<ElectrodeTableButton> electrodeButtons;
+    std::unique_ptr<Label> weightLabel;
+    std::unique_ptr<Slider> weightSlider;
+    std::unique_ptr<UtilityButton> normalizeButton;
+
+    std::unique_ptr<Label> statisticLabel;
+    std::unique_ptr<ComboBox> statisticBox;
+
+    std::unique_ptr<Label> saturationLabel;
+    std::unique_ptr<Slider> saturationSlider;
+
+    std::unique_ptr<Label> badChannelLabel;
+    std::unique_ptr<ComboBox> badChannelBox;
+
+    std::unique_ptr<Label> stepSizeLabel;
+    std::unique_ptr<Slider> stepSizeSlider;
+    std::unique_ptr<UtilityButton> freezeButton;
+    std::unique_ptr<UtilityButton> relearnButton;
+
+    std::unique_ptr<UtilityButton> probeMapButton;
+    std::unique_ptr<Label> radiusLabel;
+    std::unique_ptr<Slider> radiusSlider;
+    std::unique_ptr<Label> excludeLabel;
+    std::unique_ptr<Slider> excludeSlider;
+
+    std::unique_ptr<UtilityButton> timingButton;
+    std::unique_ptr<UtilityButton> timingLogButton;
+    std::unique_ptr<Label> timingLabel;
+
+    std::unique_ptr<UtilityButton> publishButton;
+
+    /** Applies the selected preset for the selected number of channels */
+    void applySelectedPreset();
+
+    /** Enables the adaptation controls if the current stream is adaptive */
+    void updateAdaptationControls();
 
     int scrollBarThickness;
     int scrollDistance;
@@ -101,38 +145,24 @@ private:
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (VirtualRefCanvas);
 };
 
-class ElectrodeTableButton : public ElectrodeButton
-{
-public:
-    ElectrodeTableButton (int index, int rowIndex_, int colIndex_) : ElectrodeButton (index), rowIndex (rowIndex_), colIndex (colIndex_)
-    {
-    }
+/**
 
-    int getRowIndex()
-    {
-        return rowIndex;
-    }
+  Reference matrix table
 
-    int getColIndex()
-    {
-        return colIndex;
-    }
+  Paints the rows of the reference matrix as a grid of cells, with the
+  channel numbers and an "all" toggle in front of each row. Nothing is a
+  component of its own: paint() only renders the rows and columns inside
+  the clip region (the visible part of the viewport), one pixel per cell
+  scaled up, and clicks are mapped back to cells, so opening and
+  scrolling the table costs the same for any number of channels.
 
-private:
-    int rowIndex;
-    int colIndex;
-};
+  Command + mouse wheel zooms the grid around the mouse position.
 
-class CarButton : public ElectrodeButton
-{
-public:
-    CarButton (String label_, int channelIndex_) : ElectrodeButton (channelIndex_)
-    {
-        setButtonText (label_);
-    }
-};
+*/
 
-class VirtualRefDisplay : public Component, public Button::Listener, public KeyListener
+class VirtualRefDisplay : public Component,
+                          public TooltipClient,
+                          public KeyListener
 {
 public:
     /** Constructor */
@@ -141,17 +171,24 @@ public:
     /** Destructor */
     ~VirtualRefDisplay();
 
-    void paint (Graphics& g);
+    /** Paints the visible part of the table */
+    void paint (Graphics& g) override;
+
+    /** Toggles the clicked cell, or all cells of a row */
+    void mouseDown (const MouseEvent& event) override;
+
+    /** Zooms with the command key held down, else scrolls the viewport */
+    void mouseWheelMove (const MouseEvent& event, const MouseWheelDetails& wheel) override;
+
+    /** Describes the cell or channel under the mouse */
+    String getTooltip() override;
 
     /** Updates the reference matrix view*/
     void update();
 
-    /** Respond to combo box changes*/
-    void buttonClicked (Button* button);
-
     bool keyPressed (const KeyPress& key, Component* originatingComponent);
 
-    /** Draws the Electrode Button table from the reference matrix */
+    /** Sizes the table for the reference matrix and repaints it */
     void drawTable();
 
     /** Reset's the table channel states */
@@ -163,8 +200,68 @@ public:
     /** Apply a preset from the list */
     void applyPreset (String name, int numChannels);
 
+    /** Sets the weight given to newly selected references */
+    void setSelectionWeight (float weight);
+
+    /** Sets the layout of the group presets: groupSize consecutive
+        channels per group, and banks of bankSize consecutive channels
+        (0 = the whole stream, -1 = the shanks of the probe) */
+    void setPresetLayout (int groupSize, int bankSize);
+
+    /** Sets the neighbourhood of the "Local average" preset: the sites
+        within radius (in micrometres), except the excludeNearest nearest */
+    void setLocalNeighbourhood (float radius, int excludeNearest);
+
+    /** Marks the channels that the processor excludes or down-weights.
+        Only stores the assessment and repaints. */
+    void updateChannelQuality();
+
+    /** Scales the grid cells by zoom, keeping the point anchor (in
+        table coordinates) under the mouse */
+    void setZoom (float zoom, Point<int> anchor);
+
 private:
+    static constexpr int xOffset = 50;
+    static constexpr int yOffset = 1;
+    static constexpr int cellWidth = 19;
+    static constexpr int cellHeight = 15;
+    static constexpr int vSpace = 1;
+    static constexpr int headerHeight = 20;
+    static constexpr int carWidth = 35;
+
+    /** Zoom limits; at the smallest, a cell is a single pixel wide */
+    static constexpr float minZoom = 1.0f / cellWidth;
+    static constexpr float maxZoom = 3.0f;
+
+    /** Width of a cell at the current zoom */
+    int getCellWidth() const { return jmax (1, roundToInt (cellWidth * zoom)); }
+
+    /** Height of a row, including the space below it, at the current zoom */
+    int getRowHeight() const { return jmax (1, roundToInt ((cellHeight + vSpace) * zoom)); }
+
+    /** Row under a point of the table, or -1 */
+    int getRowAt (Point<int> position) const;
+
+    /** Column of the cell under a point of the table, -1 if the point is
+        not over a cell */
+    int getColumnAt (Point<int> position) const;
+
+    /** Updates the preview image of the editor */
+    void updateSnapshot();
+
+    /** Source scale of each channel, as last reported by the processor */
+    std::vector<float> columnScale;
+
+    /** Assessment of each channel, as last reported by the processor */
+    std::vector<ChannelStatistics::Quality> channelQuality;
+
     int nChannelsBefore;
+    float zoom;
+    float selectionWeight;
+    float localRadius;
+    int localExcludeNearest;
+    int presetGroupSize;
+    int presetBankSize;
     bool singleSelectMode;
     int selectedRow;
     int selectedColumn;
@@ -174,11 +271,6 @@ private:
     Viewport* viewport;
     ReferenceMatrix* refMatrix;
 
-    OwnedArray<ElectrodeTableButton> electrodeButtons;
-    OwnedArray<CarButton> carButtons;
-    OwnedArray<Label> rowLabels;
-    OwnedArray<Label> headerLabels;
-
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (VirtualRefDisplay);
 };
 
@@ -58,9 +58,40 @@ void PreviewImageComponent::setImage (juce::Image& img)
 VirtualRefEditor::VirtualRefEditor (GenericProcessor* parentNode)
     : VisualizerEditor (parentNode, "Virtual Ref"), chanRefCanvas (nullptr)
 {
+    desiredWidth = 230;
+
     canvasSnapshot = std::make_unique<PreviewImageComponent> ("Canvas Snapshot");
     canvasSnapshot->setBounds (45, 26, 100, 100);
     addAndMakeVisible (canvasSnapshot.get());
+
+    threadCountLabel = std::make_unique<Label> ("ThreadCountLabel", "Threads");
+    threadCountLabel->setFont (Font ("Fira Sans", "Regular", 13.0f));
+    threadCountLabel->setBounds (155, 30, 65, 20);
+    addAndMakeVisible (threadCountLabel.get());
+
+    threadCountBox = std::make_unique<ComboBox> ("Threads");
+    threadCountBox->setTooltip ("Number of threads used to reference each block");
+
+    for (int i = 1; i <= SystemStats::getNumCpus(); i++)
+        threadCountBox->addItem (String (i), i);
+
+    threadCountBox->setSelectedId (1, dontSendNotification);
+    threadCountBox->addListener (this);
+    threadCountBox->setBounds (155, 52, 60, 20);
+    addAndMakeVisible (threadCountBox.get());
+
+    asyncButton = std::make_unique<UtilityButton> ("Async");
+    asyncButton->setTooltip ("Reference each block on the worker threads and output it one block later");
+    asyncButton->setRadius (3.0f);
+    asyncButton->setClickingTogglesState (true);
+    asyncButton->addListener (this);
+    asyncButton->setBounds (155, 82, 60, 20);
+    addAndMakeVisible (asyncButton.get());
+
+    latencyLabel = std::make_unique<Label> ("LatencyLabel", String());
+    latencyLabel->setFont (Font ("Fira Sans", "Regular", 12.0f));
+    latencyLabel->setBounds (150, 104, 75, 20);
+    addAndMakeVisible (latencyLabel.get());
 }
 
 VirtualRefEditor::~VirtualRefEditor()
@@ -109,35 +140,108 @@ void VirtualRefEditor::saveParametersDialog()
 
 void VirtualRefEditor::loadParametersDialog()
 {
-    if (! acquisitionIsActive)
-    {
-        FileChooser fc ("Choose the file name...",
-                        File::getCurrentWorkingDirectory(),
-                        "*",
-                        true);
-
-        if (fc.browseForFileToOpen())
-        {
-            File fileToOpen = fc.getResult();
-
-            VirtualRef* p = dynamic_cast<VirtualRef*> (getProcessor());
-            auto fileXml = XmlDocument::parse (fileToOpen);
-            p->loadCustomParametersFromXml (fileXml.get());
-            CoreServices::sendStatusMessage ("Loaded channel reference data from " + fileToOpen.getFullPathName());
-        }
-    }
-    else
+    // references are published to the audio thread atomically, so they
+    // can also be loaded during acquisition
+    FileChooser fc ("Choose the file name...",
+                    File::getCurrentWorkingDirectory(),
+                    "*",
+                    true);
+
+    if (fc.browseForFileToOpen())
     {
-        CoreServices::sendStatusMessage ("Stop acquisition before loading channel references.");
+        // large files take a while to parse, so they are decoded in the
+        // background and applied once ready
+        VirtualRef* p = dynamic_cast<VirtualRef*> (getProcessor());
+        p->loadSettingsFile (fc.getResult());
     }
 }
 
 void VirtualRefEditor::selectedStreamHasChanged()
 {
     updateVisualizer();
+    updateLatencyLabel();
 }
 
 void VirtualRefEditor::setSnapshot (juce::Image& canvasImage)
 {
     canvasSnapshot->setImage (canvasImage);
 }
+
+void VirtualRefEditor::comboBoxChanged (ComboBox* cb)
+{
+    if (cb == threadCountBox.get())
+    {
+        VirtualRef* p = dynamic_cast<VirtualRef*> (getProcessor());
+        p->setNumThreads (threadCountBox->getSelectedId());
+    }
+}
+
+void VirtualRefEditor::buttonClicked (Button* button)
+{
+    if (button == asyncButton.get())
+    {
+        VirtualRef* p = dynamic_cast<VirtualRef*> (getProcessor());
+        p->setAsynchronous (asyncButton->getToggleState());
+        updateLatencyLabel();
+    }
+}
+
+void VirtualRefEditor::updateSettings()
+{
+    VirtualRef* p = dynamic_cast<VirtualRef*> (getProcessor());
+
+    if (threadCountBox->indexOfItemId (p->getNumThreads()) < 0)
+        threadCountBox->addItem (String (p->getNumThreads()), p->getNumThreads());
+
+    threadCountBox->setSelectedId (p->getNumThreads(), dontSendNotification);
+    asyncButton->setToggleState (p->isAsynchronous(), dontSendNotification);
+    updateLatencyLabel();
+}
+
+void VirtualRefEditor::updateLatencyLabel()
+{
+    VirtualRef* p = dynamic_cast<VirtualRef*> (getProcessor());
+
+    if (p->getLatencySamples() == 0)
+    {
+        latencyLabel->setText ("No delay", dontSendNotification);
+        return;
+    }
+
+    String text = "+" + String (p->getLatencySamples()) + " smp";
+
+    if (auto stream = p->getDataStream (getCurrentStream()))
+        text = "+" + String (1000.0f * p->getLatencySamples() / stream->getSampleRate(), 1) + " ms";
+
+    latencyLabel->setText (text, dontSendNotification);
+    latencyLabel->setTooltip ("Output delayed by " + String (p->getLatencySamples()) + " samples. The sample numbers and timestamps of the delayed streams are moved back by the same amount, so they still line up with other streams and events.");
+}
+
+void VirtualRefEditor::startAcquisition()
+{
+    VisualizerEditor::startAcquisition();
+    threadCountBox->setEnabled (false);
+    asyncButton->setEnabled (false);
+
+    // the latency follows the host's block size
+    updateLatencyLabel();
+}
+
+void VirtualRefEditor::stopAcquisition()
+{
+    VisualizerEditor::stopAcquisition();
+    threadCountBox->setEnabled (true);
+    asyncButton->setEnabled (true);
+}
+
+void VirtualRefEditor::updateChannelQuality()
+{
+    if (chanRefCanvas != nullptr)
+        chanRefCanvas->updateChannelQuality();
+}
+
+void VirtualRefEditor::updateTiming()
+{
+    if (chanRefCanvas != nullptr)
+        chanRefCanvas->updateTiming();
+}
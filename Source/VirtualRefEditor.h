@@ -61,7 +61,9 @@ private:
 
 */
 class VirtualRefEditor : public VisualizerEditor,
-                         public DragAndDropContainer
+                         public DragAndDropContainer,
+                         public ComboBox::Listener,
+                         public Button::Listener
 {
 public:
     /** Constructor*/
@@ -85,11 +87,41 @@ public:
     /** Sets the canvas preview image for the editor*/
     void setSnapshot (juce::Image& canvasImage);
 
+    /** Respond to combo box changes*/
+    void comboBoxChanged (ComboBox* cb) override;
+
+    /** Respond to button clicks*/
+    void buttonClicked (Button* button) override;
+
+    /** Syncs the controls with the processor's settings */
+    void updateSettings() override;
+
+    /** Disables the thread and mode selection during acquisition */
+    void startAcquisition() override;
+
+    /** Re-enables the thread and mode selection */
+    void stopAcquisition() override;
+
+    /** Shows the processor's latest channel assessment in the canvas */
+    void updateChannelQuality();
+
+    /** Shows the processor's latest processing time in the canvas */
+    void updateTiming();
+
 private:
     VirtualRefCanvas* chanRefCanvas;
 
     std::unique_ptr<PreviewImageComponent> canvasSnapshot;
 
+    std::unique_ptr<Label> threadCountLabel;
+    std::unique_ptr<ComboBox> threadCountBox;
+
+    std::unique_ptr<UtilityButton> asyncButton;
+    std::unique_ptr<Label> latencyLabel;
+
+    /** Shows the latency added by the asynchronous mode */
+    void updateLatencyLabel();
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (VirtualRefEditor);
 };
 
@@ -0,0 +1,184 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+  Reference engine stress test
+
+  Runs many tiny blocks through an engine with 8 threads, in the
+  synchronous and the asynchronous mode, so that workers are often still
+  claiming jobs of one block while the next one is being added. The number
+  of streams changes from block to block, so the job count does too.
+
+  Every channel is referenced to the mean of 16 other channels of its
+  stream, and the samples are small integers, so the result is exact: a
+  job that runs twice subtracts its reference twice, a job that is skipped
+  leaves its channels unchanged, and a job that runs with the data of
+  another block writes the wrong values. The test checks that every
+  channel of every block holds exactly x_i - mean_j (x_j), i.e. that every
+  job ran exactly once per block.
+
+  Returns 0 if every check passed.
+
+*/
+
+#include "ReferenceEngine.h"
+#include "ReferenceMatrix.h"
+#include "ReferencePlan.h"
+#include "ReferenceSnapshot.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+const int numStreams = 4;
+const int numChannels = 64;
+const int numSources = 16;
+const int maxBlockSamples = 4;
+const int numBlocks = 20000;
+const int numThreads = 8;
+
+/** Input sample of a channel of a stream in a block */
+float sampleValue (int block, int stream, int channel, int sample)
+{
+    return (float) ((block * 13 + stream * 7 + channel * 5 + sample * 3) % 97);
+}
+
+float expectedValue (int block, int stream, int channel, int sample)
+{
+    float sum = 0.0f;
+
+    for (int k = 1; k <= numSources; k++)
+        sum += sampleValue (block, stream, (channel + k) % numChannels, sample);
+
+    return sampleValue (block, stream, channel, sample) - sum / numSources;
+}
+
+int runBlocks (bool asynchronous)
+{
+    ReferenceMatrix matrix (numChannels);
+
+    for (int c = 0; c < numChannels; c++)
+    {
+        for (int k = 1; k <= numSources; k++)
+            matrix.setValue (c, (c + k) % numChannels, 1.0f);
+    }
+
+    ReferencePlan plans[numStreams];
+    ReferenceSnapshot snapshots[numStreams];
+    std::vector<int> globalIndices (numChannels);
+
+    for (int s = 0; s < numStreams; s++)
+    {
+        for (int c = 0; c < numChannels; c++)
+            globalIndices[c] = s * numChannels + c;
+
+        plans[s].build (&matrix, globalIndices);
+        snapshots[s].prepare (numChannels, maxBlockSamples, numStreams * numChannels);
+    }
+
+    std::vector<float> samples ((size_t) numStreams * numChannels * maxBlockSamples);
+    std::vector<float*> channels (numStreams * numChannels);
+
+    for (int c = 0; c < numStreams * numChannels; c++)
+        channels[c] = samples.data() + (size_t) c * maxBlockSamples;
+
+    ReferenceEngine engine;
+    engine.prepare (numThreads, numStreams, numChannels, asynchronous);
+
+    int failures = 0;
+
+    for (int b = 0; b < numBlocks; b++)
+    {
+        int blockStreams = 1 + b % numStreams;
+        int numSamples = 1 + (b / numStreams) % maxBlockSamples;
+
+        for (int s = 0; s < blockStreams; s++)
+        {
+            for (int c = 0; c < numChannels; c++)
+            {
+                for (int i = 0; i < numSamples; i++)
+                    channels[s * numChannels + c][i] = sampleValue (b, s, c, i);
+            }
+        }
+
+        engine.beginBlock();
+
+        for (int s = 0; s < blockStreams; s++)
+        {
+            const float* const* sources = snapshots[s].capture (&plans[s], channels.data(), numSamples);
+            engine.addStream (&plans[s], sources, channels.data(), numSamples, 1.0f, s);
+        }
+
+        if (asynchronous)
+        {
+            engine.startBlock();
+            engine.waitForBlock();
+        }
+        else
+        {
+            engine.processBlock();
+        }
+
+        for (int s = 0; s < blockStreams; s++)
+        {
+            for (int c = 0; c < numChannels; c++)
+            {
+                for (int i = 0; i < numSamples; i++)
+                {
+                    float expected = expectedValue (b, s, c, i);
+                    float actual = channels[s * numChannels + c][i];
+
+                    if (actual != expected && failures++ < 10)
+                    {
+                        std::printf ("FAIL %s, block %d, stream %d, channel %d, sample %d: %g instead of %g\n",
+                                     asynchronous ? "asynchronous" : "synchronous",
+                                     b,
+                                     s,
+                                     c,
+                                     i,
+                                     actual,
+                                     expected);
+                    }
+                }
+            }
+        }
+    }
+
+    std::printf ("%-12s %d blocks, %d threads: %d failures\n",
+                 asynchronous ? "asynchronous" : "synchronous",
+                 numBlocks,
+                 numThreads,
+                 failures);
+
+    return failures;
+}
+} // namespace
+
+int main()
+{
+    int failures = runBlocks (false) + runBlocks (true);
+
+    return failures > 0 ? 1 : 0;
+}
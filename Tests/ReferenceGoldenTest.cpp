@@ -0,0 +1,1110 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+  Reference golden-output test
+
+  Replays fixed blocks through every execution path of the referencing
+  engine and compares the output with the original per-row loop of
+  VirtualRef::process, evaluated in double precision on the same input:
+
+    ref_i = sum_j w_ij * x_j / norm_i    (from an unmodified copy)
+    x_i  -= gain * ref_i
+
+  (or the per-sample median of the selected channels, or the masked mean
+  over the unsaturated ones). The input blocks are generated from a fixed
+  seed with a portable generator, so they are the same on every platform:
+  white noise, and "recorded-like" blocks with a common-mode line noise
+  and drift, DC offsets, spikes, a flat and a noisy channel, and railed
+  segments.
+
+  Every matrix pattern is compiled with each normalization and statistic
+  and run with every instruction set the CPU supports, with 1 to 8
+  threads, in the synchronous and the asynchronous mode, with block
+  sizes that do and do not fill whole tiles, and with two streams per
+  block. The test checks that
+
+  - every output sample is within the bound of its path (below) of the
+    exact result,
+  - the output does not depend on the number of threads or the mode
+    (bit-identical),
+  - the reference signal published for each group is within the same
+    bound of the reference of all channels its members are referenced to
+    (for leave-one-out groups, including the members themselves), and
+  - channels that are not referenced, channels outside the streams and
+    output channels of groups that are not published are left
+    bit-identical.
+
+  The error of a sample is measured in units of u * M, with u = 2^-24
+  the unit roundoff of single precision and M the magnitude of the terms
+  that the path sums in single precision:
+
+    M = |x_i| + gain * sum_j |w_ij * x_j| / norm_i
+
+  over the row's own sources for the sparse, dense, median and masked
+  paths, and over all sources of the stream for the leave-one-out and
+  window paths, which form a larger sum first and take a difference of
+  it. The bounds are in maxError below. Adaptive references learn while
+  they run and have no fixed reference output. Instead, they are run
+  through a ReferenceDelayLine with blocks that wrap around its end and 2
+  to 8 threads, and the delayed output and the learned weights must be
+  bit-identical to those of one thread without the delay line.
+
+  Returns 0 if every check passed.
+
+*/
+
+#include "ReferenceDelayLine.h"
+#include "ReferenceEngine.h"
+#include "ReferenceKernels.h"
+#include "ReferenceMatrix.h"
+#include "ReferencePlan.h"
+#include "ReferencePreset.h"
+#include "ReferenceSnapshot.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace
+{
+/** Paths whose errors are bounded separately */
+enum Path
+{
+    Sparse = 0,
+    Dense,
+    Window,
+    LeaveOneOut,
+    Median,
+    MedianLeaveOneOut,
+    Masked,
+    MaskedLeaveOneOut,
+    numPaths
+};
+
+const char* pathNames[numPaths] = { "sparse",
+                                    "dense",
+                                    "window",
+                                    "leave-one-out",
+                                    "median",
+                                    "median leave-one-out",
+                                    "masked",
+                                    "masked leave-one-out" };
+
+/** Largest error allowed per path, in units of u * M (see above) */
+const double maxError[numPaths] = { 16.0, 16.0, 32.0, 32.0, 4.0, 4.0, 32.0, 32.0 };
+
+const int numChannels = 64;
+const int maxBlockSamples = 1024;
+const int blockSizes[] = { 1, 37, 128, 500, 1024 };
+const int threadCounts[] = { 1, 2, 3, 5, 8 };
+
+/** Number of groups whose reference the second stream publishes */
+const int numPartialOutputs = 3;
+
+/** Amplitude at which channels rail in the recorded-like blocks */
+const float railLevel = 5000.0f;
+
+/** Saturation threshold used for the masked paths */
+const float saturationThreshold = 4000.0f;
+
+const double pi = 3.14159265358979323846;
+
+/** Small portable generator (xorshift64*), so that the blocks do not
+    depend on the standard library */
+class Random
+{
+public:
+    explicit Random (uint64_t seed) : state (seed * 2685821657736338717ull + 1) {}
+
+    /** Uniform in [0, 1) */
+    double uniform()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (double) ((state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    /** Approximately normal, with unit variance */
+    double normal()
+    {
+        double sum = 0.0;
+
+        for (int k = 0; k < 12; k++)
+            sum += uniform();
+
+        return sum - 6.0;
+    }
+
+private:
+    uint64_t state;
+};
+
+/** A block of numChannels x maxBlockSamples input samples */
+struct Block
+{
+    std::string name;
+    std::vector<float> samples;
+    bool railed = false;
+
+    float* channel (int c) { return samples.data() + (size_t) c * maxBlockSamples; }
+};
+
+Block whiteNoise()
+{
+    Block block;
+    block.name = "white noise";
+    block.samples.resize ((size_t) numChannels * maxBlockSamples);
+
+    Random random (1);
+
+    for (auto& sample : block.samples)
+        sample = (float) (50.0 * random.normal());
+
+    return block;
+}
+
+Block recordedLike (bool railed)
+{
+    Block block;
+    block.name = railed ? "recorded-like, railed" : "recorded-like";
+    block.samples.resize ((size_t) numChannels * maxBlockSamples);
+    block.railed = railed;
+
+    Random random (railed ? 3 : 2);
+    const double sampleRate = 30000.0;
+
+    for (int c = 0; c < numChannels; c++)
+    {
+        float* x = block.channel (c);
+        double offset = 200.0 * random.normal();
+        double noise = c == 5 ? 400.0 : 10.0 + 20.0 * random.uniform();
+
+        for (int i = 0; i < maxBlockSamples; i++)
+        {
+            double t = i / sampleRate;
+            double commonMode = 120.0 * std::sin (2.0 * pi * 50.0 * t) + 30.0 * std::sin (2.0 * pi * 150.0 * t + 0.3) + 2000.0 * t;
+
+            x[i] = (float) (offset + commonMode + noise * random.normal());
+        }
+
+        // a few spikes
+        for (int s = 0; s < 3; s++)
+        {
+            int at = (int) (random.uniform() * (maxBlockSamples - 30));
+
+            for (int i = 0; i < 30; i++)
+                x[at + i] -= (float) (150.0 * std::exp (-i / 6.0) * std::sin (pi * i / 10.0));
+        }
+    }
+
+    // a disconnected channel
+    std::fill (block.channel (9), block.channel (9) + maxBlockSamples, 0.0f);
+
+    if (railed)
+    {
+        // some channels rail for part of the block, one for all of it
+        for (int c : { 3, 17, 18, 40 })
+        {
+            int from = (int) (random.uniform() * maxBlockSamples / 2);
+            int to = from + (int) (random.uniform() * maxBlockSamples / 2);
+
+            for (int i = from; i < to; i++)
+                block.channel (c)[i] = c % 2 == 0 ? railLevel : -railLevel;
+        }
+
+        std::fill (block.channel (60), block.channel (60) + maxBlockSamples, railLevel);
+    }
+
+    return block;
+}
+
+/** A reference matrix to test */
+struct Pattern
+{
+    std::string name;
+    std::function<void (ReferenceMatrix&)> fill;
+    std::vector<float> sourceScale;
+    std::vector<int> channelOrder;
+};
+
+void applyPreset (ReferenceMatrix& matrix, ReferencePreset::Scope scope, bool includeSelf, int groupSize, int bankSize)
+{
+    ReferencePreset preset (scope, includeSelf);
+    preset.groupSize = groupSize;
+
+    if (bankSize > 0)
+        preset.channelBank = ReferencePreset::consecutiveBanks (numChannels, bankSize);
+
+    preset.apply (&matrix, numChannels);
+}
+
+void fillRandom (ReferenceMatrix& matrix, double density, bool weighted, uint64_t seed)
+{
+    Random random (seed);
+
+    for (int row = 0; row < numChannels; row++)
+    {
+        std::vector<ReferenceMatrix::Reference> references;
+
+        for (int column = 0; column < numChannels; column++)
+        {
+            if (random.uniform() < density)
+                references.push_back ({ column, weighted ? (float) (0.1 + 1.9 * random.uniform()) : 1.0f });
+        }
+
+        matrix.setReferences (row, references);
+    }
+}
+
+/** Every channel references its neighbours along order, up to radius
+    positions away, without itself */
+void fillBand (ReferenceMatrix& matrix, const std::vector<int>& order, int radius)
+{
+    for (int p = 0; p < numChannels; p++)
+    {
+        std::vector<ReferenceMatrix::Reference> references;
+
+        for (int q = std::max (0, p - radius); q <= std::min (numChannels - 1, p + radius); q++)
+        {
+            if (q != p)
+                references.push_back ({ order[q], 1.0f });
+        }
+
+        std::sort (references.begin(),
+                   references.end(),
+                   [] (const ReferenceMatrix::Reference& a, const ReferenceMatrix::Reference& b)
+                   {
+                       return a.channel < b.channel;
+                   });
+
+        matrix.setReferences (order[p], references);
+    }
+}
+
+std::vector<Pattern> makePatterns()
+{
+    typedef ReferencePreset::Scope Scope;
+
+    std::vector<int> shuffled (numChannels);
+    Random random (7);
+
+    for (int c = 0; c < numChannels; c++)
+        shuffled[c] = c;
+
+    for (int c = numChannels - 1; c > 0; c--)
+        std::swap (shuffled[c], shuffled[(int) (random.uniform() * (c + 1))]);
+
+    std::vector<float> scale (numChannels);
+
+    for (int c = 0; c < numChannels; c++)
+        scale[c] = c % 11 == 4 ? 0.0f : (float) (0.2 + 0.8 * random.uniform());
+
+    std::vector<Pattern> patterns;
+
+    patterns.push_back ({ "empty", [] (ReferenceMatrix&) {}, {}, {} });
+    patterns.push_back ({ "common average", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::AllChannels, true, 1, 0);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "average of all other channels", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::AllChannels, false, 1, 0);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "average of other channels, noise weighted", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::AllChannels, false, 1, 0);
+                          },
+                          scale,
+                          {} });
+    patterns.push_back ({ "common average per bank of 16", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::AllChannels, false, 1, 16);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "all electrodes of tetrode", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::OwnGroup, true, 4, 0);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "other electrodes of tetrode", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::OwnGroup, false, 4, 0);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "average of other tetrodes", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::OtherGroups, false, 4, 0);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "average of next tetrode", [] (ReferenceMatrix& m)
+                          {
+                              applyPreset (m, Scope::NextGroup, false, 4, 0);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "single reference channel", [] (ReferenceMatrix& m)
+                          {
+                              for (int row = 1; row < numChannels; row++)
+                                  m.setValue (row, 0, 1.0f);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "random 10%, weighted", [] (ReferenceMatrix& m)
+                          {
+                              fillRandom (m, 0.1, true, 11);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "random 70%", [] (ReferenceMatrix& m)
+                          {
+                              fillRandom (m, 0.7, false, 12);
+                          },
+                          {},
+                          {} });
+    patterns.push_back ({ "random 90%, weighted", [] (ReferenceMatrix& m)
+                          {
+                              fillRandom (m, 0.9, true, 13);
+                          },
+                          {},
+                          {} });
+
+    std::vector<int> identity (numChannels);
+
+    for (int c = 0; c < numChannels; c++)
+        identity[c] = c;
+
+    patterns.push_back ({ "local band", [identity] (ReferenceMatrix& m)
+                          {
+                              fillBand (m, identity, 6);
+                          },
+                          {},
+                          identity });
+    patterns.push_back ({ "local band, shuffled order", [shuffled] (ReferenceMatrix& m)
+                          {
+                              fillBand (m, shuffled, 9);
+                          },
+                          {},
+                          shuffled });
+
+    return patterns;
+}
+
+/** Effective references of one row, as the plan sees them */
+std::vector<std::pair<int, double>> rowReferences (ReferenceMatrix& matrix, const Pattern& pattern, int row, ReferencePlan::Statistic statistic)
+{
+    std::vector<std::pair<int, double>> references;
+
+    for (auto& reference : matrix.getReferences (row))
+    {
+        double value = reference.value;
+
+        if (reference.channel < (int) pattern.sourceScale.size())
+            value = (double) (reference.value * pattern.sourceScale[reference.channel]);
+
+        if (value > 0)
+            references.emplace_back (reference.channel, statistic == ReferencePlan::Statistic::Median ? 1.0 : value);
+    }
+
+    return references;
+}
+
+bool isValid (float x, float threshold)
+{
+    return threshold <= 0.0f || std::fabs (x) < threshold;
+}
+
+/** Running maximum of the normalized error per path */
+struct Errors
+{
+    double worst[numPaths] = {};
+    bool covered[numPaths] = {};
+    int failures = 0;
+};
+
+/** The path that computes a group */
+Path pathOf (const ReferencePlan& plan, int group)
+{
+    bool leaveOneOut = plan.groupLeaveOneOut[group];
+
+    if (plan.getStatistic() == ReferencePlan::Statistic::Median)
+        return leaveOneOut ? MedianLeaveOneOut : Median;
+
+    if (plan.isMasked())
+        return leaveOneOut ? MaskedLeaveOneOut : Masked;
+
+    if (leaveOneOut)
+        return LeaveOneOut;
+
+    if (plan.getMode() == ReferencePlan::Mode::Dense)
+        return Dense;
+
+    if (plan.getMode() == ReferencePlan::Mode::Window)
+        return Window;
+
+    return Sparse;
+}
+
+/** Computes the reference of a set of references at sample i as the
+    original loop does, in double precision, together with the magnitude
+    of the terms that path sums (see above). Returns false if every
+    source is masked. */
+bool exactReference (const std::vector<std::pair<int, double>>& references,
+                     const float* const* input,
+                     int i,
+                     const ReferencePlan& plan,
+                     const ReferencePlan::Options& options,
+                     Path path,
+                     double& ref,
+                     double& magnitude)
+{
+    float threshold = plan.getSaturationThreshold();
+
+    if (options.statistic == ReferencePlan::Statistic::Median)
+    {
+        std::vector<double> values;
+
+        for (auto& reference : references)
+            values.push_back (input[reference.first][i]);
+
+        std::sort (values.begin(), values.end());
+        size_t n = values.size();
+
+        ref = n % 2 == 1 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+        magnitude = std::max (std::fabs (values.front()), std::fabs (values.back()));
+
+        return true;
+    }
+
+    double sum = 0.0;
+    double norm = 0.0;
+    double terms = 0.0;
+    double maxValue = 0.0;
+
+    for (auto& reference : references)
+    {
+        float source = input[reference.first][i];
+        maxValue = std::max (maxValue, reference.second);
+
+        if (! isValid (source, threshold))
+            continue;
+
+        sum += reference.second * source;
+        norm += options.normalization == ReferencePlan::Normalization::Sum ? reference.second : 1.0;
+        terms += std::fabs (reference.second * source);
+    }
+
+    if (norm == 0.0)
+        return false;
+
+    ref = sum / norm;
+    magnitude = terms / norm;
+
+    // these paths sum more channels than the row's own
+    if (path == Window || path == LeaveOneOut || path == MaskedLeaveOneOut)
+    {
+        double all = 0.0;
+
+        for (int c = 0; c < numChannels; c++)
+        {
+            float source = input[c][i];
+
+            if (isValid (source, threshold))
+                all += std::fabs (source);
+        }
+
+        magnitude = maxValue * all / norm;
+    }
+
+    return true;
+}
+
+/** Records the error of one output sample */
+void checkSample (float y, double exact, double magnitude, Path path, Errors& errors, const std::string& context, const char* what, int channel, int i)
+{
+    const double u = std::ldexp (1.0, -24);
+
+    double error = std::fabs (y - exact) / (u * std::max (magnitude, 1.0e-30));
+
+    if (! std::isfinite (y))
+        error = INFINITY;
+
+    errors.worst[path] = std::max (errors.worst[path], error);
+
+    if (error > maxError[path] && errors.failures++ < 10)
+    {
+        std::printf ("FAIL %s: %s %s %d sample %d: %.9g, expected %.9g (%.1f u*M, bound %.0f)\n",
+                     context.c_str(),
+                     pathNames[path],
+                     what,
+                     channel,
+                     i,
+                     y,
+                     exact,
+                     error,
+                     maxError[path]);
+    }
+}
+
+/** Compares one stream's output with the original per-row loop. input
+    and output hold the stream's channels. */
+void checkStream (const ReferencePlan& plan,
+                  ReferenceMatrix& matrix,
+                  const Pattern& pattern,
+                  const ReferencePlan::Options& options,
+                  const float* const* input,
+                  const float* const* output,
+                  int numSamples,
+                  float gain,
+                  Errors& errors,
+                  const std::string& context)
+{
+    for (int row = 0; row < numChannels; row++)
+    {
+        auto references = rowReferences (matrix, pattern, row, options.statistic);
+        const float* x = input[row];
+        const float* y = output[row];
+
+        if (references.empty())
+        {
+            if (std::memcmp (x, y, numSamples * sizeof (float)) != 0 && errors.failures++ < 10)
+                std::printf ("FAIL %s: unreferenced channel %d was modified\n", context.c_str(), row);
+
+            continue;
+        }
+
+        Path path = pathOf (plan, plan.channelGroup[row]);
+        errors.covered[path] = true;
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            double ref;
+            double magnitude;
+
+            if (! exactReference (references, input, i, plan, options, path, ref, magnitude))
+            {
+                if (y[i] != x[i] && errors.failures++ < 10)
+                    std::printf ("FAIL %s: fully masked sample %d of channel %d was modified\n", context.c_str(), i, row);
+
+                continue;
+            }
+
+            checkSample (y[i], x[i] - gain * ref, std::fabs (x[i]) + gain * magnitude, path, errors, context, "channel", row, i);
+        }
+    }
+}
+
+/** Compares the published reference of every group with the reference
+    of all the channels its members are referenced to, including the
+    members of a leave-one-out group themselves (0 where all of them are
+    masked). outputs holds the output channel of each published group. */
+void checkPublished (const ReferencePlan& plan,
+                     ReferenceMatrix& matrix,
+                     const Pattern& pattern,
+                     const ReferencePlan::Options& options,
+                     const float* const* input,
+                     const float* const* outputs,
+                     int numSamples,
+                     Errors& errors,
+                     const std::string& context)
+{
+    for (int g = 0; g < plan.getNumPublished(); g++)
+    {
+        std::map<int, double> set;
+
+        for (int row = 0; row < numChannels; row++)
+        {
+            if (plan.channelGroup[row] != g)
+                continue;
+
+            for (auto& reference : rowReferences (matrix, pattern, row, options.statistic))
+                set.emplace (reference.first, reference.second);
+        }
+
+        std::vector<std::pair<int, double>> references (set.begin(), set.end());
+        Path path = pathOf (plan, g);
+        const float* y = outputs[g];
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            double ref = 0.0;
+            double magnitude = 0.0;
+
+            exactReference (references, input, i, plan, options, path, ref, magnitude);
+            checkSample (y[i], ref, magnitude, path, errors, context, "published group", g, i);
+        }
+    }
+}
+
+const char* getModeName (const ReferencePlan& plan)
+{
+    switch (plan.getMode())
+    {
+        case ReferencePlan::Mode::Dense:
+            return "dense";
+        case ReferencePlan::Mode::Window:
+            return "window";
+        default:
+            return "sparse";
+    }
+}
+
+/** A global buffer with two streams, the second offset by a few
+    channels that no stream owns, followed by room for the published
+    references of each stream */
+struct Buffer
+{
+    static constexpr int firstOffset = 2;
+    static constexpr int secondOffset = numChannels + 5;
+    static constexpr int referenceOffset = secondOffset + numChannels + 3;
+    static constexpr int numGlobalChannels = referenceOffset + 2 * numChannels;
+
+    /** First output channel of a stream's published references */
+    static int outputOffset (int stream) { return referenceOffset + stream * numChannels; }
+
+    std::vector<float> samples;
+    std::vector<float*> channels;
+
+    Buffer()
+        : samples ((size_t) numGlobalChannels * maxBlockSamples),
+          channels (numGlobalChannels)
+    {
+        for (int c = 0; c < numGlobalChannels; c++)
+            channels[c] = samples.data() + (size_t) c * maxBlockSamples;
+    }
+
+    /** Copies the block into both streams; the second gets it reversed
+        in channel order, so the streams differ */
+    void load (Block& block)
+    {
+        for (int c = 0; c < numGlobalChannels; c++)
+            std::fill (channels[c], channels[c] + maxBlockSamples, (float) c + 0.5f);
+
+        for (int c = 0; c < numChannels; c++)
+        {
+            std::memcpy (channels[firstOffset + c], block.channel (c), maxBlockSamples * sizeof (float));
+            std::memcpy (channels[secondOffset + c], block.channel (numChannels - 1 - c), maxBlockSamples * sizeof (float));
+        }
+    }
+};
+
+/** Runs both streams through the engine */
+void runEngine (ReferenceEngine& engine,
+                ReferenceSnapshot* snapshots,
+                const ReferencePlan* const* plans,
+                Buffer& buffer,
+                int numSamples,
+                float gain)
+{
+    engine.beginBlock();
+
+    for (int s = 0; s < 2; s++)
+    {
+        if (plans[s]->isEmpty())
+            continue;
+
+        const float* const* sources = snapshots[s].capture (plans[s], buffer.channels.data(), numSamples);
+        engine.addStream (plans[s], sources, buffer.channels.data(), numSamples, gain, s);
+    }
+
+    if (engine.isAsynchronous())
+    {
+        engine.startBlock();
+        engine.waitForBlock();
+    }
+    else
+    {
+        engine.processBlock();
+    }
+}
+/** Runs an adaptive plan over a block split into chunks of the given
+    sizes, synchronously on one thread or through a delay line, and
+    returns the output (delayed by delaySamples through the delay line)
+    and the final weights */
+void runAdaptive (const std::function<void (ReferenceMatrix&)>& fill,
+                  const ReferencePlan::Options& options,
+                  const Block& input,
+                  const std::vector<int>& chunkSizes,
+                  int numThreads,
+                  int delaySamples,
+                  std::vector<float>& output,
+                  std::vector<float>& weights)
+{
+    ReferenceMatrix matrix (numChannels);
+    fill (matrix);
+
+    std::vector<int> globalIndices (numChannels);
+
+    for (int c = 0; c < numChannels; c++)
+        globalIndices[c] = c;
+
+    ReferencePlan plan;
+    plan.build (&matrix, globalIndices, options);
+
+    output = input.samples;
+    std::vector<float*> chunk (numChannels);
+
+    ReferenceEngine engine;
+    engine.prepare (numThreads, 1, numChannels, delaySamples > 0);
+
+    ReferenceSnapshot snapshot;
+    snapshot.prepare (numChannels, maxBlockSamples, numChannels);
+
+    ReferenceDelayLine delayLine;
+    delayLine.prepare (globalIndices, numChannels, delaySamples);
+
+    for (int start = 0, k = 0; start < maxBlockSamples; k++)
+    {
+        int numSamples = std::min (chunkSizes[k % chunkSizes.size()], maxBlockSamples - start);
+
+        for (int c = 0; c < numChannels; c++)
+            chunk[c] = output.data() + (size_t) c * maxBlockSamples + start;
+
+        engine.beginBlock();
+
+        if (delaySamples > 0)
+        {
+            delayLine.push (chunk.data(), numSamples);
+            engine.addStream (&plan, delayLine.getSources(), delayLine.getOutputs(), delayLine.getBlockSamples(), 1.0f);
+            engine.startBlock();
+        }
+        else
+        {
+            const float* const* sources = snapshot.capture (&plan, chunk.data(), numSamples);
+            engine.addStream (&plan, sources, chunk.data(), numSamples, 1.0f);
+            engine.processBlock();
+        }
+
+        start += numSamples;
+    }
+
+    engine.waitForBlock();
+
+    weights = plan.adaptive->weights;
+}
+
+/** Checks that adaptive plans referenced through a delay line, with
+    blocks that wrap around its end and several threads, learn exactly as
+    they do synchronously on one thread: once per block, from the whole
+    block. Returns the number of failed checks. */
+int checkAdaptiveDelayLine (const Block& input)
+{
+    const int delaySamples = 128;
+
+    // blocks of up to the delay, most of which wrap around the ring
+    const std::vector<int> chunkSizes = { 96, 128, 37, 128, 70 };
+
+    struct AdaptivePattern
+    {
+        const char* name;
+        std::function<void (ReferenceMatrix&)> fill;
+    };
+
+    const AdaptivePattern adaptivePatterns[] = {
+        { "adaptive, other electrodes of tetrode", [] (ReferenceMatrix& m)
+          { applyPreset (m, ReferencePreset::Scope::OwnGroup, false, 4, 0); } },
+        { "adaptive, random 70%", [] (ReferenceMatrix& m)
+          { fillRandom (m, 0.7, false, 12); } }
+    };
+
+    int failures = 0;
+
+    for (const AdaptivePattern& pattern : adaptivePatterns)
+    {
+        ReferencePlan::Options options;
+        options.statistic = ReferencePlan::Statistic::Adaptive;
+
+        std::vector<float> expected, expectedWeights;
+        runAdaptive (pattern.fill, options, input, chunkSizes, 1, 0, expected, expectedWeights);
+
+        for (int numThreads : { 2, 3, 8 })
+        {
+            std::vector<float> output, weights;
+            runAdaptive (pattern.fill, options, input, chunkSizes, numThreads, delaySamples, output, weights);
+
+            bool delayed = true;
+
+            for (int c = 0; c < numChannels; c++)
+            {
+                const float* out = output.data() + (size_t) c * maxBlockSamples;
+                const float* ref = expected.data() + (size_t) c * maxBlockSamples;
+
+                for (int i = 0; i < delaySamples; i++)
+                    delayed = delayed && out[i] == 0.0f;
+
+                delayed = delayed && std::memcmp (out + delaySamples, ref, (maxBlockSamples - delaySamples) * sizeof (float)) == 0;
+            }
+
+            std::printf ("%-44s delay line, %d threads\n", pattern.name, numThreads);
+
+            if (! delayed)
+            {
+                failures++;
+                std::printf ("FAIL %s, %d threads: delayed output differs from 1 thread\n", pattern.name, numThreads);
+            }
+
+            if (weights != expectedWeights)
+            {
+                failures++;
+                std::printf ("FAIL %s, %d threads: learned weights differ from 1 thread\n", pattern.name, numThreads);
+            }
+        }
+    }
+
+    return failures;
+}
+} // namespace
+
+int main()
+{
+    typedef ReferenceKernels::InstructionSet InstructionSet;
+
+    std::vector<Block> blocks = { whiteNoise(), recordedLike (false), recordedLike (true) };
+    std::vector<Pattern> patterns = makePatterns();
+
+    std::vector<InstructionSet> instructionSets;
+
+    for (InstructionSet set : { InstructionSet::Scalar, InstructionSet::SSE2, InstructionSet::AVX2, InstructionSet::AVX512 })
+    {
+        if (ReferenceKernels::setInstructionSet (set))
+            instructionSets.push_back (set);
+    }
+
+    struct Variant
+    {
+        const char* name;
+        ReferencePlan::Statistic statistic;
+        ReferencePlan::Normalization normalization;
+        bool masked;
+    };
+
+    const Variant variants[] = {
+        { "mean", ReferencePlan::Statistic::Mean, ReferencePlan::Normalization::Count, false },
+        { "weighted mean", ReferencePlan::Statistic::Mean, ReferencePlan::Normalization::Sum, false },
+        { "median", ReferencePlan::Statistic::Median, ReferencePlan::Normalization::Count, false },
+        { "masked mean", ReferencePlan::Statistic::Mean, ReferencePlan::Normalization::Count, true },
+        { "masked weighted mean", ReferencePlan::Statistic::Mean, ReferencePlan::Normalization::Sum, true }
+    };
+
+    const float gain = 0.75f;
+
+    Errors errors;
+    Buffer input;
+    Buffer output;
+    Buffer expected;
+    int numRuns = 0;
+
+    for (const Pattern& pattern : patterns)
+    {
+        ReferenceMatrix matrix (numChannels);
+        pattern.fill (matrix);
+
+        for (const Variant& variant : variants)
+        {
+            ReferencePlan::Options options;
+            options.statistic = variant.statistic;
+            options.normalization = variant.normalization;
+            options.saturationThreshold = variant.masked ? saturationThreshold : 0.0f;
+            options.sourceScale = pattern.sourceScale;
+            options.channelOrder = pattern.channelOrder;
+
+            ReferencePlan plans[2];
+            std::vector<int> globalIndices (numChannels);
+
+            for (int s = 0; s < 2; s++)
+            {
+                int offset = s == 0 ? Buffer::firstOffset : Buffer::secondOffset;
+
+                for (int c = 0; c < numChannels; c++)
+                    globalIndices[c] = offset + c;
+
+                // the first stream publishes every group, the second only
+                // the first few
+                options.outputIndices.clear();
+
+                for (int g = 0; g < (s == 0 ? numChannels : numPartialOutputs); g++)
+                    options.outputIndices.push_back (Buffer::outputOffset (s) + g);
+
+                plans[s].build (&matrix, globalIndices, options);
+            }
+
+            const ReferencePlan* planPointers[2] = { &plans[0], &plans[1] };
+
+            std::printf ("%-44s %-21s %-7s %3d groups\n",
+                         pattern.name.c_str(),
+                         variant.name,
+                         plans[0].isEmpty() ? "empty" : getModeName (plans[0]),
+                         plans[0].getNumGroups());
+
+            ReferenceSnapshot snapshots[2];
+
+            for (auto& snapshot : snapshots)
+                snapshot.prepare (numChannels, maxBlockSamples, Buffer::numGlobalChannels);
+
+            for (Block& block : blocks)
+            {
+                // masking only matters for railed blocks, and the railed
+                // blocks are only meaningful with masking
+                if (block.railed != variant.masked)
+                    continue;
+
+                input.load (block);
+
+                for (InstructionSet set : instructionSets)
+                {
+                    ReferenceKernels::setInstructionSet (set);
+
+                    for (int numSamples : blockSizes)
+                    {
+                        bool first = true;
+
+                        for (int asynchronous = 0; asynchronous < 2; asynchronous++)
+                        {
+                            for (int numThreads : threadCounts)
+                            {
+                                if (asynchronous && numThreads == 1)
+                                    continue;
+
+                                ReferenceEngine engine;
+                                engine.prepare (numThreads, 2, numChannels, asynchronous != 0);
+
+                                output.samples = input.samples;
+                                runEngine (engine, snapshots, planPointers, output, numSamples, gain);
+                                numRuns++;
+
+                                std::string context = pattern.name + ", " + variant.name + ", " + block.name + ", "
+                                                      + ReferenceKernels::getInstructionSetName (set) + ", "
+                                                      + std::to_string (numSamples) + " samples, "
+                                                      + std::to_string (numThreads) + (asynchronous ? " async" : "") + " threads";
+
+                                // samples beyond the block and channels outside the streams must not change
+                                for (int c = 0; c < Buffer::numGlobalChannels; c++)
+                                {
+                                    bool owned = (c >= Buffer::firstOffset && c < Buffer::firstOffset + numChannels)
+                                                 || (c >= Buffer::secondOffset && c < Buffer::secondOffset + numChannels);
+
+                                    for (int s = 0; s < 2; s++)
+                                        owned = owned || (c >= Buffer::outputOffset (s) && c < Buffer::outputOffset (s) + plans[s].getNumPublished());
+
+                                    int from = owned ? numSamples : 0;
+
+                                    if (std::memcmp (input.channels[c] + from, output.channels[c] + from, (maxBlockSamples - from) * sizeof (float)) != 0)
+                                    {
+                                        if (errors.failures++ < 10)
+                                            std::printf ("FAIL %s: channel %d was modified outside the block\n", context.c_str(), c);
+                                    }
+                                }
+
+                                if (first)
+                                {
+                                    for (int s = 0; s < 2; s++)
+                                    {
+                                        // the second stream holds the block in reverse channel order
+                                        int offset = s == 0 ? Buffer::firstOffset : Buffer::secondOffset;
+
+                                        checkStream (plans[s],
+                                                     matrix,
+                                                     pattern,
+                                                     options,
+                                                     input.channels.data() + offset,
+                                                     output.channels.data() + offset,
+                                                     numSamples,
+                                                     gain,
+                                                     errors,
+                                                     context + ", stream " + std::to_string (s));
+
+                                        checkPublished (plans[s],
+                                                        matrix,
+                                                        pattern,
+                                                        options,
+                                                        input.channels.data() + offset,
+                                                        output.channels.data() + Buffer::outputOffset (s),
+                                                        numSamples,
+                                                        errors,
+                                                        context + ", stream " + std::to_string (s));
+                                    }
+
+                                    expected.samples = output.samples;
+                                    first = false;
+                                }
+                                else if (output.samples != expected.samples)
+                                {
+                                    if (errors.failures++ < 10)
+                                        std::printf ("FAIL %s: output differs from 1 thread\n", context.c_str());
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // adaptive references have no exact result, so the asynchronous
+    // mode is compared with the synchronous one instead
+    std::printf ("\n");
+    errors.failures += checkAdaptiveDelayLine (blocks[1]);
+
+    std::printf ("\n%d runs, instruction sets:", numRuns);
+
+    for (InstructionSet set : instructionSets)
+        std::printf (" %s", ReferenceKernels::getInstructionSetName (set));
+
+    std::printf ("\n\n%-22s %12s %8s\n", "path", "worst (u*M)", "bound");
+
+    for (int p = 0; p < numPaths; p++)
+    {
+        std::printf ("%-22s %12.2f %8.0f\n", pathNames[p], errors.worst[p], maxError[p]);
+
+        if (! errors.covered[p])
+        {
+            errors.failures++;
+            std::printf ("FAIL no pattern exercised the %s path\n", pathNames[p]);
+        }
+    }
+
+    if (errors.failures > 0)
+    {
+        std::printf ("\n%d checks failed\n", errors.failures);
+        return 1;
+    }
+
+    std::printf ("\nAll checks passed\n");
+    return 0;
+}